@@ -23,6 +23,8 @@ typedef struct {
   meters_t closest_range;
   radians_t closest_heading_error;
 
+  unsigned short seed[3]; // for erand48(), as drand48() is not thread safe
+
 } robot_t;
 
 const double VSPEED = 0.4; // meters per second
@@ -40,6 +42,9 @@ extern "C" int Init(Model *mod)
 {
   robot_t *robot = new robot_t;
   robot->position = (ModelPosition *)mod;
+  robot->seed[0] = mod->GetId();
+  robot->seed[1] = mod->GetId() >> 16;
+  robot->seed[2] = 0x330E;
 
   // subscribe to the ranger, which we use for navigating
   robot->ranger = (ModelRanger *)mod->GetUnusedModelOfType("ranger");
@@ -93,7 +98,7 @@ int RangerUpdate(ModelRanger *rgr, robot_t *robot)
   } else {
     // front not clear. we might be stuck, so wiggle a bit
     if (fabs(turn_speed) < 0.1)
-      turn_speed = drand48();
+      turn_speed = erand48(robot->seed);
   }
 
   robot->position->SetSpeed(forward_speed, side_speed, turn_speed);
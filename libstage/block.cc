@@ -10,7 +10,7 @@ static void canonicalize_winding(vector<point_t> &pts);
     blocks. The point data is copied, so pts can safely be freed
     after calling this.*/
 Block::Block(BlockGroup *group, const std::vector<point_t> &pts, const Bounds &zrange)
-    : group(group), pts(pts), local_z(zrange), global_z(), rendered_cells()
+    : group(group), pts(pts), local_z(zrange), global_z(), rendered_cells(), paged_superregions()
 {
   assert(group);
   // canonicalize_winding(this->pts);
@@ -18,7 +18,7 @@ Block::Block(BlockGroup *group, const std::vector<point_t> &pts, const Bounds &z
 
 /** A from-file  constructor */
 Block::Block(BlockGroup *group, Worldfile *wf, int entity)
-    : group(group), pts(), local_z(), global_z(), rendered_cells()
+    : group(group), pts(), local_z(), global_z(), rendered_cells(), paged_superregions()
 {
   assert(group);
   assert(wf);
@@ -113,16 +113,18 @@ void Block::SetZ(double min, double max)
   group->BuildDisplayList();
 }
 
-void Block::AppendTouchingModels(std::set<Model *> &touchers)
+void Block::AppendTouchingModels(std::vector<Model *> &touchers)
 {
   unsigned int layer = group->mod.world->updates % 2;
 
+  SuperRegion::PageLock lock(paged_superregions);
+
   // for every cell we are rendered into
   FOR_EACH (cell_it, rendered_cells[layer])
     // for every block rendered into that cell
-    FOR_EACH (block_it, (*cell_it)->GetBlocks(layer)) {
-      if (!group->mod.IsRelated(&(*block_it)->group->mod))
-        touchers.insert(&(*block_it)->group->mod);
+    FOR_EACH (entry_it, (*cell_it)->GetEntries(layer)) {
+      if (!group->mod.IsRelated(entry_it->mod))
+        touchers.push_back(entry_it->mod);
     }
 }
 
@@ -133,28 +135,29 @@ Model *Block::TestCollision()
   // find the set of cells we would render into given the current global pose
   // GenerateCandidateCells();
 
+  if (group->mod.world->profiling)
+    ++group->mod.profile.collision_tests;
+
   if (group->mod.vis.obstacle_return) {
     if (global_z.min < 0)
       return group->mod.world->GetGround();
 
     unsigned int layer = group->mod.world->updates % 2;
 
+    SuperRegion::PageLock lock(paged_superregions);
+
     // for every cell we may be rendered into
     FOR_EACH (cell_it, rendered_cells[layer]) {
       // for every block rendered into that cell
-      FOR_EACH (block_it, (*cell_it)->GetBlocks(layer)) {
-        Block *testblock = *block_it;
-        Model *testmod = &testblock->group->mod;
-
-        // printf( "   testing block %p of model %s\n", testblock,
-        // testmod->Token() );
+      FOR_EACH (entry_it, (*cell_it)->GetEntries(layer)) {
+        Model *testmod = entry_it->mod;
 
         // if the tested model is an obstacle and it's not attached to this
         // model
-        if ((testmod != &group->mod) && testmod->vis.obstacle_return
-            && (!group->mod.IsRelated(testmod)) &&
+        if ((testmod != &group->mod) && (entry_it->vis & Model::VIS_OBSTACLE) &&
             // also must intersect in the Z range
-            testblock->global_z.min <= global_z.max && testblock->global_z.max >= global_z.min) {
+            entry_it->z_min <= global_z.max && entry_it->z_max >= global_z.min
+            && (!group->mod.IsRelated(testmod))) {
           // puts( "HIT");
           return testmod; // bail immediately with the bad news
         }
@@ -169,19 +172,35 @@ Model *Block::TestCollision()
 
 void Block::Map(unsigned int layer)
 {
-  // calculate the global pixel coords of the block vertices
-  // and render this block's polygon into the world
-  group->mod.world->MapPoly(group->mod.LocalToPixels(pts), this, layer);
+  const size_t cells_before(rendered_cells[layer].size());
 
-  // update the block's absolute z bounds at this rendering
+  // update the block's absolute z bounds at this rendering, before
+  // the cells copy them
   Pose gpose(group->mod.GetGlobalPose());
   gpose.z += group->mod.geom.pose.z;
   global_z.min = local_z.min + gpose.z;
   global_z.max = local_z.max + gpose.z;
+
+  // calculate the global pixel coords of the block vertices
+  // and render this block's polygon into the world
+  group->mod.LocalToPixels(pts, group->mod.pixels);
+  group->mod.world->MapPoly(group->mod.pixels, this, layer);
+
+  if (group->mod.world->profiling) {
+    ++group->mod.profile.maps;
+    group->mod.profile.map_cells += rendered_cells[layer].size() - cells_before;
+  }
 }
 
 void Block::UnMap(unsigned int layer)
 {
+  // our cells in compacted superregions must exist before we can
+  // remove ourselves from them
+  SuperRegion::PageLock lock(paged_superregions);
+
+  if (group->mod.world->profiling && rendered_cells[layer].size())
+    ++group->mod.profile.unmaps;
+
   FOR_EACH (it, rendered_cells[layer])
     (*it)->RemoveBlock(this, layer);
 
@@ -32,7 +32,7 @@ void BlockGroup::Clear()
   blocks.clear();
 }
 
-void BlockGroup::AppendTouchingModels(std::set<Model *> &v)
+void BlockGroup::AppendTouchingModels(std::vector<Model *> &v)
 {
   FOR_EACH (it, blocks)
     it->AppendTouchingModels(v);
@@ -291,19 +291,22 @@ void BlockGroup::LoadBlock(Worldfile *wf, int entity)
   // CalcSize(); // adjust the blocks so they fit in our bounding box
 }
 
+std::string BlockGroup::BitmapPath(const std::string &bitmapfile, Worldfile *wf)
+{
+  if (bitmapfile[0] == '/')
+    return bitmapfile;
+
+  char *workaround_const = strdup(wf->filename.c_str());
+  const std::string full(std::string(dirname(workaround_const)) + "/" + bitmapfile);
+  free(workaround_const);
+  return full;
+}
+
 void BlockGroup::LoadBitmap(const std::string &bitmapfile, Worldfile *wf)
 {
   PRINT_DEBUG1("attempting to load bitmap \"%s\n", bitmapfile.c_str());
 
-  std::string full;
-
-  if (bitmapfile[0] == '/')
-    full = bitmapfile;
-  else {
-    char *workaround_const = strdup(wf->filename.c_str());
-    full = std::string(dirname(workaround_const)) + "/" + bitmapfile;
-    free(workaround_const);
-  }
+  const std::string full(BitmapPath(bitmapfile, wf));
 
   char buf[512];
   snprintf(buf, 512, "[Image \"%s\"", bitmapfile.c_str());
@@ -316,7 +319,15 @@ void BlockGroup::LoadBitmap(const std::string &bitmapfile, Worldfile *wf)
 
   std::vector<std::vector<point_t> > polys;
 
-  if (polys_from_image_file(full, polys)) {
+  // traced while the world was loading?
+  const std::map<std::string, std::vector<std::vector<point_t> > > &traced(
+      mod.world->bitmap_polys);
+  std::map<std::string, std::vector<std::vector<point_t> > >::const_iterator cached(
+      traced.find(full));
+
+  if (cached != traced.end())
+    polys = cached->second;
+  else if (polys_from_image_file(full, polys)) {
     PRINT_ERR1("failed to load polys from image file \"%s\"", full.c_str());
     return;
   }
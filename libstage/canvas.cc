@@ -39,6 +39,16 @@ static bool texture_load_done = false;
 // GLuint glowTex;
 GLuint checkTex;
 
+/** Holds the world lock for its lifetime, so that a threaded
+simulation does not change the world while the canvas uses it. */
+class WorldLock {
+  WorldGui *world;
+
+public:
+  explicit WorldLock(WorldGui *world) : world(world) { world->Lock(); }
+  ~WorldLock() { world->Unlock(); }
+};
+
 void Canvas::TimerCallback(Canvas *c)
 {
   if (c->world->dirty) {
@@ -344,6 +354,8 @@ void Canvas::CanvasToWorld(int px, int py, double *wx, double *wy, double *wz)
 
 int Canvas::handle(int event)
 {
+  WorldLock lock(world);
+
   // printf( "cam %.2f %.2f\n", camera.yaw(), camera.pitch() );
 
   switch (event) {
@@ -1213,6 +1225,8 @@ void Canvas::Save(Worldfile *wf, int sec)
 
 void Canvas::draw()
 {
+  WorldLock lock(world);
+
   // Enable the following to debug camera model
   //	if( loaded_texture == true && pCamOn == true )
   //		return;
@@ -0,0 +1,294 @@
+/*
+  control.cc
+  Client of Stage's control server. See control.hh for the protocol.
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "control.hh"
+#include "stage.hh" // for the PRINT macros
+
+using namespace Stg;
+using namespace Stg::ControlProtocol;
+
+ControlClient::ControlClient(const std::string &path)
+    : fd(-1), out(), queued(0), in(65536), in_start(0), in_end(0), sent(0), received(0)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    PRINT_ERR1("control socket path %s is too long", path.c_str());
+    return;
+  }
+  strcpy(addr.sun_path, path.c_str());
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    PRINT_ERR2("failed to connect to control socket %s: %s", path.c_str(), strerror(errno));
+    Disconnect();
+    return;
+  }
+
+  Hello hello;
+  if (!ReadFully(&hello, sizeof(hello)))
+    return;
+  if (hello.magic != MAGIC || hello.version != PROTOCOL_VERSION) {
+    PRINT_ERR1("%s is not a Stage control server of this version", path.c_str());
+    Disconnect();
+  }
+}
+
+ControlClient::~ControlClient()
+{
+  Disconnect();
+}
+
+void ControlClient::Disconnect()
+{
+  if (fd >= 0)
+    close(fd);
+  fd = -1;
+}
+
+void ControlClient::Queue(op_t op, const void *payload, uint32_t length)
+{
+  RequestHeader header;
+  header.op = op;
+  header.length = length;
+
+  const size_t at(out.size());
+  out.resize(at + sizeof(header) + length);
+  memcpy(&out[at], &header, sizeof(header));
+  if (length)
+    memcpy(&out[at + sizeof(header)], payload, length);
+  ++queued;
+}
+
+void ControlClient::QueueStep(uint32_t updates)
+{
+  Queue(OP_STEP, &updates, sizeof(updates));
+}
+
+void ControlClient::QueueGetPoses(const std::vector<uint32_t> &ids)
+{
+  std::vector<uint32_t> payload(1, ids.size());
+  payload.insert(payload.end(), ids.begin(), ids.end());
+  Queue(OP_GET_POSES, &payload[0], payload.size() * sizeof(uint32_t));
+}
+
+void ControlClient::QueueGetRangers(const std::vector<uint32_t> &ids)
+{
+  std::vector<uint32_t> payload(1, ids.size());
+  payload.insert(payload.end(), ids.begin(), ids.end());
+  Queue(OP_GET_RANGERS, &payload[0], payload.size() * sizeof(uint32_t));
+}
+
+void ControlClient::QueueSetVelocities(const std::vector<VelocityEntry> &velocities)
+{
+  std::vector<char> payload(sizeof(uint32_t) + velocities.size() * sizeof(VelocityEntry));
+  const uint32_t count(velocities.size());
+  memcpy(&payload[0], &count, sizeof(count));
+  if (count)
+    memcpy(&payload[sizeof(count)], &velocities[0], count * sizeof(VelocityEntry));
+  Queue(OP_SET_VELOCITIES, &payload[0], payload.size());
+}
+
+bool ControlClient::ReadFully(void *buf, size_t length)
+{
+  char *dest(static_cast<char *>(buf));
+
+  while (length > 0) {
+    if (in_start == in_end) {
+      // read whatever has arrived, to make few syscalls for many
+      // small responses
+      const ssize_t n(recv(fd, &in[0], in.size(), 0));
+      if (n <= 0) {
+        if (n < 0)
+          PRINT_ERR1("control connection failed: %s", strerror(errno));
+        Disconnect();
+        return false;
+      }
+      in_start = 0;
+      in_end = n;
+      received += n;
+    }
+
+    const size_t take(std::min(length, in_end - in_start));
+    memcpy(dest, &in[in_start], take);
+    in_start += take;
+    dest += take;
+    length -= take;
+  }
+
+  return true;
+}
+
+bool ControlClient::Exchange(std::vector<Response> &responses)
+{
+  responses.resize(queued);
+  if (fd < 0)
+    return false;
+
+  // one write for all the requests
+  for (size_t done(0); done < out.size();) {
+    const ssize_t n(send(fd, &out[done], out.size() - done, MSG_NOSIGNAL));
+    if (n < 0) {
+      PRINT_ERR1("control connection failed: %s", strerror(errno));
+      Disconnect();
+      return false;
+    }
+    done += n;
+  }
+  sent += out.size();
+  out.clear();
+  queued = 0;
+
+  for (size_t i(0); i < responses.size(); ++i) {
+    Response &r(responses[i]);
+    if (!ReadFully(&r.header, sizeof(r.header)))
+      return false;
+    r.payload.resize(r.header.length);
+    if (r.header.length && !ReadFully(&r.payload[0], r.header.length))
+      return false;
+  }
+
+  return true;
+}
+
+bool ControlClient::DecodeStep(const Response &r, StepReply &step)
+{
+  if (r.header.op != OP_STEP || r.header.status != STATUS_OK
+      || r.payload.size() != sizeof(step))
+    return false;
+  memcpy(&step, &r.payload[0], sizeof(step));
+  return true;
+}
+
+bool ControlClient::DecodePoses(const Response &r, std::vector<double> &poses)
+{
+  if (r.header.op != OP_GET_POSES || r.header.status != STATUS_OK
+      || r.payload.size() % (4 * sizeof(double)))
+    return false;
+
+  const size_t at(poses.size());
+  poses.resize(at + r.payload.size() / sizeof(double));
+  if (!r.payload.empty())
+    memcpy(&poses[at], &r.payload[0], r.payload.size());
+  return true;
+}
+
+bool ControlClient::DecodeRangers(const Response &r, const std::vector<uint32_t> &ids,
+                                  std::vector<Scan> &scans)
+{
+  if (r.header.op != OP_GET_RANGERS || r.header.status != STATUS_OK)
+    return false;
+
+  const char *p(r.payload.empty() ? NULL : &r.payload[0]);
+  const char *end(p + r.payload.size());
+
+  for (size_t m(0); m < ids.size(); ++m) {
+    uint32_t sensors(0);
+    if (p + sizeof(sensors) > end)
+      return false;
+    memcpy(&sensors, p, sizeof(sensors));
+    p += sizeof(sensors);
+
+    for (uint32_t s(0); s < sensors; ++s) {
+      uint32_t samples(0);
+      if (p + sizeof(samples) > end)
+        return false;
+      memcpy(&samples, p, sizeof(samples));
+      p += sizeof(samples);
+      if (p + samples * sizeof(float) > end)
+        return false;
+
+      scans.push_back(Scan());
+      Scan &scan(scans.back());
+      scan.model = ids[m];
+      scan.sensor = s;
+      scan.ranges.resize(samples);
+      if (samples)
+        memcpy(&scan.ranges[0], p, samples * sizeof(float));
+      p += samples * sizeof(float);
+    }
+  }
+
+  return p == end;
+}
+
+bool ControlClient::Single(op_t op, const void *payload, uint32_t length, Response &r)
+{
+  Queue(op, payload, length);
+  std::vector<Response> responses;
+  if (!Exchange(responses))
+    return false;
+  r = responses[0];
+  return r.header.status == STATUS_OK;
+}
+
+bool ControlClient::List(std::vector<ModelInfo> &models)
+{
+  Response r;
+  if (!Single(OP_LIST, NULL, 0, r))
+    return false;
+
+  const char *p(r.payload.empty() ? NULL : &r.payload[0]);
+  const char *end(p + r.payload.size());
+  uint32_t count(0);
+  if (p + sizeof(count) > end)
+    return false;
+  memcpy(&count, p, sizeof(count));
+  p += sizeof(count);
+
+  models.clear();
+  for (uint32_t i(0); i < count; ++i) {
+    uint32_t fields[4]; // id, parent, type length, name length
+    if (p + sizeof(fields) > end)
+      return false;
+    memcpy(fields, p, sizeof(fields));
+    p += sizeof(fields);
+    if (p + fields[2] + fields[3] > end)
+      return false;
+
+    ModelInfo info;
+    info.id = fields[0];
+    info.parent = fields[1];
+    info.type.assign(p, fields[2]);
+    info.name.assign(p + fields[2], fields[3]);
+    p += fields[2] + fields[3];
+    models.push_back(info);
+  }
+
+  return true;
+}
+
+bool ControlClient::Checkpoint(uint32_t &checkpoint)
+{
+  Response r;
+  if (!Single(OP_CHECKPOINT, NULL, 0, r) || r.payload.size() != sizeof(checkpoint))
+    return false;
+  memcpy(&checkpoint, &r.payload[0], sizeof(checkpoint));
+  return true;
+}
+
+bool ControlClient::Reset(uint32_t checkpoint, uint32_t &skipped)
+{
+  Response r;
+  if (!Single(OP_RESET, &checkpoint, sizeof(checkpoint), r) || r.payload.size() != sizeof(skipped))
+    return false;
+  memcpy(&skipped, &r.payload[0], sizeof(skipped));
+  return true;
+}
+
+bool ControlClient::Quit()
+{
+  Response r;
+  return Single(OP_QUIT, NULL, 0, r);
+}
@@ -0,0 +1,195 @@
+#ifndef STG_CONTROL_H
+#define STG_CONTROL_H
+/*
+  control.hh
+  The binary protocol of Stage's control server (stage --control=path),
+  through which another process steps the simulation and gets and sets
+  the state of many models at once over a Unix domain socket, and a
+  client for it. Like logfile.hh, this header does not depend on the
+  rest of Stage: clients link against libstagecontrol alone.
+
+  On accepting a connection the server sends a Hello. The client then
+  sends requests, each a RequestHeader followed by its payload, and
+  the server answers each, in order, with a ResponseHeader followed by
+  its payload. Requests may be pipelined: the server answers all the
+  requests it has received in a single write, so setting the
+  velocities of a fleet, stepping and reading back its poses and
+  sensors costs one round trip.
+
+  Integers and floats are in the byte order of the server's machine.
+*/
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace Stg {
+
+namespace ControlProtocol {
+const uint32_t MAGIC = 0x43475453; ///< "STGC"
+const uint32_t PROTOCOL_VERSION = 2;
+const uint32_t MAX_REQUEST = 1 << 26; ///< the longest payload the server accepts
+const uint32_t NO_PARENT = 0xFFFFFFFF; ///< the parent id of a top-level model
+
+/** The requests, and the payloads of their requests and responses */
+typedef enum {
+  /** Request: nothing. Response: uint32 count, then for each model
+      uint32 id, uint32 parent id (or NO_PARENT), uint32 type length,
+      uint32 name length, the type and the name. */
+  OP_LIST = 1,
+  /** Request: uint32 updates. Response: a StepReply. Stops early if
+      the world reaches its quit time. */
+  OP_STEP = 2,
+  /** Request: uint32 count, then count uint32 model ids. Response: for
+      each model, its global pose as double x, y, z, a. */
+  OP_GET_POSES = 3,
+  /** Request: as OP_GET_POSES, for ranger models. Response: for each
+      model, uint32 sensors, then for each sensor uint32 samples and
+      float ranges[samples]. */
+  OP_GET_RANGERS = 4,
+  /** Request: uint32 count, then count VelocityEntry. Response:
+      nothing. Sets the speeds of position models. */
+  OP_SET_VELOCITIES = 5,
+  /** Request: nothing. Response: uint32 checkpoint, the handle of a
+      copy of the local pose of every model in the world, and the
+      velocity and odometry of every position model. Pooled models are
+      left out. */
+  OP_CHECKPOINT = 6,
+  /** Request: uint32 checkpoint. Response: uint32 skipped, the number
+      of checkpointed models since deleted or pooled. Puts the poses,
+      velocities and odometry back as they were at the checkpoint.
+      Nothing else is restored: simulated time, pending events,
+      controller and sensor state, energy, and the models spawned
+      since the checkpoint all stay as they are. */
+  OP_RESET = 7,
+  /** Request: nothing. Response: nothing. Stops the server after the
+      response. */
+  OP_QUIT = 8
+} op_t;
+
+typedef enum {
+  STATUS_OK = 0,
+  STATUS_BAD_OP = 1, ///< unknown request
+  STATUS_BAD_REQUEST = 2, ///< the payload is too short or too long
+  STATUS_NO_MODEL = 3, ///< a model id is unknown
+  STATUS_WRONG_TYPE = 4, ///< a model is not of the type the request needs
+  STATUS_NO_CHECKPOINT = 5 ///< unknown checkpoint handle
+} status_t;
+
+class Hello {
+public:
+  uint32_t magic;
+  uint32_t version;
+};
+
+class RequestHeader {
+public:
+  uint32_t op; ///< an op_t
+  uint32_t length; ///< bytes of payload that follow
+};
+
+class ResponseHeader {
+public:
+  uint32_t op; ///< the op_t of the request answered
+  uint32_t status; ///< a status_t. The payload is empty unless STATUS_OK.
+  uint32_t length; ///< bytes of payload that follow
+  uint32_t reserved;
+};
+
+class StepReply {
+public:
+  uint64_t sim_time; ///< usec
+  uint64_t updates; ///< World::UpdateCount()
+  uint32_t steps; ///< updates made by this request
+  uint32_t quit; ///< non-zero if the world has reached its quit time
+};
+
+class VelocityEntry {
+public:
+  uint32_t id; ///< of a position model
+  uint32_t reserved;
+  double x, y, a; ///< as for ModelPosition::SetSpeed()
+};
+}
+
+/** A connection to a control server. Requests are queued, then sent
+    together by Exchange(), which reads all their responses. */
+class ControlClient {
+public:
+  class ModelInfo {
+  public:
+    uint32_t id;
+    uint32_t parent; ///< ControlProtocol::NO_PARENT for none
+    std::string type;
+    std::string name;
+  };
+
+  class Response {
+  public:
+    ControlProtocol::ResponseHeader header;
+    std::vector<char> payload;
+  };
+
+  /** The ranges of one ranger sensor */
+  class Scan {
+  public:
+    uint32_t model;
+    uint32_t sensor;
+    std::vector<float> ranges;
+  };
+
+  /** Connects to the server listening on the socket at path */
+  explicit ControlClient(const std::string &path);
+  ~ControlClient();
+
+  /** Returns true while connected */
+  bool Ok() const { return fd >= 0; }
+
+  /** Queues a request */
+  void Queue(ControlProtocol::op_t op, const void *payload = NULL, uint32_t length = 0);
+  void QueueStep(uint32_t updates);
+  void QueueGetPoses(const std::vector<uint32_t> &ids);
+  void QueueGetRangers(const std::vector<uint32_t> &ids);
+  void QueueSetVelocities(const std::vector<ControlProtocol::VelocityEntry> &velocities);
+
+  /** Sends the queued requests and reads a response to each. Returns
+      false, and disconnects, if the connection fails. */
+  bool Exchange(std::vector<Response> &responses);
+
+  /** Decode the payloads of responses. Each returns false if the
+      response is not a successful one of that kind. */
+  static bool DecodeStep(const Response &r, ControlProtocol::StepReply &step);
+  /** Appends x, y, z, a for each model */
+  static bool DecodePoses(const Response &r, std::vector<double> &poses);
+  static bool DecodeRangers(const Response &r, const std::vector<uint32_t> &ids,
+                            std::vector<Scan> &scans);
+
+  /** Single requests, each a round trip of its own */
+  bool List(std::vector<ModelInfo> &models);
+  bool Checkpoint(uint32_t &checkpoint);
+  bool Reset(uint32_t checkpoint, uint32_t &skipped);
+  bool Quit();
+
+  /** Bytes sent and received so far */
+  uint64_t BytesSent() const { return sent; }
+  uint64_t BytesReceived() const { return received; }
+
+private:
+  int fd;
+  std::vector<char> out; ///< queued requests
+  uint32_t queued; ///< requests in out
+  std::vector<char> in; ///< received bytes not yet read
+  size_t in_start; ///< first unread byte of in
+  size_t in_end; ///< end of the received bytes in in
+  uint64_t sent;
+  uint64_t received;
+
+  bool Single(ControlProtocol::op_t op, const void *payload, uint32_t length, Response &r);
+  bool ReadFully(void *buf, size_t length);
+  void Disconnect();
+};
+
+} // namespace Stg
+
+#endif
@@ -0,0 +1,182 @@
+/////////////////////////////////
+// File: controlbench.cc
+// Desc: Measures round trips to Stage's control server
+// License: GPL
+/////////////////////////////////
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "control.hh"
+using namespace Stg;
+using namespace Stg::ControlProtocol;
+
+const char *USAGE =
+    "USAGE:  stage-controlbench [options] <socket>\n"
+    "Measures round trips to a Stage started with --control=socket. Each\n"
+    "round trip sets the speeds of every position model, steps the world,\n"
+    "and gets the poses of every position model and the scans of every\n"
+    "ranger, as a pipelined batch of requests.\n"
+    "Available [options] are:\n"
+    "  --rounds n  : round trips to measure (default 1000)\n"
+    "  --step n    : updates to step in each round trip (default 1)\n"
+    "  --ping      : send only the gets, without setting speeds or stepping\n"
+    "  --quit      : stop the server when done\n"
+    "  --help      : print this message";
+
+static struct option longopts[] = {
+  { "rounds",  required_argument,   NULL,  'n' },
+  { "step",  required_argument,   NULL,  's' },
+  { "ping",  no_argument,   NULL,  'p' },
+  { "quit",  no_argument,   NULL,  'q' },
+  { "help",  no_argument,   NULL,  'h' },
+  { NULL, 0, NULL, 0 }
+};
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double p)
+{
+  return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))] / 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t rounds(1000);
+  uint32_t step(1);
+  bool ping(false);
+  bool quit(false);
+
+  int ch = 0, optindex = 0;
+  while ((ch = getopt_long(argc, argv, "h?", longopts, &optindex)) != -1) {
+    switch (ch) {
+    case 'n': rounds = strtoul(optarg, NULL, 10); break;
+    case 's': step = strtoul(optarg, NULL, 10); break;
+    case 'p': ping = true; break;
+    case 'q': quit = true; break;
+    case 'h':
+    case '?':
+    default: puts(USAGE); exit(ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc - 1 || rounds == 0) {
+    puts(USAGE);
+    return EXIT_FAILURE;
+  }
+
+  ControlClient client(argv[optind]);
+  std::vector<ControlClient::ModelInfo> models;
+  if (!client.Ok() || !client.List(models)) {
+    fprintf(stderr, "stage-controlbench: no server at %s\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  std::vector<uint32_t> positions, rangers;
+  for (size_t i(0); i < models.size(); ++i) {
+    if (models[i].type == "position")
+      positions.push_back(models[i].id);
+    else if (models[i].type == "ranger")
+      rangers.push_back(models[i].id);
+  }
+
+  // turn slowly, so that the robots stay clear of the walls
+  std::vector<VelocityEntry> velocities(positions.size());
+  for (size_t i(0); i < positions.size(); ++i) {
+    velocities[i].id = positions[i];
+    velocities[i].reserved = 0;
+    velocities[i].x = 0.2;
+    velocities[i].y = 0;
+    velocities[i].a = 0.3;
+  }
+
+  uint32_t checkpoint(0);
+  if (!client.Checkpoint(checkpoint)) {
+    fprintf(stderr, "stage-controlbench: checkpoint failed\n");
+    return EXIT_FAILURE;
+  }
+
+  std::vector<uint64_t> rtt;
+  rtt.reserve(rounds);
+  std::vector<ControlClient::Response> responses;
+  std::vector<double> poses;
+  std::vector<ControlClient::Scan> scans;
+  uint64_t updates(0), samples(0), failed(0);
+  const uint64_t sent(client.BytesSent()), received(client.BytesReceived());
+  const uint64_t start(now_ns());
+
+  for (uint32_t r(0); r < rounds; ++r) {
+    const uint64_t t(now_ns());
+
+    if (!ping) {
+      client.QueueSetVelocities(velocities);
+      client.QueueStep(step);
+    }
+    client.QueueGetPoses(positions);
+    client.QueueGetRangers(rangers);
+    if (!client.Exchange(responses))
+      return EXIT_FAILURE;
+
+    rtt.push_back(now_ns() - t);
+
+    // the gets are the last two responses
+    const size_t n(responses.size());
+    StepReply reply;
+    if (!ping) {
+      if (!ControlClient::DecodeStep(responses[1], reply)) {
+        ++failed;
+        continue;
+      }
+      updates += reply.steps;
+      if (reply.quit)
+        break;
+    }
+
+    poses.clear();
+    scans.clear();
+    if (!ControlClient::DecodePoses(responses[n - 2], poses)
+        || !ControlClient::DecodeRangers(responses[n - 1], rangers, scans))
+      ++failed;
+    for (size_t i(0); i < scans.size(); ++i)
+      samples += scans[i].ranges.size();
+  }
+
+  const double seconds((now_ns() - start) / 1e9);
+  const double per_round(rtt.size());
+  const double sent_per_round((client.BytesSent() - sent) / per_round);
+  const double received_per_round((client.BytesReceived() - received) / per_round);
+
+  // leave the world as it was, for the next run
+  uint32_t skipped(0);
+  if (!client.Reset(checkpoint, skipped))
+    fprintf(stderr, "stage-controlbench: reset failed\n");
+  else if (skipped)
+    fprintf(stderr, "stage-controlbench: %u checkpointed models are gone\n", skipped);
+  if (quit)
+    client.Quit();
+
+  std::sort(rtt.begin(), rtt.end());
+  printf("%s: %u position and %u ranger models, %u round trips%s, %llu failed\n",
+         argv[optind], (unsigned int)positions.size(), (unsigned int)rangers.size(),
+         (unsigned int)rtt.size(), ping ? " without stepping" : "",
+         (unsigned long long)failed);
+  printf("%.0f round trips/s, %.0f updates/s, %.0f bytes sent and %.0f received per round "
+         "trip, %.1f range samples per round trip\n",
+         per_round / seconds, updates / seconds, sent_per_round, received_per_round,
+         samples / per_round);
+  printf("round trip usec: min %.2f median %.2f p90 %.2f p99 %.2f max %.2f\n",
+         rtt.front() / 1e3, percentile(rtt, 0.5), percentile(rtt, 0.9), percentile(rtt, 0.99),
+         rtt.back() / 1e3);
+
+  return EXIT_SUCCESS;
+}
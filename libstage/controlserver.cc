@@ -0,0 +1,381 @@
+/*
+  controlserver.cc
+  Serves Stage's control protocol on a Unix domain socket. See
+  control.hh for the protocol.
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.hh"
+#include "stage.hh"
+
+using namespace Stg;
+using namespace Stg::ControlProtocol;
+
+ControlServer::ControlServer(World *world, const std::string &path)
+    : world(world), path(path), listener(-1), quit(false), checkpoints(), in(), out()
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    PRINT_ERR1("control socket path %s is too long", path.c_str());
+    return;
+  }
+  strcpy(addr.sun_path, path.c_str());
+
+  // a socket left by an earlier run would make bind() fail
+  unlink(path.c_str());
+
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0
+      || listen(listener, 1) != 0) {
+    PRINT_ERR2("failed to listen on control socket %s: %s", path.c_str(), strerror(errno));
+    if (listener >= 0)
+      close(listener);
+    listener = -1;
+  }
+}
+
+ControlServer::~ControlServer()
+{
+  if (listener >= 0) {
+    close(listener);
+    unlink(path.c_str());
+  }
+}
+
+void ControlServer::Serve()
+{
+  if (listener < 0)
+    return;
+
+  printf("[Control %s]\n", path.c_str());
+  fflush(stdout);
+
+  while (!quit) {
+    const int fd(accept(listener, NULL, NULL));
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      PRINT_ERR1("control server failed: %s", strerror(errno));
+      return;
+    }
+
+    ServeClient(fd);
+    close(fd);
+  }
+}
+
+// write all of buf, returning false if the client has gone
+static bool send_all(int fd, const char *buf, size_t length)
+{
+  while (length > 0) {
+    const ssize_t n(send(fd, buf, length, MSG_NOSIGNAL));
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    buf += n;
+    length -= n;
+  }
+  return true;
+}
+
+void ControlServer::ServeClient(int fd)
+{
+  Hello hello;
+  hello.magic = MAGIC;
+  hello.version = PROTOCOL_VERSION;
+  if (!send_all(fd, reinterpret_cast<const char *>(&hello), sizeof(hello)))
+    return;
+
+  in.resize(65536);
+  size_t used(0); // bytes received in in
+
+  while (!quit) {
+    if (used == in.size())
+      in.resize(2 * in.size());
+
+    const ssize_t n(recv(fd, &in[used], in.size() - used, 0));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return; // the client has gone
+    used += n;
+
+    // answer every complete request, then send all the responses in
+    // one write, so that a pipelined batch costs one round trip
+    size_t start(0);
+    while (!quit && used - start >= sizeof(RequestHeader)) {
+      RequestHeader header;
+      memcpy(&header, &in[start], sizeof(header));
+
+      if (header.length > MAX_REQUEST) {
+        PRINT_ERR1("control request of %u bytes is too long, disconnecting", header.length);
+        return;
+      }
+      if (used - start < sizeof(header) + header.length) {
+        // make room for the rest of it
+        if (sizeof(header) + header.length > in.size())
+          in.resize(sizeof(header) + header.length);
+        break;
+      }
+
+      Handle(header.op, in.data() + start + sizeof(header), header.length);
+      start += sizeof(header) + header.length;
+    }
+
+    // keep the start of an incomplete request
+    memmove(in.data(), in.data() + start, used - start);
+    used -= start;
+
+    const bool sent(out.empty() || send_all(fd, &out[0], out.size()));
+    out.clear();
+    if (!sent)
+      return;
+  }
+}
+
+char *ControlServer::Respond(uint32_t op, uint32_t status, uint32_t length)
+{
+  ResponseHeader header;
+  header.op = op;
+  header.status = status;
+  header.length = status == STATUS_OK ? length : 0;
+  header.reserved = 0;
+
+  const size_t at(out.size());
+  out.resize(at + sizeof(header) + header.length);
+  memcpy(&out[at], &header, sizeof(header));
+  return header.length ? &out[at + sizeof(header)] : NULL;
+}
+
+uint32_t ControlServer::ReadModels(const char *payload, uint32_t length,
+                                   std::vector<Model *> &models)
+{
+  uint32_t count(0);
+  if (length < sizeof(count))
+    return STATUS_BAD_REQUEST;
+  memcpy(&count, payload, sizeof(count));
+  if (length != sizeof(count) + (uint64_t)count * sizeof(uint32_t))
+    return STATUS_BAD_REQUEST;
+
+  models.resize(count);
+  for (uint32_t i(0); i < count; ++i) {
+    uint32_t id;
+    memcpy(&id, payload + sizeof(count) + i * sizeof(id), sizeof(id));
+    models[i] = Model::LookupId(id);
+    if (models[i] == NULL || models[i]->GetWorld() != world)
+      return STATUS_NO_MODEL;
+  }
+  return STATUS_OK;
+}
+
+void ControlServer::Handle(uint32_t op, const char *payload, uint32_t length)
+{
+  std::vector<Model *> models;
+
+  switch (op) {
+  case OP_LIST: {
+    const std::set<Model *> all(world->GetAllModels());
+    uint32_t bytes(sizeof(uint32_t));
+    FOR_EACH (it, all)
+      bytes += 4 * sizeof(uint32_t) + (*it)->GetModelType().size() + (*it)->TokenStr().size();
+
+    char *p(Respond(op, STATUS_OK, bytes));
+    const uint32_t count(all.size());
+    memcpy(p, &count, sizeof(count));
+    p += sizeof(count);
+
+    FOR_EACH (it, all) {
+      const std::string &type((*it)->GetModelType());
+      const std::string &name((*it)->TokenStr());
+      const uint32_t fields[4] = { (*it)->GetId(),
+                                   (*it)->Parent() ? (*it)->Parent()->GetId() : NO_PARENT,
+                                   (uint32_t)type.size(), (uint32_t)name.size() };
+      memcpy(p, fields, sizeof(fields));
+      p += sizeof(fields);
+      memcpy(p, type.data(), type.size());
+      p += type.size();
+      memcpy(p, name.data(), name.size());
+      p += name.size();
+    }
+  } break;
+
+  case OP_STEP: {
+    uint32_t updates(0);
+    if (length != sizeof(updates)) {
+      Respond(op, STATUS_BAD_REQUEST, 0);
+      break;
+    }
+    memcpy(&updates, payload, sizeof(updates));
+
+    StepReply reply;
+    reply.steps = 0;
+    reply.quit = 0;
+    while (reply.steps < updates && !reply.quit) {
+      // Update() returns true, without updating, once the world is done
+      if (world->Update())
+        reply.quit = 1;
+      else
+        ++reply.steps;
+    }
+
+    reply.sim_time = world->SimTimeNow();
+    reply.updates = world->UpdateCount();
+    memcpy(Respond(op, STATUS_OK, sizeof(reply)), &reply, sizeof(reply));
+  } break;
+
+  case OP_GET_POSES: {
+    const uint32_t status(ReadModels(payload, length, models));
+    char *p(Respond(op, status, models.size() * 4 * sizeof(double)));
+    if (status != STATUS_OK)
+      break;
+
+    FOR_EACH (it, models) {
+      const Pose gpose((*it)->GetGlobalPose());
+      const double v[4] = { gpose.x, gpose.y, gpose.z, gpose.a };
+      memcpy(p, v, sizeof(v));
+      p += sizeof(v);
+    }
+  } break;
+
+  case OP_GET_RANGERS: {
+    uint32_t status(ReadModels(payload, length, models));
+    uint32_t bytes(0);
+    FOR_EACH (it, models) {
+      const ModelRanger *rgr(dynamic_cast<ModelRanger *>(*it));
+      if (rgr == NULL) {
+        status = STATUS_WRONG_TYPE;
+        break;
+      }
+      bytes += sizeof(uint32_t);
+      FOR_EACH (s, rgr->GetSensors())
+        bytes += sizeof(uint32_t) + s->ranges.size() * sizeof(float);
+    }
+
+    char *p(Respond(op, status, bytes));
+    if (status != STATUS_OK)
+      break;
+
+    FOR_EACH (it, models) {
+      const std::vector<ModelRanger::Sensor> &sensors(
+          dynamic_cast<ModelRanger *>(*it)->GetSensors());
+      const uint32_t count(sensors.size());
+      memcpy(p, &count, sizeof(count));
+      p += sizeof(count);
+
+      FOR_EACH (s, sensors) {
+        const uint32_t samples(s->ranges.size());
+        memcpy(p, &samples, sizeof(samples));
+        p += sizeof(samples);
+        for (uint32_t i(0); i < samples; ++i) {
+          const float r(s->ranges[i]);
+          memcpy(p, &r, sizeof(r));
+          p += sizeof(r);
+        }
+      }
+    }
+  } break;
+
+  case OP_SET_VELOCITIES: {
+    uint32_t count(0);
+    if (length < sizeof(count)) {
+      Respond(op, STATUS_BAD_REQUEST, 0);
+      break;
+    }
+    memcpy(&count, payload, sizeof(count));
+    if (length != sizeof(count) + (uint64_t)count * sizeof(VelocityEntry)) {
+      Respond(op, STATUS_BAD_REQUEST, 0);
+      break;
+    }
+
+    // check every entry before changing anything
+    std::vector<VelocityEntry> entries(count);
+    std::vector<ModelPosition *> positions(count);
+    uint32_t status(STATUS_OK);
+    if (count)
+      memcpy(&entries[0], payload + sizeof(count), count * sizeof(VelocityEntry));
+    for (uint32_t i(0); i < count && status == STATUS_OK; ++i) {
+      Model *mod(Model::LookupId(entries[i].id));
+      if (mod == NULL || mod->GetWorld() != world)
+        status = STATUS_NO_MODEL;
+      else if ((positions[i] = dynamic_cast<ModelPosition *>(mod)) == NULL)
+        status = STATUS_WRONG_TYPE;
+    }
+
+    if (status == STATUS_OK)
+      for (uint32_t i(0); i < count; ++i)
+        positions[i]->SetSpeed(entries[i].x, entries[i].y, entries[i].a);
+
+    Respond(op, status, 0);
+  } break;
+
+  case OP_CHECKPOINT: {
+    const std::set<Model *> all(world->GetAllModels());
+    checkpoints.push_back(std::vector<ModelState>());
+    std::vector<ModelState> &states(checkpoints.back());
+
+    FOR_EACH (it, all) {
+      if ((*it)->IsPooled())
+        continue; // not in the world until it is spawned again
+
+      ModelState state;
+      state.id = (*it)->GetId();
+      state.pose = (*it)->GetPose();
+      if (const ModelPosition *pos = dynamic_cast<ModelPosition *>(*it)) {
+        state.velocity = pos->GetVelocity();
+        state.odom = pos->est_pose;
+      }
+      states.push_back(state);
+    }
+
+    const uint32_t handle(checkpoints.size() - 1);
+    memcpy(Respond(op, STATUS_OK, sizeof(handle)), &handle, sizeof(handle));
+  } break;
+
+  case OP_RESET: {
+    uint32_t handle(0);
+    if (length != sizeof(handle)) {
+      Respond(op, STATUS_BAD_REQUEST, 0);
+      break;
+    }
+    memcpy(&handle, payload, sizeof(handle));
+    if (handle >= checkpoints.size()) {
+      Respond(op, STATUS_NO_CHECKPOINT, 0);
+      break;
+    }
+
+    // models deleted or pooled since the checkpoint are left alone
+    uint32_t skipped(0);
+    FOR_EACH (it, checkpoints[handle]) {
+      Model *mod(Model::LookupId(it->id));
+      if (mod == NULL || mod->GetWorld() != world || mod->IsPooled()) {
+        ++skipped;
+        continue;
+      }
+
+      mod->SetPose(it->pose);
+      if (ModelPosition *pos = dynamic_cast<ModelPosition *>(mod)) {
+        pos->SetSpeed(it->velocity.x, it->velocity.y, it->velocity.a);
+        pos->SetVelocity(it->velocity);
+        pos->SetOdom(it->odom);
+      }
+    }
+    memcpy(Respond(op, STATUS_OK, sizeof(skipped)), &skipped, sizeof(skipped));
+  } break;
+
+  case OP_QUIT:
+    quit = true;
+    Respond(op, STATUS_OK, 0);
+    break;
+
+  default: Respond(op, STATUS_BAD_OP, 0);
+  }
+}
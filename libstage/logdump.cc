@@ -0,0 +1,120 @@
+/////////////////////////////////
+// File: logdump.cc
+// Desc: Prints a Stage log file as text
+// License: GPL
+/////////////////////////////////
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <map>
+
+#include "logfile.hh"
+using namespace Stg;
+
+const char *USAGE =
+    "USAGE:  stage-logdump [options] <logfile>\n"
+    "Prints the records of a log written by Stage's log_file property, one\n"
+    "per line: time in seconds, model name, kind, sensor index, then values.\n"
+    "Available [options] are:\n"
+    "  --model name : only print the records of this model\n"
+    "  --from secs  : skip chunks that end before this simulated time\n"
+    "  --summary    : print the index and the model table instead of records\n"
+    "  --help       : print this message";
+
+static struct option longopts[] = {
+  { "model",  required_argument,   NULL,  'm' },
+  { "from",  required_argument,   NULL,  'f' },
+  { "summary",  no_argument,   NULL,  's' },
+  { "help",  no_argument,   NULL,  'h' },
+  { NULL, 0, NULL, 0 }
+};
+
+static const char *kind_name(log_kind_t kind)
+{
+  switch (kind) {
+  case LOG_POSE: return "pose";
+  case LOG_VELOCITY: return "velocity";
+  case LOG_RANGER: return "ranger";
+  case LOG_FIDUCIAL: return "fiducial";
+  case LOG_BLOBFINDER: return "blobfinder";
+  }
+  return "unknown";
+}
+
+int main(int argc, char *argv[])
+{
+  const char *model(NULL);
+  double from(0);
+  bool summary(false);
+
+  int ch = 0, optindex = 0;
+  while ((ch = getopt_long(argc, argv, "h?", longopts, &optindex)) != -1) {
+    switch (ch) {
+    case 'm': model = optarg; break;
+    case 'f': from = atof(optarg); break;
+    case 's': summary = true; break;
+    case 'h':
+    case '?':
+    default: puts(USAGE); exit(ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc - 1) {
+    puts(USAGE);
+    return EXIT_FAILURE;
+  }
+
+  LogReader log(argv[optind]);
+  if (!log.Ok())
+    return EXIT_FAILURE;
+
+  std::map<uint32_t, std::string> names;
+  for (size_t i(0); i < log.Models().size(); ++i)
+    names[log.Models()[i].id] = log.Models()[i].name;
+
+  if (summary) {
+    printf("%u chunks%s\n", (unsigned int)log.Chunks().size(),
+           log.Indexed() ? "" : " (no index, the log may be incomplete)");
+    for (size_t i(0); i < log.Chunks().size(); ++i) {
+      const LogFormat::IndexEntry &c(log.Chunks()[i]);
+      printf("  chunk %u: thread %u, %u records, %.3f - %.3f s, offset %llu\n",
+             (unsigned int)i, c.thread, c.records, c.first_time / 1e6, c.last_time / 1e6,
+             (unsigned long long)c.offset);
+    }
+
+    printf("%u models\n", (unsigned int)log.Models().size());
+    for (size_t i(0); i < log.Models().size(); ++i) {
+      const LogReader::ModelInfo &m(log.Models()[i]);
+      printf("  %u %s (%s), kinds 0x%x\n", m.id, m.name.c_str(), m.type.c_str(), m.kinds);
+    }
+    return EXIT_SUCCESS;
+  }
+
+  const LogReader::ModelInfo *only(NULL);
+  if (model && (only = log.FindModel(model)) == NULL) {
+    fprintf(stderr, "stage-logdump: no model \"%s\" in the log\n", model);
+    return EXIT_FAILURE;
+  }
+
+  log.Seek((uint64_t)(from * 1e6));
+
+  LogReader::Record rec;
+  while (log.Next(rec)) {
+    if (only && rec.model != only->id)
+      continue;
+
+    const std::map<uint32_t, std::string>::const_iterator name(names.find(rec.model));
+    if (name == names.end())
+      printf("%.3f %u %s %u", rec.time / 1e6, rec.model, kind_name(rec.kind), rec.aux);
+    else
+      printf("%.3f %s %s %u", rec.time / 1e6, name->second.c_str(), kind_name(rec.kind), rec.aux);
+
+    for (uint32_t i(0); i < rec.count; ++i)
+      printf(" %g", rec.values[i]);
+    putchar('\n');
+  }
+
+  return EXIT_SUCCESS;
+}
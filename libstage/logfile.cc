@@ -0,0 +1,555 @@
+/*
+  logfile.cc
+  Stage's binary log of model state. See logfile.hh for the format.
+*/
+
+#include <errno.h>
+
+#include <sstream>
+
+#include "config.h" // for HAVE_ZLIB
+#include "logfile.hh"
+#include "stage.hh" // for the PRINT macros
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace Stg;
+using namespace Stg::LogFormat;
+
+uint32_t Stg::LogKinds(const std::string &list)
+{
+  uint32_t kinds(0);
+  std::istringstream words(list);
+  std::string word;
+
+  while (words >> word) {
+    if (word == "pose")
+      kinds |= LOG_POSE;
+    else if (word == "velocity")
+      kinds |= LOG_VELOCITY;
+    else if (word == "ranger")
+      kinds |= LOG_RANGER;
+    else if (word == "fiducial")
+      kinds |= LOG_FIDUCIAL;
+    else if (word == "blobfinder")
+      kinds |= LOG_BLOBFINDER;
+    else if (word == "none")
+      continue;
+    else if (word == "all")
+      kinds |= LOG_POSE | LOG_VELOCITY | LOG_RANGER | LOG_FIDUCIAL | LOG_BLOBFINDER;
+    else {
+      PRINT_ERR1("unknown log record kind \"%s\"", word.c_str());
+      return 0;
+    }
+  }
+
+  return kinds;
+}
+
+LogWriter::LogWriter(const std::string &filename, unsigned int threads, size_t chunk_size,
+                     unsigned int ring_length, bool compress)
+    : filename(filename), fp(NULL), chunk_size(std::max(chunk_size, (size_t)4096)),
+      compress(compress), rings(std::max(threads, 1U)), index(), models(), stats(), thread(),
+      closing(false)
+{
+#ifndef HAVE_ZLIB
+  if (compress) {
+    PRINT_WARN1("Stage was built without zlib, so log %s will not be compressed",
+                filename.c_str());
+    this->compress = false;
+  }
+#endif
+
+  // allocate every buffer now, so that logging does not allocate
+  // in the simulation loop
+  FOR_EACH (it, rings) {
+    it->chunks.resize(std::max(ring_length, 2U));
+    FOR_EACH (ch, it->chunks)
+      ch->data.resize(this->chunk_size);
+  }
+
+  fp = fopen(filename.c_str(), "wb");
+  if (fp == NULL) {
+    PRINT_ERR2("failed to open log %s: %s", filename.c_str(), strerror(errno));
+    return;
+  }
+
+  FileHeader header;
+  memcpy(header.magic, MAGIC, sizeof(header.magic));
+  header.version = FORMAT_VERSION;
+  header.byte_order = BYTE_ORDER_MARK;
+  fwrite(&header, sizeof(header), 1, fp);
+
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&chunk_ready, NULL);
+  pthread_cond_init(&chunk_free, NULL);
+  pthread_create(&thread, NULL, WriterEntry, this);
+}
+
+LogWriter::~LogWriter()
+{
+  Close();
+}
+
+void LogWriter::AddModel(uint32_t id, const std::string &type, const std::string &name,
+                         uint32_t kinds)
+{
+  ModelEntry entry;
+  entry.id = id;
+  entry.kinds = kinds;
+  entry.type_length = type.size();
+  entry.name_length = name.size();
+  models.push_back(std::make_pair(entry, type + name));
+}
+
+float *LogWriter::Record(unsigned int thread, uint64_t time, uint32_t model, log_kind_t kind,
+                         uint16_t aux, uint32_t count)
+{
+  assert(thread < rings.size());
+  Ring &ring(rings[thread]);
+  const size_t need(sizeof(RecordHeader) + count * sizeof(float));
+
+  Chunk *chunk(&ring.chunks[ring.head % ring.chunks.size()]);
+  if (chunk->used > 0 && chunk->used + need > chunk->data.size()) {
+    Publish(thread);
+    chunk = &ring.chunks[ring.head % ring.chunks.size()];
+  }
+
+  // a record bigger than a chunk gets a chunk to itself
+  if (need > chunk->data.size())
+    chunk->data.resize(need);
+
+  if (chunk->records == 0)
+    chunk->first_time = time;
+  chunk->last_time = time;
+  ++chunk->records;
+
+  RecordHeader header;
+  header.time = time;
+  header.model = model;
+  header.kind = kind;
+  header.aux = aux;
+  header.count = count;
+  header.reserved = 0;
+
+  char *dest(&chunk->data[chunk->used]);
+  memcpy(dest, &header, sizeof(header));
+  chunk->used += need;
+
+  return reinterpret_cast<float *>(dest + sizeof(header));
+}
+
+void LogWriter::Publish(unsigned int thread)
+{
+  Ring &ring(rings[thread]);
+
+  pthread_mutex_lock(&mutex);
+  ++ring.head;
+  pthread_cond_signal(&chunk_ready);
+
+  // wait for the writer to empty the chunk we fill next
+  if (ring.head - ring.tail >= ring.chunks.size()) {
+    ++stats.stalls;
+    do
+      pthread_cond_wait(&chunk_free, &mutex);
+    while (ring.head - ring.tail >= ring.chunks.size());
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void LogWriter::Flush()
+{
+  if (fp == NULL)
+    return;
+
+  for (unsigned int t(0); t < rings.size(); ++t)
+    if (rings[t].chunks[rings[t].head % rings[t].chunks.size()].used > 0)
+      Publish(t);
+}
+
+void LogWriter::Close()
+{
+  if (fp == NULL)
+    return;
+
+  Flush();
+
+  pthread_mutex_lock(&mutex);
+  closing = true;
+  pthread_cond_signal(&chunk_ready);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(thread, NULL);
+
+  Footer footer;
+  footer.index_offset = ftello(fp);
+  footer.chunks = index.size();
+  footer.models = models.size();
+  memcpy(footer.magic, INDEX_MAGIC, sizeof(footer.magic));
+
+  if (!index.empty())
+    fwrite(&index[0], sizeof(IndexEntry), index.size(), fp);
+
+  FOR_EACH (it, models) {
+    fwrite(&it->first, sizeof(it->first), 1, fp);
+    fwrite(it->second.data(), 1, it->second.size(), fp);
+  }
+
+  fwrite(&footer, sizeof(footer), 1, fp);
+
+  if (ferror(fp) | fclose(fp))
+    PRINT_ERR2("failed to write log %s: %s", filename.c_str(), strerror(errno));
+  fp = NULL;
+
+  pthread_cond_destroy(&chunk_free);
+  pthread_cond_destroy(&chunk_ready);
+  pthread_mutex_destroy(&mutex);
+}
+
+void LogWriter::WriteChunk(unsigned int thread, const Chunk &chunk, std::vector<char> &scratch)
+{
+  ChunkHeader header;
+  memcpy(header.magic, CHUNK_MAGIC, sizeof(header.magic));
+  header.thread = thread;
+  header.raw_size = chunk.used;
+  header.stored_size = chunk.used;
+  header.records = chunk.records;
+  header.flags = 0;
+  header.first_time = chunk.first_time;
+  header.last_time = chunk.last_time;
+
+  const char *payload(&chunk.data[0]);
+
+#ifdef HAVE_ZLIB
+  if (compress) {
+    uLongf length(compressBound(chunk.used));
+    scratch.resize(length);
+
+    // store the records raw if they do not compress
+    if (compress2(reinterpret_cast<Bytef *>(&scratch[0]), &length,
+                  reinterpret_cast<const Bytef *>(payload), chunk.used, Z_BEST_SPEED)
+            == Z_OK
+        && length < chunk.used) {
+      payload = &scratch[0];
+      header.stored_size = length;
+      header.flags = CHUNK_COMPRESSED;
+    }
+  }
+#else
+  (void)scratch;
+#endif
+
+  IndexEntry entry;
+  entry.offset = ftello(fp);
+  entry.first_time = chunk.first_time;
+  entry.last_time = chunk.last_time;
+  entry.records = chunk.records;
+  entry.thread = thread;
+  index.push_back(entry);
+
+  if (fwrite(&header, sizeof(header), 1, fp) != 1
+      || fwrite(payload, 1, header.stored_size, fp) != header.stored_size)
+    PRINT_ERR2("failed to write log %s: %s", filename.c_str(), strerror(errno));
+
+  stats.records += chunk.records;
+  stats.raw_bytes += chunk.used;
+  stats.stored_bytes += sizeof(header) + header.stored_size;
+  ++stats.chunks;
+}
+
+void LogWriter::WriterLoop()
+{
+  std::vector<char> scratch;
+  size_t next(0); // take the threads' chunks in turn
+
+  pthread_mutex_lock(&mutex);
+
+  while (1) {
+    // find a thread with a chunk to write
+    size_t t(0);
+    for (; t < rings.size(); ++t)
+      if (rings[(next + t) % rings.size()].tail < rings[(next + t) % rings.size()].head)
+        break;
+
+    if (t == rings.size()) {
+      if (closing)
+        break;
+      pthread_cond_wait(&chunk_ready, &mutex);
+      continue;
+    }
+
+    const unsigned int thread((next + t) % rings.size());
+    Ring &ring(rings[thread]);
+    Chunk &chunk(ring.chunks[ring.tail % ring.chunks.size()]);
+    next = thread + 1;
+
+    // the simulation thread does not touch a handed over chunk, so
+    // it can be written without the lock
+    pthread_mutex_unlock(&mutex);
+    WriteChunk(thread, chunk, scratch);
+    chunk.used = 0;
+    chunk.records = 0;
+    pthread_mutex_lock(&mutex);
+
+    ++ring.tail;
+    pthread_cond_broadcast(&chunk_free);
+  }
+
+  pthread_mutex_unlock(&mutex);
+}
+
+void *LogWriter::WriterEntry(void *writer)
+{
+  static_cast<LogWriter *>(writer)->WriterLoop();
+  return NULL;
+}
+
+void LogWriter::Report(FILE *out) const
+{
+  fprintf(out,
+          "\n[Log %s: %llu records in %llu chunks, %.1f MB raw, %.1f MB written (%.0f%%), "
+          "%llu stalls]",
+          filename.c_str(), (unsigned long long)stats.records, (unsigned long long)stats.chunks,
+          stats.raw_bytes / 1e6, stats.stored_bytes / 1e6,
+          stats.raw_bytes ? 100.0 * stats.stored_bytes / stats.raw_bytes : 0.0,
+          (unsigned long long)stats.stalls);
+}
+
+LogReader::LogReader(const std::string &filename)
+    : fp(fopen(filename.c_str(), "rb")), indexed(false), models(), chunks(), next_chunk(0),
+      buffer(), position(0)
+{
+  if (fp == NULL) {
+    PRINT_ERR2("failed to open log %s: %s", filename.c_str(), strerror(errno));
+    return;
+  }
+
+  FileHeader header;
+  if (fread(&header, sizeof(header), 1, fp) != 1
+      || memcmp(header.magic, MAGIC, sizeof(header.magic)) != 0) {
+    PRINT_ERR1("%s is not a Stage log", filename.c_str());
+    fclose(fp);
+    fp = NULL;
+    return;
+  }
+
+  if (header.version != FORMAT_VERSION || header.byte_order != BYTE_ORDER_MARK) {
+    PRINT_ERR1("log %s was written by another version of Stage, or on a machine with another "
+               "byte order",
+               filename.c_str());
+    fclose(fp);
+    fp = NULL;
+    return;
+  }
+
+  indexed = ReadIndex();
+  if (!indexed) {
+    PRINT_WARN1("log %s has no index, so it may be incomplete", filename.c_str());
+    ScanChunks();
+  }
+}
+
+LogReader::~LogReader()
+{
+  if (fp)
+    fclose(fp);
+}
+
+bool LogReader::ReadIndex()
+{
+  Footer footer;
+  if (fseeko(fp, -(off_t)sizeof(footer), SEEK_END) != 0 || fread(&footer, sizeof(footer), 1, fp) != 1
+      || memcmp(footer.magic, INDEX_MAGIC, sizeof(footer.magic)) != 0
+      || fseeko(fp, footer.index_offset, SEEK_SET) != 0)
+    return false;
+
+  chunks.resize(footer.chunks);
+  if (footer.chunks && fread(&chunks[0], sizeof(IndexEntry), footer.chunks, fp) != footer.chunks) {
+    chunks.clear();
+    return false;
+  }
+
+  models.resize(footer.models);
+  FOR_EACH (it, models) {
+    ModelEntry entry;
+    if (fread(&entry, sizeof(entry), 1, fp) != 1) {
+      chunks.clear();
+      models.clear();
+      return false;
+    }
+
+    std::vector<char> strings(entry.type_length + entry.name_length + 1);
+    if (fread(&strings[0], 1, strings.size() - 1, fp) != strings.size() - 1) {
+      chunks.clear();
+      models.clear();
+      return false;
+    }
+
+    it->id = entry.id;
+    it->kinds = entry.kinds;
+    it->type.assign(&strings[0], entry.type_length);
+    it->name.assign(&strings[entry.type_length], entry.name_length);
+  }
+
+  return true;
+}
+
+void LogReader::ScanChunks()
+{
+  off_t offset(sizeof(FileHeader));
+  ChunkHeader header;
+
+  while (fseeko(fp, offset, SEEK_SET) == 0 && fread(&header, sizeof(header), 1, fp) == 1
+         && memcmp(header.magic, CHUNK_MAGIC, sizeof(header.magic)) == 0) {
+    IndexEntry entry;
+    entry.offset = offset;
+    entry.first_time = header.first_time;
+    entry.last_time = header.last_time;
+    entry.records = header.records;
+    entry.thread = header.thread;
+    chunks.push_back(entry);
+
+    offset += sizeof(header) + header.stored_size;
+  }
+
+  // a chunk cut short by a crash fails in LoadChunk()
+}
+
+bool LogReader::LoadChunk(size_t i)
+{
+  ChunkHeader header;
+  if (fseeko(fp, chunks[i].offset, SEEK_SET) != 0 || fread(&header, sizeof(header), 1, fp) != 1
+      || memcmp(header.magic, CHUNK_MAGIC, sizeof(header.magic)) != 0)
+    return false;
+
+  std::vector<char> stored(header.stored_size);
+  if (header.stored_size && fread(&stored[0], 1, header.stored_size, fp) != header.stored_size)
+    return false;
+
+  if (header.flags & CHUNK_COMPRESSED) {
+#ifdef HAVE_ZLIB
+    buffer.resize(header.raw_size);
+    uLongf length(header.raw_size);
+    if (uncompress(reinterpret_cast<Bytef *>(&buffer[0]), &length,
+                   reinterpret_cast<const Bytef *>(&stored[0]), header.stored_size)
+            != Z_OK
+        || length != header.raw_size)
+      return false;
+#else
+    PRINT_ERR("this log is compressed, but Stage was built without zlib");
+    return false;
+#endif
+  } else
+    buffer.swap(stored);
+
+  position = 0;
+  return true;
+}
+
+bool LogReader::Next(Record &rec)
+{
+  if (fp == NULL)
+    return false;
+
+  while (position >= buffer.size()) {
+    if (next_chunk >= chunks.size() || !LoadChunk(next_chunk++)) {
+      buffer.clear();
+      position = 0;
+      return false;
+    }
+  }
+
+  RecordHeader header;
+  if (position + sizeof(header) > buffer.size())
+    return false;
+  memcpy(&header, &buffer[position], sizeof(header));
+
+  const size_t length(sizeof(header) + header.count * sizeof(float));
+  if (position + length > buffer.size())
+    return false;
+
+  rec.time = header.time;
+  rec.model = header.model;
+  rec.kind = (log_kind_t)header.kind;
+  rec.aux = header.aux;
+  rec.count = header.count;
+  rec.values = reinterpret_cast<const float *>(&buffer[position + sizeof(header)]);
+
+  position += length;
+  return true;
+}
+
+void LogReader::Rewind()
+{
+  next_chunk = 0;
+  buffer.clear();
+  position = 0;
+}
+
+void LogReader::Seek(uint64_t time)
+{
+  Rewind();
+
+  while (next_chunk < chunks.size() && chunks[next_chunk].last_time < time)
+    ++next_chunk;
+}
+
+const LogReader::ModelInfo *LogReader::FindModel(const std::string &name) const
+{
+  FOR_EACH (it, models)
+    if (it->name == name)
+      return &*it;
+  return NULL;
+}
+
+LogTable::LogTable(const std::string &filename) : ok(false), entries(), values()
+{
+  LogReader log(filename);
+  if (!log.Ok())
+    return;
+
+  size_t records(0);
+  for (size_t i(0); i < log.Chunks().size(); ++i)
+    records += log.Chunks()[i].records;
+  entries.reserve(records);
+
+  LogReader::Record rec;
+  while (log.Next(rec)) {
+    Entry entry;
+    entry.model = rec.model;
+    entry.kind = rec.kind;
+    entry.aux = rec.aux;
+    entry.time = rec.time;
+    entry.count = rec.count;
+    entry.offset = values.size();
+    entries.push_back(entry);
+
+    values.insert(values.end(), rec.values, rec.values + rec.count);
+  }
+
+  std::sort(entries.begin(), entries.end());
+  ok = true;
+}
+
+const float *LogTable::Find(uint32_t model, log_kind_t kind, uint16_t aux, uint64_t time,
+                            uint32_t &count) const
+{
+  Entry key;
+  key.model = model;
+  key.kind = kind;
+  key.aux = aux;
+  key.time = time;
+
+  const std::vector<Entry>::const_iterator it(std::lower_bound(entries.begin(), entries.end(), key));
+  if (it == entries.end() || it->model != model || it->kind != kind || it->aux != aux
+      || it->time != time)
+    return NULL;
+
+  // a record may have no values, e.g. when no fiducials were seen,
+  // but it was still found
+  static const float none(0);
+
+  count = it->count;
+  return count ? &values[it->offset] : &none;
+}
@@ -0,0 +1,356 @@
+#ifndef STG_LOGFILE_H
+#define STG_LOGFILE_H
+/*
+  logfile.hh
+  Stage's binary log of model state: the streaming writer used by
+  World, and a reader for offline analysis. This header does not
+  depend on the rest of Stage, so analysis programs can link against
+  libstagelog alone.
+
+  A log file is a header, followed by chunks of records, followed by
+  an index of the chunks and a table of the logged models. Each chunk
+  holds the records made by one simulation thread, in time order, and
+  may be compressed with zlib. A file whose writer did not finish has
+  no index, but its chunks can still be read in file order.
+
+  All values are in the byte order of the machine that wrote the
+  file, which is recorded in the header.
+*/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+namespace Stg {
+
+/** The kinds of record in a log file. Each is a bit, so that a set
+    of kinds can be held in a mask. Every record is an array of
+    floats. */
+typedef enum {
+  LOG_POSE = 0x01, ///< global pose: x, y, z, a
+  LOG_VELOCITY = 0x02, ///< velocity: x, y, z, a
+  LOG_RANGER = 0x04, ///< one ranger sensor, whose index is aux: n ranges then n intensities
+  LOG_FIDUCIAL = 0x08, ///< detected fiducials, LOG_FIDUCIAL_SIZE floats each (see ModelFiducial)
+  LOG_BLOBFINDER = 0x10 ///< detected blobs, LOG_BLOB_SIZE floats each (see ModelBlobfinder)
+} log_kind_t;
+
+/** Floats per fiducial in a LOG_FIDUCIAL record: range, bearing,
+    geom x y z a, pose x y z a, id, and the bits of the target's model
+    id */
+const uint32_t LOG_FIDUCIAL_SIZE = 12;
+/** Floats per blob in a LOG_BLOBFINDER record: color r g b a, left,
+    top, right, bottom, range */
+const uint32_t LOG_BLOB_SIZE = 9;
+
+/** Parses a list of record kinds, such as "pose velocity ranger
+    fiducial blobfinder",
+    into a mask of log_kind_t. "all" selects every kind and "none"
+    selects none. Returns 0 if the list names an unknown kind. */
+uint32_t LogKinds(const std::string &list);
+
+/** The on-disk structures of a log file. */
+namespace LogFormat {
+const char MAGIC[8] = { 'S', 'T', 'A', 'G', 'E', 'L', 'O', 'G' };
+const char CHUNK_MAGIC[4] = { 'C', 'H', 'N', 'K' };
+const char INDEX_MAGIC[8] = { 'S', 'T', 'G', 'I', 'N', 'D', 'E', 'X' };
+const uint32_t FORMAT_VERSION = 1;
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+const uint32_t CHUNK_COMPRESSED = 0x01;
+
+class FileHeader {
+public:
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+};
+
+class ChunkHeader {
+public:
+  char magic[4];
+  uint32_t thread; ///< the simulation thread that made the records
+  uint32_t raw_size; ///< bytes of records
+  uint32_t stored_size; ///< bytes that follow this header
+  uint32_t records;
+  uint32_t flags; ///< CHUNK_COMPRESSED if the records are zlib compressed
+  uint64_t first_time; ///< sim time of the first record, in usec
+  uint64_t last_time; ///< sim time of the last record, in usec
+};
+
+class RecordHeader {
+public:
+  uint64_t time; ///< sim time in usec
+  uint32_t model; ///< model id
+  uint16_t kind; ///< a log_kind_t
+  uint16_t aux; ///< sensor index, for kinds with several sensors
+  uint32_t count; ///< floats that follow this header
+  uint32_t reserved;
+};
+
+class IndexEntry {
+public:
+  uint64_t offset; ///< file offset of the chunk header
+  uint64_t first_time;
+  uint64_t last_time;
+  uint32_t records;
+  uint32_t thread;
+};
+
+// after the index entries come the models, each a ModelEntry
+// followed by its type and name strings
+class ModelEntry {
+public:
+  uint32_t id;
+  uint32_t kinds; ///< mask of the log_kind_t logged for this model
+  uint32_t type_length;
+  uint32_t name_length;
+};
+
+// the last bytes of a finished file
+class Footer {
+public:
+  uint64_t index_offset;
+  uint32_t chunks;
+  uint32_t models;
+  char magic[8];
+};
+}
+
+/** Something that takes records of model state, such as a log
+    file. Model::LogState() writes its records to one. */
+class RecordSink {
+public:
+  virtual ~RecordSink() {}
+
+  /** Starts a record of count floats, made by the given thread, and
+      returns where to write the floats. The pointer is valid until
+      the thread's next Record(). */
+  virtual float *Record(unsigned int thread, uint64_t time, uint32_t model, log_kind_t kind,
+                        uint16_t aux, uint32_t count) = 0;
+};
+
+/** Writes a log file from several simulation threads at once. Each
+    thread appends records to its own ring of chunk buffers, without
+    locking. Full chunks are compressed and written to disk by a
+    background thread, so the simulation only waits for the disk if
+    every buffer in a thread's ring is full. */
+class LogWriter : public RecordSink {
+public:
+  /** Counters of the writer's work, for reporting. */
+  class Stats {
+  public:
+    uint64_t records; ///< records written
+    uint64_t raw_bytes; ///< bytes of records, before compression
+    uint64_t stored_bytes; ///< bytes of chunks written to disk
+    uint64_t chunks; ///< chunks written
+    uint64_t stalls; ///< times a simulation thread waited for a free buffer
+
+    Stats() : records(0), raw_bytes(0), stored_bytes(0), chunks(0), stalls(0) {}
+  };
+
+  /** Opens the file and starts the writer thread. Records may be
+      made from threads 0 to threads-1. Chunks hold about chunk_size
+      bytes of records, and each thread has buffers for ring_length
+      of them. Compression needs Stage to be built with zlib. */
+  LogWriter(const std::string &filename, unsigned int threads, size_t chunk_size,
+            unsigned int ring_length, bool compress);
+
+  /** Calls Close() */
+  ~LogWriter();
+
+  /** Returns true if the file was opened */
+  bool Ok() const { return fp != NULL; }
+  const std::string &GetFilename() const { return filename; }
+  /** Returns the counters. Only exact after Close(). */
+  const Stats &GetStats() const { return stats; }
+
+  /** Adds a model to the table in the index. Call from the main
+      thread. */
+  void AddModel(uint32_t id, const std::string &type, const std::string &name, uint32_t kinds);
+
+  /** See RecordSink::Record(). Each thread must only make records
+      with its own index, and records must be in time order. */
+  virtual float *Record(unsigned int thread, uint64_t time, uint32_t model, log_kind_t kind,
+                        uint16_t aux, uint32_t count);
+
+  /** Hands every partly filled chunk to the writer thread. Call
+      only while no other thread is making records. */
+  void Flush();
+
+  /** Flushes, waits for all chunks to be written, then writes the
+      index and closes the file. Call only while no other thread is
+      making records, and make no records afterwards. */
+  void Close();
+
+  /** Prints the counters to the file */
+  void Report(FILE *out) const;
+
+private:
+  class Chunk {
+  public:
+    std::vector<char> data;
+    size_t used;
+    uint32_t records;
+    uint64_t first_time;
+    uint64_t last_time;
+
+    Chunk() : data(), used(0), records(0), first_time(0), last_time(0) {}
+  };
+
+  // the chunks of one thread. The thread fills chunks[head % size]
+  // while the writer empties chunks[tail % size].
+  class Ring {
+  public:
+    std::vector<Chunk> chunks;
+    volatile uint64_t head; ///< chunks handed over by the simulation thread
+    volatile uint64_t tail; ///< chunks written by the writer thread
+
+    Ring() : chunks(), head(0), tail(0) {}
+  };
+
+  std::string filename;
+  FILE *fp;
+  size_t chunk_size;
+  bool compress;
+  std::vector<Ring> rings;
+  std::vector<LogFormat::IndexEntry> index;
+  std::vector<std::pair<LogFormat::ModelEntry, std::string> > models; ///< entries and their type+name
+  Stats stats;
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t chunk_ready; ///< signalled when a chunk is handed to the writer
+  pthread_cond_t chunk_free; ///< signalled when the writer empties a chunk
+  bool closing;
+
+  /** Hands the thread's current chunk to the writer and waits for
+      the next one to be free */
+  void Publish(unsigned int thread);
+
+  /** Compresses and writes one chunk */
+  void WriteChunk(unsigned int thread, const Chunk &chunk, std::vector<char> &scratch);
+
+  void WriterLoop();
+  static void *WriterEntry(void *writer);
+};
+
+/** Reads a log file written by LogWriter. Records are returned in
+    file order: those of any one thread, and so of any one model, are
+    in time order, but chunks of different threads interleave. */
+class LogReader {
+public:
+  /** A model in the file's table */
+  class ModelInfo {
+  public:
+    uint32_t id;
+    uint32_t kinds; ///< mask of the log_kind_t logged for this model
+    std::string type;
+    std::string name;
+  };
+
+  /** One record. The values point into the reader's buffer, and
+      are valid until the next call of Next() or Seek(). */
+  class Record {
+  public:
+    uint64_t time; ///< sim time in usec
+    uint32_t model;
+    log_kind_t kind;
+    uint16_t aux;
+    uint32_t count;
+    const float *values;
+  };
+
+  /** Opens the file and reads its index. If the file has no index,
+      because its writer did not finish, the chunks are found by
+      scanning the file, and the model table is empty. */
+  explicit LogReader(const std::string &filename);
+  ~LogReader();
+
+  /** Returns true if the file was opened and has a valid header */
+  bool Ok() const { return fp != NULL; }
+  /** Returns true if the file had an index */
+  bool Indexed() const { return indexed; }
+
+  const std::vector<ModelInfo> &Models() const { return models; }
+  /** Returns the model with this name, or NULL */
+  const ModelInfo *FindModel(const std::string &name) const;
+  /** Returns the chunks in file order */
+  const std::vector<LogFormat::IndexEntry> &Chunks() const { return chunks; }
+
+  /** Reads the next record into rec. Returns false at the end of
+      the file, or if a chunk could not be read. */
+  bool Next(Record &rec);
+
+  /** Goes back to the first record */
+  void Rewind();
+
+  /** Goes to the first chunk in the file that holds records at or
+      after the given time. Records from before that time may still
+      follow, in the chunks of other threads. */
+  void Seek(uint64_t time);
+
+private:
+  FILE *fp;
+  bool indexed;
+  std::vector<ModelInfo> models;
+  std::vector<LogFormat::IndexEntry> chunks;
+  size_t next_chunk; ///< index of the next chunk to load
+  std::vector<char> buffer; ///< the records of the loaded chunk
+  size_t position; ///< of the next record in the buffer
+
+  bool ReadIndex();
+  void ScanChunks();
+  bool LoadChunk(size_t i);
+};
+
+/** Every record of a log file, held in memory and looked up by
+    model, kind, sensor index and time. Used to replay recorded sensor
+    data. Lookups do not change the table, so any thread may make
+    them. */
+class LogTable {
+public:
+  /** Reads every record of the file */
+  explicit LogTable(const std::string &filename);
+
+  /** Returns true if the file was read */
+  bool Ok() const { return ok; }
+  /** Returns the number of records */
+  size_t Records() const { return entries.size(); }
+
+  /** Returns the values of the record made at the given time, and
+      sets count to their number, or returns NULL if there is none. */
+  const float *Find(uint32_t model, log_kind_t kind, uint16_t aux, uint64_t time,
+                    uint32_t &count) const;
+
+private:
+  class Entry {
+  public:
+    uint32_t model;
+    uint16_t kind;
+    uint16_t aux;
+    uint64_t time;
+    uint32_t count;
+    size_t offset; ///< of the first value in values
+
+    bool operator<(const Entry &other) const
+    {
+      if (model != other.model)
+        return model < other.model;
+      if (kind != other.kind)
+        return kind < other.kind;
+      if (aux != other.aux)
+        return aux < other.aux;
+      return time < other.time;
+    }
+  };
+
+  bool ok;
+  std::vector<Entry> entries; ///< sorted
+  std::vector<float> values;
+};
+
+} // namespace Stg
+
+#endif
@@ -19,6 +19,40 @@
 
     -a \"str\"       : equivalent to --args "str"
 
+    --pose-stats   : print global pose cache statistics on exit, which
+                     are collected by profiling the simulation
+
+    --profile[=file] : profile the simulation and print a report on
+                     exit, or write it to file. If the file name ends
+                     in .csv, the report is written as CSV
+
+    --alloc-check[=N] : report heap allocations made by updates after
+                     the first N (default 100) and fail if there were
+                     any. Allocations by controllers, and by the
+                     occupancy grid growing into new places, are
+                     reported but allowed. Requires libstage built
+                     with -DALLOC_COUNT=ON
+
+    --quit-time=S  : stop after S simulated seconds, overriding the
+                     worldfile's quit_time
+
+    --speedup=F    : without a GUI, run F times faster than real time,
+                     overriding the worldfile's headless_speedup, and
+                     print the update lateness statistics on exit
+
+    --pacing=P     : what a paced headless world does when it falls
+                     behind: "catchup" or "skip" (see headless_pacing)
+
+    --replay=file  : take ranger, fiducial and blobfinder data from a
+                     log written by an earlier run with log_file,
+                     overriding the worldfile's replay_file, and print
+                     how much was replayed on exit
+
+    --control=path : without a GUI, do not run the world but serve the
+                     control protocol of control.hh on a Unix domain
+                     socket at path, through which another process
+                     steps it and gets and sets the state of its models
+
     -h             : equivalent to --help"
 
     -?             : equivalent to --help
@@ -40,6 +74,17 @@ const char *USAGE = "USAGE:  stage [options] <worldfile1> [worldfile2 ... worldf
                     "  --args \"str\"   : define an argument string to be passed to all "
                     "controllers\n"
                     "  -a \"str\"       : equivalent to --args \"str\"\n"
+                    "  --pose-stats   : print global pose cache statistics on exit\n"
+                    "  --profile[=file] : print a profile on exit, or write it to file "
+                    "(CSV if file ends in .csv)\n"
+                    "  --alloc-check[=N] : fail if updates after the first N (default 100) "
+                    "allocate memory\n"
+                    "  --quit-time=S  : stop after S simulated seconds\n"
+                    "  --speedup=F    : without a GUI, run F times faster than real time\n"
+                    "  --pacing=P     : catchup or skip when a paced world falls behind\n"
+                    "  --replay=file  : take sensor data from a log written with log_file\n"
+                    "  --control=path : without a GUI, let a client step the world over a "
+                    "socket at path\n"
                     "  -h             : equivalent to --help\n"
                     "  -?             : equivalent to --help";
 
@@ -50,6 +95,14 @@ static struct option longopts[] = {
   { "clock",  optional_argument,   NULL,  'c' },
   { "help",  optional_argument,   NULL,  'h' },
   { "args",  required_argument,   NULL,  'a' },
+  { "pose-stats",  no_argument,   NULL,  'p' },
+  { "alloc-check",  optional_argument,   NULL,  'm' },
+  { "profile",  optional_argument,   NULL,  'P' },
+  { "quit-time",  required_argument,   NULL,  'q' },
+  { "speedup",  required_argument,   NULL,  's' },
+  { "pacing",  required_argument,   NULL,  'S' },
+  { "replay",  required_argument,   NULL,  'r' },
+  { "control",  required_argument,   NULL,  'C' },
   { NULL, 0, NULL, 0 }
 };
 
@@ -63,6 +116,17 @@ int main( int argc, char* argv[] )
   int ch = 0, optindex = 0;
   bool usegui = true;
   bool showclock = false;
+  bool posestats = false;
+  bool alloccheck = false;
+  uint64_t allocwarmup = 100;
+  bool profile = false;
+  std::string profilefile;
+  double quittime = -1.0; // use the worldfile's quit_time
+  double speedup = 0.0; // use the worldfile's headless_speedup
+  std::string pacing;
+  std::string replay;
+  std::string control;
+  std::vector<World *> worlds;
 
   while ((ch = getopt_long(argc, argv, "cgh?", longopts, &optindex)) != -1) {
     switch (ch) {
@@ -78,6 +142,27 @@ int main( int argc, char* argv[] )
       usegui = false;
       printf("[GUI disabled]");
       break;
+    case 'p': posestats = true; break;
+    case 'P':
+      profile = true;
+      if (optarg)
+        profilefile = optarg;
+      printf("[Profiling]");
+      break;
+    case 'm':
+      alloccheck = true;
+      if (optarg)
+        allocwarmup = strtoull(optarg, NULL, 10);
+      break;
+    case 'q': quittime = atof(optarg); break;
+    case 's': speedup = atof(optarg); break;
+    case 'S':
+      pacing = optarg;
+      if (pacing != "catchup" && pacing != "skip")
+        PRINT_WARN1("unknown pacing \"%s\", using the worldfile's", optarg);
+      break;
+    case 'r': replay = optarg; break;
+    case 'C': control = optarg; break;
     case 'h':
     case '?':
       puts(USAGE);
@@ -92,6 +177,11 @@ int main( int argc, char* argv[] )
 
   puts(""); // end the first start-up line
 
+  if (!control.empty() && usegui) {
+    PRINT_ERR("--control needs -g, as the client steps the world instead of the GUI");
+    exit(-1);
+  }
+
   // arguments at index [optindex] and later are not options, so they
   // must be world file names
 
@@ -100,8 +190,21 @@ int main( int argc, char* argv[] )
     if (optindex > 0) {
       const char *worldfilename = argv[optindex];
       World *world = (usegui ? new WorldGui(400, 300, worldfilename) : new World(worldfilename));
+      world->SetReplayFile(replay);
       world->Load(worldfilename);
       world->ShowClock(showclock);
+      if (quittime >= 0.0)
+        world->SetQuitTime((usec_t)(quittime * 1e6));
+      world->SetAllocationWarmup(allocwarmup);
+      // the pose cache is only counted while profiling
+      world->EnableProfiling(profile || posestats);
+
+      if (speedup > 0.0 || !pacing.empty())
+        world->SetPacing(speedup > 0.0 ? speedup : world->GetPaceSpeedup(),
+                         pacing == "skip" ?
+                             World::PACE_SKIP :
+                             (pacing == "catchup" ? World::PACE_CATCHUP : world->GetPacePolicy()));
+      worlds.push_back(world);
 
       if (!world->paused)
         world->Start();
@@ -109,9 +212,76 @@ int main( int argc, char* argv[] )
     optindex++;
   }
 
-  World::Run();
+  if (control.empty())
+    World::Run();
+  else if (!worlds.empty()) {
+    if (worlds.size() > 1)
+      PRINT_WARN1("--control serves only the first world, %s", worlds[0]->Token());
+
+    ControlServer server(worlds[0], control);
+    if (server.Ok())
+      server.Serve();
+  }
+
+  if (posestats)
+    FOR_EACH (it, worlds) {
+      const World::PoseCacheStats stats((*it)->GetPoseCacheStats());
+      const double updates(std::max((*it)->UpdateCount(), (uint64_t)1));
+
+      printf("\n[Pose cache %s: %llu lookups, %llu compositions, %llu saved (%.1f per update)]",
+             (*it)->Token(), (unsigned long long)stats.lookups,
+             (unsigned long long)stats.compositions, (unsigned long long)stats.saved,
+             stats.saved / updates);
+    }
+
+  FOR_EACH (it, worlds) {
+    (*it)->CloseLog(stdout);
+    (*it)->ReplayReport(stdout);
+  }
+
+  FOR_EACH (it, worlds)
+    if (!(*it)->IsGUI() && (*it)->GetPaceSpeedup() > 0.0)
+      (*it)->PaceReport(stdout);
+
+  int status = EXIT_SUCCESS;
+
+  if (profile) {
+    const bool csv = profilefile.size() > 4
+                     && profilefile.compare(profilefile.size() - 4, 4, ".csv") == 0;
+    FILE *fp = profilefile.empty() ? stdout : fopen(profilefile.c_str(), "w");
+
+    if (fp == NULL)
+      PRINT_ERR1("failed to open profile file %s", profilefile.c_str());
+    else {
+      FOR_EACH (it, worlds)
+        (*it)->ProfileReport(fp, csv);
+      if (fp != stdout)
+        fclose(fp);
+    }
+  }
+
+  if (alloccheck) {
+    if (AllocationCount() == 0)
+      PRINT_WARN("allocation counting is not compiled in. Rebuild with -DALLOC_COUNT=ON");
+
+    FOR_EACH (it, worlds) {
+      const World::AllocationStats &stats((*it)->GetAllocationStats());
+
+      printf("\n[Allocations %s: %llu of %llu updates after the first %llu allocated, at most "
+             "%llu. %llu more by the grid and controllers]",
+             (*it)->Token(), (unsigned long long)stats.updates,
+             (unsigned long long)((*it)->UpdateCount() > stats.warmup ?
+                                      (*it)->UpdateCount() - stats.warmup :
+                                      0),
+             (unsigned long long)stats.warmup, (unsigned long long)stats.max,
+             (unsigned long long)stats.exempt);
+
+      if (stats.updates)
+        status = EXIT_FAILURE;
+    }
+  }
 
   puts("\n[Stage: done]");
 
-  return EXIT_SUCCESS;
+  return status;
 }
@@ -28,6 +28,7 @@
     color "red"
     bitmap ""
     ctrl ""
+    ctrl_threadsafe 0
 
     # determine how the model appears in various sensors
     fiducial_return 0
@@ -50,6 +51,9 @@
     alwayson 0
 
     stack_children 1
+
+    log "" (all if the world's log_types lists the model's type)
+    shm "" (all if the world's shm_types lists the model's type)
     )
     @endverbatim
 
@@ -83,6 +87,13 @@
     is up to the controller to parse the string if it needs
     arguments."
 
+    - ctrl_threadsafe <int>\n if 1, the CB_UPDATE callbacks that the
+    model's controllers add when they initialize are called in the
+    worker threads, in parallel with those of other robots. Each
+    robot's callbacks (those of the models under the same top-level
+    model) are still called in series. Only set it for controllers
+    that touch nothing but their own robot and their own data.
+
     - fiducial_return fiducial_id:<int>\n if non-zero, this model is
     detected by fiducialfinder sensors. The value is used as the
     fiducial ID.
@@ -126,6 +137,18 @@
     _top_ of this model, making it easy to stack models together. If
     zero, the child coordinate system is not offset in z, making it
     easy to define objects in a single local coordinate system.
+
+    - log <string>\n The kinds of state recorded in the world's log
+    file (see the world's log_file property) each time this model is
+    updated: any of "pose", "velocity" (position models), "ranger",
+    "fiducial" and "blobfinder" (those sensor models), or "all" or
+    "none". Put this in a define to log every model of that type.
+
+    - shm <string>\n The kinds of state published in shared memory
+    (see the world's shm_prefix property) each time this model is
+    updated, in the same form as log. A model that publishes anything
+    is subscribed, so that it keeps updating without an in-process
+    controller.
 */
 
 #ifndef _GNU_SOURCE
@@ -138,6 +161,7 @@
 
 #include "config.h" // for build-time config
 #include "file_manager.hh"
+#include "region.hh"
 #include "stage.hh"
 #include "worldfile.hh"
 using namespace Stg;
@@ -234,10 +258,13 @@ Model::Model(World *world, Model *parent, const std::string &type, const std::st
       data_fresh(false), disabled(false), cv_list(), flag_list(), friction(DEFAULT_FRICTION),
       geom(), has_default_block(true), id(Model::count++), interval((usec_t)1e5), // 100msec
       interval_energy((usec_t)1e5), // 100msec
-      last_update(0), log_state(false), map_resolution(0.1), mass(0), parent(parent), pose(),
-      power_pack(NULL), pps_charging(), rastervis(), rebuild_displaylist(true), say_string(),
-      stack_children(true), stall(false), subs(0), thread_safe(false), trail(20),
-      trail_index(0),  trail_interval(10), type(type), event_queue_num(0), used(false), watts(0.0), watts_give(0.0),
+      last_update(0), log_kinds(0), map_resolution(0.1), mass(0), parent(parent), pose(),
+      global_pose(), pose_version(1), global_pose_version(0), power_pack(NULL), pps_charging(), touchers(),
+      contacts(), contacts_reported(), contacts_changed(false), pixels(), rastervis(), rebuild_displaylist(true), say_string(),
+      shm(NULL), shm_kinds(0), stack_children(true), stall(false), subs(0), thread_safe(false),
+      ctrl_threadsafe(false), threadsafe_update_callbacks(0), trail(20),
+      trail_index(0),  trail_interval(10), type(type), event_queue_num(0), used(false), spawned(false), pooled(false),
+      pooled_subs(0), watts(0.0), watts_give(0.0),
       watts_take(0.0), wf(NULL), wf_entity(0), world(world),
       world_gui(dynamic_cast<WorldGui *>(world))
 {
@@ -248,6 +275,12 @@ Model::Model(World *world, Model *parent, const std::string &type, const std::st
 
   modelsbyid[id] = this;
 
+  // room for a few contacts, so that a model's first touches do not
+  // allocate during an update
+  contacts[0].reserve(4);
+  contacts[1].reserve(4);
+  contacts_reported.reserve(4);
+
   if (name.size()) // use a name if specified
   {
     // printf( "name set %s\n", name.c_str() );
@@ -305,6 +338,10 @@ Model::~Model(void)
   {
     UnMap(); // remove from all layers
 
+    // our contacts have ended, but we are not around to report it
+    if (contacts_changed)
+      EraseAll(this, world->contacts_changed);
+
     // remove myself from my parent's child list, or the world's child
     // list if I have no parent
     EraseAll(this, parent ? parent->children : world->children);
@@ -313,11 +350,16 @@ Model::~Model(void)
 
     world->RemoveModel(this);
   }
+
+  delete shm;
 }
 
 void Model::InitControllers()
 {
+  // the callbacks the controllers add are thread safe if we say so
+  init_threadsafe = ctrl_threadsafe;
   CallCallbacks(CB_INIT);
+  init_threadsafe = false;
 }
 
 void Model::AddFlag(Flag *flag)
@@ -472,10 +514,18 @@ point_t Model::LocalToGlobal(const point_t &pt) const
 }
 
 std::vector<point_int_t> Model::LocalToPixels(const std::vector<point_t> &local) const
+{
+  std::vector<point_int_t> global;
+  LocalToPixels(local, global);
+  return global;
+}
+
+void Model::LocalToPixels(const std::vector<point_t> &local,
+                          std::vector<point_int_t> &global) const
 {
   const size_t sz = local.size();
 
-  std::vector<point_int_t> global(sz);
+  global.resize(sz);
 
   const Pose gpose(GetGlobalPose() + geom.pose);
   Pose ptpose;
@@ -486,8 +536,6 @@ std::vector<point_int_t> Model::LocalToPixels(const std::vector<point_t> &local)
     global[i].x = (int32_t)floor(ptpose.x * world->ppm);
     global[i].y = (int32_t)floor(ptpose.y * world->ppm);
   }
-
-  return global;
 }
 
 void Model::MapWithChildren(unsigned int layer)
@@ -610,13 +658,33 @@ void Model::Update(void)
   // they may make OpenGL calls or unsafe Stage API calls,
   // etc. We queue up the callback into a queue specific to
 
-  if (!callbacks[Model::CB_UPDATE].empty())
-    world->pending_update_callbacks[event_queue_num].push(this);
+  if (callbacks[Model::CB_UPDATE].size() > threadsafe_update_callbacks)
+    world->pending_update_callbacks[event_queue_num].push_back(this);
+
+  // callbacks that are thread safe are called in parallel instead
+  if (threadsafe_update_callbacks)
+    world->pending_threadsafe_callbacks[event_queue_num].push_back(this);
+
+  if (log_kinds)
+    world->Log(this);
+
+  if (shm_kinds)
+    world->Publish(this);
+
+  if (world->Replaying())
+    world->ReplayCheck(this);
 }
 
-void Model::CallUpdateCallbacks(void)
+void Model::LogState(RecordSink &log, unsigned int thread, uint32_t kinds)
 {
-  CallCallbacks(CB_UPDATE);
+  if (kinds & LOG_POSE) {
+    const Pose gpose(GetGlobalPose());
+    float *v(log.Record(thread, world->SimTimeNow(), id, LOG_POSE, 0, 4));
+    v[0] = gpose.x;
+    v[1] = gpose.y;
+    v[2] = gpose.z;
+    v[3] = gpose.a;
+  }
 }
 
 meters_t Model::ModelHeight() const
@@ -658,9 +726,45 @@ bool Model::RandomPoseInFreeSpace(meters_t xmin, meters_t xmax,
   return i <= max_iter; // return true if a free pose was found within max iterations
 }
 
-void Model::AppendTouchingModels(std::set<Model *> &touchers)
+void Model::AppendTouchingModels(std::vector<Model *> &touchers)
 {
-  blockgroup.AppendTouchingModels(touchers);
+  FOR_EACH (it, GetContacts())
+    touchers.push_back(it->mod);
+}
+
+void Model::Touch(Model *other, unsigned int layer, int overlaps)
+{
+  std::vector<Contact> &c(contacts[layer]);
+
+  size_t i(0);
+  while (i < c.size() && c[i].mod != other)
+    ++i;
+
+  if (i < c.size()) {
+    c[i].overlaps += overlaps;
+    if (c[i].overlaps > 0)
+      return; // still touching
+    c[i] = c.back();
+    c.pop_back();
+  } else {
+    assert(overlaps > 0);
+    if (c.size() == c.capacity()) {
+      AllocationExempt exempt; // more contacts than this model has had before
+      c.reserve(std::max(c.size() * 2, (size_t)4));
+    }
+    c.push_back(Contact(other, overlaps));
+  }
+
+  // the contact began or ended
+  if (!contacts_changed) {
+    contacts_changed = true;
+    std::vector<Model *> &changed(world->contacts_changed);
+    if (changed.size() == changed.capacity()) {
+      AllocationExempt exempt; // more models changed contacts than in any update before
+      changed.reserve(std::max(changed.size() * 2, (size_t)8));
+    }
+    changed.push_back(this);
+  }
 }
 
 Model *Model::TestCollision()
@@ -696,8 +800,9 @@ void Model::UpdateCharge()
       (*it)->ChargeStop();
     pps_charging.clear();
 
-    // run through and update all appropriate touchers
-    std::set<Model *> touchers;
+    // run through and update all appropriate touchers. The contact
+    // graph lists each only once.
+    touchers.clear();
     AppendTouchingModels(touchers);
 
     FOR_EACH (it, touchers) {
@@ -721,12 +826,29 @@ void Model::UpdateCharge()
         mypp->TransferTo(hispp, amount);
 
         // remember who we are charging so we can detatch next time
-        pps_charging.push_front(hispp);
+        pps_charging.push_back(hispp);
       }
     }
   }
 }
 
+ModelProfile &ModelProfile::operator+=(const ModelProfile &other)
+{
+  updates += other.updates;
+  update_time += other.update_time;
+  rays += other.rays;
+  cells += other.cells;
+  maps += other.maps;
+  map_cells += other.map_cells;
+  unmaps += other.unmaps;
+  collision_tests += other.collision_tests;
+  callbacks += other.callbacks;
+  callback_time += other.callback_time;
+  scans += other.scans;
+  scans_cached += other.scans_cached;
+  return *this;
+}
+
 void Model::UpdateTrail()
 {
   // get the current item and increment the counter
@@ -813,6 +935,9 @@ kg_t Model::GetMassOfChildren() const
 // render all blocks in the group at my global pose and size
 void Model::Map(unsigned int layer)
 {
+  if (world->map_deferred)
+    return;
+
   blockgroup.Map(layer);
 }
 
@@ -829,6 +954,7 @@ void Model::BecomeParentOf(Model *child)
     world->RemoveChild(child);
 
   child->parent = this;
+  child->InvalidateGlobalPose();
 
   this->AddChild(child);
 
@@ -1069,6 +1195,7 @@ void Model::SetGeom(const Geom &val)
   UnMapWithChildren(1);
 
   geom = val;
+  InvalidateGlobalPose(); // our height changes the pose of stacked children
 
   blockgroup.CalcSize();
 
@@ -1102,11 +1229,13 @@ void Model::SetStall(bool val)
 void Model::SetGripperReturn(bool val)
 {
   vis.gripper_return = val;
+  RefreshVis();
 }
 
 void Model::SetFiducialReturn(int val)
 {
   vis.fiducial_return = val;
+  RefreshVis();
 
   // non-zero values mean we need to be in the world's set of
   // detectable models
@@ -1116,6 +1245,23 @@ void Model::SetFiducialReturn(int val)
     world->FiducialInsert(this);
 }
 
+uint32_t Model::VisBits() const
+{
+  return ((vis.obstacle_return ? VIS_OBSTACLE : 0) | (vis.ranger_return >= 0 ? VIS_RANGER : 0)
+          | (vis.blob_return ? VIS_BLOB : 0) | (vis.gripper_return ? VIS_GRIPPER : 0)
+          | (vis.fiducial_return ? VIS_FIDUCIAL : 0));
+}
+
+void Model::RefreshVis()
+{
+  FOR_EACH (it, blockgroup.blocks) {
+    SuperRegion::PageLock lock(it->paged_superregions);
+    for (unsigned int layer = 0; layer < 2; ++layer)
+      FOR_EACH (cell, it->rendered_cells[layer])
+        (*cell)->RefreshBlock(&*it, layer);
+  }
+}
+
 void Model::SetFiducialKey(int val)
 {
   vis.fiducial_key = val;
@@ -1124,16 +1270,19 @@ void Model::SetFiducialKey(int val)
 void Model::SetObstacleReturn(bool val)
 {
   vis.obstacle_return = val;
+  RefreshVis();
 }
 
 void Model::SetBlobReturn(bool val)
 {
   vis.blob_return = val;
+  RefreshVis();
 }
 
 void Model::SetRangerReturn(double val)
 {
   vis.ranger_return = val;
+  RefreshVis();
 }
 
 void Model::SetBoundary(bool val)
@@ -1188,6 +1337,7 @@ int Model::SetParent(Model *newparent)
     world->RemoveChild(this);
   // link from the model to its new parent
   this->parent = newparent;
+  InvalidateGlobalPose();
 
   if (newparent)
     newparent->AddChild(this);
@@ -1203,20 +1353,56 @@ int Model::SetParent(Model *newparent)
 
 // get the model's position in the global frame
 Pose Model::GetGlobalPose() const
+{
+  if (world && world->profiling) {
+    World::PoseCacheStats &stats(world->ThreadPoseCacheStats());
+    ++stats.lookups;
+
+    // without the cache, each lookup composes one pose per ancestor
+    for (const Model *p(parent); p; p = p->parent)
+      ++stats.saved;
+  }
+
+  return CachedGlobalPose();
+}
+
+const Pose &Model::CachedGlobalPose() const
 {
   // if I'm a top level model, my global pose is my local pose
   if (parent == NULL)
     return pose;
 
-  // otherwise
-  Pose global_pose = parent->GetGlobalPose() + pose;
+  // the version is sampled before reading the parent, so that a pose
+  // change made by another thread while we compute is not hidden by
+  // our stale result
+  const uint64_t version(pose_version);
+
+  if (global_pose_version != version) {
+    Pose gpose(parent->CachedGlobalPose() + pose);
+
+    if (parent->stack_children) // should we be on top of our parent?
+      gpose.z += parent->geom.size.z;
+
+    global_pose = gpose;
+    __sync_synchronize(); // publish the pose before the version
+    global_pose_version = version;
 
-  if (parent->stack_children) // should we be on top of our parent?
-    global_pose.z += parent->geom.size.z;
+    if (world->profiling)
+      ++world->ThreadPoseCacheStats().compositions;
+  }
 
   return global_pose;
 }
 
+void Model::InvalidateGlobalPose()
+{
+  __sync_synchronize(); // publish the new pose before invalidating
+  ++pose_version;
+
+  FOR_EACH (it, children)
+    (*it)->InvalidateGlobalPose();
+}
+
 // set the model's pose in the local frame
 void Model::SetPose(const Pose &newpose)
 {
@@ -1224,6 +1410,7 @@ void Model::SetPose(const Pose &newpose)
   if (pose != newpose) {
     pose = newpose;
     pose.a = normalize(pose.a);
+    InvalidateGlobalPose();
 
     //       if( isnan( pose.a ) )
     // 		  printf( "SetPose bad angle %s [%.2f %.2f %.2f %.2f]\n",
@@ -1254,6 +1441,18 @@ void Model::Load()
   // choose the thread to run in, if thread_safe > 0
   event_queue_num = wf->ReadInt(wf_entity, "event_queue", event_queue_num);
 
+  if (LogWriter *logger = world->GetLogger()) {
+    const bool by_type(world->log_types.count(type) > 0);
+    log_kinds = LogKinds(wf->ReadString(wf_entity, "log", by_type ? "all" : "none"));
+    if (log_kinds)
+      logger->AddModel(id, type, token, log_kinds);
+  }
+
+  if (!world->shm_prefix.empty()) {
+    const bool by_type(world->shm_types.count(type) > 0);
+    shm_kinds = LogKinds(wf->ReadString(wf_entity, "shm", by_type ? "all" : "none"));
+  }
+
   if (wf->PropertyExists(wf_entity, "joules")) {
     if (!power_pack)
       power_pack = new PowerPack(this);
@@ -1390,13 +1589,14 @@ void Model::Load()
   }
 
   this->stack_children = wf->ReadInt(wf_entity, "stack_children", this->stack_children);
+  InvalidateGlobalPose();
 
   kg_t m = wf->ReadFloat(wf_entity, "mass", this->mass);
   if (m != this->mass)
     SetMass(m);
 
   vis.Load(wf, wf_entity);
-  SetFiducialReturn(vis.fiducial_return); // may have some work to do
+  SetFiducialReturn(vis.fiducial_return); // may have some work to do, and refreshes the vis bits
 
   gui.Load(wf, wf_entity);
 
@@ -1408,6 +1608,8 @@ void Model::Load()
     this->SetFriction(wf->ReadFloat(wf_entity, "friction", this->friction));
   }
 
+  ctrl_threadsafe = wf->ReadInt(wf_entity, "ctrl_threadsafe", ctrl_threadsafe);
+
   if (CProperty *ctrlp = wf->GetProperty(wf_entity, "ctrl")) {
     for (unsigned int index = 0; index < ctrlp->values.size(); index++) {
       const char *lib = wf->GetPropertyValue(ctrlp, index);
@@ -1466,6 +1668,7 @@ void Model::Save(void)
 
   // just in case
   pose.a = normalize(pose.a);
+  InvalidateGlobalPose();
   geom.pose.a = normalize(geom.pose.a);
 
   if (wf->PropertyExists(wf_entity, "pose"))
@@ -18,6 +18,7 @@
 #include <sys/time.h>
 
 #include "option.hh"
+#include "raytrace.hh"
 #include "stage.hh"
 #include "worldfile.hh"
 using namespace Stg;
@@ -84,7 +85,7 @@ static const unsigned int DEFAULT_BLOBFINDERSCANHEIGHT = 60;
 */
 
 ModelBlobfinder::ModelBlobfinder(World *world, Model *parent, const std::string &type)
-    : Model(world, parent, type), vis(world), blobs(), colors(), fov(DEFAULT_BLOBFINDERFOV),
+    : Model(world, parent, type), vis(world), blobs(), colors(), samples(), fov(DEFAULT_BLOBFINDERFOV),
       pan(DEFAULT_BLOBFINDERPAN), range(DEFAULT_BLOBFINDERRANGE),
       scan_height(DEFAULT_BLOBFINDERSCANHEIGHT), scan_width(DEFAULT_BLOBFINDERSCANWIDTH)
 {
@@ -99,12 +100,15 @@ ModelBlobfinder::~ModelBlobfinder(void)
 {
 }
 
-static bool blob_match(Model *candidate, const Model *finder, const void *dummy)
-{
-  (void)dummy; // avoid warning about unused var
+class BlobMatch {
+public:
+  static const uint32_t VIS = 0;
 
-  return (!finder->IsRelated(candidate));
-}
+  bool operator()(Model *candidate, const Model *finder) const
+  {
+    return (!finder->IsRelated(candidate));
+  }
+};
 
 static bool ColorMatchIgnoreAlpha(Color a, Color b)
 {
@@ -164,10 +168,29 @@ void ModelBlobfinder::Load(void)
 
 void ModelBlobfinder::Update(void)
 {
+  uint32_t count(0);
+  if (const float *v = world->Replay(this, LOG_BLOBFINDER, 0, count)) {
+    blobs.clear();
+
+    for (uint32_t i(0); i + LOG_BLOB_SIZE <= count; i += LOG_BLOB_SIZE) {
+      Blob blob;
+      blob.color = Color(v[i], v[i + 1], v[i + 2], v[i + 3]);
+      blob.left = v[i + 4];
+      blob.top = v[i + 5];
+      blob.right = v[i + 6];
+      blob.bottom = v[i + 7];
+      blob.range = v[i + 8];
+      blobs.push_back(blob);
+    }
+
+    Model::Update();
+    return;
+  }
+
   // generate a scan for post-processing into a blob image
-  std::vector<RaytraceResult> samples(scan_width);
+  samples.resize(scan_width);
 
-  Raytrace(Pose(0, 0, 0, pan), range, fov, blob_match, NULL, false, samples);
+  Raytrace(Pose(0, 0, 0, pan), range, fov, BlobMatch(), false, samples);
 
   // now the colors and ranges are filled in - time to do blob detection
   double yRadsPerPixel = fov / scan_height;
@@ -249,6 +272,29 @@ void ModelBlobfinder::Update(void)
   Model::Update();
 }
 
+void ModelBlobfinder::LogState(RecordSink &log, unsigned int thread, uint32_t kinds)
+{
+  Model::LogState(log, thread, kinds);
+
+  if (kinds & LOG_BLOBFINDER) {
+    float *v(log.Record(thread, world->SimTimeNow(), id, LOG_BLOBFINDER, 0,
+                        LOG_BLOB_SIZE * blobs.size()));
+
+    FOR_EACH (it, blobs) {
+      v[0] = it->color.r;
+      v[1] = it->color.g;
+      v[2] = it->color.b;
+      v[3] = it->color.a;
+      v[4] = it->left;
+      v[5] = it->top;
+      v[6] = it->right;
+      v[7] = it->bottom;
+      v[8] = it->range;
+      v += LOG_BLOB_SIZE;
+    }
+  }
+}
+
 void ModelBlobfinder::Startup(void)
 {
   Model::Startup();
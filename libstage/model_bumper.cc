@@ -55,6 +55,7 @@ setting above.
 */
 
 #include "option.hh"
+#include "raytrace.hh"
 #include "stage.hh"
 #include "worldfile.hh"
 using namespace Stg;
@@ -154,12 +155,17 @@ void ModelBumper::Load(void)
   }
 }
 
-static bool bumper_match(Model *candidate, const Model *finder, const void *)
-{
-  // Ignore myself, my children, and my ancestors.
-  return ( // candidate->vis.obstacle_return &&
-      !finder->IsRelated(candidate));
-}
+class BumperMatch {
+public:
+  static const uint32_t VIS = 0;
+
+  bool operator()(Model *candidate, const Model *finder) const
+  {
+    // Ignore myself, my children, and my ancestors.
+    return ( // candidate->vis.obstacle_return &&
+        !finder->IsRelated(candidate));
+  }
+};
 
 void ModelBumper::Update(void)
 {
@@ -183,7 +189,7 @@ void ModelBumper::Update(void)
     bpose.x = bumpers[t].pose.x - bumpers[t].length / 2.0 * cos(bpose.a);
     bpose.y = bumpers[t].pose.y - bumpers[t].length / 2.0 * sin(bpose.a);
 
-    RaytraceResult ray = Raytrace(bpose, bumpers[t].length, bumper_match, NULL, false);
+    RaytraceResult ray = Raytrace(bpose, bumpers[t].length, BumperMatch(), false);
 
     samples[t].hit = ray.mod;
     if (ray.mod) {
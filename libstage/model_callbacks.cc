@@ -2,25 +2,41 @@
 using namespace Stg;
 using namespace std;
 
+bool Model::init_threadsafe(false);
+
 void Model::AddCallback(callback_type_t type, model_callback_t cb, void *user)
+{
+  AddCallback(type, cb, user, init_threadsafe);
+}
+
+void Model::AddCallback(callback_type_t type, model_callback_t cb, void *user, bool threadsafe)
 {
   // callbacks[address].insert( cb_t( cb, user ));
-  callbacks[type].insert(cb_t(cb, user));
+  const bool added(callbacks[type].insert(cb_t(cb, user, threadsafe)).second);
 
   // debug info - record the global number of registered callbacks
   if (type == CB_UPDATE) {
     assert(world->update_cb_count >= 0);
-    world->update_cb_count++;
+    __sync_fetch_and_add(&world->update_cb_count, 1);
+
+    if (added && threadsafe)
+      ++threadsafe_update_callbacks;
   }
 }
 
 int Model::RemoveCallback(callback_type_t type, model_callback_t callback)
 {
   set<cb_t> &callset = callbacks[type];
-  callset.erase(cb_t(callback, NULL));
+  set<cb_t>::iterator it(callset.find(cb_t(callback, NULL)));
+  if (it != callset.end()) {
+    if (type == CB_UPDATE && it->threadsafe)
+      --threadsafe_update_callbacks;
+    callset.erase(it);
+  }
 
+  // thread-safe callbacks may remove themselves in worker threads
   if (type == CB_UPDATE) {
-    world->update_cb_count--;
+    __sync_fetch_and_sub(&world->update_cb_count, 1);
     assert(world->update_cb_count >= 0);
   }
 
@@ -31,7 +47,10 @@ int Model::RemoveCallback(callback_type_t type, model_callback_t callback)
 
 int Model::CallCallbacks(callback_type_t type)
 {
-  // maintain a list of callbacks that should be cancelled
+  // maintain a list of callbacks that should be cancelled. An empty
+  // vector does not allocate, so this costs nothing in the common
+  // case. Erasing in the loop instead would break callbacks that
+  // remove themselves.
   vector<cb_t> doomed;
 
   set<cb_t> &callset = callbacks[type];
@@ -43,10 +62,33 @@ int Model::CallCallbacks(callback_type_t type)
       doomed.push_back(cba);
   }
 
-  FOR_EACH (it, doomed)
+  FOR_EACH (it, doomed) {
+    if (type == CB_UPDATE && it->threadsafe)
+      --threadsafe_update_callbacks;
     callset.erase(*it);
+  }
 
   // return the number of callbacks remaining for this address. Useful
   // for detecting when there are none.
   return callset.size();
 }
+
+void Model::CallUpdateCallbacks(bool threadsafe)
+{
+  // as CallCallbacks( CB_UPDATE ), for the callbacks of one kind only
+  vector<cb_t> doomed;
+
+  set<cb_t> &callset = callbacks[CB_UPDATE];
+
+  FOR_EACH (it, callset) {
+    const cb_t &cba = *it;
+    if (cba.threadsafe == threadsafe && (cba.callback)(this, cba.arg))
+      doomed.push_back(cba);
+  }
+
+  FOR_EACH (it, doomed) {
+    if (threadsafe)
+      --threadsafe_update_callbacks;
+    callset.erase(*it);
+  }
+}
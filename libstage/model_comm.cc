@@ -0,0 +1,338 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// File: model_comm.cc
+// Desc: radio that passes messages between models in range
+//
+///////////////////////////////////////////////////////////////////////////
+
+#undef DEBUG
+
+#include "option.hh"
+#include "raytrace.hh"
+#include "stage.hh"
+#include "worldfile.hh"
+using namespace Stg;
+
+Option ModelComm::showLinks("Comm links", "show_comm", "", true, NULL);
+
+/**
+  @ingroup model
+  @defgroup model_comm Comm model
+
+  The comm model simulates a radio that passes messages between
+models. Two radios are linked while they are within the range of both,
+and, if either needs it, in line of sight of each other. A message
+sent by a controller goes on the air at the start of the next update
+and is received by the linked radios it is addressed to in their first
+update after that. Radios are found through a spatial index of all the
+radios that is rebuilt at every update, so each radio only tests the
+radios close to it.
+
+A radio sends and receives only while it is subscribed. The "wifi"
+model type of older worldfiles is a comm model, and reads its range.
+
+API: Stg::ModelComm
+
+<h2>Worldfile properties</h2>
+
+@par Summary and default values
+
+@verbatim
+comm
+(
+  # comm properties
+  range 10.0
+  los 1
+  inbox 64
+
+  # model properties
+  size [ 0.0 0.0 0.0 ]
+)
+@endverbatim
+
+@par Details
+
+- range <float>\n
+  the maximum range of a link, in meters. A link between two radios
+  is as long as the shorter of their ranges.
+- los <1/0>\n
+  if 1, the default, links are blocked by obstacles between the
+  radios. Walls of any height block them.
+- inbox <int>\n
+  the most received messages that wait to be read. When the inbox is
+  full, the oldest message is dropped to make room. 0 for no limit.
+ */
+
+ModelComm::ModelComm(World *world, Model *parent, const std::string &type)
+    : Model(world, parent, type), outbox(), on_air(), inbox(), neighbors(), received(),
+      air_pose(), air_time(0), last_receive(0), dropped(0), range(10.0), los(true),
+      inbox_size(64)
+{
+  // assert that Update() is reentrant for this derived model
+  thread_safe = true;
+
+  this->ClearBlocks();
+
+  Geom geom;
+  geom.Zero();
+  SetGeom(geom);
+
+  RegisterOption(&showLinks);
+
+  // models are made and destroyed in the main thread. A radio stays in
+  // the list while it is switched off, since Startup() and Shutdown()
+  // may be called from callbacks running in parallel.
+  world->comms.push_back(this);
+}
+
+ModelComm::~ModelComm(void)
+{
+  Disconnect();
+}
+
+void ModelComm::Load(void)
+{
+  Model::Load();
+
+  range = wf->ReadLength(wf_entity, "range", range);
+  los = wf->ReadInt(wf_entity, "los", los);
+  inbox_size = wf->ReadInt(wf_entity, "inbox", inbox_size);
+
+  // a full inbox never grows in the update
+  inbox.reserve(inbox_size);
+}
+
+void ModelComm::Startup(void)
+{
+  Model::Startup();
+
+  // only messages sent from now on can be received
+  last_receive = world->SimTimeNow();
+}
+
+void ModelComm::Shutdown(void)
+{
+  // the index drops this radio when it is next built
+  outbox.clear();
+  on_air.clear();
+  inbox.clear();
+  neighbors.clear();
+
+  Model::Shutdown();
+}
+
+void ModelComm::Disconnect()
+{
+  EraseAll(this, world->comms);
+
+  // the other radios may hold this one until their next update
+  FOR_EACH (it, world->comms) {
+    std::vector<Neighbor> &nbrs((*it)->neighbors);
+    for (size_t i(0); i < nbrs.size();)
+      if (nbrs[i].comm == this)
+        nbrs.erase(nbrs.begin() + i);
+      else
+        ++i;
+  }
+
+  for (size_t i(0); i < world->comm_index.size();)
+    if (world->comm_index[i].comm == this)
+      world->comm_index.erase(world->comm_index.begin() + i);
+    else
+      ++i;
+}
+
+void ModelComm::MessageQueue::reserve(size_t n)
+{
+  if (n <= slots.size())
+    return;
+
+  AllocationExempt exempt; // more messages than this queue has held before
+
+  // move the messages, oldest first, into more slots
+  std::vector<Message> bigger(n);
+  for (size_t i(0); i < count; ++i)
+    std::swap(bigger[i], (*this)[i]);
+  slots.swap(bigger);
+  head = 0;
+}
+
+ModelComm::Message &ModelComm::MessageQueue::push_back()
+{
+  if (count == slots.size())
+    reserve(std::max(slots.size() * 2, (size_t)8));
+
+  Message &msg(slots[(head + count) % slots.size()]);
+  ++count;
+  return msg;
+}
+
+void ModelComm::Send(uint32_t to, const std::string &data)
+{
+  Message &msg(outbox.push_back());
+  msg.from = id;
+  msg.to = to;
+  msg.time = 0; // set when it goes on the air
+  msg.data = data;
+}
+
+bool ModelComm::Receive(Message &msg)
+{
+  if (inbox.empty())
+    return false;
+
+  msg = inbox.front();
+  inbox.pop_front();
+  return true;
+}
+
+void ModelComm::Transmit(usec_t now, usec_t window)
+{
+  air_pose = GetGlobalPose();
+  air_time = now;
+
+  while (!on_air.empty() && on_air.front().time + window <= now)
+    on_air.pop_front();
+
+  // swap rather than copy, so the strings keep their storage
+  for (; !outbox.empty(); outbox.pop_front()) {
+    Message &msg(on_air.push_back());
+    Message &sent(outbox.front());
+    msg.from = sent.from;
+    msg.to = sent.to;
+    msg.time = now;
+    msg.data.swap(sent.data);
+  }
+}
+
+class CommMatch {
+public:
+  static const uint32_t VIS = Model::VIS_OBSTACLE;
+
+  bool operator()(Model *candidate, const Model *finder) const
+  {
+    return (!finder->IsRelated(candidate));
+  }
+};
+
+bool ModelComm::InSight(ModelComm *him, const Pose &to, meters_t dist) const
+{
+  // trace only as far as him: the first obstacle ends the ray
+  const Pose from(air_pose.x, air_pose.y, air_pose.z, atan2(to.y - air_pose.y, to.x - air_pose.x));
+  const RaytraceResult result(world->Raytrace(Ray(this, from, dist, NULL, NULL, false), CommMatch()));
+
+  // the ray may end on the body of the model carrying him
+  return (result.mod == NULL || result.mod->Root() == him->Root());
+}
+
+// copy a message into a reused slot, whose string keeps its storage
+static void copy_message(ModelComm::Message &to, const ModelComm::Message &from)
+{
+  if (to.data.capacity() < from.data.size()) {
+    AllocationExempt exempt; // a longer message than this slot has held before
+    to.data.reserve(from.data.size());
+  }
+  to = from;
+}
+
+// order received messages by the time they were sent, then by sender
+static bool message_before(const ModelComm::Message *a, const ModelComm::Message *b)
+{
+  return (a->time == b->time ? a->from < b->from : a->time < b->time);
+}
+
+void ModelComm::Update(void)
+{
+  if (subs < 1)
+    return;
+
+  neighbors.clear();
+  received.clear();
+
+  const usec_t now(world->SimTimeNow());
+
+  // a radio switched on since the index was built joins it next time
+  if (air_time != now) {
+    Model::Update();
+    return;
+  }
+
+  const std::vector<World::CommEntry> &index(world->comm_index);
+
+  // every radio in range is in the 3x3 cells around this one
+  for (int dx(-1); dx <= 1; ++dx)
+    for (int dy(-1); dy <= 1; ++dy) {
+      const int64_t cell(world->CommCell(air_pose.x, air_pose.y, dx, dy));
+      std::vector<World::CommEntry>::const_iterator it(
+          std::lower_bound(index.begin(), index.end(), cell, World::CommEntry::CellBelow));
+      const std::vector<World::CommEntry>::const_iterator end(
+          std::upper_bound(it, index.end(), cell, World::CommEntry::CellAbove));
+
+      for (; it != end; ++it) {
+        ModelComm *him(it->comm);
+        if (him == this || IsRelated(him))
+          continue;
+
+        const double x(it->pose.x - air_pose.x);
+        const double y(it->pose.y - air_pose.y);
+        const meters_t dist(hypot(x, y));
+        if (dist > std::min(range, him->range))
+          continue;
+
+        if ((los || him->los) && !InSight(him, it->pose, dist))
+          continue;
+
+        Neighbor nbr;
+        nbr.comm = him;
+        nbr.range = dist;
+        nbr.bearing = normalize(atan2(y, x) - air_pose.a);
+        neighbors.push_back(nbr);
+      }
+    }
+
+  // collect the messages for this radio sent since its last update.
+  // The newest messages are at the back of each neighbor's queue.
+  FOR_EACH (nbr, neighbors) {
+    const MessageQueue &msgs(nbr->comm->on_air);
+    for (size_t i(msgs.size()); i > 0 && msgs[i - 1].time > last_receive; --i)
+      if (msgs[i - 1].to == id || msgs[i - 1].to == BROADCAST)
+        received.push_back(&msgs[i - 1]);
+  }
+
+  std::sort(received.begin(), received.end(), message_before);
+
+  FOR_EACH (it, received) {
+    if (inbox_size && inbox.size() >= inbox_size) {
+      inbox.pop_front();
+      ++dropped;
+    }
+    copy_message(inbox.push_back(), **it);
+  }
+
+  last_receive = now;
+
+  Model::Update();
+}
+
+void ModelComm::DataVisualize(Camera *cam)
+{
+  (void)cam; // avoid warning about unused var
+
+  if (!showLinks)
+    return;
+
+  PushColor(0, 0.6, 0.6, 0.5); // teal, with a bit of alpha
+
+  // draw dotted lines to the neighbors
+  glLineStipple(1, 0x0F0F);
+  glEnable(GL_LINE_STIPPLE);
+  glBegin(GL_LINES);
+  FOR_EACH (it, neighbors) {
+    glVertex2f(0, 0);
+    glVertex2f(it->range * cos(it->bearing), it->range * sin(it->bearing));
+  }
+  glEnd();
+  glDisable(GL_LINE_STIPPLE);
+
+  PopColor();
+}
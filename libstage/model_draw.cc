@@ -105,34 +105,59 @@ void Model::DrawTrailBlocks()
 
 void Model::DrawTrailArrows()
 {
-  double dx = 0.2;
-  double dy = 0.07;
-  double timescale = 1e-7;
+  const double dx = 0.2;
+  const double dy = 0.07;
+  const double timescale = 1e-7;
 
-  PushColor(0, 0, 0, 1); // dummy push
+  if (trail.empty())
+    return;
 
-  FOR_EACH (it, trail) {
-    TrailItem &checkpoint = *it;
+  // the arrow triangle in the model's own frame
+  static const double arrow[3][2] = { { 0, -dy }, { dx, 0 }, { 0, +dy } };
 
-    glPushMatrix();
-    Pose pz = checkpoint.pose;
-    // set the height proportional to age
-    pz.z = (world->sim_time - checkpoint.time) * timescale;
+  // the arrows are transformed here rather than by the matrix stack,
+  // so the whole trail goes to OpenGL as one array. Only the GUI
+  // thread draws, so the arrays can be reused between calls.
+  static std::vector<GLfloat> verts;
+  static std::vector<GLfloat> colors;
+  verts.resize(9 * trail.size());
+  colors.resize(12 * trail.size());
 
-    Gl::pose_shift(pz);
-    Gl::pose_shift(geom.pose);
+  const double gcos = cos(geom.pose.a);
+  const double gsin = sin(geom.pose.a);
 
-    Color &c = checkpoint.color;
-    glColor4f(c.r, c.g, c.b, c.a);
+  size_t v = 0, c = 0;
+  FOR_EACH (it, trail) {
+    const TrailItem &checkpoint = *it;
+    const Pose &pz = checkpoint.pose;
+    // set the height proportional to age
+    const double z = (world->sim_time - checkpoint.time) * timescale + geom.pose.z;
+    const double pcos = cos(pz.a);
+    const double psin = sin(pz.a);
+
+    for (int i = 0; i < 3; ++i) {
+      // the geometry offset, then the checkpoint pose
+      const double gx = geom.pose.x + gcos * arrow[i][0] - gsin * arrow[i][1];
+      const double gy = geom.pose.y + gsin * arrow[i][0] + gcos * arrow[i][1];
+      verts[v++] = pz.x + pcos * gx - psin * gy;
+      verts[v++] = pz.y + psin * gx + pcos * gy;
+      verts[v++] = z;
+
+      const Color &col = checkpoint.color;
+      colors[c++] = col.r;
+      colors[c++] = col.g;
+      colors[c++] = col.b;
+      colors[c++] = col.a;
+    }
+  }
 
-    glBegin(GL_TRIANGLES);
-    glVertex3f(0, -dy, 0);
-    glVertex3f(dx, 0, 0);
-    glVertex3f(0, +dy, 0);
-    glEnd();
+  PushColor(0, 0, 0, 1); // dummy push
 
-    glPopMatrix();
-  }
+  glEnableClientState(GL_COLOR_ARRAY);
+  glVertexPointer(3, GL_FLOAT, 0, &verts[0]);
+  glColorPointer(4, GL_FLOAT, 0, &colors[0]);
+  glDrawArrays(GL_TRIANGLES, 0, 3 * trail.size());
+  glDisableClientState(GL_COLOR_ARRAY);
 
   PopColor();
 }
@@ -16,6 +16,7 @@
 #undef DEBUG
 
 #include "option.hh"
+#include "raytrace.hh"
 #include "stage.hh"
 #include "worldfile.hh"
 using namespace Stg;
@@ -74,7 +75,7 @@ the fiducial finder will see the shorter robot.
  */
 
 ModelFiducial::ModelFiducial(World *world, Model *parent, const std::string &type)
-    : Model(world, parent, type), fiducials(), max_range_anon(8.0), max_range_id(5.0),
+    : Model(world, parent, type), fiducials(), horiz(), vert(), nearby(), max_range_anon(8.0), max_range_id(5.0),
       min_range(0.0), fov(M_PI), heading(0), key(0), ignore_zloc(false)
 {
   // PRINT_DEBUG2( "Constructing ModelFiducial %d (%s)\n",
@@ -100,11 +101,34 @@ ModelFiducial::~ModelFiducial(void)
 {
 }
 
-static bool fiducial_raytrace_match(Model *candidate, const Model *finder, const void *dummy)
+// compare a model's global position with a coordinate, for searching
+// the world's vectors of fiducials sorted by position
+static bool x_below(const Model *mod, meters_t x)
 {
-  (void)dummy; // avoid warning about unused var
-  return (!finder->IsRelated(candidate));
+  return mod->GetGlobalPose().x < x;
 }
+static bool x_above(meters_t x, const Model *mod)
+{
+  return x < mod->GetGlobalPose().x;
+}
+static bool y_below(const Model *mod, meters_t y)
+{
+  return mod->GetGlobalPose().y < y;
+}
+static bool y_above(meters_t y, const Model *mod)
+{
+  return y < mod->GetGlobalPose().y;
+}
+
+class FiducialMatch {
+public:
+  static const uint32_t VIS = 0;
+
+  bool operator()(Model *candidate, const Model *finder) const
+  {
+    return (!finder->IsRelated(candidate));
+  }
+};
 
 void ModelFiducial::AddModelIfVisible(Model *him)
 {
@@ -178,7 +202,7 @@ void ModelFiducial::AddModelIfVisible(Model *him)
 
   RaytraceResult result = Raytrace(Pose(0, 0, 0, dtheta),
                                    max_range_anon, // TODOscan only as far as the object
-                                   fiducial_raytrace_match, NULL, true);
+                                   FiducialMatch(), true);
 
   // TODO
   if (ignore_zloc && result.mod == NULL) // i.e. we didn't hit anything *else*
@@ -236,6 +260,27 @@ void ModelFiducial::Update(void)
   // reset the array of detected fiducials
   fiducials.clear();
 
+  uint32_t count(0);
+  if (const float *v = world->Replay(this, LOG_FIDUCIAL, 0, count)) {
+    for (uint32_t i(0); i + LOG_FIDUCIAL_SIZE <= count; i += LOG_FIDUCIAL_SIZE) {
+      Fiducial fid;
+      fid.range = v[i];
+      fid.bearing = v[i + 1];
+      fid.geom = Pose(v[i + 2], v[i + 3], v[i + 4], v[i + 5]);
+      fid.pose = Pose(v[i + 6], v[i + 7], v[i + 8], v[i + 9]);
+      fid.id = (int)v[i + 10];
+
+      uint32_t target;
+      memcpy(&target, &v[i + 11], sizeof(target));
+      fid.mod = Model::LookupId(target);
+
+      fiducials.push_back(fid);
+    }
+
+    Model::Update();
+    return;
+  }
+
 #if (1)
   // BEGIN EXPERIMENT
 
@@ -244,37 +289,35 @@ void ModelFiducial::Update(void)
 
   double rng = max_range_anon;
   Pose gp = GetGlobalPose();
-  Model edge; // dummy model used to find bounds in the sets
-
-  edge.pose = Pose(gp.x - rng, gp.y, 0, 0); // LEFT
-  std::set<Model *, World::ltx>::iterator xmin =
-      world->models_with_fiducials_byx.lower_bound(&edge); // O(log(n))
-
-  edge.pose = Pose(gp.x + rng, gp.y, 0, 0); // RIGHT
-  const std::set<Model *, World::ltx>::iterator xmax =
-      world->models_with_fiducials_byx.upper_bound(&edge);
 
-  edge.pose = Pose(gp.x, gp.y - rng, 0, 0); // BOTTOM
-  std::set<Model *, World::lty>::iterator ymin =
-      world->models_with_fiducials_byy.lower_bound(&edge);
+  const std::vector<Model *> &byx(world->models_with_fiducials_byx);
+  const std::vector<Model *> &byy(world->models_with_fiducials_byy);
 
-  edge.pose = Pose(gp.x, gp.y + rng, 0, 0); // TOP
-  const std::set<Model *, World::lty>::iterator ymax =
-      world->models_with_fiducials_byy.upper_bound(&edge);
+  // assign() grows a vector only to the size it needs, so make room
+  // for every fiducial at once rather than one more at a time
+  if (horiz.capacity() < byx.size()) {
+    horiz.reserve(byx.size());
+    vert.reserve(byx.size());
+    nearby.reserve(byx.size());
+  }
 
-  // put these models into sets keyed on model pointer, rather than position
-  std::set<Model *> horiz, vert;
+  // O(log(n)) searches for the LEFT, RIGHT, BOTTOM and TOP edges
+  horiz.assign(std::lower_bound(byx.begin(), byx.end(), gp.x - rng, x_below),
+               std::upper_bound(byx.begin(), byx.end(), gp.x + rng, x_above));
 
-  for (; xmin != xmax; ++xmin)
-    horiz.insert(*xmin);
+  vert.assign(std::lower_bound(byy.begin(), byy.end(), gp.y - rng, y_below),
+              std::upper_bound(byy.begin(), byy.end(), gp.y + rng, y_above));
 
-  for (; ymin != ymax; ++ymin)
-    vert.insert(*ymin);
+  // sort these models by pointer, rather than position, so we can
+  // intersect them. The member vectors keep their capacity between
+  // updates, so this does not allocate in the steady state.
+  std::sort(horiz.begin(), horiz.end());
+  std::sort(vert.begin(), vert.end());
 
   // the intersection of the sets is all the fiducials close by
-  std::vector<Model *> nearby;
+  nearby.clear();
   std::set_intersection(horiz.begin(), horiz.end(), vert.begin(), vert.end(),
-                        std::inserter(nearby, nearby.end()));
+                        std::back_inserter(nearby));
 
   //	printf( "cand sz %lu\n", nearby.size() );
 
@@ -292,6 +335,36 @@ void ModelFiducial::Update(void)
   Model::Update();
 }
 
+void ModelFiducial::LogState(RecordSink &log, unsigned int thread, uint32_t kinds)
+{
+  Model::LogState(log, thread, kinds);
+
+  if (kinds & LOG_FIDUCIAL) {
+    float *v(log.Record(thread, world->SimTimeNow(), id, LOG_FIDUCIAL, 0,
+                        LOG_FIDUCIAL_SIZE * fiducials.size()));
+
+    FOR_EACH (it, fiducials) {
+      v[0] = it->range;
+      v[1] = it->bearing;
+      v[2] = it->geom.x;
+      v[3] = it->geom.y;
+      v[4] = it->geom.z;
+      v[5] = it->geom.a;
+      v[6] = it->pose.x;
+      v[7] = it->pose.y;
+      v[8] = it->pose.z;
+      v[9] = it->pose.a;
+      v[10] = it->id;
+
+      // the bits of the target's id, which a float may not hold exactly
+      const uint32_t target(it->mod ? it->mod->GetId() : 0);
+      memcpy(&v[11], &target, sizeof(target));
+
+      v += LOG_FIDUCIAL_SIZE;
+    }
+  }
+}
+
 void ModelFiducial::Load(void)
 {
   PRINT_DEBUG("fiducial load");
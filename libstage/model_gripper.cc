@@ -50,6 +50,7 @@
    "down"
 */
 
+#include "raytrace.hh"
 #include "stage.hh"
 #include "worldfile.hh"
 #include <sys/time.h>
@@ -326,14 +327,17 @@ void ModelGripper::Update()
   Model::Update();
 }
 
-static bool gripper_raytrace_match(Model *hit, const Model *finder, const void *dummy)
-{
-  (void)dummy; // avoid warning about unused var
+class GripperMatch {
+public:
+  static const uint32_t VIS = Model::VIS_GRIPPER;
 
-  return ((hit != finder) && hit->vis.gripper_return);
-  // can't use the normal relation check, because we may pick things
-  // up and we must still see them.
-}
+  bool operator()(Model *hit, const Model *finder) const
+  {
+    return (hit != finder);
+    // can't use the normal relation check, because we may pick things
+    // up and we must still see them.
+  }
+};
 
 void ModelGripper::UpdateBreakBeams()
 {
@@ -358,7 +362,7 @@ void ModelGripper::UpdateBreakBeams()
         (1.0 - cfg.paddle_position) * (geom.size.y - (geom.size.y * cfg.paddle_size.y * 2.0));
 
     // store the model (possibly NULL) hit by the breakbeam
-    cfg.beam[index] = Raytrace(pz, bbr, gripper_raytrace_match, NULL, true).mod;
+    cfg.beam[index] = Raytrace(pz, bbr, GripperMatch(), true).mod;
   }
 
   // autosnatch grabs anything that breaks the inner beam
@@ -400,8 +404,8 @@ void ModelGripper::UpdateContacts()
   // paddle beam max range
   double bbr = cfg.paddle_size.x * geom.size.x;
 
-  cfg.contact[0] = Raytrace(lpz, bbr, gripper_raytrace_match, NULL, true).mod;
-  cfg.contact[1] = Raytrace(rpz, bbr, gripper_raytrace_match, NULL, true).mod;
+  cfg.contact[0] = Raytrace(lpz, bbr, GripperMatch(), true).mod;
+  cfg.contact[1] = Raytrace(rpz, bbr, GripperMatch(), true).mod;
 
   if (cfg.contact[0] || cfg.contact[1]) {
     cfg.paddles_stalled = true;
@@ -284,6 +284,9 @@ void ModelPosition::Update(void)
 {
   PRINT_DEBUG1("[%lu] position update", this->world->SimTimeNow());
 
+  if (shm)
+    ApplyCommands();
+
   // stop by default
   Velocity vel(0, 0, 0, 0);
 
@@ -523,6 +526,31 @@ void ModelPosition::Update(void)
   Model::Update();
 }
 
+void ModelPosition::LogState(RecordSink &log, unsigned int thread, uint32_t kinds)
+{
+  Model::LogState(log, thread, kinds);
+
+  if (kinds & LOG_VELOCITY) {
+    float *v(log.Record(thread, world->SimTimeNow(), id, LOG_VELOCITY, 0, 4));
+    v[0] = velocity.x;
+    v[1] = velocity.y;
+    v[2] = velocity.z;
+    v[3] = velocity.a;
+  }
+}
+
+void ModelPosition::ApplyCommands()
+{
+  ShmFormat::Command cmd;
+  while (shm->NextCommand(cmd))
+    switch (cmd.type) {
+    case SHM_CMD_SPEED: SetSpeed(cmd.values[0], cmd.values[1], cmd.values[3]); break;
+    case SHM_CMD_GOTO: GoTo(cmd.values[0], cmd.values[1], cmd.values[3]); break;
+    case SHM_CMD_STOP: Stop(); break;
+    default: PRINT_WARN2("%s ignored unknown shared memory command %u", Token(), cmd.type);
+    }
+}
+
 void ModelPosition::Move(void)
 {
   if (velocity.IsZero())
@@ -545,6 +573,7 @@ void ModelPosition::Move(void)
   const Pose startpose(pose);
 
   pose = newpose; // do the move provisionally - we might undo it below
+  InvalidateGlobalPose();
 
   const unsigned int layer(world->UpdateCount() % 2);
   // @todo th
@@ -556,6 +585,7 @@ void ModelPosition::Move(void)
     // put things back the way they were
     // this is expensive, but it happens _very_ rarely for most people
     pose = startpose;
+    InvalidateGlobalPose();
     UnMapWithChildren(layer);
     MapWithChildren(layer);
 
@@ -78,6 +78,7 @@
 //#define DEBUG 1
 
 #include "option.hh"
+#include "raytrace.hh"
 #include "stage.hh"
 #include "worldfile.hh"
 
@@ -155,19 +156,25 @@ void ModelRanger::Sensor::Load(Worldfile *wf, int entity)
   color.Load(wf, entity);
 }
 
-static bool ranger_match(Model *hit, const Model *finder, const void *dummy)
-{
-  (void)dummy; // avoid warning about unused var
+// a predicate object rather than a function, so that the raytrace
+// inlines it
+class RangerMatch {
+public:
+  static const uint32_t VIS = Model::VIS_RANGER;
 
-  // Ignore the model that's looking and things that are invisible to
-  // rangers
+  bool operator()(Model *hit, const Model *finder) const
+  {
+    // Ignore the model that's looking and things that are invisible to
+    // rangers
 
-  // small optimization to avoid recursive Model::IsRelated call in common cases
-  if ((hit == finder->Parent()) || (hit == finder))
-    return false;
+    // small optimization to avoid recursive Model::IsRelated call in common cases
+    if ((hit == finder->Parent()) || (hit == finder))
+      return false;
 
-  return ((!hit->IsRelated(finder)) && (sgn(hit->vis.ranger_return) != -1));
-}
+    // models invisible to rangers were skipped through VIS
+    return (!hit->IsRelated(finder));
+  }
+};
 
 // Returns random numbers in range [-1.0, 1.0)
 double simpleNoise()
@@ -201,13 +208,38 @@ template <class Scalar_t> Scalar_t generateGaussianNoise(Scalar_t variance)
 
 void ModelRanger::Update(void)
 {
-  // raytrace new range data for all sensors
-  FOR_EACH (it, sensors)
-    it->Update(this);
+  // raytrace new range data for all sensors, unless it is being
+  // replayed from a log
+  for (size_t s(0); s < sensors.size(); ++s) {
+    uint32_t count(0);
+    const float *values(world->Replay(this, LOG_RANGER, s, count));
+
+    if (values && count == 2 * sensors[s].sample_count)
+      sensors[s].Replay(values);
+    else
+      sensors[s].Update(this);
+  }
 
   Model::Update();
 }
 
+void ModelRanger::LogState(RecordSink &log, unsigned int thread, uint32_t kinds)
+{
+  Model::LogState(log, thread, kinds);
+
+  if (kinds & LOG_RANGER)
+    for (size_t s(0); s < sensors.size(); ++s) {
+      const Sensor &sensor(sensors[s]);
+      const size_t n(sensor.ranges.size());
+      float *v(log.Record(thread, world->SimTimeNow(), id, LOG_RANGER, s, 2 * n));
+
+      for (size_t i(0); i < n; ++i) {
+        v[i] = sensor.ranges[i];
+        v[n + i] = sensor.intensities[i];
+      }
+    }
+}
+
 void ModelRanger::Sensor::Update(ModelRanger *mod)
 {
   // these sizes change very rarely, so this is very cheap
@@ -229,29 +261,80 @@ void ModelRanger::Sensor::Update(ModelRanger *mod)
   rayorg.z += size.z / 2.0;
   rayorg = mod->LocalToGlobal(rayorg);
 
-  // set up a ray to trace
-  Ray ray(mod, rayorg, range.max, ranger_match, NULL, true);
+  // if the sensor has not moved, and no block has entered or left
+  // its range, since it last scanned from this layer, the rays would
+  // hit the same things again. Angle noise moves the rays, so it
+  // defeats the cache.
+  Scan &scan(scans[mod->world->UpdateCount() % 2]);
+  const bool cacheable(angle_noise == 0.0);
+  const uint64_t version(cacheable ? mod->world->CellsVersion(rayorg, range.max) : 0);
+  const bool cached(cacheable && scan.valid && scan.version == version && scan.origin == rayorg
+                    && scan.range == range.max && scan.fov == fov
+                    && scan.ranges.size() == sample_count);
+
+  if (!cached) {
+    scan.ranges.resize(sample_count);
+    scan.intensities.resize(sample_count);
+
+    // set up a ray to trace
+    Ray ray(mod, rayorg, range.max, NULL, NULL, true);
+
+    // trace the ray, incrementing its heading for each sample
+    for (size_t t(0); t < sample_count; t++) {
+      float savedAngle = ray.origin.a;
+      float distortedAngle = ray.origin.a + sample_incr * angle_noise * simpleNoise() * 0.5;
+      ray.origin.a = distortedAngle;
+      const RaytraceResult res = mod->world->Raytrace(ray, RangerMatch());
+      ray.origin.a = savedAngle;
+
+      scan.ranges[t] = res.range;
+      scan.intensities[t] = res.mod ? res.mod->vis.ranger_return : 0.0;
+
+      // point the ray to the next angle:
+      ray.origin.a += sample_incr;
+    }
 
-  // trace the ray, incrementing its heading for each sample
+    scan.valid = cacheable;
+    scan.origin = rayorg;
+    scan.range = range.max;
+    scan.fov = fov;
+    scan.version = version;
+  }
+
+  if (mod->world->IsProfiling()) {
+    ++mod->profile.scans;
+    if (cached)
+      ++mod->profile.scans_cached;
+  }
+
+  // the noise is fresh for every scan, whether it was traced or not
   for (size_t t(0); t < sample_count; t++) {
-    float savedAngle = ray.origin.a;
-    float distortedAngle = ray.origin.a + sample_incr * angle_noise * simpleNoise() * 0.5;
-    ray.origin.a = distortedAngle;
-    const RaytraceResult res = mod->world->Raytrace(ray);
-    ray.origin.a = savedAngle;
+    const meters_t r(scan.ranges[t]);
 
     /// Apply noise only if it is in valid range
-    if (res.range < this->range.max)
-      ranges[t] = res.range + res.range * range_noise * simpleNoise()
-                  + generateGaussianNoise(range_noise_const);
+    if (r < this->range.max)
+      ranges[t] = r + r * range_noise * simpleNoise() + generateGaussianNoise(range_noise_const);
     else
-      ranges[t] = res.range;
+      ranges[t] = r;
 
-    intensities[t] = res.mod ? res.mod->vis.ranger_return : 0.0;
+    intensities[t] = scan.intensities[t];
     bearings[t] = start_angle + ((double)t) * sample_incr;
+  }
+}
+
+void ModelRanger::Sensor::Replay(const float *values)
+{
+  ranges.resize(sample_count);
+  intensities.resize(sample_count);
+  bearings.resize(sample_count);
+
+  const double sample_incr(fov / std::max(sample_count - 1, (unsigned int)1));
+  const double start_angle = (sample_count > 1 ? -fov / 2.0 : 0.0);
 
-    // point the ray to the next angle:
-    ray.origin.a += sample_incr;
+  for (size_t t(0); t < sample_count; t++) {
+    ranges[t] = values[t];
+    intensities[t] = values[sample_count + t];
+    bearings[t] = start_angle + ((double)t) * sample_incr;
   }
 }
 
@@ -283,6 +366,8 @@ void ModelRanger::Sensor::Visualize(ModelRanger::Vis *vis, ModelRanger *rgr) con
     rgr->PopColor();
   }
   
+  std::vector<GLfloat> &verts(vis->verts);
+
   if (vis->showFov)
     {
       if (sample_count == 1)
@@ -300,48 +385,50 @@ void ModelRanger::Sensor::Visualize(ModelRanger::Vis *vis, ModelRanger *rgr) con
 	  Color c = color;
 	  c.a = 0.5;
 	  rgr->PushColor(c);
-	  glBegin( GL_POLYGON );
-	  
-	  glVertex2f( 0,0 );
-	  
+
+	  verts.resize(2 * (sample_count + 1));
+	  verts[0] = verts[1] = 0;
+
 	  for (size_t s(0); s < sample_count; s++) {
-	    const double ray_angle = (((double)s)-0.5) * sample_fov - fov / 2.0;      
-	    const GLfloat x = range.max * cos(ray_angle);
-	    const GLfloat y = range.max * sin(ray_angle);
-	    
-	    glVertex2f( x, y );
+	    const double ray_angle = (((double)s)-0.5) * sample_fov - fov / 2.0;
+	    verts[2 * s + 2] = range.max * cos(ray_angle);
+	    verts[2 * s + 3] = range.max * sin(ray_angle);
 	  }
-	  
-	  glVertex2f( 0,0 );
-	  
-	  glEnd();
-	  
+
+	  glVertexPointer(2, GL_FLOAT, 0, &verts[0]);
+	  glDrawArrays(GL_LINE_LOOP, 0, sample_count + 1);
+
 	  rgr->PopColor();
 	}
     }
   
-  std::vector<glpoint_t> verts( sample_count );
-  
+  // the origin, then the strike point of each sample
   if (sample_count == 1) {
     // only one sample, so we fake up some beam width for beauty
     const double sidelen = ranges[0];
     const double da = fov / 2.0;
     
-    verts.resize(3);
-    verts[0].x = 0;
-    verts[0].y = 0;
-    verts[1].x = sidelen * cos(-da);
-    verts[1].y = sidelen * sin(-da);
-    verts[2].x = sidelen * cos(+da);
-    verts[2].y = sidelen * sin(+da);
+    verts.resize(6);
+    verts[0] = 0;
+    verts[1] = 0;
+    verts[2] = sidelen * cos(-da);
+    verts[3] = sidelen * sin(-da);
+    verts[4] = sidelen * cos(+da);
+    verts[5] = sidelen * sin(+da);
   } else {
+    verts.resize(2 * (sample_count + 1));
+    verts[0] = verts[1] = 0;
+
     for (size_t s(0); s < sample_count; s++) {
       const double ray_angle = (((double)s)-0.5) * sample_fov - fov / 2.0;
-      verts[s].x = (float)(ranges[s] * cos(ray_angle));
-      verts[s].y = (float)(ranges[s] * sin(ray_angle));
+      verts[2 * s + 2] = (float)(ranges[s] * cos(ray_angle));
+      verts[2 * s + 3] = (float)(ranges[s] * sin(ray_angle));
     }
   }
-  
+
+  const GLsizei count(verts.size() / 2);
+  glVertexPointer(2, GL_FLOAT, 0, &verts[0]);
+
   if (vis->showArea) {        
     // draw the filled polygon in transparent blue
     glEnable( GL_BLEND );
@@ -352,16 +439,10 @@ void ModelRanger::Sensor::Visualize(ModelRanger::Vis *vis, ModelRanger *rgr) con
     Color c = color;
     c.a = 0.1; // some alpha
     rgr->PushColor(c);
-    
-    glBegin( GL_POLYGON );
-    glVertex2f( 0,0 );
-    
-    FOR_EACH( it, verts )
-      glVertex2f( it->x, it->y );
-    
-    glVertex2f( 0,0 );    
-    glEnd();	
-    
+
+    // a fan around the origin, which unlike a polygon may be concave
+    glDrawArrays(GL_TRIANGLE_FAN, 0, count);
+
     rgr->PopColor();
     glDepthMask(GL_TRUE);
   }
@@ -370,10 +451,7 @@ void ModelRanger::Sensor::Visualize(ModelRanger::Vis *vis, ModelRanger *rgr) con
     rgr->PushColor(Color::blue); // solid color
     glPointSize(2);
 
-    glBegin( GL_POINTS );
-    FOR_EACH( it, verts )
-      glVertex2f( it->x, it->y );
-    glEnd();
+    glDrawArrays(GL_POINTS, 1, count - 1);
       
     rgr->PopColor();
   }
@@ -0,0 +1,154 @@
+/////////////////////////////////
+// File: raybench.cc
+// Desc: Measures the cost of Stage's raytrace per ray and per cell
+// License: GPL
+/////////////////////////////////
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "raytrace.hh"
+#include "stage.hh"
+using namespace Stg;
+
+const char *USAGE =
+    "USAGE:  stage-raybench [options] <worldfile>\n"
+    "Traces the same random rays through the world twice, through the\n"
+    "function pointer API that plugins use and through the templated\n"
+    "raytrace that the built-in sensors use, and prints the time taken per\n"
+    "ray and per occupancy grid cell visited by each.\n"
+    "Available [options] are:\n"
+    "  --rays n    : rays to trace each way (default 1000000)\n"
+    "  --range m   : length of the rays in meters (default 8)\n"
+    "  --ztest     : test the z range of the blocks, as rangers do\n"
+    "  --rbits n   : regions of 2^n x 2^n cells (default from the worldfile)\n"
+    "  --sbits n   : superregions of 2^n x 2^n regions (default from the worldfile)\n"
+    "  --help      : print this message";
+
+static struct option longopts[] = {
+  { "rays",  required_argument,   NULL,  'n' },
+  { "range",  required_argument,   NULL,  'r' },
+  { "ztest",  no_argument,   NULL,  'z' },
+  { "rbits",  required_argument,   NULL,  'R' },
+  { "sbits",  required_argument,   NULL,  'S' },
+  { "help",  no_argument,   NULL,  'h' },
+  { NULL, 0, NULL, 0 }
+};
+
+// the same test, as a function and as a predicate object
+static bool obstacle_match(Model *candidate, const Model *finder, const void *)
+{
+  return (candidate != finder && candidate->vis.obstacle_return);
+}
+
+class ObstacleMatch {
+public:
+  static const uint32_t VIS = Model::VIS_OBSTACLE;
+
+  bool operator()(Model *candidate, const Model *finder) const
+  {
+    return (candidate != finder); // VIS picks out the obstacles
+  }
+};
+
+// trace every ray, returning the time taken and the cells visited
+template <bool TEMPLATED>
+static void trace(World *world, std::vector<Ray> &rays, uint64_t &ns, uint64_t &cells,
+                  double &checksum)
+{
+  Model *finder(world->GetGround());
+  const uint64_t cells_before(finder->GetProfile().cells);
+  const uint64_t start(ProfileClock());
+
+  FOR_EACH (it, rays)
+    checksum += (TEMPLATED ? world->Raytrace(*it, ObstacleMatch()) : world->Raytrace(*it)).range;
+
+  ns = ProfileClock() - start;
+  cells = finder->GetProfile().cells - cells_before;
+}
+
+static void report(const char *name, uint64_t rays, uint64_t ns, uint64_t cells)
+{
+  printf("%-10s %8.1f ns/ray %8.3f ns/cell %8.1f cells/ray\n", name, ns / (double)rays,
+         cells ? ns / (double)cells : 0.0, cells / (double)rays);
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t count(1000000);
+  meters_t range(8.0);
+  bool ztest(false);
+  int rbits(-1), sbits(-1);
+
+  int ch = 0, optindex = 0;
+  while ((ch = getopt_long(argc, argv, "h?", longopts, &optindex)) != -1) {
+    switch (ch) {
+    case 'n': count = strtoul(optarg, NULL, 10); break;
+    case 'r': range = strtod(optarg, NULL); break;
+    case 'z': ztest = true; break;
+    case 'R': rbits = atoi(optarg); break;
+    case 'S': sbits = atoi(optarg); break;
+    case 'h':
+    case '?':
+    default: puts(USAGE); exit(ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc - 1 || count == 0) {
+    puts(USAGE);
+    return EXIT_FAILURE;
+  }
+
+  Init(&argc, &argv);
+
+  World world;
+  world.Load(argv[optind]);
+  world.EnableProfiling(true);
+
+  if (rbits >= 0 || sbits >= 0) {
+    const RegionBits &bits(world.GetRegionBits());
+    if (!world.SetRegionBits(RegionBits(rbits >= 0 ? rbits : bits.rbits,
+                                        sbits >= 0 ? sbits : bits.sbits)))
+      return EXIT_FAILURE;
+  }
+
+  // map the blocks into both layers of the occupancy grid
+  world.Update();
+  world.Update();
+
+  // random rays from within the world, the same for both runs
+  const bounds3d_t &extent(world.GetExtent());
+  unsigned short seed[3] = { 1, 2, 3 };
+  std::vector<Ray> rays(count);
+  FOR_EACH (it, rays)
+    *it = Ray(world.GetGround(),
+              Pose(extent.x.min + erand48(seed) * (extent.x.max - extent.x.min),
+                   extent.y.min + erand48(seed) * (extent.y.max - extent.y.min),
+                   extent.z.min + erand48(seed) * (extent.z.max - extent.z.min),
+                   normalize(erand48(seed) * 2.0 * M_PI)),
+              range, obstacle_match, NULL, ztest);
+
+  uint64_t fn_ns(0), fn_cells(0), tmpl_ns(0), tmpl_cells(0);
+  double fn_sum(0), tmpl_sum(0);
+
+  // once untimed, to warm the caches and expand compacted superregions
+  trace<false>(&world, rays, fn_ns, fn_cells, fn_sum);
+  fn_sum = 0;
+
+  trace<false>(&world, rays, fn_ns, fn_cells, fn_sum);
+  trace<true>(&world, rays, tmpl_ns, tmpl_cells, tmpl_sum);
+
+  printf("%s: %u rays of %.2f m%s, region_bits [%u %u]\n", argv[optind], count, range,
+         ztest ? ", z tested" : "", world.GetRegionBits().rbits, world.GetRegionBits().sbits);
+  report("function", count, fn_ns, fn_cells);
+  report("template", count, tmpl_ns, tmpl_cells);
+  if (tmpl_ns)
+    printf("speedup %.2fx\n", fn_ns / (double)tmpl_ns);
+  if (fn_sum != tmpl_sum)
+    printf("the two raytraces disagree!\n");
+
+  return EXIT_SUCCESS;
+}
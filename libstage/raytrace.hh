@@ -0,0 +1,285 @@
+#pragma once
+/*
+  raytrace.hh
+  The raytrace templates of the world class. A sensor that includes
+  this and passes its own predicate class to World::Raytrace() gets
+  the predicate and the z test compiled into the inner loop, instead
+  of a call through a function pointer for every block of every cell.
+
+  A predicate class has a const member
+    bool operator()(Model *candidate, const Model *finder)
+  returning true if the ray stops at a block of candidate, and a
+    static const uint32_t VIS
+  of the Model::VIS_* bits a candidate must have for the predicate to
+  be called at all. The raytrace tests those bits and the z range on
+  the cell's own entries, so that most blocks are rejected without
+  reading the block or its model.
+*/
+
+#include "region.hh"
+
+namespace Stg {
+
+template <class Match> RaytraceResult World::Raytrace(const Ray &r, const Match &match)
+{
+  // choose the z test once per ray rather than once per block
+  return (r.ztest ? RaytraceCore<Match, true>(r, match) : RaytraceCore<Match, false>(r, match));
+}
+
+// Perform multiple raytraces evenly spaced over an angular field of view
+template <class Match>
+void World::Raytrace(const Ray &r, const radians_t fov, const Match &match,
+                     std::vector<RaytraceResult> &results)
+{
+  // find the direction of the first ray
+  const double starta(fov / 2.0 - r.origin.a);
+
+  // set up a ray to trace
+  Ray ray(r);
+
+  const size_t sample_count = results.size();
+
+  for (size_t s(0); s < sample_count; ++s) {
+    // aim the ray in the right direction before tracing
+    ray.origin.a = (s * fov / (double)(sample_count - 1)) - starta;
+    results[s] = Raytrace(ray, match);
+  }
+}
+
+template <class Match, bool ZTEST>
+RaytraceResult World::RaytraceCore(const Ray &r, const Match &match)
+{
+  // initialize result for return
+  RaytraceResult result(r.origin, NULL, Color(), r.range);
+
+  // our global position in (floating point) cell coordinates
+  double globx(r.origin.x * ppm);
+  double globy(r.origin.y * ppm);
+
+  // record our starting position
+  const double startx(globx);
+  const double starty(globy);
+
+  // eliminate a potential divide by zero
+  const double angle(r.origin.a == 0.0 ? 1e-12 : r.origin.a);
+  const double sina(sin(angle));
+  const double cosa(cos(angle));
+  const double tana(sina / cosa); // approximately tan(angle) but faster
+
+  // the x and y components of the ray (these need to be doubles, or a
+  // very weird and rare bug is produced)
+  const double dx(ppm * r.range * cosa);
+  const double dy(ppm * r.range * sina);
+
+  // fast integer line 3d algorithm adapted from Cohen's code from
+  // Graphics Gems IV
+  const int32_t sx(sgn(dx));
+  const int32_t sy(sgn(dy));
+  const int32_t ax(std::abs(dx));
+  const int32_t ay(std::abs(dy));
+  const int32_t bx(2 * ax);
+  const int32_t by(2 * ay);
+  int32_t exy(ay - ax); // difference between x and y distances
+  int32_t n(ax + ay); // the manhattan distance to the goal cell
+
+  // the shape of the grid, copied so that it stays in registers
+  const RegionBits bits(region_bits);
+  const int32_t width(bits.region_width);
+
+  // the distances between region crossings in X and Y
+  const double xjumpx(sx * width);
+  const double xjumpy(sx * width * tana);
+  const double yjumpx(sy * width / tana);
+  const double yjumpy(sy * width);
+
+  // manhattan distance between region crossings in X and Y
+  const double xjumpdist(fabs(xjumpx) + fabs(xjumpy));
+  const double yjumpdist(fabs(yjumpx) + fabs(yjumpy));
+
+  const unsigned int layer((updates + 1) % 2);
+
+  // these are updated as we go along the ray
+  double xcrossx(0), xcrossy(0);
+  double ycrossx(0), ycrossy(0);
+  double distX(0), distY(0);
+  bool calculatecrossings(true);
+
+  // cells visited in populated regions, for the profiler. Counted
+  // per region rather than per cell to keep the inner loop tight.
+  uint64_t cells(0);
+
+  // Stage spends up to 95% of its time in this loop! It would be
+  // neater with more function calls encapsulating things, but even
+  // inline calls have a noticeable (2-3%) effect on performance.
+
+  // several useful asserts are commented out so that Stage is not too
+  // slow in debug builds. Add them in if chasing a suspected raytrace bug
+  while (n > 0) // while we are still not at the ray end
+  {
+    SuperRegion *sr(GetSuperRegion(point_int_t(bits.GetSReg(globx), bits.GetSReg(globy))));
+
+    if (sr) {
+      sr->Touch(updates);
+      if (sr->IsCompacted())
+        sr->Expand();
+    }
+
+    Region *reg(sr ? sr->GetRegion(bits.GetReg(globx), bits.GetReg(globy)) : NULL);
+
+    if (reg && reg->count) // if the region contains any objects
+    {
+      // assert( reg->cells.size() );
+
+      // invalidate the region crossing points used to jump over
+      // empty regions
+      calculatecrossings = true;
+
+      // convert from global cell to local cell coords
+      int32_t cx(bits.GetCell(globx));
+      int32_t cy(bits.GetCell(globy));
+
+      // since reg->count was non-zero, we expect this pointer to be good
+      Cell *c(&reg->cells[cx + cy * width]);
+
+      const int32_t n_enter(n);
+
+      // while within the bounds of this region and while some ray remains
+      // we'll tweak the cell pointer directly to move around quickly
+      while ((cx >= 0) && (cx < width) && (cy >= 0) && (cy < width) && n > 0) {
+        FOR_EACH (it, c->entries[layer]) {
+          // skip if not in the right z range
+          if (ZTEST && (r.origin.z < it->z_min || r.origin.z > it->z_max))
+            continue;
+
+          // skip models the predicate can never match
+          if ((it->vis & Match::VIS) != Match::VIS)
+            continue;
+
+          // test the predicate we were passed
+          if (match(it->mod, r.mod)) {
+            // a hit!
+            result.pose = r.origin;
+            result.mod = it->mod;
+            result.color = result.mod->GetColor();
+
+            if (ax > ay) // faster than the equivalent hypot() call
+              result.range = fabs((globx - startx) / cosa) / ppm;
+            else
+              result.range = fabs((globy - starty) / sina) / ppm;
+
+            if (profiling && r.mod) {
+              ++r.mod->profile.rays;
+              r.mod->profile.cells += cells + (n_enter - n) + 1;
+            }
+
+            return result;
+          }
+        }
+
+        // increment our cell in the correct direction
+        if (exy < 0) // we're iterating along X
+        {
+          globx += sx; // global coordinate
+          exy += by;
+          c += sx; // move the cell left or right
+          cx += sx; // cell coordinate for bounds checking
+        } else // we're iterating along Y
+        {
+          globy += sy; // global coordinate
+          exy -= bx;
+          c += sy * width; // move the cell up or down
+          cy += sy; // cell coordinate for bounds checking
+        }
+        --n; // decrement the manhattan distance remaining
+
+        // rt_cells.push_back( point_int_t( globx, globy ));
+      }
+      cells += n_enter - n;
+      // printf( "leaving populated region\n" );
+    } else // jump over the empty region
+    {
+      // on the first run, and when we've been iterating over
+      // cells, we need to calculate the next crossing of a region
+      // boundary along each axis
+      if (calculatecrossings) {
+        calculatecrossings = false;
+
+        // find the coordinate in cells of the bottom left corner of
+        // the current region
+        const int32_t ix(globx);
+        const int32_t iy(globy);
+        double regionx(ix / width * width);
+        double regiony(iy / width * width);
+        if ((globx < 0) && (ix % width))
+          regionx -= width;
+        if ((globy < 0) && (iy % width))
+          regiony -= width;
+
+        // calculate the distance to the edge of the current region
+        const double xdx(sx < 0 ? regionx - globx - 1.0 : // going left
+                             regionx + width - globx); // going right
+        const double xdy(xdx * tana);
+
+        const double ydy(sy < 0 ? regiony - globy - 1.0 : // going down
+                             regiony + width - globy); // going up
+        const double ydx(ydy / tana);
+
+        // these stored hit points are updated as we go along
+        xcrossx = globx + xdx;
+        xcrossy = globy + xdy;
+
+        ycrossx = globx + ydx;
+        ycrossy = globy + ydy;
+
+        // find the distances to the region crossing points
+        // manhattan distance is faster than using hypot()
+        distX = fabs(xdx) + fabs(xdy);
+        distY = fabs(ydx) + fabs(ydy);
+      }
+
+      if (distX < distY) // crossing a region boundary left or right
+      {
+        // move to the X crossing
+        globx = xcrossx;
+        globy = xcrossy;
+
+        n -= distX; // decrement remaining manhattan distance
+
+        // calculate the next region crossing
+        xcrossx += xjumpx;
+        xcrossy += xjumpy;
+
+        distY -= distX;
+        distX = xjumpdist;
+
+        // rt_candidate_cells.push_back( point_int_t( xcrossx, xcrossy ));
+      } else // crossing a region boundary up or down
+      {
+        // move to the X crossing
+        globx = ycrossx;
+        globy = ycrossy;
+
+        n -= distY; // decrement remaining manhattan distance
+
+        // calculate the next region crossing
+        ycrossx += yjumpx;
+        ycrossy += yjumpy;
+
+        distX -= distY;
+        distY = yjumpdist;
+
+        // rt_candidate_cells.push_back( point_int_t( ycrossx, ycrossy ));
+      }
+    }
+    // rt_cells.push_back( point_int_t( globx, globy ));
+  }
+
+  if (profiling && r.mod) {
+    ++r.mod->profile.rays;
+    r.mod->profile.cells += cells;
+  }
+
+  return result;
+}
+
+} // namespace Stg
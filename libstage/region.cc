@@ -8,8 +8,17 @@
 #include <pthread.h>
 using namespace Stg;
 
+// compaction and expansion are rare, so a single lock covers all
+// superregions and the paged lists and rendered cells of all blocks
+static pthread_mutex_t paging_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// the number of compacted superregions. While it is zero no block
+// has cells to page in, so the lock is not needed.
+static unsigned int compacted_count(0);
+
 Stg::Region::Region() : cells(), count(0), superregion(NULL)
 {
+  modifications[0] = modifications[1] = 0;
 }
 
 Stg::Region::~Region()
@@ -33,25 +42,206 @@ void Stg::Region::RemoveBlock()
     cells.clear();
 }
 
+// marks a vertex array as never built
+static const uint64_t STALE(~0ULL);
+
 SuperRegion::SuperRegion(World *world, point_int_t origin)
-    : count(0), origin(origin), regions(), world(world)
+    : count(0), origin(origin), bits(world->GetRegionBits()), regions(bits.superregion_size),
+      world(world), runs(), compacted(false),
+      last_access(world->UpdateCount()), modifications(0), voxel_verts(), voxel_colors(),
+      occupancy_rects(), occupancy_regions(), occupancy_version(STALE)
 {
-  for (int32_t c = 0; c < SUPERREGIONSIZE; ++c)
-    regions[c].superregion = this;
+  voxel_version[0] = voxel_version[1] = STALE;
+
+  FOR_EACH (it, regions)
+    it->superregion = this;
 }
 
 SuperRegion::~SuperRegion()
 {
+  if (compacted)
+    __sync_fetch_and_sub(&compacted_count, 1);
+}
+
+void SuperRegion::Compact()
+{
+  pthread_mutex_lock(&paging_mutex);
+
+  if (compacted || count == 0) {
+    pthread_mutex_unlock(&paging_mutex);
+    return;
+  }
+
+  // the run most recently started by each block in each layer
+  std::map<Block *, size_t> open[2];
+  std::set<Block *> blocks;
+
+  // superregion-local cells per row, used to index runs
+  const uint32_t srcellwidth(1 << bits.srbits);
+
+  // visit the cells in row-major order so that horizontal runs of
+  // cells holding the same block collapse into a single Run
+  for (uint32_t y = 0; y < srcellwidth; ++y)
+    for (uint32_t rx = 0; rx < (uint32_t)bits.superregion_width; ++rx) {
+      const Region &r(regions[rx + (y >> bits.rbits) * bits.superregion_width]);
+
+      if (r.count == 0)
+        continue;
+
+      for (uint32_t cx = 0; cx < (uint32_t)bits.region_width; ++cx) {
+        const Cell &c(r.cells[cx + bits.GetCell(y) * bits.region_width]);
+        const uint32_t index((rx << bits.rbits) + cx + y * srcellwidth);
+
+        for (uint8_t layer = 0; layer < 2; ++layer)
+          FOR_EACH (it, c.entries[layer]) {
+            std::map<Block *, size_t>::iterator o(open[layer].find(it->block));
+
+            if (o != open[layer].end() && runs[o->second].start + runs[o->second].length == index)
+              ++runs[o->second].length;
+            else {
+              open[layer][it->block] = runs.size();
+              runs.push_back(Run(it->block, index, layer));
+            }
+
+            blocks.insert(it->block);
+          }
+      }
+    }
+
+  // the blocks forget their cells in this superregion and remember
+  // that they must page it in before touching their cells again
+  FOR_EACH (it, blocks) {
+    Block *b(*it);
+
+    for (unsigned int layer = 0; layer < 2; ++layer) {
+      std::vector<Cell *> &cells(b->rendered_cells[layer]);
+      size_t keep(0);
+      for (size_t i = 0; i < cells.size(); ++i)
+        if (cells[i]->region->superregion != this)
+          cells[keep++] = cells[i];
+      cells.resize(keep);
+    }
+
+    b->paged_superregions.push_back(this);
+  }
+
+  // release the cell memory
+  FOR_EACH (it, regions) {
+    std::vector<Cell>().swap(it->cells);
+    it->count = 0;
+  }
+  count = 0;
+
+  std::vector<Run>(runs).swap(runs); // trim to fit
+  __atomic_store_n(&compacted, true, __ATOMIC_RELEASE);
+  __sync_fetch_and_add(&compacted_count, 1);
+
+  // nothing is drawn from a compacted superregion
+  ClearDrawCache();
+
+  pthread_mutex_unlock(&paging_mutex);
+}
+
+void SuperRegion::ExpandLocked()
+{
+  if (!compacted)
+    return;
+
+  const uint32_t srcellwidth(1 << bits.srbits);
+
+  FOR_EACH (it, runs) {
+    for (uint32_t i = it->start; i < it->start + it->length; ++i) {
+      const uint32_t x(i % srcellwidth);
+      const uint32_t y(i / srcellwidth);
+
+      GetRegion(x >> bits.rbits, y >> bits.rbits)
+          ->GetCell(bits.GetCell(x), bits.GetCell(y))
+          ->RestoreBlock(it->block, it->layer);
+    }
+
+    EraseAll(this, it->block->paged_superregions);
+  }
+
+  std::vector<Run>().swap(runs);
+
+  // readers test this flag without the lock, so the cells must be
+  // complete before it is cleared
+  __atomic_store_n(&compacted, false, __ATOMIC_RELEASE);
+  __sync_fetch_and_sub(&compacted_count, 1);
+}
+
+void SuperRegion::Expand()
+{
+  pthread_mutex_lock(&paging_mutex);
+  ExpandLocked();
+  pthread_mutex_unlock(&paging_mutex);
+}
+
+void SuperRegion::Expand(std::vector<SuperRegion *> &paged)
+{
+  PageLock lock(paged);
+}
+
+SuperRegion::PageLock::PageLock(std::vector<SuperRegion *> &paged)
+    : locked(__atomic_load_n(&compacted_count, __ATOMIC_ACQUIRE) > 0)
+{
+  if (!locked)
+    return;
+
+  pthread_mutex_lock(&paging_mutex);
+  while (!paged.empty()) {
+    SuperRegion *sr(paged.back());
+    sr->ExpandLocked(); // removes sr from the list
+    EraseAll(sr, paged); // in case it was already expanded
+  }
+}
+
+SuperRegion::PageLock::~PageLock()
+{
+  if (locked)
+    pthread_mutex_unlock(&paging_mutex);
+}
+
+size_t SuperRegion::MemoryUsage() const
+{
+  size_t bytes(sizeof(SuperRegion) + regions.capacity() * sizeof(Region)
+               + runs.capacity() * sizeof(Run));
+
+  bytes += (voxel_verts[0].capacity() + voxel_verts[1].capacity() + voxel_colors[0].capacity()
+            + voxel_colors[1].capacity() + occupancy_rects.capacity())
+               * sizeof(GLfloat)
+           + occupancy_regions.capacity() * sizeof(GLint);
+
+  // each cell reserves room for 2 entries in each layer
+  FOR_EACH (it, regions)
+    bytes += it->cells.capacity() * (sizeof(Cell) + 4 * sizeof(CellEntry));
+
+  return bytes;
 }
 
 void SuperRegion::AddBlock()
 {
   ++count;
+  ++modifications;
 }
 
 void SuperRegion::RemoveBlock()
 {
   --count;
+  ++modifications;
+}
+
+void SuperRegion::ClearDrawCache()
+{
+  for (unsigned int layer = 0; layer < 2; ++layer) {
+    std::vector<GLfloat>().swap(voxel_verts[layer]);
+    std::vector<GLfloat>().swap(voxel_colors[layer]);
+    voxel_version[layer] = STALE;
+  }
+
+  std::vector<GLfloat>().swap(occupancy_rects);
+  std::vector<GLint>().swap(occupancy_regions);
+  occupancy_version = STALE;
 }
 
 void SuperRegion::DrawOccupancy(void) const
@@ -61,95 +251,105 @@ void SuperRegion::DrawOccupancy(void) const
   glPushMatrix();
   GLfloat scale = 1.0 / world->Resolution();
   glScalef(scale, scale, 1.0); // XX TODO - this seems slightly
-  glTranslatef(origin.x << SRBITS, origin.y << SRBITS, 0);
+  glTranslatef(origin.x << bits.srbits, origin.y << bits.srbits, 0);
 
   glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
   // outline superregion
   glColor3f(0, 0, 1);
-  glRecti(0, 0, 1 << SRBITS, 1 << SRBITS);
-
-  // outline regions
-  const Region *r = &regions[0];
-
-  // XX hack: this means only one window at a time will have its cells
-  // drawn properly, but OpenGL needs a non-stack vertex buffer
-  static std::vector<GLfloat> rects(1000);
-  rects.resize(0);
-
-  //char buf[16];
-  
-  for (unsigned int y = 0; y < SUPERREGIONWIDTH; ++y)
-    for (unsigned int x = 0; x < SUPERREGIONWIDTH; ++x) {
-      if (r->count) // region contains some occupied cells
-      {
-        // outline the region
-        glColor3f(0, 1, 0);
-        glRecti(x << RBITS, y << RBITS, (x + 1) << RBITS, (y + 1) << RBITS);
-	
-	// show how many cells are occupied	
-	//snprintf( buf, 15, "%lu", r->count );
-	//Gl::draw_string( x<<RBITS, y<<RBITS, 0, buf );
-	
-	// draw a rectangle around each occupied cell
-        for (unsigned int p = 0; p < REGIONWIDTH; ++p)
-          for (unsigned int q = 0; q < REGIONWIDTH; ++q) {
-            const Cell &c = r->cells[p + (q * REGIONWIDTH)];
-
-            if (c.blocks[0].size()) // layer 0
-            {
-              const GLfloat xx = p + (x << RBITS);
-              const GLfloat yy = q + (y << RBITS);
-
-              rects.push_back(xx);
-              rects.push_back(yy);
-              rects.push_back(xx + 1);
-              rects.push_back(yy);
-              rects.push_back(xx + 1);
-              rects.push_back(yy + 1);
-              rects.push_back(xx);
-              rects.push_back(yy + 1);
-	    }
-
-            if (c.blocks[1].size()) // layer 1
-            {
-              const GLfloat xx = p + (x << RBITS);
-              const GLfloat yy = q + (y << RBITS);
-              const double dx = 0.1;
-
-              rects.push_back(xx + dx);
-              rects.push_back(yy + dx);
-              rects.push_back(xx + 1 - dx);
-              rects.push_back(yy + dx);
-              rects.push_back(xx + 1 - dx);
-              rects.push_back(yy + 1 - dx);
-              rects.push_back(xx + dx);
-              rects.push_back(yy + 1 - dx);
-            }
+  glRecti(0, 0, 1 << bits.srbits, 1 << bits.srbits);
+
+  // rebuild the outlines only if cells have changed since the last frame
+  if (occupancy_version != modifications) {
+    occupancy_rects.clear();
+    occupancy_regions.clear();
+
+    const Region *r = &regions[0];
+
+    for (int y = 0; y < bits.superregion_width; ++y)
+      for (int x = 0; x < bits.superregion_width; ++x) {
+        if (r->count) // region contains some occupied cells
+        {
+          // outline the region
+          occupancy_regions.push_back(x << bits.rbits);
+          occupancy_regions.push_back(y << bits.rbits);
+          occupancy_regions.push_back((x + 1) << bits.rbits);
+          occupancy_regions.push_back(y << bits.rbits);
+          occupancy_regions.push_back((x + 1) << bits.rbits);
+          occupancy_regions.push_back((y + 1) << bits.rbits);
+          occupancy_regions.push_back(x << bits.rbits);
+          occupancy_regions.push_back((y + 1) << bits.rbits);
+
+          // draw a rectangle around each occupied cell
+          for (int p = 0; p < bits.region_width; ++p)
+            for (int q = 0; q < bits.region_width; ++q) {
+              const Cell &c = r->cells[p + (q * bits.region_width)];
+
+              if (c.entries[0].size()) // layer 0
+              {
+                const GLfloat xx = p + (x << bits.rbits);
+                const GLfloat yy = q + (y << bits.rbits);
+
+                occupancy_rects.push_back(xx);
+                occupancy_rects.push_back(yy);
+                occupancy_rects.push_back(xx + 1);
+                occupancy_rects.push_back(yy);
+                occupancy_rects.push_back(xx + 1);
+                occupancy_rects.push_back(yy + 1);
+                occupancy_rects.push_back(xx);
+                occupancy_rects.push_back(yy + 1);
+              }
 
-	  }
+              if (c.entries[1].size()) // layer 1
+              {
+                const GLfloat xx = p + (x << bits.rbits);
+                const GLfloat yy = q + (y << bits.rbits);
+                const double dx = 0.1;
+
+                occupancy_rects.push_back(xx + dx);
+                occupancy_rects.push_back(yy + dx);
+                occupancy_rects.push_back(xx + 1 - dx);
+                occupancy_rects.push_back(yy + dx);
+                occupancy_rects.push_back(xx + 1 - dx);
+                occupancy_rects.push_back(yy + 1 - dx);
+                occupancy_rects.push_back(xx + dx);
+                occupancy_rects.push_back(yy + 1 - dx);
+              }
+            }
+        }
+        ++r; // next region quickly
       }
-      ++r; // next region quickly
-    }
+
+    occupancy_version = modifications;
+  }
 
   glEnableClientState(GL_VERTEX_ARRAY);
 
-  if (rects.size()) {
-    assert(rects.size() % 8 == 0); // should be full of squares
-    glVertexPointer(2, GL_FLOAT, 0, &rects[0]);
-    glDrawArrays(GL_QUADS, 0, rects.size() / 2);
+  if (occupancy_regions.size()) {
+    glColor3f(0, 1, 0);
+    glVertexPointer(2, GL_INT, 0, &occupancy_regions[0]);
+    glDrawArrays(GL_QUADS, 0, occupancy_regions.size() / 2);
+  }
+
+  if (occupancy_rects.size()) {
+    assert(occupancy_rects.size() % 8 == 0); // should be full of squares
+    glVertexPointer(2, GL_FLOAT, 0, &occupancy_rects[0]);
+    glDrawArrays(GL_QUADS, 0, occupancy_rects.size() / 2);
   }
 
   // char buf[32];
   // snprintf( buf, 15, "%lu", count );
-  // Gl::draw_string( 1<<SBITS, 1<<SBITS, 0, buf );
+  // Gl::draw_string( 1<<bits.sbits, 1<<bits.sbits, 0, buf );
 
   glPopMatrix();
 }
 
-static inline const std::vector<GLfloat> DrawBlock(GLfloat x, GLfloat y, GLfloat zmin, GLfloat zmax)
+// append the 20 vertices of the quads of a voxel to verts
+static inline void DrawBlock(std::vector<GLfloat> &verts, GLfloat x, GLfloat y, GLfloat zmin,
+                             GLfloat zmax)
 {
-  std::vector<GLfloat> v(60);
+  verts.resize(verts.size() + 60);
+  GLfloat *v(&verts[verts.size() - 60]);
 
   // TOP
   v[0] = x;
@@ -215,7 +415,6 @@ static inline const std::vector<GLfloat> DrawBlock(GLfloat x, GLfloat y, GLfloat
   v[58] = 1 + y;
   v[59] = zmin;
 
-  return v;
 }
 
 void SuperRegion::DrawVoxels(unsigned int layer) const
@@ -223,46 +422,52 @@ void SuperRegion::DrawVoxels(unsigned int layer) const
   glPushMatrix();
   GLfloat scale = 1.0 / world->Resolution();
   glScalef(scale, scale, 1.0); // XX TODO - this seems slightly
-  glTranslatef(origin.x << SRBITS, origin.y << SRBITS, 0);
+  glTranslatef(origin.x << bits.srbits, origin.y << bits.srbits, 0);
 
   glEnable(GL_DEPTH_TEST);
   glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
-  std::vector<GLfloat> verts(1000);
-  std::vector<GLfloat> colors(1000);
+  std::vector<GLfloat> &verts(voxel_verts[layer]);
+  std::vector<GLfloat> &colors(voxel_colors[layer]);
 
-  const Region *r = &regions[0];
+  // rebuild the voxels only if cells have changed since the last frame
+  if (voxel_version[layer] != modifications) {
+    verts.clear();
+    colors.clear();
 
-  for (int y = 0; y < SUPERREGIONWIDTH; ++y)
-    for (int x = 0; x < SUPERREGIONWIDTH; ++x) {
-      if (r->count) // not an empty region
-        for (int p = 0; p < REGIONWIDTH; ++p)
-          for (int q = 0; q < REGIONWIDTH; ++q) {
-            const std::vector<Block *> &blocks = r->cells[p + (q * REGIONWIDTH)].blocks[layer];
+    const Region *r = &regions[0];
 
-            if (blocks.size()) // not an empty cell
-            {
-              const GLfloat xx(p + (x << RBITS));
-              const GLfloat yy(q + (y << RBITS));
+    for (int y = 0; y < bits.superregion_width; ++y)
+      for (int x = 0; x < bits.superregion_width; ++x) {
+        if (r->count) // not an empty region
+          for (int p = 0; p < bits.region_width; ++p)
+            for (int q = 0; q < bits.region_width; ++q) {
+              const std::vector<CellEntry> &entries =
+                  r->cells[p + (q * bits.region_width)].entries[layer];
 
-              FOR_EACH (it, blocks) {
-                Block *block = *it;
-                Color c = block->group->mod.GetColor();
+              if (entries.size()) // not an empty cell
+              {
+                const GLfloat xx(p + (x << bits.rbits));
+                const GLfloat yy(q + (y << bits.rbits));
 
-                const std::vector<GLfloat> v =
-                    DrawBlock(xx, yy, block->global_z.min, block->global_z.max);
-                verts.insert(verts.end(), v.begin(), v.end());
+                FOR_EACH (it, entries) {
+                  Color c = it->mod->GetColor();
 
-                for (unsigned int i = 0; i < 20; i++) {
-                  colors.push_back(c.r);
-                  colors.push_back(c.g);
-                  colors.push_back(c.b);
+                  DrawBlock(verts, xx, yy, it->z_min, it->z_max);
+
+                  for (unsigned int i = 0; i < 20; i++) {
+                    colors.push_back(c.r);
+                    colors.push_back(c.g);
+                    colors.push_back(c.b);
+                  }
                 }
               }
             }
-          }
-      ++r;
-    }
+        ++r;
+      }
+
+    voxel_version[layer] = modifications;
+  }
 
   if (verts.size()) {
     assert(verts.size() % 60 == 0); // should be full of blocks, each with 20 3D vertices
@@ -280,13 +485,74 @@ void SuperRegion::DrawVoxels(unsigned int layer) const
   glPopMatrix();
 }
 
+// the nearest floats below and above x, so that rounding never
+// shrinks a block's z range
+static float float_below(double x)
+{
+  const float f(x);
+  return (f > x ? nextafterf(f, -HUGE_VALF) : f);
+}
+
+static float float_above(double x)
+{
+  const float f(x);
+  return (f < x ? nextafterf(f, HUGE_VALF) : f);
+}
+
+Stg::CellEntry::CellEntry(Block *block)
+    : z_min(float_below(block->global_z.min)), z_max(float_above(block->global_z.max)),
+      vis(block->group->mod.VisBits()), mod(&block->group->mod), block(block)
+{
+}
+
+void Stg::Cell::Touch(Block *b, unsigned int layer, int overlaps, size_t count)
+{
+  Model *mod(&b->group->mod);
+  const Model *root(mod->Root());
+
+  for (size_t i = 0; i < count; ++i) {
+    Model *other(entries[layer][i].mod);
+    if (other->Root() != root) {
+      mod->Touch(other, layer, overlaps);
+      other->Touch(mod, layer, overlaps);
+    }
+  }
+}
+
 void Stg::Cell::AddBlock(Block *b, unsigned int layer)
+{
+  LinkBlock(b, layer, PlaceBlock(b, layer));
+}
+
+size_t Stg::Cell::PlaceBlock(Block *b, unsigned int layer)
 {
   assert(b);
   assert(layer < 2);
-  blocks[layer].push_back(b);
-  b->rendered_cells[layer].push_back(this);
+
+  const size_t before(entries[layer].size());
+  if (before == entries[layer].capacity()) {
+    AllocationExempt exempt; // more blocks than this cell has held before
+    entries[layer].reserve(std::max(before * 2, (size_t)2));
+  }
+  entries[layer].push_back(CellEntry(b));
+  ++region->modifications[layer];
   region->AddBlock();
+  return before;
+}
+
+void Stg::Cell::LinkBlock(Block *b, unsigned int layer, size_t before)
+{
+  b->rendered_cells[layer].push_back(this);
+
+  // b now overlaps each block placed here before it once more
+  if (before)
+    Touch(b, layer, 1, before);
+}
+
+void Stg::Cell::RestoreBlock(Block *b, unsigned int layer)
+{
+  PlaceBlock(b, layer);
+  b->rendered_cells[layer].push_back(this);
 }
 
 void Stg::Cell::RemoveBlock(Block *b, unsigned int layer)
@@ -294,6 +560,30 @@ void Stg::Cell::RemoveBlock(Block *b, unsigned int layer)
   assert(b);
   assert(layer < 2);
 
-  EraseAll( b, blocks[layer] );  
+  // a block can be rendered into a cell more than once, and each copy
+  // overlapped the blocks left here
+  std::vector<CellEntry> &v(entries[layer]);
+  size_t keep(0);
+  for (size_t i = 0; i < v.size(); ++i)
+    if (v[i].block != b)
+      v[keep++] = v[i];
+  const int copies(v.size() - keep);
+  v.erase(v.begin() + keep, v.end());
+  if (copies && !v.empty())
+    Touch(b, layer, -copies, v.size());
+
+  ++region->modifications[layer];
   region->RemoveBlock();
 }
+
+void Stg::Cell::RefreshBlock(Block *b, unsigned int layer)
+{
+  const uint32_t vis(b->group->mod.VisBits());
+
+  FOR_EACH (it, entries[layer])
+    if (it->block == b && it->vis != vis) {
+      it->vis = vis;
+      // rays traced here may now stop or pass differently
+      ++region->modifications[layer];
+    }
+}
@@ -9,84 +9,80 @@
 
 namespace Stg {
 
-// a bit of experimenting suggests that these values are fast. YMMV.
-const uint32_t RBITS(5); // regions contain (2^RBITS)^2 pixels
-const uint32_t SBITS(5); // superregions contain (2^SBITS)^2 regions
-const uint32_t SRBITS(RBITS + SBITS);
-
-const int32_t REGIONWIDTH(1 << RBITS);
-const int32_t REGIONSIZE(REGIONWIDTH *REGIONWIDTH);
-
-const int32_t SUPERREGIONWIDTH(1 << SBITS);
-const int32_t SUPERREGIONSIZE(SUPERREGIONWIDTH *SUPERREGIONWIDTH);
-
-const int32_t CELLMASK(~((~0x00u) << RBITS));
-const int32_t REGIONMASK(~((~0x00u) << SRBITS));
-
-inline int32_t GETCELL(const int32_t x)
-{
-  return (x & CELLMASK);
-}
-inline int32_t GETREG(const int32_t x)
-{
-  return ((x & REGIONMASK) >> RBITS);
-}
-inline int32_t GETSREG(const int32_t x)
-{
-  return (x >> SRBITS);
-}
+/** What the raytrace needs to know about a block rendered into a
+    cell, copied into the cell so that blocks the ray misses, or that
+    the predicate cannot match, are rejected without reading the block
+    or its model. The z range is rounded outwards to floats. */
+class CellEntry {
+public:
+  float z_min, z_max; ///< global z range of the block
+  uint32_t vis; ///< the Model::VisBits() of its model
+  Model *mod; ///< the model that owns the block
+  Block *block;
 
-// this is slightly faster than the inline method above, but not as safe
-//#define GETREG(X) (( (static_cast<int32_t>(X)) & REGIONMASK ) >> RBITS)
+  explicit CellEntry(Block *block);
+};
 
 class Cell {
   friend class SuperRegion;
   friend class World;
 
 private:
-  std::vector<Block *> blocks[2];
+  std::vector<CellEntry> entries[2];
 
 public:
-  Cell() : blocks(), region(NULL)
+  Cell() : entries(), region(NULL)
   {
     // prevent frequent memory allocations
-    blocks[0].reserve(8);
-    blocks[1].reserve(8);
-    /* nothing to do */
+    entries[0].reserve(2);
+    entries[1].reserve(2);
   }
 
   void RemoveBlock(Block *b, unsigned int index);
   void AddBlock(Block *b, unsigned int index);
 
-  inline const std::vector<Block *> &GetBlocks(unsigned int index) { return blocks[index]; }
+  /** As AddBlock(), but for a block put back by SuperRegion::Expand(),
+      whose contacts were kept while it was compacted */
+  void RestoreBlock(Block *b, unsigned int index);
+
+  /** Copies the current vis bits of b's model into its entries */
+  void RefreshBlock(Block *b, unsigned int index);
+
+  /** The first half of AddBlock(): appends b's entry and counts it in
+      the region, touching nothing outside this cell's superregion.
+      Returns the number of entries that were here before. */
+  size_t PlaceBlock(Block *b, unsigned int index);
+
+  /** The second half of AddBlock(): records this cell in b and adds
+      the contacts between b and the before entries placed ahead of it */
+  void LinkBlock(Block *b, unsigned int index, size_t before);
+
+private:
+  /** Adds overlaps to the contacts between b and the blocks of other
+      trees in the first count entries of this cell */
+  void Touch(Block *b, unsigned int index, int overlaps, size_t count);
+
+public:
+
+  inline const std::vector<CellEntry> &GetEntries(unsigned int index) { return entries[index]; }
   Region *region;
 }; // class Cell
 
 class Region {
+  friend class Cell;
   friend class SuperRegion;
   friend class World; // for raytracing
 
 private:
   std::vector<Cell> cells;
   unsigned long count; // number of blocks rendered into this region
+  uint64_t modifications[2]; ///< changes to the entries of the cells, per layer
 
 public:
   Region();
   ~Region();
 
-  inline Cell *GetCell(int32_t x, int32_t y)
-  {
-    if (cells.size() == 0) {
-      assert(count == 0);
-
-      cells.resize(REGIONSIZE);
-
-      for (int32_t c = 0; c < REGIONSIZE; ++c)
-        cells[c].region = this;
-    }
-
-    return (&cells[x + y * REGIONWIDTH]);
-  }
+  inline Cell *GetCell(int32_t x, int32_t y);
 
   inline void AddBlock();
   inline void RemoveBlock();
@@ -97,16 +93,58 @@ public:
 
 class SuperRegion {
 private:
+  /** A horizontal run of cells occupied by a block, used to store the
+      contents of a compacted superregion. Cells are indexed row-major
+      across the whole superregion. */
+  class Run {
+  public:
+    Block *block;
+    uint32_t start; ///< index of the first cell in the run
+    uint16_t length; ///< number of cells in the run
+    uint8_t layer; ///< the bitmap layer the block was rendered into
+
+    Run(Block *block, uint32_t start, uint8_t layer)
+        : block(block), start(start), length(1), layer(layer)
+    {
+    }
+  };
+
   unsigned long count; // number of blocks rendered into this superregion
   point_int_t origin;
-  Region regions[SUPERREGIONSIZE];
+  const RegionBits bits; ///< the shape of the world's grid when this was created
+  std::vector<Region> regions;
   World *world;
 
+  std::vector<Run> runs; ///< occupancy while compacted, else empty
+  bool compacted; ///< iff true, regions are empty and runs hold the occupancy
+  uint64_t last_access; ///< World::UpdateCount() when last mapped into or raytraced
+  uint64_t modifications; ///< count of blocks added to or removed from the cells
+
+  /** Vertex arrays drawn by DrawVoxels() for each layer and by
+      DrawOccupancy(). They are kept between frames and rebuilt only
+      when the cells have been modified since they were built. */
+  mutable std::vector<GLfloat> voxel_verts[2];
+  mutable std::vector<GLfloat> voxel_colors[2];
+  mutable uint64_t voxel_version[2]; ///< modifications when voxel_verts was built
+  mutable std::vector<GLfloat> occupancy_rects;
+  mutable std::vector<GLint> occupancy_regions; ///< outlines of the occupied regions
+  mutable uint64_t occupancy_version; ///< modifications when occupancy_rects was built
+
+  /** Release the vertex arrays and mark them out of date */
+  void ClearDrawCache();
+
+  /** Rebuild the regions from the runs. Caller must hold the paging lock. */
+  void ExpandLocked();
+
 public:
   SuperRegion(World *world, point_int_t origin);
   ~SuperRegion();
 
-  inline Region *GetRegion(int32_t x, int32_t y) { return (&regions[x + y * SUPERREGIONWIDTH]); }
+  inline Region *GetRegion(int32_t x, int32_t y)
+  {
+    return (&regions[x + y * bits.superregion_width]);
+  }
+  const RegionBits &Bits() const { return bits; }
   void DrawOccupancy(void) const;
   void DrawVoxels(unsigned int layer) const;
 
@@ -114,6 +152,67 @@ public:
   inline void RemoveBlock();
 
   const point_int_t &GetOrigin() const { return origin; }
+  unsigned long GetCount() const { return count; }
+  /** Note that the superregion is in use at this update. Avoids
+      writing the shared cache line when nothing changed. */
+  void Touch(uint64_t update)
+  {
+    if (__atomic_load_n(&last_access, __ATOMIC_RELAXED) != update)
+      __atomic_store_n(&last_access, update, __ATOMIC_RELAXED);
+  }
+
+  uint64_t LastAccess() const { return __atomic_load_n(&last_access, __ATOMIC_RELAXED); }
+  /** Tested by worker threads without the paging lock */
+  bool IsCompacted() const { return __atomic_load_n(&compacted, __ATOMIC_ACQUIRE); }
+  /** Replace the cells with a run-length encoded copy of their
+      contents and release the cell memory. Blocks rendered here
+      remember this superregion so they can page it back in. Only call
+      this while no worker threads are running. */
+  void Compact();
+
+  /** Restore the cells of a compacted superregion. Safe to call
+      from worker threads. */
+  void Expand();
+
+  /** Expand every superregion in the list. Used by blocks to page
+      in all the superregions they have been compacted into. */
+  static void Expand(std::vector<SuperRegion *> &paged);
+
+  /** Pages in a block's compacted superregions and holds the paging
+      lock until destroyed. Worker threads expanding a superregion
+      append to the rendered cells of its blocks, so a block reads its
+      rendered cells and paged list only while one of these exists.
+      Superregions are only compacted between updates, so while none
+      is compacted, as when paging is off, nothing is locked. */
+  class PageLock {
+  public:
+    explicit PageLock(std::vector<SuperRegion *> &paged);
+    ~PageLock();
+
+  private:
+    bool locked;
+  };
+
+  /** Approximate heap memory used by this superregion in bytes. */
+  size_t MemoryUsage() const;
 }; // class SuperRegion;
 
+inline Cell *Region::GetCell(int32_t x, int32_t y)
+{
+  const int32_t width(superregion->Bits().region_width);
+
+  if (cells.size() == 0) {
+    assert(count == 0);
+
+    // the grid grows with the area explored, not with each update
+    AllocationExempt exempt;
+    cells.resize(width * width);
+
+    for (size_t c = 0; c < cells.size(); ++c)
+      cells[c].region = this;
+  }
+
+  return (&cells[x + y * width]);
+}
+
 } // namespace Stg
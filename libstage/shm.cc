@@ -0,0 +1,390 @@
+/*
+  shm.cc
+  Shared-memory channel between Stage and out-of-process controllers.
+  See shm.hh for the layout of a segment.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "shm.hh"
+#include "stage.hh" // for the PRINT macros
+
+using namespace Stg;
+using namespace Stg::ShmFormat;
+using Stg::LogFormat::RecordHeader;
+
+std::string Stg::ShmName(const std::string &prefix, const std::string &model)
+{
+  // shm_open(3) names have a single slash, at the start
+  std::string name("/" + prefix + "." + model);
+  for (size_t i(1); i < name.size(); ++i)
+    if (name[i] == '/')
+      name[i] = '_';
+  return name;
+}
+
+size_t ShmFormat::SegmentSize(uint32_t slots, uint32_t slot_size, uint32_t commands)
+{
+  return sizeof(Header) + (size_t)slots * slot_size + (size_t)commands * sizeof(Command);
+}
+
+uint64_t Stg::ShmClock()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool ShmRecords::Next(LogReader::Record &rec)
+{
+  RecordHeader header;
+  if (data + sizeof(header) > end)
+    return false;
+  memcpy(&header, data, sizeof(header));
+
+  const size_t length(sizeof(header) + header.count * sizeof(float));
+  if (data + length > end)
+    return false;
+
+  rec.time = header.time;
+  rec.model = header.model;
+  rec.kind = (log_kind_t)header.kind;
+  rec.aux = header.aux;
+  rec.count = header.count;
+  rec.values = reinterpret_cast<const float *>(data + sizeof(header));
+
+  data += length;
+  return true;
+}
+
+ShmPublisher::ShmPublisher(const std::string &name, uint32_t model, const std::string &type,
+                           uint32_t kinds, uint32_t slots, uint32_t slot_size,
+                           uint32_t commands)
+    : name(name), size(0), header(NULL), frame(NULL), cursor(NULL), overflow()
+{
+  // whole cache lines, so that frames do not share them
+  slot_size = (slot_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+  size = SegmentSize(slots, slot_size, commands);
+
+  // a segment left by a run that crashed may still be open in stale
+  // clients, so make a new one rather than reusing it
+  shm_unlink(name.c_str());
+  const int fd(shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666));
+  if (fd < 0) {
+    PRINT_ERR2("failed to create shared memory %s: %s", name.c_str(), strerror(errno));
+    return;
+  }
+
+  void *mem(MAP_FAILED);
+  if (ftruncate(fd, size) == 0)
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (mem == MAP_FAILED) {
+    PRINT_ERR2("failed to map shared memory %s: %s", name.c_str(), strerror(errno));
+    shm_unlink(name.c_str());
+    return;
+  }
+
+  // the segment starts zeroed, so only the header needs filling in
+  Header *h(static_cast<Header *>(mem));
+  h->version = FORMAT_VERSION;
+  h->model = model;
+  h->kinds = kinds;
+  h->slots = slots;
+  h->slot_size = slot_size;
+  h->commands = commands;
+  strncpy(h->type, type.c_str(), sizeof(h->type) - 1);
+  h->open = 1;
+
+  // clients check the magic, so it goes in last
+  __sync_synchronize();
+  memcpy(h->magic, MAGIC, sizeof(MAGIC));
+  header = h;
+}
+
+ShmPublisher::~ShmPublisher()
+{
+  if (header == NULL)
+    return;
+
+  header->open = 0;
+  __sync_synchronize();
+  munmap(header, size);
+  shm_unlink(name.c_str());
+}
+
+FrameHeader *ShmPublisher::Slot(uint64_t n) const
+{
+  char *frames(reinterpret_cast<char *>(header) + sizeof(Header));
+  return reinterpret_cast<FrameHeader *>(frames + (n % header->slots) * header->slot_size);
+}
+
+void ShmPublisher::BeginFrame(uint64_t time)
+{
+  if (header == NULL)
+    return;
+
+  const uint64_t n(header->frames);
+  frame = Slot(n);
+
+  // readers of this slot's previous frame see the odd number and retry
+  frame->seq = 2 * n + 1;
+  __sync_synchronize();
+
+  frame->time = time;
+  frame->records = 0;
+  frame->bytes = 0;
+  frame->flags = 0;
+  cursor = reinterpret_cast<char *>(frame) + sizeof(FrameHeader);
+}
+
+float *ShmPublisher::Record(unsigned int thread, uint64_t time, uint32_t model,
+                            log_kind_t kind, uint16_t aux, uint32_t count)
+{
+  (void)thread;
+  const size_t need(sizeof(RecordHeader) + count * sizeof(float));
+
+  if (frame == NULL || cursor + need > reinterpret_cast<char *>(frame) + header->slot_size) {
+    if (frame)
+      frame->flags |= FRAME_TRUNCATED;
+    if (overflow.size() < count + 1)
+      overflow.resize(count + 1);
+    return &overflow[0];
+  }
+
+  RecordHeader rec;
+  rec.time = time;
+  rec.model = model;
+  rec.kind = kind;
+  rec.aux = aux;
+  rec.count = count;
+  rec.reserved = 0;
+  memcpy(cursor, &rec, sizeof(rec));
+
+  float *values(reinterpret_cast<float *>(cursor + sizeof(rec)));
+  cursor += need;
+  frame->bytes += need;
+  ++frame->records;
+  return values;
+}
+
+void ShmPublisher::EndFrame()
+{
+  if (frame == NULL)
+    return;
+
+  const uint64_t n(header->frames);
+  frame->stamp = ShmClock();
+
+  // the frame must be complete before its number says so, and its
+  // number must be right before the frame count points readers at it
+  __sync_synchronize();
+  frame->seq = 2 * n + 2;
+  __sync_synchronize();
+  header->frames = n + 1;
+  frame = NULL;
+}
+
+bool ShmPublisher::NextCommand(Command &cmd)
+{
+  if (header == NULL || header->commands == 0)
+    return false;
+
+  const uint64_t tail(header->command_tail);
+  char *commands(reinterpret_cast<char *>(header) + sizeof(Header)
+                 + (size_t)header->slots * header->slot_size);
+  Command *c(reinterpret_cast<Command *>(commands) + tail % header->commands);
+
+  // claimed but not yet written, or not claimed at all
+  if (c->seq != tail + 1)
+    return false;
+  __sync_synchronize();
+
+  cmd.seq = c->seq;
+  cmd.type = c->type;
+  memcpy(cmd.values, c->values, sizeof(cmd.values));
+
+  // hand the slot back to the clients
+  __sync_synchronize();
+  header->command_tail = tail + 1;
+  return true;
+}
+
+float *ShmSizer::Record(unsigned int thread, uint64_t time, uint32_t model, log_kind_t kind,
+                        uint16_t aux, uint32_t count)
+{
+  (void)thread;
+  (void)time;
+  (void)model;
+  (void)kind;
+  (void)aux;
+  bytes += sizeof(RecordHeader) + count * sizeof(float);
+  if (scratch.size() < count + 1)
+    scratch.resize(count + 1);
+  return &scratch[0];
+}
+
+ShmClient::ShmClient(const std::string &name) : size(0), header(NULL)
+{
+  const int fd(shm_open(name.c_str(), O_RDWR, 0));
+  if (fd < 0) {
+    PRINT_ERR2("failed to open shared memory %s: %s", name.c_str(), strerror(errno));
+    return;
+  }
+
+  struct stat st;
+  void *mem(MAP_FAILED);
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)) {
+    size = st.st_size;
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+
+  if (mem == MAP_FAILED) {
+    PRINT_ERR1("failed to map shared memory %s", name.c_str());
+    return;
+  }
+
+  Header *h(static_cast<Header *>(mem));
+  __sync_synchronize();
+  if (memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0 || h->version != FORMAT_VERSION
+      || SegmentSize(h->slots, h->slot_size, h->commands) > size) {
+    PRINT_ERR1("shared memory %s is not a Stage segment of this version", name.c_str());
+    munmap(mem, size);
+    return;
+  }
+
+  header = h;
+}
+
+ShmClient::~ShmClient()
+{
+  if (header)
+    munmap(header, size);
+}
+
+FrameHeader *ShmClient::Slot(uint64_t n) const
+{
+  char *frames(reinterpret_cast<char *>(header) + sizeof(Header));
+  return reinterpret_cast<FrameHeader *>(frames + (n % header->slots) * header->slot_size);
+}
+
+Command *ShmClient::CommandSlot(uint64_t n) const
+{
+  char *commands(reinterpret_cast<char *>(header) + sizeof(Header)
+                 + (size_t)header->slots * header->slot_size);
+  return reinterpret_cast<ShmFormat::Command *>(commands) + n % header->commands;
+}
+
+bool ShmClient::Wait(uint64_t frames, double timeout) const
+{
+  if (header == NULL)
+    return false;
+
+  // spinning catches frames that follow closely, without a syscall
+  for (int i(0); i < 1000; ++i)
+    if (header->frames > frames)
+      return true;
+
+  const uint64_t deadline(ShmClock() + (uint64_t)(timeout * 1e9));
+  const struct timespec step = { 0, 20000 };
+
+  while (header->frames <= frames) {
+    if (!header->open || ShmClock() >= deadline)
+      return false;
+    nanosleep(&step, NULL);
+  }
+  return true;
+}
+
+const FrameHeader *ShmClient::Peek(uint64_t &seq) const
+{
+  if (header == NULL)
+    return NULL;
+
+  const uint64_t n(header->frames);
+  if (n == 0)
+    return NULL;
+  __sync_synchronize();
+
+  const FrameHeader *frame(Slot(n - 1));
+  seq = frame->seq;
+  __sync_synchronize();
+  return frame;
+}
+
+bool ShmClient::Valid(const FrameHeader *frame, uint64_t seq)
+{
+  // an odd number means the frame was being written when peeked
+  __sync_synchronize();
+  return (seq & 1) == 0 && frame->seq == seq;
+}
+
+ShmRecords ShmClient::Records(const FrameHeader *frame) const
+{
+  const uint32_t max_bytes(header->slot_size - sizeof(FrameHeader));
+  return ShmRecords(reinterpret_cast<const char *>(frame) + sizeof(FrameHeader),
+                    std::min(frame->bytes, max_bytes));
+}
+
+bool ShmClient::Read(Frame &out) const
+{
+  const uint32_t max_bytes(header ? header->slot_size - sizeof(FrameHeader) : 0);
+
+  for (int attempt(0); attempt < 8; ++attempt) {
+    uint64_t seq(0);
+    const FrameHeader *frame(Peek(seq));
+    if (frame == NULL)
+      return false;
+
+    const uint32_t bytes(std::min(frame->bytes, max_bytes));
+    out.data.resize(bytes);
+    if (bytes)
+      memcpy(&out.data[0], reinterpret_cast<const char *>(frame) + sizeof(FrameHeader), bytes);
+    out.number = seq / 2 - 1;
+    out.time = frame->time;
+    out.stamp = frame->stamp;
+    out.records = frame->records;
+    out.truncated = frame->flags & FRAME_TRUNCATED;
+
+    if (Valid(frame, seq))
+      return true;
+  }
+
+  return false;
+}
+
+bool ShmClient::Command(shm_command_t type, double x, double y, double z, double a)
+{
+  if (header == NULL || header->commands == 0)
+    return false;
+
+  // claim a slot, if the simulation has applied the command that used
+  // it last time round
+  uint64_t head;
+  do {
+    head = header->command_head;
+    if (head - header->command_tail >= header->commands)
+      return false;
+  } while (!__sync_bool_compare_and_swap(&header->command_head, head, head + 1));
+
+  ShmFormat::Command *c(CommandSlot(head));
+  c->type = type;
+  c->values[0] = x;
+  c->values[1] = y;
+  c->values[2] = z;
+  c->values[3] = a;
+
+  __sync_synchronize();
+  c->seq = head + 1;
+  return true;
+}
@@ -0,0 +1,242 @@
+#ifndef STG_SHM_H
+#define STG_SHM_H
+/*
+  shm.hh
+  A shared-memory channel between Stage and controllers running in
+  other processes. Each published model has a POSIX shared memory
+  segment holding a ring of frames, which Stage fills with the
+  model's state at each update, and, for position models, a ring of
+  commands that clients fill and Stage applies at the model's next
+  update. Neither side ever locks or waits for the other.
+
+  A frame holds records in the format of the log file (logfile.hh): a
+  LogFormat::RecordHeader followed by its floats. Readers detect a
+  frame that is overwritten while they read it by its sequence number,
+  and try again.
+
+  Like logfile.hh, this header does not depend on the rest of Stage:
+  clients link against libstageshm alone.
+*/
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "logfile.hh"
+
+namespace Stg {
+
+/** Commands a client can send to a position model */
+typedef enum {
+  SHM_CMD_SPEED = 1, ///< ModelPosition::SetSpeed(x, y, a)
+  SHM_CMD_GOTO = 2, ///< ModelPosition::GoTo(x, y, a)
+  SHM_CMD_STOP = 3 ///< ModelPosition::Stop()
+} shm_command_t;
+
+/** Returns the name of the segment of a model, for shm_open(3) */
+std::string ShmName(const std::string &prefix, const std::string &model);
+
+/** The layout of a segment: a Header, then the frames, each
+    slot_size bytes, then the commands. */
+namespace ShmFormat {
+const char MAGIC[8] = { 'S', 'T', 'A', 'G', 'E', 'S', 'H', 'M' };
+const uint32_t FORMAT_VERSION = 1;
+const uint32_t FRAME_TRUNCATED = 0x01;
+const size_t CACHE_LINE = 64;
+
+class Header {
+public:
+  char magic[8];
+  uint32_t version;
+  uint32_t model; ///< model id
+  uint32_t kinds; ///< mask of the log_kind_t published
+  uint32_t slots; ///< frames in the ring
+  uint32_t slot_size; ///< bytes per frame, including its FrameHeader
+  uint32_t commands; ///< commands in the ring, zero if the model takes none
+  char type[28]; ///< model type
+  volatile uint32_t open; ///< non-zero until the simulation closes the segment
+
+  // written by the simulation
+  volatile uint64_t frames; ///< frames published. The latest is frames - 1.
+  volatile uint64_t command_tail; ///< commands applied
+  char pad1[CACHE_LINE - 16];
+
+  // written by clients
+  volatile uint64_t command_head; ///< commands claimed
+  char pad2[CACHE_LINE - 8];
+};
+
+class FrameHeader {
+public:
+  volatile uint64_t seq; ///< 2n+1 while frame n is written, then 2n+2
+  uint64_t time; ///< sim time in usec
+  uint64_t stamp; ///< CLOCK_MONOTONIC time of publication in nsec
+  uint32_t records;
+  uint32_t bytes; ///< bytes of records that follow
+  uint32_t flags; ///< FRAME_TRUNCATED if some records did not fit
+  uint32_t reserved;
+};
+
+class Command {
+public:
+  volatile uint64_t seq; ///< n+1 once command n is written
+  uint32_t type; ///< a shm_command_t
+  uint32_t reserved;
+  double values[4]; ///< x, y, z, a
+  char pad[CACHE_LINE - 48];
+};
+
+/** Returns the size of a segment */
+size_t SegmentSize(uint32_t slots, uint32_t slot_size, uint32_t commands);
+}
+
+/** Reads the records of a frame in place */
+class ShmRecords {
+public:
+  ShmRecords(const char *data, uint32_t bytes) : data(data), end(data + bytes) {}
+
+  /** Reads the next record into rec. Returns false after the last. */
+  bool Next(LogReader::Record &rec);
+
+private:
+  const char *data;
+  const char *end;
+};
+
+/** The simulation's side of a model's segment. Frames are written
+    from the thread that updates the model, and commands read from it,
+    so no locking is needed. */
+class ShmPublisher : public RecordSink {
+public:
+  /** Creates the segment, replacing any left by an earlier run. Each
+      frame may hold slot_size bytes, including its header. */
+  ShmPublisher(const std::string &name, uint32_t model, const std::string &type,
+               uint32_t kinds, uint32_t slots, uint32_t slot_size, uint32_t commands);
+
+  /** Marks the segment closed and removes its name. Clients that have
+      it open may keep reading the last frames. */
+  ~ShmPublisher();
+
+  bool Ok() const { return header != NULL; }
+  const std::string &GetName() const { return name; }
+
+  /** Starts a frame of records made at the given sim time */
+  void BeginFrame(uint64_t time);
+
+  /** Adds a record to the frame. If it does not fit, the frame is
+      marked truncated and the floats are discarded. */
+  virtual float *Record(unsigned int thread, uint64_t time, uint32_t model, log_kind_t kind,
+                        uint16_t aux, uint32_t count);
+
+  /** Publishes the frame */
+  void EndFrame();
+
+  /** Takes the oldest unapplied command. Returns false if there is
+      none. */
+  bool NextCommand(ShmFormat::Command &cmd);
+
+private:
+  std::string name;
+  size_t size;
+  ShmFormat::Header *header;
+  ShmFormat::FrameHeader *frame; ///< being written, or NULL
+  char *cursor; ///< where the next record goes
+  std::vector<float> overflow; ///< takes the floats of records that do not fit
+
+  ShmFormat::FrameHeader *Slot(uint64_t n) const;
+};
+
+/** Counts the bytes of the records made into it, to size frames */
+class ShmSizer : public RecordSink {
+public:
+  ShmSizer() : bytes(0), scratch() {}
+
+  virtual float *Record(unsigned int thread, uint64_t time, uint32_t model, log_kind_t kind,
+                        uint16_t aux, uint32_t count);
+
+  size_t bytes;
+
+private:
+  std::vector<float> scratch;
+};
+
+/** A client's view of a model's segment */
+class ShmClient {
+public:
+  /** A copy of a frame */
+  class Frame {
+  public:
+    uint64_t number; ///< frames published before this one
+    uint64_t time; ///< sim time in usec
+    uint64_t stamp; ///< CLOCK_MONOTONIC time of publication in nsec
+    uint32_t records;
+    bool truncated;
+    std::vector<char> data; ///< the records
+
+    Frame() : number(0), time(0), stamp(0), records(0), truncated(false), data() {}
+    ShmRecords Records() const
+    {
+      return ShmRecords(data.empty() ? NULL : &data[0], data.size());
+    }
+  };
+
+  /** Opens the segment with this name, as made by ShmName() */
+  explicit ShmClient(const std::string &name);
+  ~ShmClient();
+
+  /** Returns true if the segment was opened and is valid */
+  bool Ok() const { return header != NULL; }
+  /** Returns false once the simulation has closed the segment */
+  bool Open() const { return header && header->open; }
+  const ShmFormat::Header *GetHeader() const { return header; }
+
+  /** Returns the number of frames published so far */
+  uint64_t Frames() const { return header ? header->frames : 0; }
+
+  /** Waits until more than the given number of frames have been
+      published, for at most timeout seconds. Spins briefly, then
+      sleeps in short steps. Returns false on timeout or if the
+      segment is closed. */
+  bool Wait(uint64_t frames, double timeout) const;
+
+  /** Copies the latest frame. Returns false if there is none yet, or
+      if it was overwritten during every attempt. */
+  bool Read(Frame &frame) const;
+
+  /** Returns the latest frame in place, without copying, and sets seq
+      to its sequence number, or returns NULL if there is none. The
+      frame may be overwritten at any time: check with Valid() after
+      using its records. */
+  const ShmFormat::FrameHeader *Peek(uint64_t &seq) const;
+
+  /** Returns true if the frame has not been overwritten since Peek()
+      returned it with this sequence number */
+  static bool Valid(const ShmFormat::FrameHeader *frame, uint64_t seq);
+
+  /** Returns the records of a frame returned by Peek(). If the frame
+      is overwritten meanwhile, they are garbage, but within the frame. */
+  ShmRecords Records(const ShmFormat::FrameHeader *frame) const;
+
+  /** Queues a command for the model. Returns false if the model takes
+      no commands or the ring is full. */
+  bool Command(shm_command_t type, double x, double y, double z, double a);
+
+  bool SetSpeed(double x, double y, double a) { return Command(SHM_CMD_SPEED, x, y, 0, a); }
+  bool GoTo(double x, double y, double a) { return Command(SHM_CMD_GOTO, x, y, 0, a); }
+  bool Stop() { return Command(SHM_CMD_STOP, 0, 0, 0, 0); }
+
+private:
+  size_t size;
+  ShmFormat::Header *header;
+
+  ShmFormat::FrameHeader *Slot(uint64_t n) const;
+  ShmFormat::Command *CommandSlot(uint64_t n) const;
+};
+
+/** Returns CLOCK_MONOTONIC in nsec, the clock of the frame stamps */
+uint64_t ShmClock();
+
+} // namespace Stg
+
+#endif
@@ -0,0 +1,205 @@
+/////////////////////////////////
+// File: shmbench.cc
+// Desc: Measures the latency of Stage's shared-memory channel
+// License: GPL
+/////////////////////////////////
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include "shm.hh"
+using namespace Stg;
+
+const char *USAGE =
+    "USAGE:  stage-shmbench [options] [segment]\n"
+    "Measures the time from the publication of a frame in shared memory to\n"
+    "a client reading it. Given a segment name, such as /stage.r0, reads\n"
+    "the frames of a running Stage. Otherwise a thread of this program\n"
+    "publishes frames of synthetic ranger scans, to measure the channel alone.\n"
+    "Available [options] are:\n"
+    "  --frames n  : frames to measure (default 10000)\n"
+    "  --rate hz   : frames published per second without a segment (default 1000)\n"
+    "  --samples n : ranger samples in each synthetic frame (default 360)\n"
+    "  --copy      : copy each frame with Read() instead of reading it in place\n"
+    "  --help      : print this message";
+
+static struct option longopts[] = {
+  { "frames",  required_argument,   NULL,  'f' },
+  { "rate",  required_argument,   NULL,  'r' },
+  { "samples",  required_argument,   NULL,  's' },
+  { "copy",  no_argument,   NULL,  'c' },
+  { "help",  no_argument,   NULL,  'h' },
+  { NULL, 0, NULL, 0 }
+};
+
+// the synthetic publisher
+class Source {
+public:
+  ShmPublisher *publisher;
+  double rate;
+  uint32_t samples;
+  volatile bool done;
+};
+
+static void *publish(void *arg)
+{
+  Source *src(static_cast<Source *>(arg));
+  const uint64_t period((uint64_t)(1e9 / src->rate));
+
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  for (uint64_t n(0); !src->done; ++n) {
+    src->publisher->BeginFrame(n * period / 1000);
+    float *v(src->publisher->Record(0, n * period / 1000, 0, LOG_RANGER, 0, 2 * src->samples));
+    for (uint32_t i(0); i < 2 * src->samples; ++i)
+      v[i] = i;
+    src->publisher->EndFrame();
+
+    // absolute deadlines, so that the rate does not drift
+    next.tv_nsec += period;
+    while (next.tv_nsec >= 1000000000) {
+      next.tv_nsec -= 1000000000;
+      ++next.tv_sec;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+
+  return NULL;
+}
+
+// touch every value, as a client would
+static float consume(ShmRecords records)
+{
+  float sum(0);
+  LogReader::Record rec;
+  while (records.Next(rec))
+    for (uint32_t i(0); i < rec.count; ++i)
+      sum += rec.values[i];
+  return sum;
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double p)
+{
+  return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))] / 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+  uint64_t frames(10000);
+  double rate(1000);
+  uint32_t samples(360);
+  bool copy(false);
+
+  int ch = 0, optindex = 0;
+  while ((ch = getopt_long(argc, argv, "h?", longopts, &optindex)) != -1) {
+    switch (ch) {
+    case 'f': frames = strtoull(optarg, NULL, 10); break;
+    case 'r': rate = atof(optarg); break;
+    case 's': samples = atoi(optarg); break;
+    case 'c': copy = true; break;
+    case 'h':
+    case '?':
+    default: puts(USAGE); exit(ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+
+  if (optind < argc - 1 || frames == 0 || rate <= 0) {
+    puts(USAGE);
+    return EXIT_FAILURE;
+  }
+
+  Source src;
+  src.publisher = NULL;
+  src.rate = rate;
+  src.samples = samples;
+  src.done = false;
+  pthread_t thread;
+
+  std::string name;
+  if (optind == argc - 1)
+    name = argv[optind];
+  else {
+    std::ostringstream os;
+    os << "/stage-shmbench." << getpid();
+    name = os.str();
+
+    const uint32_t frame_size(sizeof(ShmFormat::FrameHeader) + sizeof(LogFormat::RecordHeader)
+                              + 2 * samples * sizeof(float));
+    src.publisher = new ShmPublisher(name, 0, "ranger", LOG_RANGER, 4, frame_size, 0);
+    if (!src.publisher->Ok())
+      return EXIT_FAILURE;
+    pthread_create(&thread, NULL, publish, &src);
+  }
+
+  ShmClient client(name);
+  if (!client.Ok())
+    return EXIT_FAILURE;
+
+  std::vector<uint64_t> latency;
+  latency.reserve(frames);
+  uint64_t seen(client.Frames()), missed(0), failed(0);
+  ShmClient::Frame frame;
+  float sum(0);
+
+  while (latency.size() < frames && client.Wait(seen, 5.0)) {
+    uint64_t number(0), stamp(0);
+
+    if (copy) {
+      if (!client.Read(frame)) {
+        ++failed;
+        continue;
+      }
+      sum += consume(frame.Records());
+      number = frame.number;
+      stamp = frame.stamp;
+    } else {
+      uint64_t seq(0);
+      const ShmFormat::FrameHeader *f(client.Peek(seq));
+      sum += consume(client.Records(f));
+      stamp = f->stamp;
+      if (!ShmClient::Valid(f, seq)) {
+        ++failed;
+        continue;
+      }
+      number = seq / 2 - 1;
+    }
+
+    const uint64_t now(ShmClock());
+    if (number > seen)
+      missed += number - seen;
+    seen = number + 1;
+    latency.push_back(now - stamp);
+  }
+
+  if (src.publisher) {
+    src.done = true;
+    pthread_join(thread, NULL);
+    delete src.publisher;
+  }
+
+  if (latency.empty()) {
+    fprintf(stderr, "stage-shmbench: no frames from %s\n", name.c_str());
+    return EXIT_FAILURE;
+  }
+
+  std::sort(latency.begin(), latency.end());
+  printf("%s: %u frames read %s, %llu missed, %llu overwritten while read\n", name.c_str(),
+         (unsigned int)latency.size(), copy ? "by copy" : "in place",
+         (unsigned long long)missed, (unsigned long long)failed);
+  printf("latency usec: min %.2f median %.2f p90 %.2f p99 %.2f max %.2f\n",
+         latency.front() / 1e3, percentile(latency, 0.5), percentile(latency, 0.9),
+         percentile(latency, 0.99), latency.back() / 1e3);
+  if (sum < 0) // keep the reads from being optimized away
+    putchar('\n');
+
+  return EXIT_SUCCESS;
+}
@@ -42,6 +42,91 @@ bool Stg::InitDone()
   return init_called;
 }
 
+uint64_t Stg::ProfileClock()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#ifdef STAGE_ALLOC_COUNT
+
+static uint64_t alloc_count = 0;
+static uint64_t exempt_count = 0;
+
+// the AllocationExempt objects alive on this thread
+static __thread unsigned int exempt_depth = 0;
+
+// replacing the global allocation functions counts every allocation
+// in the process, including those made by the standard library
+
+void *operator new(size_t size)
+{
+  __sync_fetch_and_add(exempt_depth ? &exempt_count : &alloc_count, 1);
+
+  void *ptr = malloc(size ? size : 1);
+  if (ptr == NULL)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *ptr) throw()
+{
+  free(ptr);
+}
+
+void operator delete[](void *ptr) throw()
+{
+  free(ptr);
+}
+
+uint64_t Stg::AllocationCount()
+{
+  return __sync_add_and_fetch(&alloc_count, 0);
+}
+
+uint64_t Stg::ExemptAllocationCount()
+{
+  return __sync_add_and_fetch(&exempt_count, 0);
+}
+
+Stg::AllocationExempt::AllocationExempt()
+{
+  ++exempt_depth;
+}
+
+Stg::AllocationExempt::~AllocationExempt()
+{
+  --exempt_depth;
+}
+
+#else
+
+uint64_t Stg::AllocationCount()
+{
+  return 0;
+}
+
+uint64_t Stg::ExemptAllocationCount()
+{
+  return 0;
+}
+
+Stg::AllocationExempt::AllocationExempt()
+{
+}
+
+Stg::AllocationExempt::~AllocationExempt()
+{
+}
+
+#endif
+
 const Color Color::blue(0, 0, 1);
 const Color Color::red(1, 0, 0);
 const Color Color::green(0, 1, 0);
@@ -69,8 +154,9 @@ const Color Color::cyan(0, 1, 1);
 //     }
 // }
 
-static inline bool pixel_is_set(uint8_t *pixels, const unsigned int width, const unsigned int depth,
-                                const unsigned int x, const unsigned int y, uint8_t threshold)
+static inline bool pixel_is_set(const uint8_t *pixels, const unsigned int width,
+                                const unsigned int depth, const unsigned int x,
+                                const unsigned int y, uint8_t threshold)
 {
   return ((pixels + (y * width * depth) + x * depth)[0] > threshold);
 }
@@ -86,9 +172,6 @@ double direction(double a)
 int Stg::polys_from_image_file(const std::string &filename,
                                std::vector<std::vector<point_t> > &polys)
 {
-  // TODO: make this a parameter
-  const int threshold = 127;
-
   Fl_Shared_Image *img = Fl_Shared_Image::get(filename.c_str());
   if (img == NULL) {
     std::cerr << "failed to open file: " << filename << std::endl;
@@ -100,10 +183,52 @@ int Stg::polys_from_image_file(const std::string &filename,
   // printf( "loaded image %s w %d h %d d %d count %d ld %d\n",
   //  filename, img->w(), img->h(), img->d(), img->count(), img->ld() );
 
-  const unsigned int width = img->w();
-  const unsigned height = img->h();
-  const unsigned int depth = img->d();
-  uint8_t *pixels = (uint8_t *)img->data()[0];
+  polys_from_image((const uint8_t *)img->data()[0], img->w(), img->h(), img->d(), polys);
+
+  img->release(); // frees all resources for this image
+  return 0; // ok
+}
+
+// the images of polys_from_image_files(), traced by parallel_for()
+struct ImageJob {
+  std::vector<Fl_Shared_Image *> images;
+  std::vector<std::vector<std::vector<point_t> > > polys;
+};
+
+static void trace_image(void *arg, size_t i)
+{
+  ImageJob *job(static_cast<ImageJob *>(arg));
+  Fl_Shared_Image *img(job->images[i]);
+  polys_from_image((const uint8_t *)img->data()[0], img->w(), img->h(), img->d(), job->polys[i]);
+}
+
+void Stg::polys_from_image_files(const std::set<std::string> &filenames, unsigned int threads,
+                                 std::map<std::string, std::vector<std::vector<point_t> > > &polys)
+{
+  // FLTK's image cache is not thread-safe, so the images are read
+  // here and only traced in parallel
+  ImageJob job;
+  std::vector<std::string> loaded;
+  FOR_EACH (it, filenames)
+    if (Fl_Shared_Image *img = Fl_Shared_Image::get(it->c_str())) {
+      job.images.push_back(img);
+      loaded.push_back(*it);
+    }
+
+  job.polys.resize(job.images.size());
+  parallel_for(threads, job.images.size(), trace_image, &job);
+
+  for (size_t i = 0; i < loaded.size(); ++i) {
+    job.images[i]->release();
+    polys[loaded[i]].swap(job.polys[i]);
+  }
+}
+
+void Stg::polys_from_image(const uint8_t *pixels, unsigned int width, unsigned int height,
+                           unsigned int depth, std::vector<std::vector<point_t> > &polys)
+{
+  // TODO: make this a parameter
+  const int threshold = 127;
 
   // a set of previously seen directed edges, The key is a 4-element vector
   // [x1,y1,x2,y2].
@@ -208,10 +333,6 @@ int Stg::polys_from_image_file(const std::string &filename,
 
     polys.push_back(poly);
   }
-
-  if (img)
-    img->release(); // frees all resources for this image
-  return 0; // ok
 }
 
 // POINTS -----------------------------------------------------------
@@ -232,6 +353,41 @@ point_t *Stg::unit_square_points_create(void)
   return pts;
 }
 
+// the work shared by the threads of a parallel_for()
+struct ParallelFor {
+  void (*fn)(void *arg, size_t i);
+  void *arg;
+  size_t count;
+  size_t next; ///< the next item to hand out
+};
+
+static void *parallel_for_thread(void *p)
+{
+  ParallelFor *pf(static_cast<ParallelFor *>(p));
+  for (size_t i; (i = __sync_fetch_and_add(&pf->next, 1)) < pf->count;)
+    pf->fn(pf->arg, i);
+  return NULL;
+}
+
+void Stg::parallel_for(unsigned int threads, size_t count, void (*fn)(void *arg, size_t i),
+                       void *arg)
+{
+  ParallelFor pf = { fn, arg, count, 0 };
+
+  // a thread that cannot be created leaves its share to the others
+  std::vector<pthread_t> helpers;
+  for (size_t t = 1; t < std::min((size_t)threads, count); ++t) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, parallel_for_thread, &pf) == 0)
+      helpers.push_back(thread);
+  }
+
+  parallel_for_thread(&pf);
+
+  FOR_EACH (it, helpers)
+    pthread_join(*it, NULL);
+}
+
 // return a value based on val, but limited minval <= val >= maxval
 double Stg::constrain(double val, const double minval, const double maxval)
 {
@@ -55,6 +55,9 @@
 #include <set>
 #include <vector>
 
+#include "logfile.hh"
+#include "shm.hh"
+
 // FLTK Gui includes
 #include <FL/Fl.H>
 #include <FL/Fl_Box.H>
@@ -76,6 +79,7 @@ namespace Stg {
 class Block;
 class Canvas;
 class Cell;
+class CellEntry;
 class Worldfile;
 class World;
 class WorldGui;
@@ -94,6 +98,32 @@ void Init(int *argc, char **argv[]);
 /** returns true iff Stg::Init() has been called. */
 bool InitDone();
 
+/** returns the number of heap allocations made by the process so
+      far, except those made while an AllocationExempt existed. Always
+      zero unless libstage was built with the ALLOC_COUNT cmake
+      option, which replaces the global operator new with a counting
+      version. */
+uint64_t AllocationCount();
+
+/** returns the number of heap allocations made while an
+      AllocationExempt existed. Always zero without ALLOC_COUNT. */
+uint64_t ExemptAllocationCount();
+
+/** While one of these exists, the heap allocations made by its
+      thread count towards ExemptAllocationCount() instead of
+      AllocationCount(). It marks allocations that go on after the
+      warmup without being a cost of each update: the occupancy grid
+      growing into places not visited before, and controllers. */
+class AllocationExempt {
+public:
+  AllocationExempt();
+  ~AllocationExempt();
+};
+
+/** returns a monotonic clock reading in nanoseconds, used by the
+      profiler. */
+uint64_t ProfileClock();
+
 /** returns a human readable string indicating the libstage version
       number. */
 const char *Version();
@@ -563,6 +593,23 @@ typedef struct {
    */
 int polys_from_image_file(const std::string &filename, std::vector<std::vector<point_t> > &polys);
 
+/** convert an image of width x height pixels of depth bytes to a
+   vector of polygons outlining its dark pixels. Thread-safe. */
+void polys_from_image(const uint8_t *pixels, unsigned int width, unsigned int height,
+                      unsigned int depth, std::vector<std::vector<point_t> > &polys);
+
+/** load each of the image files and convert it to a vector of
+   polygons, converting the images on up to threads threads. Files
+   that cannot be loaded are left out of polys. */
+void polys_from_image_files(const std::set<std::string> &filenames, unsigned int threads,
+                            std::map<std::string, std::vector<std::vector<point_t> > > &polys);
+
+/** call fn(arg, i) for each i in [0, count) on up to threads
+   threads, the calling thread among them, returning when all the
+   calls are done. The i are handed out one at a time, so that calls
+   of uneven cost are shared evenly. */
+void parallel_for(unsigned int threads, size_t count, void (*fn)(void *arg, size_t i), void *arg);
+
 /** matching function should return true iff the candidate block is
       stops the ray, false if the block transmits the ray
   */
@@ -708,6 +755,50 @@ public:
   }
 };
 
+/** The shape of the occupancy grid of a world: square regions of
+cells, grouped in square superregions of regions, each a power of two
+wide. Finer regions let rays skip more empty space, coarser ones make
+fewer region lookups in cluttered maps. See the region_bits worldfile
+property. */
+class RegionBits {
+public:
+  uint32_t rbits; ///< regions are (2^rbits)^2 cells
+  uint32_t sbits; ///< superregions are (2^sbits)^2 regions
+  uint32_t srbits; ///< rbits + sbits
+  int32_t region_width; ///< cells along the side of a region
+  int32_t region_size; ///< cells in a region
+  int32_t superregion_width; ///< regions along the side of a superregion
+  int32_t superregion_size; ///< regions in a superregion
+
+  /** a bit of experimenting suggests that the defaults are fast. YMMV. */
+  explicit RegionBits(uint32_t rbits = 5, uint32_t sbits = 5)
+      : rbits(rbits), sbits(sbits), srbits(rbits + sbits), region_width(1 << rbits),
+        region_size(1 << (2 * rbits)), superregion_width(1 << sbits),
+        superregion_size(1 << (2 * sbits))
+  {
+  }
+
+  /** The limits keep the cell indices of a compacted superregion
+within its 16 bit runs */
+  static const uint32_t MIN = 2, MAX = 8, MAX_SUM = 15;
+  bool Valid() const
+  {
+    return (rbits >= MIN && rbits <= MAX && sbits >= MIN && sbits <= MAX && srbits <= MAX_SUM);
+  }
+
+  /** The cell within its region of a global cell coordinate */
+  int32_t GetCell(const int32_t x) const { return (x & (region_width - 1)); }
+  /** The region within its superregion of a global cell coordinate */
+  int32_t GetReg(const int32_t x) const { return ((x >> rbits) & (superregion_width - 1)); }
+  /** The superregion of a global cell coordinate */
+  int32_t GetSReg(const int32_t x) const { return (x >> srbits); }
+
+  bool operator==(const RegionBits &other) const
+  {
+    return (rbits == other.rbits && sbits == other.sbits);
+  }
+};
+
 class Ray {
 public:
   Ray(const Model *mod, const Pose &origin, const meters_t range, const ray_test_func_t func,
@@ -731,25 +822,6 @@ class SuperRegion;
 class BlockGroup;
 class PowerPack;
 
-class LogEntry {
-  usec_t timestamp;
-  Model *mod;
-  Pose pose;
-
-public:
-  LogEntry(usec_t timestamp, Model *mod);
-
-  /** A log of all LogEntries ever created */
-  static std::vector<LogEntry> log;
-
-  /** Returns the number of logged entries */
-  static size_t Count() { return log.size(); }
-  /** Clear the log */
-  static void Clear() { log.clear(); }
-  /** Print the log on stdout */
-  static void Print();
-};
-
 class CtrlArgs {
 public:
   std::string worldfile;
@@ -758,14 +830,45 @@ public:
   CtrlArgs(std::string w, std::string c) : worldfile(w), cmdline(c) {}
 };
 
+/** Counters and timers collected for a model while its world is
+    profiling (see World::EnableProfiling()). Times are in
+    nanoseconds. */
+class ModelProfile {
+public:
+  uint64_t updates; ///< calls of Update()
+  uint64_t update_time; ///< time spent in Update()
+  uint64_t rays; ///< rays traced
+  uint64_t cells; ///< occupancy grid cells visited by those rays
+  uint64_t maps; ///< blocks rendered into the occupancy grid
+  uint64_t map_cells; ///< occupancy grid cells those blocks were rendered into
+  uint64_t unmaps; ///< blocks removed from the occupancy grid
+  uint64_t collision_tests; ///< blocks tested for collisions
+  uint64_t callbacks; ///< calls of the CB_UPDATE callbacks
+  uint64_t callback_time; ///< time spent in CB_UPDATE callbacks
+  uint64_t scans; ///< ranger sensor scans
+  uint64_t scans_cached; ///< of those, scans reused from an earlier update without raytracing
+
+  ModelProfile() { Clear(); }
+  void Clear()
+  {
+    updates = update_time = rays = cells = maps = map_cells = unmaps = collision_tests =
+        callbacks = callback_time = scans = scans_cached = 0;
+  }
+
+  ModelProfile &operator+=(const ModelProfile &other);
+};
+
 class ModelPosition;
+class ModelComm;
 
 /// %World class
 class World : public Ancestor {
 public:
   friend class Block;
+  friend class BlockGroup;
   friend class Model; // allow access to private members
   friend class ModelFiducial;
+  friend class ModelComm;
   friend class Canvas;
   friend class WorkerThread;
 
@@ -775,6 +878,100 @@ that controllers can read them. */
   static std::vector<std::string> args;
   static std::string ctrlargs;
 
+  /** Heap allocations made by Update(). The simulation loop should
+not allocate once its buffers have grown to their working size, so
+any allocation after the warmup is a performance bug, unless it was
+made under an AllocationExempt. Only counted if
+libstage was built with the ALLOC_COUNT cmake option. */
+  class AllocationStats {
+  public:
+    uint64_t last; ///< allocations made by the most recent update
+    uint64_t max; ///< most allocations made by any update after the warmup
+    uint64_t updates; ///< number of updates after the warmup that allocated
+    uint64_t warmup; ///< number of initial updates to ignore
+    uint64_t exempt; ///< allocations after the warmup made under an AllocationExempt
+
+    AllocationStats() : last(0), max(0), updates(0), warmup(100), exempt(0) {}
+  };
+
+  /** Statistics of the model global pose cache, collected while
+profiling. */
+  class PoseCacheStats {
+  public:
+    uint64_t lookups; ///< calls of Model::GetGlobalPose()
+    uint64_t compositions; ///< poses composed to answer them
+    uint64_t saved; ///< compositions that would have been needed without the cache
+
+    PoseCacheStats() : lookups(0), compositions(0), saved(0) {}
+  };
+
+  /** Time spent in each phase of Update(), collected while
+profiling. Times are in nanoseconds. See also ModelProfile. */
+  class Profile {
+  public:
+    uint64_t updates; ///< calls of Update()
+    uint64_t update_time; ///< total time spent in Update()
+    uint64_t sort_time; ///< sorting the fiducial and comm models by position
+    uint64_t main_queue_time; ///< updating models in the main thread
+    uint64_t move_time; ///< moving models with a velocity
+    uint64_t barrier_time; ///< main thread waiting for the worker threads
+    uint64_t callback_time; ///< calling model and world update callbacks
+    uint64_t charge_time; ///< updating power packs
+    std::vector<uint64_t> worker_time; ///< time each worker thread spent updating models
+    std::vector<uint64_t> worker_events; ///< events handled from each thread's queue
+    /** Pose cache statistics of each thread, counted without
+sharing a counter between threads */
+    std::vector<PoseCacheStats> pose_cache;
+    uint64_t worker_window; ///< time from waking the workers until the last finished
+    uint64_t spawned; ///< models loaded by SpawnModels()
+    uint64_t respawned; ///< models SpawnModels() took from the pool instead
+    uint64_t despawned; ///< models put in the pool by DespawnModels()
+
+    Profile()
+        : updates(0), update_time(0), sort_time(0), main_queue_time(0), move_time(0), barrier_time(0),
+          callback_time(0), charge_time(0), worker_time(), worker_events(), pose_cache(),
+          worker_window(0),
+          spawned(0), respawned(0), despawned(0)
+    {
+    }
+  };
+
+  /** How a paced headless world handles updates that start late.
+PACE_CATCHUP keeps every deadline, so updates run back to back until
+the world is on time again and simulated time never falls behind.
+PACE_SKIP drops the missed deadlines, so the update rate never bursts
+but simulated time falls behind real time by the skipped updates. */
+  typedef enum { PACE_CATCHUP, PACE_SKIP } PacePolicy;
+
+  /** Where the simulation's threads run. AFFINITY_NONE leaves them to
+the scheduler. AFFINITY_PIN pins the main thread and each worker to
+one CPU of their own, while there are enough. AFFINITY_NUMA keeps all
+of them on the CPUs of one NUMA node, so that the memory they touch
+first is allocated on that node. */
+  typedef enum { AFFINITY_NONE, AFFINITY_PIN, AFFINITY_NUMA } ThreadAffinity;
+
+  /** Timing of the updates of a world paced by UpdateAll(). Lateness
+is how long after its deadline an update started, in nanoseconds. */
+  class PaceStats {
+  public:
+    uint64_t ticks; ///< paced updates
+    uint64_t late; ///< updates that started a whole period or more late
+    uint64_t skipped; ///< deadlines dropped by PACE_SKIP
+    uint64_t lateness_max; ///< greatest lateness
+    double lateness_sum; ///< sum of the latenesses
+    double lateness_sum_sq; ///< sum of the squared latenesses
+    uint64_t histogram[32]; ///< updates counted by lateness in microseconds, in power of two bins
+
+    PaceStats() { Clear(); }
+    void Clear();
+    /** Record the lateness of one update */
+    void Add(uint64_t lateness);
+    double Mean() const;
+    double StdDev() const;
+    /** An upper bound of the given fraction of the latenesses, from the histogram */
+    uint64_t Percentile(double fraction) const;
+  };
+
 private:
   static std::set<World *> world_set; ///< all the worlds that exist
   static bool quit_all; ///< quit all worlds ASAP
@@ -783,6 +980,12 @@ private:
 
   bool destroy;
   bool dirty; ///< iff true, a gui redraw would be required
+  /** Iff true, Model::Map() does nothing, so that models being
+loaded are mapped into the occupancy grid once, at the end */
+  bool map_deferred;
+  /** Iff true, Update() is running, and DespawnModels() waits for
+its end */
+  bool updating;
 
   /** Pointers to all the models in this world. */
   std::set<Model *> models;
@@ -793,6 +996,17 @@ private:
   /** pointers to the models that make up the world, indexed by worldfile entry index */
   std::map<int, Model *> models_by_wfentity;
 
+  /** Models taken out of the simulation by DespawnModels(), indexed by
+the worldfile entity they were loaded from */
+  std::map<int, std::vector<Model *> > model_pool;
+  /** Models DespawnModels() was asked for during the current update */
+  std::vector<Model *> despawns;
+
+  /** Deactivate mod and its children for the pool, adding them to pooled */
+  void PoolModel(Model *mod, std::set<Model *> &pooled);
+  /** Reactivate mod and its children from the pool */
+  void UnpoolModel(Model *mod);
+
   /** Keep a list of all models with detectable fiducials. This
 avoids searching the whole world for fiducials. */
   std::vector<Model *> models_with_fiducials;
@@ -805,13 +1019,13 @@ avoids searching the whole world for fiducials. */
     bool operator()(const Model *a, const Model *b) const;
   };
 
-  /** maintain a set of models with fiducials sorted by pose.x, for
+  /** maintain a vector of models with fiducials sorted by pose.x, for
 quickly finding nearby fidcucials */
-  std::set<Model *, ltx> models_with_fiducials_byx;
+  std::vector<Model *> models_with_fiducials_byx;
 
-  /** maintain a set of models with fiducials sorted by pose.y, for
+  /** maintain a vector of models with fiducials sorted by pose.y, for
 quickly finding nearby fidcucials */
-  std::set<Model *, lty> models_with_fiducials_byy;
+  std::vector<Model *> models_with_fiducials_byy;
 
   /** Add a model to the set of models with non-zero fiducials, if not already there. */
   void FiducialInsert(Model *mod)
@@ -822,6 +1036,33 @@ quickly finding nearby fidcucials */
 
   /** Remove a model from the set of models with non-zero fiducials, if it exists. */
   void FiducialErase(Model *mod) { EraseAll(mod, models_with_fiducials); }
+
+  /** Every radio, switched on or not, added when it is made */
+  std::vector<ModelComm *> comms;
+
+  /** An entry in the spatial index of the radios */
+  class CommEntry {
+  public:
+    int64_t cell; ///< key of the grid cell holding the radio
+    ModelComm *comm;
+    Pose pose; ///< global pose of the radio at the start of the update
+
+    bool operator<(const CommEntry &other) const;
+    /** compare an entry's cell with a key, for searching the index */
+    static bool CellBelow(const CommEntry &entry, int64_t key) { return entry.cell < key; }
+    static bool CellAbove(int64_t key, const CommEntry &entry) { return key < entry.cell; }
+  };
+
+  /** The radios sorted by grid cell, rebuilt at the start of each
+update so that a radio finds its neighbors among the 3x3 cells around
+it instead of testing every other radio. */
+  std::vector<CommEntry> comm_index;
+  meters_t comm_cell; ///< side of the index cells, the longest radio range
+
+  /** Put the queued messages on the air and rebuild the index */
+  void UpdateCommIndex();
+  /** The key of the index cell dx, dy cells away from the one holding x, y */
+  int64_t CommCell(meters_t x, meters_t y, int dx = 0, int dy = 0) const;
   /// Defines what all World::Load(*) methods have in common. Called after initial setup.
   void LoadWorldPostHook();
 
@@ -833,10 +1074,112 @@ quickly finding nearby fidcucials */
   //--- thread sync ----
   pthread_mutex_t sync_mutex; ///< protect the worker thread management stuff
   unsigned int threads_working; ///< the number of worker threads not yet finished
+  /** Counts the calls to StartWorkers(), so that a worker that was
+not yet waiting when the workers were woken still sees the task */
+  unsigned int workers_round;
+  /** What the workers do when woken */
+  typedef enum {
+    TASK_UPDATE, ///< consume their event queues
+    TASK_CALLBACKS ///< call thread-safe CB_UPDATE callbacks
+  } worker_task_t;
+  worker_task_t worker_task;
+
+  /** Wakes the worker threads to do the task */
+  void StartWorkers(worker_task_t task);
+  /** Blocks until every worker has finished its task */
+  void WaitForWorkers();
   pthread_cond_t threads_start_cond; ///< signalled to unblock worker threads
   pthread_cond_t threads_done_cond; ///< signalled by last worker thread to unblock main thread
   int total_subs; ///< the total number of subscriptions to all models
   unsigned int worker_threads; ///< the number of worker threads to use
+  unsigned int threads_override; ///< if non-zero, replaces the worldfile's threads property
+  bool threads_auto; ///< iff true, worker_threads is sized from the CPUs and the thread-safe models
+  ThreadAffinity thread_affinity; ///< where the threads run
+  std::vector<int> thread_cpus; ///< the CPUs the threads may use
+  std::vector<int> worker_cpus; ///< the CPU each thread, 0 for the main thread, is pinned to, or -1
+  uint64_t workers_started; ///< ProfileClock() time the workers were last woken, if profiling
+
+  /** Choose thread_cpus from the CPUs this process may use, the
+thread_cpus property and the NUMA node */
+  void ChooseThreadCpus();
+  /** The worker threads for threads "auto": one per spare CPU, but
+no more than there are thread-safe models to update */
+  unsigned int AutoWorkerThreads() const;
+  /** Reduce the worker threads to threads, moving the events of the
+dropped threads' queues to the queues that remain */
+  void FoldEventQueues(unsigned int threads);
+  /** Create the worker threads and apply thread_affinity */
+  void StartWorkerThreads();
+
+  unsigned int load_threads; ///< threads that load the world, 0 for one per CPU of thread_cpus
+  /** The number of threads to load the world with */
+  unsigned int LoadThreads() const;
+
+  /** The polygons of the worldfile's bitmaps, indexed by path, traced
+by PrefetchBitmaps() for BlockGroup::LoadBitmap() while the models
+load */
+  std::map<std::string, std::vector<std::vector<point_t> > > bitmap_polys;
+  /** Trace every bitmap named in the worldfile into bitmap_polys, in
+parallel */
+  void PrefetchBitmaps();
+
+  /** A cell crossed by the outline of a block, collected by MapModels() */
+  struct MapCell {
+    point_int_t sr; ///< the superregion
+    uint32_t offset; ///< region index << (2 * rbits) | cell index, within the superregion
+    uint32_t before[2]; ///< the entries placed in the cell ahead of this block, per layer
+    Block *block;
+    Cell *cell; ///< set when the block is placed
+
+    bool operator<(const MapCell &other) const;
+  };
+  struct MapJob;
+
+  /** Map mods, which must not be mapped yet, into both layers at once,
+as CalcSize() and Map() would one by one. Their blocks are sized and
+rasterized in parallel, then sorted by superregion and placed into
+each superregion in parallel, and the contacts between the blocks are
+added last. */
+  void MapModels(const std::vector<Model *> &mods);
+  /** Size mod's blocks and append the cells their outlines cross */
+  void RasterizeModel(Model *mod, std::vector<MapCell> &cells) const;
+  struct CollectCells;
+
+  /** Call visit(x, y) with the global coordinates of each cell crossed
+by the outline of the polygon, in order. MapPoly() and RasterizeModel()
+share it, so that MapModels() fills the same cells as Map(). */
+  template <class Visitor>
+  static void TraceOutline(const std::vector<point_int_t> &pts, Visitor &visit);
+  /** parallel_for() callbacks of MapModels() */
+  static void RasterizeJob(void *arg, size_t i);
+  static void PlaceJob(void *arg, size_t i);
+
+  double pace_speedup; ///< headless updates run this much faster than real time. <= 0 is unpaced
+  PacePolicy pace_policy; ///< what to do when updates fall behind their deadlines
+  uint64_t pace_deadline; ///< ProfileClock() time at which the next update should start. 0 if not started
+  PaceStats pace_stats; ///< lateness of the paced updates
+
+  LogWriter *logger; ///< writes the log file, if there is one
+  std::set<std::string> log_types; ///< model types logged unless their log property says otherwise
+
+  std::string shm_prefix; ///< models publish to shared memory named after this, if not empty
+  std::set<std::string> shm_types; ///< model types published unless their shm property says otherwise
+  uint32_t shm_slots; ///< frames in each model's ring
+  uint32_t shm_commands; ///< commands in each position model's ring
+  uint32_t shm_frame; ///< smallest size of a frame in bytes
+
+  LogTable *replay; ///< the log whose sensor data is replayed, if there is one
+  std::string replay_override; ///< if not empty, replaces the worldfile's replay_file property
+  meters_t replay_tolerance; ///< how far a model may be from its recorded pose
+  radians_t replay_angle_tolerance; ///< how far a model may be turned from its recorded pose
+  volatile int replay_diverged; ///< non-zero once any model left its recorded trajectory
+  usec_t replay_diverged_time; ///< when that happened
+  uint64_t replay_hits; ///< sensor updates taken from the log
+  uint64_t replay_misses; ///< sensor updates sensed live while replaying
+
+  /** Returns true if the model is within the tolerances of its
+recorded pose, or its pose was not recorded now */
+  bool ReplayOnTrack(Model *mod) const;
 
 protected:
   std::list<std::pair<world_callback_t, void *> >
@@ -852,6 +1195,52 @@ protected:
   std::list<float *> ray_list; ///< List of rays traced for debug visualization
   usec_t sim_time; ///< the current sim time in this world in microseconds
   std::map<point_int_t, SuperRegion *> superregions;
+  uint64_t superregions_destroyed; ///< count of superregions deleted, for CellsVersion()
+  RegionBits region_bits; ///< the shape of the occupancy grid
+
+  /** Trace random rays through the map with each of a range of region
+sizes, and keep the fastest. Called by Load() for region_bits "auto". */
+  void TuneRegionBits();
+
+  /** superregions unused for this long are compacted, or deleted if
+empty. Zero disables paging by age. */
+  usec_t superregion_idle_time;
+
+  /** if the superregions use more than this many bytes, the least
+recently used are compacted. Zero means no limit. */
+  size_t superregion_memory_budget;
+
+  /** Compact or delete superregions according to the idle time and
+memory budget. Called between updates. */
+  void PageSuperRegions();
+
+  /** Sleep until the deadline of the next update, if the world is
+paced, and record how late the update starts. */
+  void Pace();
+
+  /** If profiling, add the time since lap to total and start a new lap. */
+  void ProfileLap(uint64_t &lap, uint64_t &total)
+  {
+    if (profiling) {
+      const uint64_t now(ProfileClock());
+      total += now - lap;
+      lap = now;
+    }
+  }
+
+  /** Print how busy each worker thread was, as part of ProfileReport() */
+  void ProfileWorkerReport(FILE *fp, bool csv) const;
+  /** Print the models spawned and despawned, as part of ProfileReport() */
+  void ProfileChurnReport(FILE *fp, bool csv) const;
+
+  /** The pose cache statistics of the calling thread. Only for use
+while profiling. */
+  PoseCacheStats &ThreadPoseCacheStats();
+
+  AllocationStats alloc_stats; ///< heap allocations made by Update()
+
+  bool profiling; ///< iff true, collect profile data for the world and its models
+  Profile profile; ///< world profile data, collected while profiling
 
   uint64_t updates; ///< the number of simulated time steps executed so far
   Worldfile *wf; ///< If set, points to the worldfile used to create this world
@@ -883,9 +1272,72 @@ the end of a complete update step */
 AddUpdateCallback is not automatically freed. */
   int RemoveUpdateCallback(world_callback_t cb, void *user);
 
-  /** Log the state of a Model */
+  /** Record the state of a model in the log file, if the world has
+one. Called at the end of each model update, from the thread that
+updates the model. */
   void Log(Model *mod);
 
+  /** Return the writer of the log file, or NULL if the world is not
+logging */
+  LogWriter *GetLogger() const { return logger; }
+
+  /** Write out the rest of the log and close it. If report is not
+NULL, print the logger's counters on it. */
+  virtual void CloseLog(FILE *report = NULL);
+
+  /** Publish the state of a model to its shared memory segment,
+creating the segment on the first call. Called at the end of each
+model update, from the thread that updates the model. */
+  void Publish(Model *mod);
+
+  /** Replay the sensor data recorded in this log file, whatever the
+worldfile says. Must be called before Load(). */
+  void SetReplayFile(const std::string &filename) { replay_override = filename; }
+
+  /** Stop at this simulated time, whatever the worldfile's quit_time
+says. Zero runs forever. */
+  void SetQuitTime(usec_t t) { quit_time = t; }
+
+  /** Returns true if the world is replaying a log */
+  bool Replaying() const { return replay != NULL; }
+
+  /** If the world is replaying a log that holds the model's record
+of this kind for the current time, and no model has left its recorded
+trajectory, returns the record's values and sets count to their
+number. Otherwise returns NULL, and the sensor should sense live. */
+  const float *Replay(Model *mod, log_kind_t kind, uint16_t aux, uint32_t &count);
+
+  /** Check that the model is on its recorded trajectory. Once any
+model is not, the whole world senses live from then on. Called at the
+end of each model update. */
+  void ReplayCheck(Model *mod);
+
+  /** Print how many sensor updates were replayed on fp */
+  void ReplayReport(FILE *fp) const;
+
+  /** Return the global pose cache statistics accumulated so far,
+summed over the threads */
+  PoseCacheStats GetPoseCacheStats() const;
+
+  /** Start or stop collecting profile data. The profile is not
+cleared, so profiling can be paused and resumed. */
+  void EnableProfiling(bool enable) { profiling = enable; }
+  bool IsProfiling() const { return profiling; }
+  /** Clear the profile data of the world and all its models */
+  void ClearProfile();
+  const Profile &GetProfile() const { return profile; }
+  /** Print the profile data on fp, as a human readable report sorted
+by update time, or as CSV with one row per model, model type and
+update phase. The CSV is followed by sections of one row per worker
+thread and, if models were spawned or despawned, one row of their
+counts, each after a blank line and a header of its own. */
+  void ProfileReport(FILE *fp, bool csv) const;
+
+  const AllocationStats &GetAllocationStats() const { return alloc_stats; }
+  /** Set the number of initial updates whose allocations are not
+counted as steady-state allocations. */
+  void SetAllocationWarmup(uint64_t updates) { alloc_stats.warmup = updates; }
+
   /** hint that the world needs to be redrawn if a GUI is attached */
   void NeedRedraw() { dirty = true; }
   /** Special model for the floor of the world */
@@ -897,6 +1349,33 @@ time. */
 
   Model *CreateModel(Model *parent, const std::string &typestr);
 
+  /** Create a copy of prototype at each of poses, with the
+prototype's parent. Each copy is loaded from the prototype's
+worldfile entity, with its child models, blocks, sensors and
+controllers, just as the world loaded the prototype. The copies are
+mapped into the occupancy grid together at the end, and then their
+controllers are initialized. A copy is named after the prototype,
+followed by a colon and its id. Returns the new top-level models, in
+the order of poses, or nothing if the prototype was not loaded from
+a worldfile. */
+  std::vector<Model *> SpawnModels(Model *prototype, const std::vector<Pose> &poses);
+
+  /** Take each of mods, with its children, out of the simulation
+without deleting it. It is unmapped from the occupancy grid,
+unsubscribed, and removed from the event queues, the fiducial list
+and the model tree. It keeps its blocks, sensor buffers, callbacks
+and controllers, and waits in the world's pool until SpawnModels()
+is asked for a copy of a model loaded from the same worldfile entity,
+when it is put back with its subscriptions. Models not loaded from a
+worldfile are left alone. Call this from the main thread, between
+updates or from a CB_UPDATE callback that is not thread safe. Models
+despawned during an update finish it, and are despawned together at
+its end; between updates, despawning many models in one call is
+cheaper than one at a time. */
+  void DespawnModels(const std::vector<Model *> &mods);
+  /** Return the number of top-level models waiting in the pool */
+  size_t PooledModels() const;
+
   void LoadModel(Worldfile *wf, int entity);
   void LoadBlock(Worldfile *wf, int entity);
   void LoadBlockGroup(Worldfile *wf, int entity);
@@ -908,9 +1387,21 @@ the edges of the polygon.*/
   void MapPoly(const std::vector<point_int_t> &poly, Block *block, unsigned int layer);
 
   SuperRegion *AddSuperRegion(const point_int_t &coord);
-  SuperRegion *GetSuperRegion(const point_int_t &org);
+  SuperRegion *GetSuperRegion(const point_int_t &org)
+  {
+    std::map<point_int_t, SuperRegion *>::iterator it(superregions.find(org));
+    return (it == superregions.end() ? NULL : it->second);
+  }
   SuperRegion *GetSuperRegionCreate(const point_int_t &org);
 
+  /** The shape of the occupancy grid */
+  const RegionBits &GetRegionBits() const { return region_bits; }
+
+  /** Change the shape of the occupancy grid, remapping every model
+into the new one. Must not be called while the world is updating.
+Returns false, changing nothing, if the sizes are out of range. */
+  bool SetRegionBits(const RegionBits &bits);
+
   /** convert a distance in meters to a distance in world occupancy
 grid pixels */
   int32_t MetersToPixels(meters_t x) const { return (int32_t)floor(x * ppm); }
@@ -938,6 +1429,19 @@ grid pixels */
   /** trace a ray. */
   RaytraceResult Raytrace(const Ray &ray);
 
+  /** trace a ray, stopping at the first block for which the predicate
+object match(candidate, finder) returns true. The predicate is
+compiled into the inner loop, and ray.func is not used. Defined in
+raytrace.hh, which callers must include. */
+  template <class Match> RaytraceResult Raytrace(const Ray &ray, const Match &match);
+
+  /** trace rays evenly spaced over the field of view fov, centered on
+the heading of ray, one for each of the results. As above, defined in
+raytrace.hh. */
+  template <class Match>
+  void Raytrace(const Ray &ray, const radians_t fov, const Match &match,
+                std::vector<RaytraceResult> &results);
+
   RaytraceResult Raytrace(const Pose &pose, const meters_t range, const ray_test_func_t func,
                           const Model *finder, const void *arg, const bool ztest);
 
@@ -946,6 +1450,18 @@ grid pixels */
                 const Model *model, const void *arg, const bool ztest,
                 std::vector<RaytraceResult> &results);
 
+private:
+  /** The raytrace, with the predicate and the z test fixed at compile time */
+  template <class Match, bool ZTEST> RaytraceResult RaytraceCore(const Ray &ray, const Match &match);
+
+public:
+  /** Returns a number that changes whenever a block is added to or
+removed from the cells within range of pos, in the layer read by
+Raytrace() during this update. A sensor that gets the same number from
+the same pose during a later update of the same parity would trace the
+same results. */
+  uint64_t CellsVersion(const Pose &pos, meters_t range);
+
   /** Enlarge the bounding volume to include this point */
   inline void Extend(point3_t pt);
 
@@ -988,8 +1504,41 @@ should quit */
   /** Queue of pending simulation events for the main thread to handle. */
   std::vector<std::priority_queue<Event> > event_queues;
 
-  /** Queue of pending simulation events for the main thread to handle. */
-  std::vector<std::queue<Model *> > pending_update_callbacks;
+  /** Models with CB_UPDATE callbacks pending, one vector per
+thread. These are vectors rather than queues so that their
+storage is reused from one update to the next. */
+  std::vector<std::vector<Model *> > pending_update_callbacks;
+
+  /** Models with thread-safe CB_UPDATE callbacks pending, one vector
+per thread */
+  std::vector<std::vector<Model *> > pending_threadsafe_callbacks;
+
+  /** The models of pending_threadsafe_callbacks sorted by the root
+of their tree, and the index of the first model of each tree, with
+the size of threadsafe_callbacks at the end */
+  std::vector<Model *> threadsafe_callbacks;
+  std::vector<size_t> threadsafe_groups;
+  size_t threadsafe_next; ///< the next group to claim, atomically
+
+  /** Calls the thread-safe CB_UPDATE callbacks, in the worker threads
+if there are any. Returns the number of models whose callbacks were
+called. */
+  size_t CallThreadSafeCallbacks();
+
+  /** Claims groups of threadsafe_callbacks and calls them until none
+are left. Run by the main thread and the workers together. */
+  void RunThreadSafeCallbacks();
+
+  /** Calls a model's CB_UPDATE callbacks, profiling them if enabled */
+  void CallModelCallbacks(Model *mod, bool threadsafe);
+
+  /** Models whose contacts have changed since the last update, and
+the ones being reported, swapped with it */
+  std::vector<Model *> contacts_changed;
+  std::vector<Model *> contacts_reporting;
+
+  /** Calls CB_CONTACT on the models whose contacts have changed */
+  void ReportContacts();
 
   /** Create a new simulation event to be handled in the future.
 
@@ -1121,6 +1670,25 @@ nonexistent */
 
   /// Control printing time to stdout
   void ShowClock(bool enable) { show_clock = enable; }
+  /** Use this many worker threads, whatever the worldfile says. Must
+be called before Load(). Zero restores the worldfile setting. */
+  void SetWorkerThreads(unsigned int threads) { threads_override = threads; }
+  /** Return the number of worker threads, as chosen when loading */
+  unsigned int GetWorkerThreads() const { return worker_threads; }
+  ThreadAffinity GetThreadAffinity() const { return thread_affinity; }
+  /** Return the sum of the profiles of all models in the world */
+  ModelProfile GetModelProfileTotal() const;
+
+  /** Pace the updates made by UpdateAll() and Run() to run speedup
+times faster than real time, on a fixed schedule of absolute
+deadlines. A speedup <= 0 runs as fast as possible. A GUI world
+running its simulation thread is paced by its speedup property. */
+  void SetPacing(double speedup, PacePolicy policy);
+  double GetPaceSpeedup() const { return pace_speedup; }
+  PacePolicy GetPacePolicy() const { return pace_policy; }
+  const PaceStats &GetPaceStats() const { return pace_stats; }
+  /** Print the lateness statistics of the paced updates on fp */
+  void PaceReport(FILE *fp) const;
   /** Return the floor model */
   Model *GetGround() { return ground; }
 };
@@ -1132,6 +1700,7 @@ class Block {
   friend class World;
   friend class Canvas;
   friend class Cell;
+  friend class CellEntry;
 
 public:
   /** Block Constructor. A model's body is a list of these
@@ -1177,7 +1746,9 @@ after constructing the block.*/
   /** Set the extent in Z of the block */
   void SetZ(double min, double max);
 
-  void AppendTouchingModels(std::set<Model *> &touchers);
+  /** Append the models that share a bitmap cell with this block. A
+model may be appended more than once. */
+  void AppendTouchingModels(std::vector<Model *> &touchers);
 
   /** Returns the first model that shares a bitmap cell with this model */
   Model *TestCollision();
@@ -1198,6 +1769,10 @@ can remove them very quickly. One vector for each of the two
 bitmap layers.*/
   std::vector<Cell *> rendered_cells[2];
 
+  /** Compacted superregions that hold some of this block's cells. These
+are paged back in before the block's cells are used or removed. */
+  std::vector<SuperRegion *> paged_superregions;
+
   void DrawTop();
   void DrawSides();
 };
@@ -1221,7 +1796,7 @@ private:
   void CalcSize();
   void Clear(); /** deletes all blocks from the group */
 
-  void AppendTouchingModels(std::set<Model *> &touchers);
+  void AppendTouchingModels(std::vector<Model *> &touchers);
 
   /** Returns a pointer to the first model detected to be colliding
 with a block in this group, or NULL, if none are detected. */
@@ -1236,6 +1811,9 @@ with a block in this group, or NULL, if none are detected. */
 as blocks to this group.*/
   void LoadBitmap(const std::string &bitmapfile, Worldfile *wf);
 
+  /** The path of a bitmap named in wf, which is relative to wf's directory */
+  static std::string BitmapPath(const std::string &bitmapfile, Worldfile *wf);
+
   /** Add a new block decribed by a worldfile entry. */
   void LoadBlock(Worldfile *wf, int entity);
 
@@ -1455,6 +2033,25 @@ updates. */
   /** Number of updates between measuring elapsed real time. */
   uint64_t timing_interval;
 
+  /** If true, the simulation runs on its own thread instead of in
+FLTK timeouts, so slow frames do not stall it. */
+  bool sim_threaded;
+  bool sim_thread_started; ///< true once sim_thread has been created
+  pthread_t sim_thread; ///< runs SimThreadLoop() if sim_threaded
+  /** Held by the simulation thread while it updates the world, and
+by the GUI while it draws or changes the world. Recursive, since FLTK
+can draw from inside GUI callbacks that already hold it. */
+  pthread_mutex_t sim_mutex;
+  /** Signalled by Unlock(), to wake the simulation thread when it is
+paused or waiting for the GUI to finish with the world. */
+  pthread_cond_t sim_cond;
+  /** The number of GUI callers waiting for sim_mutex. Between updates
+the simulation thread waits on sim_cond while this is non-zero. */
+  volatile int gui_waiting;
+
+  static void *SimThreadEntry(WorldGui *wg);
+  void SimThreadLoop();
+
   // static callback functions
   static void windowCb(Fl_Widget *w, WorldGui *wg);
   static void fileLoadCb(Fl_Widget *w, WorldGui *wg);
@@ -1524,6 +2121,15 @@ public:
   std::string EnergyString(void) const;
   virtual void RemoveChild(Model *mod);
 
+  /** Stop the simulation thread from updating the world until
+Unlock(). Calls may nest. */
+  void Lock();
+  void Unlock();
+
+  /** Closes the log while holding the world, as the simulation
+thread may be updating it */
+  virtual void CloseLog(FILE *report = NULL);
+
   bool IsTopView();
 };
 
@@ -1660,6 +2266,7 @@ class Model : public Ancestor {
   friend class PowerPack;
   friend class Ray;
   friend class ModelFiducial;
+  friend class Cell;
 
 private:
   /** the number of models instatiated - used to assign unique sequential IDs */
@@ -1682,17 +2289,33 @@ always runs. Defaults to false. */
 forming a solid boundary around the bounding box of the model. */
   int boundary;
 
+public:
+  /** Another model whose blocks share cells with this model's blocks */
+  class Contact {
+  public:
+    Model *mod;
+    uint32_t overlaps; ///< pairs of blocks that share a cell
+
+    Contact(Model *mod, uint32_t overlaps) : mod(mod), overlaps(overlaps) {}
+  };
+
   /** container for a callback function and a single argument, so
 they can be stored together in a list with a single pointer. */
-public:
   class cb_t {
   public:
     model_callback_t callback;
     void *arg;
+    /** Iff true, the callback may be called in a worker thread, in
+parallel with the callbacks of other model trees. Not part of the
+ordering. */
+    bool threadsafe;
 
-    cb_t(model_callback_t cb, void *arg) : callback(cb), arg(arg) {}
-    cb_t(world_callback_t cb, void *arg) : callback(NULL), arg(arg) { (void)cb; }
-    cb_t() : callback(NULL), arg(NULL) {}
+    cb_t(model_callback_t cb, void *arg, bool threadsafe = false)
+        : callback(cb), arg(arg), threadsafe(threadsafe)
+    {
+    }
+    cb_t(world_callback_t cb, void *arg) : callback(NULL), arg(arg), threadsafe(false) { (void)cb; }
+    cb_t() : callback(NULL), arg(NULL), threadsafe(false) {}
     /** for placing in a sorted container */
     bool operator<(const cb_t &other) const
     {
@@ -1727,6 +2350,7 @@ creating the quadric for each flag */
   };
 
   typedef enum {
+    CB_CONTACT, ///< the set of models in GetContacts() has changed
     CB_FLAGDECR,
     CB_FLAGINCR,
     CB_GEOM,
@@ -1795,7 +2419,7 @@ offset of its local coordinate system wrt that its parent. */
   usec_t interval; ///< time between updates in usec
   usec_t interval_energy; ///< time between updates of powerpack in usec
   usec_t last_update; ///< time of last update in us
-  bool log_state; ///< iff true, model state is logged
+  uint32_t log_kinds; ///< mask of the log_kind_t recorded in the world's log at each update
   meters_t map_resolution;
   kg_t mass;
 
@@ -1806,12 +2430,54 @@ offset of its local coordinate system wrt that its parent. */
 global coordinate frame is the parent is NULL. */
   Pose pose;
 
+  /** Cached result of GetGlobalPose(). Valid iff
+global_pose_version equals pose_version. */
+  mutable Pose global_pose;
+
+  /** Incremented whenever our global pose may have changed, ie. when
+the pose of this model or any ancestor changes, or the model is
+moved to a new parent. */
+  uint64_t pose_version;
+
+  /** The pose_version at which global_pose was computed. */
+  mutable uint64_t global_pose_version;
+
+  /** Mark the cached global pose of this model and all its
+descendants out of date. Must be called after changing pose directly. */
+  void InvalidateGlobalPose();
+
+  /** GetGlobalPose() without the instrumentation. */
+  const Pose &CachedGlobalPose() const;
+
   /** Optional attached PowerPack, defaults to NULL */
   PowerPack *power_pack;
 
   /** list of powerpacks that this model is currently charging,
 initially NULL. */
-  std::list<PowerPack *> pps_charging;
+  std::vector<PowerPack *> pps_charging;
+
+  /** Scratch buffer for the models touching a charger, kept between
+updates to avoid reallocating it every time. */
+  std::vector<Model *> touchers;
+
+  /** The contact graph: for each layer, the models of other trees
+whose blocks share cells with this model's blocks. Kept up to date
+by Cell::AddBlock() and Cell::RemoveBlock(). */
+  std::vector<Contact> contacts[2];
+
+  /** The contacts when CB_CONTACT was last considered */
+  std::vector<Model *> contacts_reported;
+
+  /** Iff true, this model is in World::contacts_changed */
+  bool contacts_changed;
+
+  /** Adds overlaps, which may be negative, to the contact with other
+in the layer */
+  void Touch(Model *other, unsigned int layer, int overlaps);
+
+  /** Scratch buffer for block vertices in bitmap coordinates, used
+when mapping. */
+  std::vector<point_int_t> pixels;
 
   /** Visualize the most recent rasterization operation performed by this model */
   class RasterVis : public Visualizer {
@@ -1840,6 +2506,9 @@ initially NULL. */
   bool rebuild_displaylist; ///< iff true, regenerate block display list before redraw
   std::string say_string; ///< if non-empty, this string is displayed in the GUI
 
+  ShmPublisher *shm; ///< publishes the model's state to other processes, if it has shm_kinds
+  uint32_t shm_kinds; ///< mask of the log_kind_t published in shared memory at each update
+
   bool stack_children; ///< whether child models should be stacked on top of this model or not
 
   bool stall; ///< Set to true iff the model collided with something else
@@ -1850,6 +2519,19 @@ safety. Derived classes can set it true in their constructor to
 allow parallel Updates(). */
   bool thread_safe;
 
+  /** Iff true, the CB_UPDATE callbacks that this model's controllers
+add while they initialize are thread safe (see AddCallback()). Set
+by the ctrl_threadsafe worldfile property. */
+  bool ctrl_threadsafe;
+
+  /** The number of this model's CB_UPDATE callbacks that are thread
+safe */
+  unsigned int threadsafe_update_callbacks;
+
+  /** Set while the controllers of a model with ctrl_threadsafe
+initialize, so that the callbacks they add are thread safe */
+  static bool init_threadsafe;
+
   /** Cache of recent poses, used to draw the trail. */
   class TrailItem {
   public:
@@ -1885,6 +2567,9 @@ allow parallel Updates(). */
 -1, to indicate that it is not on a list yet. */
   unsigned int event_queue_num;
   bool used; ///< TRUE iff this model has been returned by GetUnusedModelOfType()
+  bool spawned; ///< TRUE iff this model was created by World::SpawnModels()
+  bool pooled; ///< TRUE iff this model is waiting in the world's pool
+  int pooled_subs; ///< the subscriptions this model had when it was pooled
 
   watts_t watts; ///< power consumed by this model
 
@@ -1914,6 +2599,9 @@ public:
   }
 
   const std::string &GetModelType() const { return type; }
+  /** Returns true if this model is a copy made by World::SpawnModels(),
+which shares its worldfile entity with the model it was copied from */
+  bool IsSpawned() const { return spawned; }
   std::string GetSayString() { return std::string(say_string); }
   /** Returns a pointer to the model identified by name, or NULL if
 it doesn't exist in this model. */
@@ -1936,6 +2624,21 @@ it doesn't exist in this model. */
     void Save(Worldfile *wf, int wf_entity);
   } vis;
 
+  /** Bits summarizing vis, copied into the occupancy grid with each
+      block so that the raytrace can skip blocks without reading their
+      models. Change vis through the Set*Return() methods, which keep
+      the copies up to date. */
+  enum {
+    VIS_OBSTACLE = 1, ///< obstacle_return is set
+    VIS_RANGER = 2, ///< ranger_return is not negative
+    VIS_BLOB = 4, ///< blob_return is set
+    VIS_GRIPPER = 8, ///< gripper_return is set
+    VIS_FIDUCIAL = 16 ///< fiducial_return is not zero
+  };
+
+  /** Return the VIS_* bits of vis */
+  uint32_t VisBits() const;
+
   usec_t GetUpdateInterval() const { return interval; }
   usec_t GetEnergyInterval() const { return interval_energy; }
   //    usec_t GetPoseInterval() const { return interval_pose; }
@@ -1949,6 +2652,9 @@ preallocated array of width by height pixels */
 obstacles.  Returns true if a collision is detected but does not
 update the stall state, and false otherwise. */
   bool HasCollision() { return TestCollision() != NULL; }
+
+  /** Return the profile collected for this model so far */
+  const ModelProfile &GetProfile() const { return profile; }
 private:
   /** Private copy constructor declared but not defined, to make it
 impossible to copy models. */
@@ -1958,11 +2664,29 @@ impossible to copy models. */
 impossible to copy models */
   Model &operator=(const Model &original);
 
+  /** Copy the VisBits() into the occupancy grid entries of this
+model's blocks, after vis has changed */
+  void RefreshVis();
+
 protected:
+  /** Profile data, collected only while the world is profiling. Mutable so
+that const raytracing can count rays. */
+  mutable ModelProfile profile;
+
   /** Register an Option for pickup by the GUI. */
   void RegisterOption(Option *opt);
 
-  void AppendTouchingModels(std::set<Model *> &touchers);
+  /** Returns the models of other trees whose blocks share cells with
+this model's blocks, each once, in the occupancy layer that moving
+models map into during the current update. Does not include the
+contacts of the model's children. */
+  const std::vector<Contact> &GetContacts() const
+  {
+    return contacts[world->UpdateCount() % 2];
+  }
+
+  /** Appends the models in GetContacts() to touchers */
+  void AppendTouchingModels(std::vector<Model *> &touchers);
 
   /** Check to see if the current pose will yield a collision with
 obstacles.  Returns a pointer to the first entity we are in
@@ -2012,16 +2736,45 @@ by pose, in local coords */
     return world->Raytrace(LocalToGlobal(pose), range, fov, func, this, arg, ztest, results);
   }
 
+  /** as above, with a predicate object instead of a function, see
+World::Raytrace(const Ray&, const Match&) */
+  template <class Match>
+  RaytraceResult Raytrace(const Pose &pose, const meters_t range, const Match &match,
+                          const bool ztest)
+  {
+    return world->Raytrace(Ray(this, LocalToGlobal(pose), range, NULL, NULL, ztest), match);
+  }
+
+  template <class Match>
+  void Raytrace(const Pose &pose, const meters_t range, const radians_t fov, const Match &match,
+                const bool ztest, std::vector<RaytraceResult> &results)
+  {
+    world->Raytrace(Ray(this, LocalToGlobal(pose), range, NULL, NULL, ztest), fov, match,
+                    results);
+  }
+
   virtual void UpdateCharge();
 
+  /** Record the given kinds of state in the log, or another sink, as
+the given thread. Subclasses that have sensor data to log extend
+this. */
+  virtual void LogState(RecordSink &log, unsigned int thread, uint32_t kinds);
+
   static int UpdateWrapper(Model *mod, void *)
   {
-    mod->Update();
+    if (mod->world->profiling) {
+      const uint64_t start(ProfileClock());
+      mod->Update();
+      mod->profile.update_time += ProfileClock() - start;
+      ++mod->profile.updates;
+    } else
+      mod->Update();
     return 0;
   }
 
-  /** Calls CallCallback( CB_UPDATE ) */
-  void CallUpdateCallbacks(void);
+  /** Calls the CB_UPDATE callbacks that are thread safe, or those
+that are not, removing any that return true */
+  void CallUpdateCallbacks(bool threadsafe);
 
   meters_t ModelHeight() const;
 
@@ -2088,7 +2841,13 @@ public:
   /** Return a human-readable string describing the model's pose */
   std::string PoseString() { return pose.String(); }
   /** Look up a model pointer by a unique model ID */
-  static Model *LookupId(uint32_t id) { return modelsbyid[id]; }
+  static Model *LookupId(uint32_t id)
+  {
+    // find() rather than [], so that sensors may call this from
+    // worker threads
+    const std::map<id_t, Model *>::const_iterator it(modelsbyid.find(id));
+    return it == modelsbyid.end() ? NULL : it->second;
+  }
   /** Constructor */
   Model(World *world, Model *parent = NULL, const std::string &type = "model",
         const std::string &name = "");
@@ -2100,10 +2859,12 @@ public:
   Model()
       : mapped(false), alwayson(false), blockgroup(*this), boundary(false), data_fresh(false),
         disabled(true), friction(0), has_default_block(false), id(0), interval(0),
-        interval_energy(0), last_update(0), log_state(false), map_resolution(0), mass(0),
-        parent(NULL), power_pack(NULL), rebuild_displaylist(false), stack_children(true),
-        stall(false), subs(0), thread_safe(false), trail_index(0), event_queue_num(0), used(false),
-        watts(0), watts_give(0), watts_take(0), wf(NULL), wf_entity(0), world(NULL), world_gui(NULL)
+        interval_energy(0), last_update(0), log_kinds(0), map_resolution(0), mass(0),
+        parent(NULL), global_pose(), pose_version(1), global_pose_version(0), power_pack(NULL),
+        rebuild_displaylist(false), shm(NULL), shm_kinds(0), stack_children(true),
+        stall(false), subs(0), thread_safe(false), ctrl_threadsafe(false),
+        threadsafe_update_callbacks(0), trail_index(0), event_queue_num(0), used(false),
+        spawned(false), pooled(false), pooled_subs(0), watts(0), watts_give(0), watts_take(0), wf(NULL), wf_entity(0), world(NULL), world_gui(NULL)
   {
   }
 
@@ -2233,6 +2994,9 @@ matching key can detect this model as a fiducial. */
   Color GetColor() const { return color; }
   /** return a model's unique process-wide identifier */
   uint32_t GetId() const { return id; }
+  /** TRUE iff the model is waiting in the world's pool, out of the
+simulation until SpawnModels() reuses it */
+  bool IsPooled() const { return pooled; }
   /** Get the total mass of a model and it's children recursively */
   kg_t GetTotalMass() const;
 
@@ -2277,9 +3041,22 @@ indicated model method is called, and passed the user
 data.  @param cb Pointer the function to be called.  @param
 user Pointer to arbitrary user data, passed to the callback
 when called.
+
+A callback added by a controller while it initializes is thread safe
+if the model that loaded the controller has ctrl_threadsafe set.
   */
   void AddCallback(callback_type_t type, model_callback_t cb, void *user);
 
+  /** As AddCallback() above. A CB_UPDATE callback that is threadsafe
+is called in a worker thread, in parallel with the callbacks of other
+model trees, but in series with those of its own tree (the models
+that share its Root()). It must not touch other trees, change the
+world, or call the GUI. Speeds it sets with
+ModelPosition::SetSpeed() take effect at the position's next
+update, as they always do.
+  */
+  void AddCallback(callback_type_t type, model_callback_t cb, void *user, bool threadsafe);
+
   int RemoveCallback(callback_type_t type, model_callback_t callback);
 
   int CallCallbacks(callback_type_t type);
@@ -2297,6 +3074,9 @@ pose specified in the model's local coordinate system */
   /** Return a vector of global pixels corresponding to a vector of local points. */
   std::vector<point_int_t> LocalToPixels(const std::vector<point_t> &local) const;
 
+  /** As LocalToPixels(), but fills the caller's vector to avoid an allocation. */
+  void LocalToPixels(const std::vector<point_t> &local, std::vector<point_int_t> &pixels) const;
+
   /** Return the 2d point in world coordinates of a 2d point
 specified in the model's local coordinate system */
   point_t LocalToGlobal(const point_t &pt) const;
@@ -2355,6 +3135,10 @@ AddColor() and RemoveColor()
 to add and remove colors at run time.*/
   std::vector<Color> colors;
 
+  /** Scratch buffer for the raw scan, kept between updates to avoid
+reallocating it every time. */
+  std::vector<RaytraceResult> samples;
+
   /// Predicate for ray tracing
   static bool BlockMatcher(Block *testblock, Model *finder);
 
@@ -2375,6 +3159,7 @@ public:
   virtual void Shutdown();
   virtual void Update();
   virtual void Load();
+  virtual void LogState(RecordSink &log, unsigned int thread, uint32_t kinds);
 
   /** Returns a non-mutable const reference to the detected blob
 data. Use this if you don't need to modify the model's
@@ -2570,6 +3355,7 @@ private:
   void AddModelIfVisible(Model *him);
 
   virtual void Update();
+  virtual void LogState(RecordSink &log, unsigned int thread, uint32_t kinds);
   virtual void DataVisualize(Camera *cam);
 
   static Option showData;
@@ -2577,6 +3363,10 @@ private:
 
   std::vector<Fiducial> fiducials;
 
+  /** Scratch buffers for finding nearby fiducials, kept between
+updates to avoid reallocating them every time. */
+  std::vector<Model *> horiz, vert, nearby;
+
 public:
   ModelFiducial(World *world, Model *parent, const std::string &type);
   virtual ~ModelFiducial();
@@ -2604,6 +3394,119 @@ public:
   }
 };
 
+// COMM MODEL --------------------------------------------------------
+
+/// %ModelComm class
+class ModelComm : public Model {
+  friend class World; // puts the messages on the air
+
+public:
+  /** A message between radios */
+  class Message {
+  public:
+    uint32_t from; ///< id of the sending model
+    uint32_t to; ///< id of the receiving model, or BROADCAST
+    usec_t time; ///< simulation time at which the message went on the air
+    std::string data;
+  };
+
+  /** A radio in range and, if line of sight is needed, in sight */
+  class Neighbor {
+  public:
+    ModelComm *comm;
+    meters_t range; ///< distance to the neighbor
+    radians_t bearing; ///< bearing to the neighbor, relative to this model
+  };
+
+  /** The destination of a message for every neighbor */
+  static const uint32_t BROADCAST = 0xFFFFFFFF;
+
+private:
+  /** A FIFO of messages that keeps its slots, and the strings of the
+messages they held, for reuse, so that radios exchanging messages at a
+steady rate do not allocate */
+  class MessageQueue {
+  public:
+    MessageQueue() : slots(), head(0), count(0) {}
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    void clear() { head = count = 0; }
+
+    /** The i'th oldest message */
+    Message &operator[](size_t i) { return slots[(head + i) % slots.size()]; }
+    const Message &operator[](size_t i) const { return slots[(head + i) % slots.size()]; }
+    Message &front() { return (*this)[0]; }
+    void pop_front()
+    {
+      head = (head + 1) % slots.size();
+      --count;
+    }
+    /** Append a slot and return it. It holds an old message, which the
+caller overwrites. */
+    Message &push_back();
+    /** Make room for n messages without growing again */
+    void reserve(size_t n);
+
+  private:
+    std::vector<Message> slots;
+    size_t head; ///< slot of the oldest message
+    size_t count; ///< messages held
+  };
+
+  virtual void Update();
+  virtual void Startup();
+  virtual void Shutdown();
+  virtual void DataVisualize(Camera *cam);
+
+  static Option showLinks;
+
+  /** Record the pose of the radio for the index, put the messages
+sent since the last update on the air, and forget the ones that every
+radio has had the chance to receive */
+  void Transmit(usec_t now, usec_t window);
+  /** Is there a clear line of sight from here to a neighbor? */
+  bool InSight(ModelComm *him, const Pose &to, meters_t dist) const;
+  /** Leave the list of radios, the index and the neighbor lists of the
+other radios, when the radio is destroyed in the main thread */
+  void Disconnect();
+
+  MessageQueue outbox; ///< sent since the last update
+  MessageQueue on_air; ///< sent recently, oldest first
+  MessageQueue inbox; ///< received and not yet read, oldest first
+  std::vector<Neighbor> neighbors;
+  std::vector<const Message *> received; ///< scratch for sorting new messages
+  Pose air_pose; ///< global pose when the index was built
+  usec_t air_time; ///< time the index was built with this radio in it
+  usec_t last_receive; ///< time of the last update that received messages
+  uint64_t dropped; ///< messages lost from a full inbox
+
+public:
+  ModelComm(World *world, Model *parent, const std::string &type);
+  virtual ~ModelComm();
+
+  virtual void Load();
+
+  meters_t range; ///< maximum link range
+  bool los; ///< links need a clear line of sight
+  unsigned int inbox_size; ///< most messages held in the inbox
+
+  /** Send a message to the radio with model id to, delivered in the
+next update if it is then a neighbor */
+  void Send(uint32_t to, const std::string &data);
+  /** Send a message to every neighbor */
+  void Broadcast(const std::string &data) { Send(BROADCAST, data); }
+  /** Take the oldest received message. Returns false if there is none. */
+  bool Receive(Message &msg);
+  /** The number of received messages waiting to be read */
+  size_t Pending() const { return inbox.size(); }
+  /** The number of messages lost because the inbox was full */
+  uint64_t Dropped() const { return dropped; }
+
+  /** The radios that could be reached at the last update */
+  const std::vector<Neighbor> &GetNeighbors() const { return neighbors; }
+};
+
 // RANGER MODEL --------------------------------------------------------
 
 /// %ModelRanger class
@@ -2623,6 +3526,11 @@ public:
     static Option showBeams;
     static Option showTransducers;
 
+    /** The vertices of the sensor being drawn: the sensor origin
+followed by one point per sample. Reused by every sensor so that each
+is sent to OpenGL as one array per frame. */
+    std::vector<GLfloat> verts;
+
     explicit Vis(World *world);
     virtual ~Vis(void) {}
     virtual void Visualize(Model *mod, Camera *cam);
@@ -2644,14 +3552,37 @@ public:
     std::vector<double> intensities;
     std::vector<double> bearings;
 
+    /** A noise-free scan, kept so that a sensor that has not moved,
+in surroundings that have not changed, need not trace it again. */
+    class Scan {
+    public:
+      bool valid;
+      Pose origin; ///< global pose of the first ray
+      meters_t range; ///< maximum range of the rays
+      radians_t fov;
+      uint64_t version; ///< World::CellsVersion() when traced
+      std::vector<meters_t> ranges;
+      std::vector<double> intensities;
+
+      Scan() : valid(false), origin(), range(0), fov(0), version(0), ranges(), intensities() {}
+    };
+
+    /** The last scan traced in updates of each parity, which read
+different bitmap layers */
+    Scan scans[2];
+
     Sensor()
         : pose(0, 0, 0, 0), size(0.02, 0.02, 0.02), // teeny transducer
           range(0.0, 5.0), fov(0.1), angle_noise(0.0), range_noise(0.0), range_noise_const(0.0),
-          sample_count(1), color(Color(0, 0, 1, 0.15)), ranges(), intensities(), bearings()
+          sample_count(1), color(Color(0, 0, 1, 0.15)), ranges(), intensities(), bearings(),
+          scans()
     {
     }
 
     void Update(ModelRanger *rgr);
+    /** Take the ranges and intensities from a LOG_RANGER record
+instead of raytracing them */
+    void Replay(const float *values);
     void Visualize(Vis *vis, ModelRanger *rgr) const;
     std::string String() const;
     void Load(Worldfile *wf, int entity);
@@ -2670,6 +3601,7 @@ protected:
   virtual void Startup();
   virtual void Shutdown();
   virtual void Update();
+  virtual void LogState(RecordSink &log, unsigned int thread, uint32_t kinds);
 };
 
 // BLINKENLIGHT MODEL ----------------------------------------------------
@@ -2884,6 +3816,11 @@ protected:
   virtual void Shutdown();
   virtual void Update();
   virtual void Load();
+  virtual void LogState(RecordSink &log, unsigned int thread, uint32_t kinds);
+
+  /** Apply the commands that other processes have queued in the
+model's shared memory segment, in order */
+  void ApplyCommands();
 };
 
 // ACTUATOR MODEL --------------------------------------------------------
@@ -2939,6 +3876,61 @@ the goal pose */
   point3_t GetAxis() const { return axis; }
 };
 
+// CONTROL SERVER --------------------------------------------------------
+
+/** Serves the control protocol of control.hh on a Unix domain socket,
+    so that another process can step a world and get and set the state
+    of its models. Clients are served one at a time, in the thread that
+    calls Serve(), which also updates the world. */
+class ControlServer {
+public:
+  /** Listens on a socket at path, replacing any file there */
+  ControlServer(World *world, const std::string &path);
+  /** Stops listening and removes the socket */
+  ~ControlServer();
+
+  /** Returns true if the server is listening */
+  bool Ok() const { return listener >= 0; }
+
+  /** Serves clients until one sends OP_QUIT */
+  void Serve();
+
+private:
+  /** The state of one model at a checkpoint. The model is kept by id
+      and looked up at reset, as it may have been deleted or pooled. */
+  class ModelState {
+  public:
+    uint32_t id; ///< Model::GetId()
+    Pose pose; ///< local pose
+    Velocity velocity; ///< for position models
+    Pose odom; ///< for position models
+
+    ModelState() : id(0), pose(), velocity(), odom() {}
+  };
+
+  World *world;
+  std::string path;
+  int listener;
+  bool quit; ///< set by OP_QUIT
+  std::vector<std::vector<ModelState> > checkpoints;
+  std::vector<char> in; ///< received bytes
+  std::vector<char> out; ///< responses not yet sent
+
+  /** Serves one client until it disconnects or sends OP_QUIT */
+  void ServeClient(int fd);
+
+  /** Answers one request, appending the response to out */
+  void Handle(uint32_t op, const char *payload, uint32_t length);
+
+  /** Appends a response header and reserves length bytes of payload,
+      returning where to write them */
+  char *Respond(uint32_t op, uint32_t status, uint32_t length);
+
+  /** Looks up the models of a request's uint32 count and ids, or
+      returns a status_t other than STATUS_OK */
+  uint32_t ReadModels(const char *payload, uint32_t length, std::vector<Model *> &models);
+};
+
 } // end namespace stg
 
 #endif
@@ -23,9 +23,11 @@ void Stg::RegisterModels()
   Register("blobfinder", Creator<ModelBlobfinder>);
   Register("bumper", Creator<ModelBumper>);
   Register("camera", Creator<ModelCamera>);
+  Register("comm", Creator<ModelComm>);
   Register("fiducial", Creator<ModelFiducial>);
   Register("gripper", Creator<ModelGripper>);
   Register("lightindicator", Creator<ModelLightIndicator>);
   Register("position", Creator<ModelPosition>);
   Register("ranger", Creator<ModelRanger>);
+  Register("wifi", Creator<ModelComm>); // worldfiles written for the old wifi model
 }
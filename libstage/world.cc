@@ -24,6 +24,33 @@
     show_clock                0
     show_clock_interval     100
     threads                   1
+    thread_affinity           "none"
+    thread_cpus               [ ]
+    thread_numa_node          -1
+    load_threads              0
+
+    region_bits               [ 5 5 ]
+    superregion_idle_time     0
+    superregion_memory_budget 0
+
+    headless_speedup          0
+    headless_pacing           "catchup"
+
+    log_file                  ""
+    log_types                 [ ]
+    log_compress              1
+    log_chunk                 256
+    log_buffers               4
+
+    shm_prefix                ""
+    shm_types                 [ ]
+    shm_slots                 4
+    shm_commands              16
+    shm_frame                 4
+
+    replay_file               ""
+    replay_tolerance          0.01
+    replay_angle_tolerance    1.0
 
     @endverbatim
 
@@ -68,8 +95,152 @@
     depending on the number of CPU cores available and the
     worldfile. As a guideline, use one thread per core if you have
     parallel-enabled high-resolution models, e.g. a laser with
-    hundreds or thousands of samples, or lots of models. Defaults to
-    1. Values of less than 1 will be forced to 1.
+    hundreds or thousands of samples, or lots of models. The workers
+    also call the controllers of models with ctrl_threadsafe set.
+    Defaults to 1. Values of less than 1 will be forced to 1. "auto"
+    uses one thread for each CPU left over by the main thread, but no
+    more threads than there are models that can be updated in
+    parallel. The profile report shows how busy each thread was.
+
+    - thread_affinity <string>\n
+    Where the threads run. "none" (the default) leaves them to the
+    operating system. "pin" pins the main thread and each worker to a
+    CPU of its own, so that simulations sharing a machine do not
+    disturb each other's caches. "numa" keeps all the threads on the
+    CPUs of one NUMA node, so that the memory of the simulation is
+    allocated on that node. Linux only.
+
+    - thread_cpus [ <int> ... ]\n
+    The CPUs the threads may use, e.g. [ 4 5 6 7 ] to run several
+    simulations on one machine side by side with "pin". Empty (the
+    default) for all the CPUs Stage may run on. threads "auto" counts
+    only these CPUs.
+
+    - thread_numa_node <int>\n
+    The NUMA node used by thread_affinity "numa". -1 (the default)
+    for the node Stage was started on.
+
+    - load_threads <int>\n
+    The threads that trace the polygons of the bitmaps and map the
+    models into the occupancy grid while the world loads. 0 (the
+    default) for one per CPU of thread_cpus, 1 to load serially.
+
+    - region_bits [ <int> <int> ] or "auto"\n
+    The shape of the occupancy grid that rays are traced through. Its
+    cells are grouped in square regions 2^r cells wide, which are
+    grouped in superregions 2^s regions wide, for region_bits [ r s ].
+    Rays skip empty regions in one step, so small regions suit open
+    worlds and large ones cluttered worlds. r and s are from 2 to 8,
+    and r + s at most 15. "auto" traces random rays through the
+    loaded map with regions of 8 to 128 cells and superregions of 256
+    to 4096 cells, and keeps the fastest shape.
+
+    - superregion_idle_time <float>\n
+    The occupancy grid is stored in superregions, by default each
+    covering 1024x1024 cells. Superregions that have not been raytraced or
+    mapped into for this many simulated seconds are compacted into a
+    run-length encoded form that uses far less memory, or deleted if
+    empty. They are expanded again transparently when next used. Useful
+    for very large maps of which the robots only visit a small part.
+    Zero (the default) disables compaction by age.
+
+    - superregion_memory_budget <float>\n
+    Approximate limit on the memory used by the occupancy grid, in
+    megabytes. When it is exceeded, the least recently used
+    superregions are compacted until usage falls below the limit.
+    Superregions used in the current update are never compacted. Zero
+    (the default) means no limit.
+
+    - headless_speedup <float>\n
+    Without a GUI, run the simulation this many times faster than real
+    time, e.g. 1 for real time when running against hardware or other
+    processes. Updates are started on a fixed schedule of absolute
+    deadlines, so errors in the sleep times do not accumulate into
+    drift. Zero or less (the default) runs as fast as possible. The
+    GUI's speedup property is separate, so worlds tuned for the GUI
+    run headless at full speed unless this is set.
+
+    - headless_pacing <string>\n
+    What a paced headless world does when an update starts a whole
+    update period or more after its deadline. "catchup" (the default)
+    runs updates back to back until it is on schedule again, so
+    simulated time keeps up with real time. "skip" drops the missed
+    deadlines, so simulated time falls behind but updates never
+    bunch together.
+
+    - log_file <string>\n
+    If set, write a binary log of model state to this file: the pose,
+    velocity and ranger scans of the models chosen by log_types and
+    their log properties, each time they are updated. Each simulation
+    thread buffers its records without locking, and a background
+    thread compresses them and writes them out, so logging costs the
+    simulation little. Read the file with Stg::LogReader (logfile.hh,
+    libstagelog) or dump it as text with stage-logdump.
+
+    - log_types [ <string> ... ]\n
+    The types of model to log, e.g. [ "position" "ranger" ]. Models
+    of these types record all the kinds of state they have, unless
+    their log property says otherwise. Empty by default, so only
+    models with a log property are logged.
+
+    - log_compress <int>\n
+    If non-zero (the default), compress the log with zlib, if Stage
+    was built with it.
+
+    - log_chunk <int>\n
+    The size of the log's chunks in kilobytes, default 256. Each
+    chunk is compressed separately and listed in the log's index.
+
+    - log_buffers <int>\n
+    The number of chunk buffers of each simulation thread, default
+    4. A thread waits for the disk only when all of its buffers are
+    full.
+
+    - shm_prefix <string>\n
+    If set, models publish their state in POSIX shared memory at each
+    update, for controllers running in other processes. Each model's
+    segment is named /<shm_prefix>.<model name>, e.g. /dev/shm/stage.r0
+    on Linux, and holds a ring of frames in the log's record format.
+    Position models also take SetSpeed, GoTo and Stop commands from it.
+    Neither Stage nor the clients ever lock or wait for each other.
+    Clients use Stg::ShmClient (shm.hh, libstageshm); stage-shmbench
+    measures the latency.
+
+    - shm_types [ <string> ... ]\n
+    The types of model to publish, e.g. [ "position" "ranger" ]. As
+    for log_types, a model's shm property overrides this.
+
+    - shm_slots <int>\n
+    The number of frames in each model's ring, default 4. A client
+    that falls this many frames behind loses the oldest.
+
+    - shm_commands <int>\n
+    The number of commands each position model can hold before it
+    next updates, default 16.
+
+    - shm_frame <int>\n
+    The smallest size of a frame in kilobytes, default 4. Frames are
+    also at least twice the size of the model's first, so that sensors
+    that see more later still fit. Records that do not fit are dropped
+    and the frame is marked truncated.
+
+    - replay_file <string>\n
+    If set, ranger, fiducial and blobfinder models take their data
+    from this log, written by an earlier run of the same world with
+    log_file, instead of sensing. Records are matched by model and
+    simulated time, so the world must be unchanged apart from its
+    controllers. Sensors without a record for the current time sense
+    live. Replaying is much faster than raytracing when re-running a
+    scenario to test changes to controllers. Log the sensors with
+    "all", so that their poses are recorded too.
+
+    - replay_tolerance <float>\n
+    - replay_angle_tolerance <float>\n
+    While replaying, the distance in meters, and the angle in
+    degrees, by which any model may differ from the pose recorded in
+    the log. Once one differs by more, the robots are no longer
+    following the recorded run, so every sensor senses live from then
+    on. Defaults to 0.01 m and 1 degree.
 
     @par More examples
     The Stage source distribution contains several example world files in
@@ -90,13 +261,19 @@ using std::abs;
 
 #include <stdlib.h>
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <libgen.h> // for dirname(3)
 #include <limits.h>
 #include <locale.h>
+#include <sched.h>
 #include <string.h> // for strdup(3)
+#include <time.h>
+#include <unistd.h>
 
 #include "file_manager.hh"
 #include "option.hh"
+#include "raytrace.hh"
 #include "region.hh"
 #include "stage.hh"
 #include "worldfile.hh"
@@ -118,6 +295,13 @@ bool World::lty::operator()(const Model *a, const Model *b) const
   return (ay == by ? a < b : ay < by);
 }
 
+// the comm index is ordered by cell, then by model id so that every
+// radio sees its neighbors in the same order on every run
+bool World::CommEntry::operator<(const CommEntry &other) const
+{
+  return (cell == other.cell ? comm->GetId() < other.comm->GetId() : cell < other.cell);
+}
+
 // static data members
 unsigned int World::next_id(0);
 bool World::quit_all(false);
@@ -129,18 +313,28 @@ World::World(const std::string &,
              double ppm)
     : // private
       destroy(false),
-      dirty(true), models(), models_by_name(), models_with_fiducials(), models_with_fiducials_byx(),
-      models_with_fiducials_byy(), ppm(ppm), // raytrace resolution
+      dirty(true), map_deferred(false), updating(false), models(), models_by_name(), models_with_fiducials(), models_with_fiducials_byx(),
+      models_with_fiducials_byy(), comms(), comm_index(), comm_cell(0), ppm(ppm), // raytrace resolution
       quit(false), show_clock(false),
       show_clock_interval(100), // 10 simulated seconds using defaults
-      sync_mutex(), threads_working(0), threads_start_cond(), threads_done_cond(), total_subs(0),
-      worker_threads(1),
+      sync_mutex(), threads_working(0), workers_round(0), worker_task(TASK_UPDATE), threads_start_cond(), threads_done_cond(), total_subs(0),
+      worker_threads(1), threads_override(0), threads_auto(false), thread_affinity(AFFINITY_NONE),
+      thread_cpus(), worker_cpus(), workers_started(0), load_threads(0), bitmap_polys(),
+      pace_speedup(0), pace_policy(PACE_CATCHUP),
+      pace_deadline(0), pace_stats(), logger(NULL), log_types(), shm_prefix(),
+      shm_types(), shm_slots(4), shm_commands(16), shm_frame(4096), replay(NULL), replay_override(),
+      replay_tolerance(0.01), replay_angle_tolerance(dtor(1.0)), replay_diverged(0),
+      replay_diverged_time(0), replay_hits(0), replay_misses(0),
 
       // protected
       cb_list(), extent(), graphics(false), option_table(), powerpack_list(), quit_time(0),
-      ray_list(), sim_time(0), superregions(), updates(0), wf(NULL), paused(false),
+      ray_list(), sim_time(0), superregions(), superregions_destroyed(0), region_bits(),
+      superregion_idle_time(0),
+      superregion_memory_budget(0), alloc_stats(), profiling(false), profile(), updates(0), wf(NULL), paused(false),
       event_queues(1), // use 1 thread by default
-      pending_update_callbacks(), active_energy(), active_velocity(),
+      pending_update_callbacks(), pending_threadsafe_callbacks(), threadsafe_callbacks(),
+      threadsafe_groups(), threadsafe_next(0), contacts_changed(), contacts_reporting(),
+      active_energy(), active_velocity(),
       sim_interval(1e5), // 100 msec has proved a good default
       update_cb_count(0)
 {
@@ -166,6 +360,13 @@ World::World(const std::string &,
 World::~World(void)
 {
   PRINT_DEBUG1("destroying world %s", Token());
+  CloseLog();
+  delete replay;
+
+  FOR_EACH (it, model_pool)
+    FOR_EACH (mod, it->second)
+      delete *mod;
+
   if (ground)
     delete ground;
   if (wf)
@@ -175,6 +376,7 @@ World::~World(void)
 
 SuperRegion *World::CreateSuperRegion(point_int_t origin)
 {
+  AllocationExempt exempt; // the grid grows with the area explored
   SuperRegion *sr(new SuperRegion(this, origin));
   superregions[origin] = sr;
   dirty = true; // force redraw
@@ -185,6 +387,7 @@ void World::DestroySuperRegion(SuperRegion *sr)
 {
   superregions.erase(sr->GetOrigin());
   delete sr;
+  ++superregions_destroyed;
 }
 
 void World::Run()
@@ -218,6 +421,9 @@ bool World::UpdateAll()
   bool quit(true);
 
   FOR_EACH (world_it, World::world_set) {
+    // GUI worlds are paced by their own timeouts or simulation thread
+    if (!(*world_it)->IsGUI())
+      (*world_it)->Pace();
     if ((*world_it)->Update() == false)
       quit = false;
   }
@@ -225,13 +431,20 @@ bool World::UpdateAll()
   return quit;
 }
 
+// the index of the calling thread: 0 in the main thread, or the
+// instance of a worker thread
+static __thread int thread_index(0);
+
 void *World::update_thread_entry(std::pair<World *, int> *thread_info)
 {
   World *world(thread_info->first);
   const int thread_instance(thread_info->second);
+  thread_index = thread_instance;
 
   // printf( "thread ID %d waiting for mutex\n", thread_instance );
 
+  unsigned int round(0); // the last StartWorkers() seen
+
   pthread_mutex_lock(&world->sync_mutex);
 
   while (1) {
@@ -239,11 +452,19 @@ void *World::update_thread_entry(std::pair<World *, int> *thread_info)
     // wait until the main thread signals us
     // puts( "worker waiting for start signal" );
 
-    pthread_cond_wait(&world->threads_start_cond, &world->sync_mutex);
+    while (world->workers_round == round)
+      pthread_cond_wait(&world->threads_start_cond, &world->sync_mutex);
+    round = world->workers_round;
     pthread_mutex_unlock(&world->sync_mutex);
 
     // printf( "worker %u thread awakes for task %u\n", thread_instance, task );
-    world->ConsumeQueue(thread_instance);
+    const uint64_t start(world->profiling ? ProfileClock() : 0);
+    if (world->worker_task == TASK_CALLBACKS)
+      world->RunThreadSafeCallbacks();
+    else
+      world->ConsumeQueue(thread_instance);
+    if (world->profiling)
+      world->profile.worker_time[thread_instance] += ProfileClock() - start;
     // printf( "thread %d done\n", thread_instance );
 
     // done working, so increment the counter. If this was the last
@@ -261,6 +482,244 @@ void *World::update_thread_entry(std::pair<World *, int> *thread_info)
   return NULL;
 }
 
+// the CPUs this process may run on
+static std::vector<int> allowed_cpus()
+{
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    for (int c(0); c < CPU_SETSIZE; ++c)
+      if (CPU_ISSET(c, &set))
+        cpus.push_back(c);
+#endif
+  if (cpus.empty())
+    for (long c(0); c < std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)); ++c)
+      cpus.push_back(c);
+  return cpus;
+}
+
+// read a list of CPUs in the kernel's format, e.g. "0-3,8-11"
+static std::vector<int> read_cpu_list(const std::string &path)
+{
+  std::vector<int> cpus;
+  FILE *fp(fopen(path.c_str(), "r"));
+  if (fp == NULL)
+    return cpus;
+
+  int first, last;
+  while (fscanf(fp, "%d", &first) == 1) {
+    last = first;
+    if (fscanf(fp, "-%d", &last) < 0)
+      last = first;
+    for (int c(first); c <= last; ++c)
+      cpus.push_back(c);
+    if (fgetc(fp) != ',')
+      break;
+  }
+  fclose(fp);
+  return cpus;
+}
+
+// the NUMA node of cpu, or -1 if it is unknown
+static int numa_node_of(int cpu)
+{
+  DIR *dir(opendir("/sys/devices/system/node"));
+  if (dir == NULL)
+    return -1;
+
+  int node(-1);
+  while (struct dirent *entry = readdir(dir)) {
+    int n;
+    if (sscanf(entry->d_name, "node%d", &n) != 1)
+      continue;
+    const std::vector<int> cpus(
+        read_cpu_list(std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist"));
+    if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end()) {
+      node = n;
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+// confine thread to cpus, returning false if that is not possible here
+static bool set_affinity(pthread_t thread, const std::vector<int> &cpus)
+{
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  FOR_EACH (it, cpus)
+    CPU_SET(*it, &set);
+  return (pthread_setaffinity_np(thread, sizeof(set), &set) == 0);
+#else
+  (void)thread;
+  (void)cpus;
+  return false;
+#endif
+}
+
+void World::ChooseThreadCpus()
+{
+  thread_cpus = allowed_cpus();
+
+  // the thread_cpus property narrows the CPUs the process may use
+  if (CProperty *prop = wf->GetProperty(0, "thread_cpus")) {
+    std::vector<int> chosen;
+    for (unsigned int i(0); i < prop->values.size(); ++i) {
+      const int cpu(atoi(wf->GetPropertyValue(prop, i)));
+      if (std::find(thread_cpus.begin(), thread_cpus.end(), cpu) != thread_cpus.end())
+        chosen.push_back(cpu);
+      else
+        PRINT_WARN1("thread_cpus: this process may not run on CPU %d", cpu);
+    }
+    if (!chosen.empty())
+      thread_cpus = chosen;
+  }
+
+  if (thread_affinity != AFFINITY_NUMA)
+    return;
+
+  // the node Stage is running on, unless the worldfile chooses one
+  int node(wf->ReadInt(0, "thread_numa_node", -1));
+#ifdef __linux__
+  if (node < 0)
+    node = numa_node_of(sched_getcpu());
+#endif
+  if (node < 0) {
+    PRINT_WARN("thread_affinity \"numa\": cannot find the NUMA node, using \"none\"");
+    thread_affinity = AFFINITY_NONE;
+    return;
+  }
+
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  const std::vector<int> node_cpus(read_cpu_list(path));
+
+  std::vector<int> chosen;
+  FOR_EACH (it, thread_cpus)
+    if (std::find(node_cpus.begin(), node_cpus.end(), *it) != node_cpus.end())
+      chosen.push_back(*it);
+
+  if (chosen.empty()) {
+    PRINT_WARN1("thread_affinity \"numa\": none of the CPUs are on node %d, using \"none\"",
+                node);
+    thread_affinity = AFFINITY_NONE;
+  } else
+    thread_cpus = chosen;
+}
+
+unsigned int World::AutoWorkerThreads() const
+{
+  unsigned int thread_safe(0);
+  FOR_EACH (it, models)
+    if ((*it)->thread_safe)
+      ++thread_safe;
+
+  // the main thread has the main queue, and moves the models
+  const unsigned int spare(thread_cpus.size() > 1 ? thread_cpus.size() - 1 : 1);
+  return std::max(1u, std::min(spare, thread_safe));
+}
+
+void World::FoldEventQueues(unsigned int threads)
+{
+  if (threads < 1 || threads >= worker_threads)
+    return;
+
+  for (unsigned int q(threads + 1); q < event_queues.size(); ++q) {
+    std::priority_queue<Event> &from(event_queues[q]);
+    std::priority_queue<Event> &to(event_queues[(q - 1) % threads + 1]);
+    for (; !from.empty(); from.pop())
+      to.push(from.top());
+  }
+
+  FOR_EACH (it, models)
+    if ((*it)->event_queue_num > threads)
+      (*it)->event_queue_num = ((*it)->event_queue_num - 1) % threads + 1;
+
+  worker_threads = threads;
+  event_queues.resize(threads + 1);
+  pending_update_callbacks.resize(threads + 1);
+  pending_threadsafe_callbacks.resize(threads + 1);
+  profile.worker_time.resize(threads + 1);
+  profile.worker_events.resize(threads + 1);
+  profile.pose_cache.resize(threads + 1);
+}
+
+void World::StartWorkerThreads()
+{
+  // normal posix pthread C function pointer
+  typedef void *(*func_ptr)(void *);
+
+  worker_cpus.assign(worker_threads + 1, -1);
+
+  if (thread_affinity == AFFINITY_NUMA && !set_affinity(pthread_self(), thread_cpus)) {
+    PRINT_WARN("thread_affinity is not supported here, using \"none\"");
+    thread_affinity = AFFINITY_NONE;
+  }
+  if (thread_affinity == AFFINITY_PIN) {
+    if (!set_affinity(pthread_self(), std::vector<int>(1, thread_cpus[0]))) {
+      PRINT_WARN("thread_affinity is not supported here, using \"none\"");
+      thread_affinity = AFFINITY_NONE;
+    } else
+      worker_cpus[0] = thread_cpus[0];
+  }
+
+  // kick off the threads
+  for (unsigned int t(1); t <= worker_threads; ++t) {
+    // the pair<World*,int> is the configuration for each thread. it can't be a
+    // local
+    // stack var, since it's accssed in the threads
+
+    pthread_t pt;
+    pthread_create(&pt, NULL, (func_ptr)World::update_thread_entry,
+                   new std::pair<World *, int>(this, t));
+
+    // pinned threads share CPUs only when there are more threads than CPUs
+    if (thread_affinity == AFFINITY_PIN) {
+      worker_cpus[t] = thread_cpus[t % thread_cpus.size()];
+      set_affinity(pt, std::vector<int>(1, worker_cpus[t]));
+    } else if (thread_affinity == AFFINITY_NUMA)
+      set_affinity(pt, thread_cpus);
+  }
+
+  if (worker_threads > 1 || threads_auto || thread_affinity != AFFINITY_NONE) {
+    printf("[threads %u%s", worker_threads, threads_auto ? " auto" : "");
+    if (thread_affinity == AFFINITY_PIN)
+      printf(", pinned to %u cpus", (unsigned int)std::min<size_t>(worker_threads + 1, thread_cpus.size()));
+    else if (thread_affinity == AFFINITY_NUMA)
+      printf(", on %u cpus of a numa node", (unsigned int)thread_cpus.size());
+    printf("]");
+  }
+}
+
+unsigned int World::LoadThreads() const
+{
+  // threads created by a pinned main thread would share its CPU
+  if (!worker_cpus.empty() && worker_cpus[0] >= 0)
+    return 1;
+
+  return (load_threads ? load_threads : std::max(1u, (unsigned int)thread_cpus.size()));
+}
+
+void World::PrefetchBitmaps()
+{
+  bitmap_polys.clear();
+
+  std::set<std::string> files;
+  for (int entity(1); entity < wf->GetEntityCount(); ++entity)
+    if (wf->PropertyExists(entity, "bitmap")) {
+      const std::string bitmapfile(wf->ReadString(entity, "bitmap", ""));
+      if (!bitmapfile.empty())
+        files.insert(BlockGroup::BitmapPath(bitmapfile, wf));
+    }
+
+  // BlockGroup::LoadBitmap() reports the files that cannot be loaded
+  polys_from_image_files(files, LoadThreads(), bitmap_polys);
+}
+
 void World::AddModel(Model *mod)
 {
   models.insert(mod);
@@ -336,6 +795,226 @@ Model *World::CreateModel(Model *parent, const std::string &typestr)
   return mod;
 }
 
+std::vector<Model *> World::SpawnModels(Model *prototype, const std::vector<Pose> &poses)
+{
+  std::vector<Model *> spawned;
+
+  if (prototype == NULL || prototype->wf == NULL || prototype->wf_entity == 0) {
+    PRINT_ERR("SpawnModels() needs a prototype loaded from a worldfile");
+    return spawned;
+  }
+
+  Worldfile *pwf(prototype->wf);
+  const int root(prototype->wf_entity);
+
+  // the prototype's entity and those below it, in the order the world
+  // loaded them
+  std::vector<int> entities(1, root);
+  std::set<int> subtree(entities.begin(), entities.end());
+  for (int entity(root + 1); entity < pwf->GetEntityCount(); ++entity)
+    if (subtree.count(pwf->GetEntityParent(entity))) {
+      entities.push_back(entity);
+      subtree.insert(entity);
+    }
+
+  std::vector<Model *> created; // every model made, to map and initialize at the end
+  std::vector<Model *> reused; // the top-level models taken from the pool, to map at the end
+  std::map<int, Model *> copies; // the copy made of each entity for the current pose
+  std::vector<Model *> &pool(model_pool[root]);
+  spawned.reserve(poses.size());
+
+  map_deferred = true;
+
+  FOR_EACH (pose, poses) {
+    // a despawned copy is put back as it was
+    if (!pool.empty()) {
+      Model *mod(pool.back());
+      pool.pop_back();
+
+      mod->parent = prototype->Parent();
+      UnpoolModel(mod);
+      if (mod->parent)
+        mod->parent->AddChild(mod);
+      else
+        AddChild(mod);
+
+      // the parent may have moved while the copy was pooled, and
+      // SetPose() leaves the cache alone if the local pose is the same
+      mod->InvalidateGlobalPose();
+      mod->SetPose(*pose);
+      spawned.push_back(mod);
+      reused.push_back(mod);
+      continue;
+    }
+
+    copies.clear();
+    copies[pwf->GetEntityParent(root)] = prototype->Parent();
+
+    FOR_EACH (entity, entities) {
+      Model *parent(copies[pwf->GetEntityParent(*entity)]);
+      const char *typestr(pwf->GetEntityType(*entity));
+
+      if (strcmp(typestr, "block") == 0)
+        parent->LoadBlock(pwf, *entity);
+      else if (strcmp(typestr, "sensor") == 0) {
+        if (ModelRanger *rgr = dynamic_cast<ModelRanger *>(parent))
+          rgr->LoadSensor(pwf, *entity);
+      } else if (strcmp(typestr, "window") != 0) {
+        Model *mod(CreateModel(parent, typestr));
+        mod->spawned = true;
+        mod->Load(pwf, *entity);
+
+        if (*entity == root) {
+          // the copy took the prototype's name from the worldfile, so
+          // give the name back before renaming the copy, which its
+          // children's names start with
+          AddModelName(prototype, prototype->TokenStr());
+          char suffix[16];
+          snprintf(suffix, sizeof(suffix), ":%u", mod->GetId());
+          mod->SetToken(prototype->TokenStr() + suffix);
+
+          mod->SetPose(*pose);
+          spawned.push_back(mod);
+        }
+
+        copies[*entity] = mod;
+        created.push_back(mod);
+      }
+    }
+  }
+
+  map_deferred = false;
+
+  FOR_EACH (it, reused) {
+    (*it)->MapWithChildren(0);
+    (*it)->MapWithChildren(1);
+  }
+
+  MapModels(created);
+
+  // models read by other processes must keep updating
+  FOR_EACH (it, created)
+    if ((*it)->shm_kinds)
+      (*it)->Subscribe();
+
+  FOR_EACH (it, created)
+    (*it)->InitControllers();
+
+  if (profiling) {
+    profile.respawned += reused.size();
+    profile.spawned += spawned.size() - reused.size();
+  }
+
+  dirty = true;
+  return spawned;
+}
+
+void World::PoolModel(Model *mod, std::set<Model *> &pooled)
+{
+  // parents first, as their Shutdown() may unsubscribe their children
+  mod->pooled_subs = mod->subs;
+  while (mod->subs > 0)
+    mod->Unsubscribe();
+
+  FiducialErase(mod);
+  RemoveModel(mod);
+  mod->pooled = true;
+
+  // unmapping ended its contacts, which are not reported
+  mod->contacts_changed = false;
+  mod->contacts_reported.clear();
+  pooled.insert(mod);
+
+  FOR_EACH (it, mod->children)
+    PoolModel(*it, pooled);
+}
+
+void World::UnpoolModel(Model *mod)
+{
+  AddModel(mod);
+  mod->pooled = false;
+
+  // parents first, as their Startup() may subscribe their children
+  for (int s(0); s < mod->pooled_subs; ++s)
+    mod->Subscribe();
+  mod->pooled_subs = 0;
+
+  if (mod->vis.fiducial_return)
+    FiducialInsert(mod);
+
+  FOR_EACH (it, mod->children)
+    UnpoolModel(*it);
+}
+
+void World::DespawnModels(const std::vector<Model *> &mods)
+{
+  // the queues and callback lists of the update are in use, so the
+  // models are despawned at its end
+  if (updating) {
+    despawns.insert(despawns.end(), mods.begin(), mods.end());
+    return;
+  }
+
+  std::set<Model *> pooled;
+
+  FOR_EACH (it, mods) {
+    Model *mod(*it);
+    if (mod->pooled)
+      continue;
+    if (mod->wf == NULL || mod->wf_entity == 0) {
+      PRINT_WARN1("model %s was not loaded from a worldfile, so it cannot be despawned",
+                  mod->Token());
+      continue;
+    }
+
+    mod->UnMapWithChildren(0);
+    mod->UnMapWithChildren(1);
+    PoolModel(mod, pooled);
+
+    // out of the tree, so that it is neither drawn nor visited
+    if (mod->parent)
+      mod->parent->RemoveChild(mod);
+    else
+      RemoveChild(mod);
+    mod->parent = NULL;
+
+    model_pool[mod->wf_entity].push_back(mod);
+    if (profiling)
+      ++profile.despawned;
+  }
+
+  if (pooled.empty())
+    return;
+
+  // drop the pooled models' pending events, so that none is left to
+  // update them twice as often once they are spawned again
+  FOR_EACH (q, event_queues) {
+    std::vector<Event> keep;
+    keep.reserve(q->size());
+    for (; !q->empty(); q->pop())
+      if (pooled.count(q->top().mod) == 0)
+        keep.push_back(q->top());
+    *q = std::priority_queue<Event>(keep.begin(), keep.end());
+  }
+
+  // nor any contact change left to report
+  size_t kept(0);
+  FOR_EACH (it, contacts_changed)
+    if (pooled.count(*it) == 0)
+      contacts_changed[kept++] = *it;
+  contacts_changed.resize(kept);
+
+  dirty = true;
+}
+
+size_t World::PooledModels() const
+{
+  size_t count(0);
+  FOR_EACH (it, model_pool)
+    count += it->second.size();
+  return count;
+}
+
 void World::LoadModel(Worldfile *wf, int entity)
 {
   const int parent_entity(wf->GetEntityParent(entity));
@@ -412,33 +1091,129 @@ void World::LoadWorldPostHook()
   // read msec instead of usec: easier for user
   this->sim_interval = 1e3 * wf->ReadFloat(0, "interval_sim", this->sim_interval / 1e3);
 
-  this->worker_threads = wf->ReadInt(0, "threads", this->worker_threads);
+  const std::string affinity(wf->ReadString(0, "thread_affinity", "none"));
+  if (affinity == "pin")
+    this->thread_affinity = AFFINITY_PIN;
+  else if (affinity == "numa")
+    this->thread_affinity = AFFINITY_NUMA;
+  else {
+    if (affinity != "none")
+      PRINT_WARN1("unknown thread_affinity \"%s\", using \"none\"", affinity.c_str());
+    this->thread_affinity = AFFINITY_NONE;
+  }
+  ChooseThreadCpus();
+
+  this->load_threads = std::max(0, wf->ReadInt(0, "load_threads", this->load_threads));
+
+  // with threads "auto", there is a queue for every spare CPU while
+  // the models load, and the queues are folded together once the
+  // thread-safe models have been counted
+  this->threads_auto = (wf->ReadString(0, "threads", "") == "auto" && this->threads_override == 0);
+  if (this->threads_auto)
+    this->worker_threads = std::max(1, (int)thread_cpus.size() - 1);
+  else
+    this->worker_threads = wf->ReadInt(0, "threads", this->worker_threads);
+  if (this->threads_override > 0)
+    this->worker_threads = this->threads_override;
   if (this->worker_threads < 1) {
     PRINT_WARN("threads set to <1. Forcing to 1");
     this->worker_threads = 1;
   }
 
-  pending_update_callbacks.resize(worker_threads + 1);
-  event_queues.resize(worker_threads + 1);
+  this->superregion_idle_time =
+      (usec_t)(million * wf->ReadFloat(0, "superregion_idle_time", this->superregion_idle_time / 1e6));
 
-  // printf( "worker threads %d\n", worker_threads );
+  this->superregion_memory_budget = (size_t)(
+      1e6 * wf->ReadFloat(0, "superregion_memory_budget", this->superregion_memory_budget / 1e6));
 
-  // kick off the threads
-  for (unsigned int t(0); t < worker_threads; ++t) {
-    // normal posix pthread C function pointer
-    typedef void *(*func_ptr)(void *);
+  this->pace_speedup = wf->ReadFloat(0, "headless_speedup", this->pace_speedup);
 
-    // the pair<World*,int> is the configuration for each thread. it can't be a
-    // local
-    // stack var, since it's accssed in the threads
+  const std::string pacing(
+      wf->ReadString(0, "headless_pacing", pace_policy == PACE_SKIP ? "skip" : "catchup"));
+  if (pacing == "skip")
+    this->pace_policy = PACE_SKIP;
+  else if (pacing == "catchup")
+    this->pace_policy = PACE_CATCHUP;
+  else {
+    PRINT_WARN1("unknown headless_pacing \"%s\", using \"catchup\"", pacing.c_str());
+    this->pace_policy = PACE_CATCHUP;
+  }
 
-    pthread_t pt;
-    pthread_create(&pt, NULL, (func_ptr)World::update_thread_entry,
-                   new std::pair<World *, int>(this, t + 1));
+  // the shape of the grid, set before any model is mapped into it
+  bool tune_region_bits(false);
+  if (CProperty *prop = wf->GetProperty(0, "region_bits")) {
+    if (prop->values.size() >= 2) {
+      unsigned int rbits(region_bits.rbits), sbits(region_bits.sbits);
+      wf->ReadTuple(0, "region_bits", 0, 2, "uu", &rbits, &sbits);
+      SetRegionBits(RegionBits(rbits, sbits));
+    } else if (wf->ReadString(0, "region_bits", "") == "auto")
+      tune_region_bits = true;
+    else
+      PRINT_WARN("region_bits must be [ <region bits> <superregion bits> ] or \"auto\"");
+  }
+
+  pending_update_callbacks.resize(worker_threads + 1);
+  pending_threadsafe_callbacks.resize(worker_threads + 1);
+  profile.worker_time.resize(worker_threads + 1);
+  profile.worker_events.resize(worker_threads + 1);
+  profile.pose_cache.resize(worker_threads + 1);
+  event_queues.resize(worker_threads + 1);
+
+  const std::string log_file(wf->ReadString(0, "log_file", ""));
+  if (!log_file.empty()) {
+    CloseLog();
+    // one ring of buffers for each event queue
+    logger = new LogWriter(log_file, worker_threads + 1,
+                           1024 * std::max(4, wf->ReadInt(0, "log_chunk", 256)),
+                           std::max(2, wf->ReadInt(0, "log_buffers", 4)),
+                           wf->ReadInt(0, "log_compress", 1));
+    if (!logger->Ok())
+      CloseLog();
+  }
+
+  log_types.clear();
+  if (CProperty *prop = wf->GetProperty(0, "log_types"))
+    for (unsigned int i(0); i < prop->values.size(); ++i)
+      log_types.insert(wf->GetPropertyValue(prop, i));
+
+  this->shm_prefix = wf->ReadString(0, "shm_prefix", this->shm_prefix);
+  this->shm_slots = std::max(2, wf->ReadInt(0, "shm_slots", this->shm_slots));
+  this->shm_commands = std::max(1, wf->ReadInt(0, "shm_commands", this->shm_commands));
+  this->shm_frame = 1024 * std::max(1, wf->ReadInt(0, "shm_frame", this->shm_frame / 1024));
+
+  shm_types.clear();
+  if (CProperty *prop = wf->GetProperty(0, "shm_types"))
+    for (unsigned int i(0); i < prop->values.size(); ++i)
+      shm_types.insert(wf->GetPropertyValue(prop, i));
+
+  const std::string replay_file(
+      replay_override.empty() ? wf->ReadString(0, "replay_file", "") : replay_override);
+  this->replay_tolerance = wf->ReadLength(0, "replay_tolerance", this->replay_tolerance);
+  this->replay_angle_tolerance =
+      wf->ReadAngle(0, "replay_angle_tolerance", this->replay_angle_tolerance);
+
+  delete replay;
+  replay = NULL;
+  replay_diverged = 0;
+  replay_hits = replay_misses = 0;
+
+  if (!replay_file.empty()) {
+    replay = new LogTable(replay_file);
+    if (replay->Ok())
+      printf("[replay %s: %u records]", replay_file.c_str(), (unsigned int)replay->Records());
+    else {
+      delete replay;
+      replay = NULL;
+    }
   }
 
-  if (worker_threads > 1)
-    printf("[threads %u]", worker_threads);
+  // the bitmaps are the slowest part of loading most worlds
+  if (LoadThreads() > 1)
+    PrefetchBitmaps();
+
+  // the models are mapped once they are all loaded, rather than each
+  // time their geometry and pose are set
+  map_deferred = true;
 
   // Iterate through entitys and create objects of the appropriate type
   for (int entity(1); entity < wf->GetEntityCount(); ++entity) {
@@ -455,14 +1230,24 @@ void World::LoadWorldPostHook()
       LoadModel(wf, entity);
   }
 
-  // call all controller init functions
-  FOR_EACH (it, models) {
-    (*it)->blockgroup.CalcSize();
-    (*it)->UnMap(); // clears both layers
-    (*it)->Map(); // maps both layers
+  map_deferred = false;
+  bitmap_polys.clear();
 
-    // to here
-  }
+  // before the main thread can be pinned to a single CPU
+  MapModels(std::vector<Model *>(models.begin(), models.end()));
+
+  if (threads_auto)
+    FoldEventQueues(AutoWorkerThreads());
+
+  StartWorkerThreads();
+
+  // models read by other processes must keep updating
+  FOR_EACH (it, models)
+    if ((*it)->shm_kinds)
+      (*it)->Subscribe();
+
+  if (tune_region_bits)
+    TuneRegionBits();
 
   // the world is all done - run any init code for user's controllers
   FOR_EACH (it, models)
@@ -473,6 +1258,10 @@ void World::LoadWorldPostHook()
 
 void World::UnLoad()
 {
+  CloseLog();
+  delete replay;
+  replay = NULL;
+
   if (wf)
     delete wf;
 
@@ -543,14 +1332,143 @@ int World::RemoveUpdateCallback(world_callback_t cb, void *user)
   return cb_list.size();
 }
 
+void World::StartWorkers(worker_task_t task)
+{
+  pthread_mutex_lock(&sync_mutex);
+  worker_task = task;
+  threads_working = worker_threads;
+  ++workers_round;
+  workers_started = (profiling ? ProfileClock() : 0);
+  // unblock the workers - they are waiting on this condition var
+  // puts( "main thread signalling workers" );
+  pthread_cond_broadcast(&threads_start_cond);
+  pthread_mutex_unlock(&sync_mutex);
+}
+
+void World::WaitForWorkers()
+{
+  pthread_mutex_lock(&sync_mutex);
+  // wait for all the last update job to complete - it will
+  // signal the worker_threads_done condition var
+  while (threads_working > 0) {
+    // puts( "main thread waiting for workers to finish" );
+    pthread_cond_wait(&threads_done_cond, &sync_mutex);
+  }
+  if (profiling && workers_started)
+    profile.worker_window += ProfileClock() - workers_started;
+  pthread_mutex_unlock(&sync_mutex);
+  // puts( "main thread awakes" );
+}
+
+void World::CallModelCallbacks(Model *mod, bool threadsafe)
+{
+  // what controllers allocate is up to them
+  AllocationExempt exempt;
+
+  if (profiling) {
+    const uint64_t start(ProfileClock());
+    mod->CallUpdateCallbacks(threadsafe);
+    mod->profile.callback_time += ProfileClock() - start;
+    ++mod->profile.callbacks;
+  } else
+    mod->CallUpdateCallbacks(threadsafe);
+}
+
+// order models by the tree they belong to, then by id so that each
+// tree's callbacks are called in the same order every time
+static bool by_root(Model *a, Model *b)
+{
+  const Model *ra(a->Root()), *rb(b->Root());
+  return ra == rb ? a->GetId() < b->GetId() : ra < rb;
+}
+
+size_t World::CallThreadSafeCallbacks()
+{
+  threadsafe_callbacks.clear();
+  FOR_EACH (it, pending_threadsafe_callbacks) {
+    threadsafe_callbacks.insert(threadsafe_callbacks.end(), it->begin(), it->end());
+    it->clear();
+  }
+
+  if (threadsafe_callbacks.empty())
+    return 0;
+
+  // a controller usually keeps state shared by the callbacks of its
+  // robot's models, so a tree's callbacks are called in series
+  std::sort(threadsafe_callbacks.begin(), threadsafe_callbacks.end(), by_root);
+
+  threadsafe_groups.clear();
+  for (size_t i(0); i < threadsafe_callbacks.size(); ++i)
+    if (i == 0 || threadsafe_callbacks[i]->Root() != threadsafe_callbacks[i - 1]->Root())
+      threadsafe_groups.push_back(i);
+  threadsafe_groups.push_back(threadsafe_callbacks.size());
+  threadsafe_next = 0;
+
+  // the main thread works too, so a single tree needs no workers
+  if (worker_threads > 0 && threadsafe_groups.size() > 2) {
+    StartWorkers(TASK_CALLBACKS);
+    RunThreadSafeCallbacks();
+    WaitForWorkers();
+  } else
+    RunThreadSafeCallbacks();
+
+  return threadsafe_callbacks.size();
+}
+
+void World::RunThreadSafeCallbacks()
+{
+  const size_t groups(threadsafe_groups.size() - 1);
+
+  for (size_t g; (g = __sync_fetch_and_add(&threadsafe_next, 1)) < groups;)
+    for (size_t i(threadsafe_groups[g]); i < threadsafe_groups[g + 1]; ++i)
+      CallModelCallbacks(threadsafe_callbacks[i], true);
+}
+
+void World::ReportContacts()
+{
+  // callbacks may move models, changing contacts again, which are
+  // reported next time
+  contacts_reporting.swap(contacts_changed);
+  const unsigned int layer(updates % 2);
+
+  FOR_EACH (it, contacts_reporting) {
+    Model *mod(*it);
+    mod->contacts_changed = false;
+
+    // a contact that ended and began again in this update, as a
+    // model moved across its cells, is no change
+    const std::vector<Model::Contact> &now(mod->contacts[layer]);
+    std::vector<Model *> &reported(mod->contacts_reported);
+    bool same(now.size() == reported.size());
+    for (size_t i(0); same && i < now.size(); ++i)
+      same = std::find(reported.begin(), reported.end(), now[i].mod) != reported.end();
+    if (same)
+      continue;
+
+    reported.clear();
+    if (reported.capacity() < now.size()) {
+      AllocationExempt exempt; // more contacts than this model has had before
+      reported.reserve(now.capacity());
+    }
+    FOR_EACH (c, now)
+      reported.push_back(c->mod);
+
+    mod->CallCallbacks(Model::CB_CONTACT);
+  }
+
+  contacts_reporting.clear();
+}
+
 void World::CallUpdateCallbacks()
 {
-  // call model CB_UPDATE callbacks queued up by worker threads
+  // thread-safe controllers first, in parallel
+  int cbcount(CallThreadSafeCallbacks());
+
+  // then the model CB_UPDATE callbacks queued up by worker threads
   size_t threads(pending_update_callbacks.size());
-  int cbcount(0);
 
   for (size_t t(0); t < threads; ++t) {
-    std::queue<Model *> &q(pending_update_callbacks[t]);
+    std::vector<Model *> &q(pending_update_callbacks[t]);
 
     // 			printf( "pending callbacks for thread %u: %u\n",
     // 							(unsigned int)t,
@@ -559,10 +1477,10 @@ void World::CallUpdateCallbacks()
 
     cbcount += q.size();
 
-    while (!q.empty()) {
-      q.front()->CallUpdateCallbacks();
-      q.pop();
-    }
+    // index rather than iterate, in case a callback queues another
+    for (size_t i(0); i < q.size(); ++i)
+      CallModelCallbacks(q[i], false);
+    q.clear();
   }
   //	printf( "cb total %u (global %d)\n\n", (unsigned
   // int)cbcount,update_cb_count );
@@ -585,6 +1503,8 @@ void World::ConsumeQueue(unsigned int queue_num)
 
   // printf( "event queue len %d\n", (int)queue.size() );
 
+  uint64_t events(0);
+
   // update everything on the event queue that happens at this time or earlier
   do {
     Event ev(queue.top());
@@ -599,7 +1519,11 @@ void World::ConsumeQueue(unsigned int queue_num)
     // ev.time, ev.mod->Token() );
 
     ev.cb(ev.mod, ev.arg); // call the event's callback on the model
+    ++events;
   } while (!queue.empty());
+
+  if (profiling && queue_num < profile.worker_events.size())
+    profile.worker_events[queue_num] += events;
 }
 
 bool World::Update()
@@ -612,53 +1536,56 @@ bool World::Update()
   if (PastQuitTime() || World::quit_all || this->quit)
     return true;
 
+  updating = true;
+
   if (show_clock && ((this->updates % show_clock_interval) == 0)) {
     printf("\r[Stage: %s]", ClockString().c_str());
     fflush(stdout);
   }
 
+  // count the allocations made from here on
+  const uint64_t allocs(AllocationCount());
+  const uint64_t exempt_allocs(ExemptAllocationCount());
+
+  // the start of the update and of the current phase, if profiling
+  const uint64_t start(profiling ? ProfileClock() : 0);
+  uint64_t lap(start);
+
   sim_time += sim_interval;
 
-  // rebuild the sets sorted by position on x,y axis
-  models_with_fiducials_byx.clear();
-  models_with_fiducials_byy.clear();
+  // rebuild the vectors sorted by position on x,y axis. Assigning
+  // reuses their capacity, so this does not allocate.
+  models_with_fiducials_byx.assign(models_with_fiducials.begin(), models_with_fiducials.end());
+  models_with_fiducials_byy.assign(models_with_fiducials.begin(), models_with_fiducials.end());
 
-  FOR_EACH (it, models_with_fiducials) {
-    models_with_fiducials_byx.insert(*it);
-    models_with_fiducials_byy.insert(*it);
-  }
+  std::sort(models_with_fiducials_byx.begin(), models_with_fiducials_byx.end(), ltx());
+  std::sort(models_with_fiducials_byy.begin(), models_with_fiducials_byy.end(), lty());
+
+  // put the radio messages on the air and index the radios by position
+  UpdateCommIndex();
+  ProfileLap(lap, profile.sort_time);
 
   // printf( "x %lu y %lu\n", models_with_fiducials_byy.size(),
   //			models_with_fiducials_byx.size() );
 
   // handle the zeroth queue synchronously in the main thread
   ConsumeQueue(0);
+  ProfileLap(lap, profile.main_queue_time);
 
   // handle all the remaining queues asynchronously in worker threads
-  pthread_mutex_lock(&sync_mutex);
-  threads_working = worker_threads;
-  // unblock the workers - they are waiting on this condition var
-  // puts( "main thread signalling workers" );
-  pthread_cond_broadcast(&threads_start_cond);
-  pthread_mutex_unlock(&sync_mutex);
+  StartWorkers(TASK_UPDATE);
 
   // update the position of all position models based on their velocity
   // while sensor models are running in other threads
   FOR_EACH (it, active_velocity)
     (*it)->Move();
+  ProfileLap(lap, profile.move_time);
 
-  pthread_mutex_lock(&sync_mutex);
-  // wait for all the last update job to complete - it will
-  // signal the worker_threads_done condition var
-  while (threads_working > 0) {
-    // puts( "main thread waiting for workers to finish" );
-    pthread_cond_wait(&threads_done_cond, &sync_mutex);
-  }
-  pthread_mutex_unlock(&sync_mutex);
-  // puts( "main thread awakes" );
+  WaitForWorkers();
+  ProfileLap(lap, profile.barrier_time);
 
-  // TODO: allow threadsafe callbacks to be called in worker
-  // threads
+  // the models have moved, so their contacts are settled
+  ReportContacts();
 
   dirty = true; // need redraw
 
@@ -666,24 +1593,148 @@ bool World::Update()
 
   // world callbacks
   CallUpdateCallbacks();
+  ProfileLap(lap, profile.callback_time);
 
   FOR_EACH (it, active_energy)
     (*it)->UpdateCharge();
+  ProfileLap(lap, profile.charge_time);
+
+  updating = false;
+  if (!despawns.empty()) {
+    DespawnModels(despawns);
+    despawns.clear();
+  }
+
+  PageSuperRegions();
+
+  if (profiling) {
+    profile.update_time += ProfileClock() - start;
+    ++profile.updates;
+  }
+
+  alloc_stats.last = AllocationCount() - allocs;
+  if (updates >= alloc_stats.warmup) {
+    alloc_stats.exempt += ExemptAllocationCount() - exempt_allocs;
+    if (alloc_stats.last) {
+      ++alloc_stats.updates;
+      alloc_stats.max = std::max(alloc_stats.max, alloc_stats.last);
+    }
+  }
 
   ++updates;
 
   return false;
 }
 
-unsigned int World::GetEventQueue(Model *) const
+void World::UpdateCommIndex()
 {
-  // todo: there should be a policy that works faster than random, but
-  // random should do a good core load balancing.
+  comm_index.clear();
+  if (comms.empty())
+    return;
 
-  if (worker_threads < 1)
-    return 0;
-  return ((random() % worker_threads) + 1);
-}
+  // cells as wide as the longest range hold every radio in range of
+  // another in the 3x3 cells around it, and a message stays on the
+  // air until the slowest radio has had an update since it was sent
+  meters_t range(1.0 / ppm);
+  usec_t window(0);
+  FOR_EACH (it, comms) {
+    if ((*it)->subs < 1)
+      continue;
+    range = std::max(range, (*it)->range);
+    window = std::max(window, (*it)->interval);
+  }
+  comm_cell = range;
+  window += sim_interval; // updates may run up to one step late
+
+  // only the radios switched on are put in the index
+  FOR_EACH (it, comms) {
+    if ((*it)->subs < 1)
+      continue;
+
+    (*it)->Transmit(sim_time, window);
+
+    CommEntry entry;
+    entry.comm = *it;
+    entry.pose = (*it)->air_pose;
+    entry.cell = CommCell(entry.pose.x, entry.pose.y);
+    comm_index.push_back(entry);
+  }
+
+  std::sort(comm_index.begin(), comm_index.end());
+}
+
+int64_t World::CommCell(meters_t x, meters_t y, int dx, int dy) const
+{
+  const int64_t cx((int64_t)floor(x / comm_cell) + dx);
+  const int64_t cy((int64_t)floor(y / comm_cell) + dy);
+  return (int64_t)(((uint64_t)cx << 32) | (uint32_t)cy);
+}
+
+// ordering for least-recently-used superregion eviction
+static bool lru_superregion(const SuperRegion *a, const SuperRegion *b)
+{
+  return a->LastAccess() < b->LastAccess();
+}
+
+void World::PageSuperRegions()
+{
+  if (superregion_idle_time == 0 && superregion_memory_budget == 0)
+    return;
+
+  // paging is cheap but not free: look about once per simulated second
+  const uint64_t interval(std::max(1.0, 1e6 / (double)sim_interval));
+  if (updates % interval)
+    return;
+
+  const uint64_t idle_updates(std::max(superregion_idle_time / sim_interval, (usec_t)1));
+
+  std::vector<SuperRegion *> candidates;
+  size_t bytes(0);
+
+  for (std::map<point_int_t, SuperRegion *>::iterator it(superregions.begin());
+       it != superregions.end();) {
+    SuperRegion *sr(it->second);
+    ++it; // advance now in case sr is destroyed
+
+    if (superregion_idle_time > 0 && updates - sr->LastAccess() >= idle_updates) {
+      if (sr->GetCount() == 0 && !sr->IsCompacted()) {
+        DestroySuperRegion(sr);
+        continue;
+      }
+      sr->Compact();
+    }
+
+    if (superregion_memory_budget > 0) {
+      bytes += sr->MemoryUsage();
+      if (!sr->IsCompacted() && sr->GetCount() && sr->LastAccess() < updates)
+        candidates.push_back(sr);
+    }
+  }
+
+  if (bytes <= superregion_memory_budget)
+    return;
+
+  std::sort(candidates.begin(), candidates.end(), lru_superregion);
+
+  FOR_EACH (it, candidates) {
+    const size_t before((*it)->MemoryUsage());
+    (*it)->Compact();
+    bytes -= before - (*it)->MemoryUsage();
+
+    if (bytes <= superregion_memory_budget)
+      break;
+  }
+}
+
+unsigned int World::GetEventQueue(Model *) const
+{
+  // todo: there should be a policy that works faster than random, but
+  // random should do a good core load balancing.
+
+  if (worker_threads < 1)
+    return 0;
+  return ((random() % worker_threads) + 1);
+}
 
 Model *World::GetModel(const std::string &name) const
 {
@@ -717,6 +1768,24 @@ void World::ClearRays()
   ray_list.clear();
 }
 
+// adapts the function pointer and argument of a ray to the predicate
+// objects of the raytrace templates, for plugins and other callers
+// that pass a ray_test_func_t
+class RayFuncMatch {
+public:
+  static const uint32_t VIS = 0; // the function may match anything
+
+  RayFuncMatch(ray_test_func_t func, const void *arg) : func(func), arg(arg) {}
+  bool operator()(Model *candidate, const Model *finder) const
+  {
+    return (*func)(candidate, finder, arg);
+  }
+
+private:
+  ray_test_func_t func;
+  const void *arg;
+};
+
 // Perform multiple raytraces evenly spaced over an angular field of view
 void World::Raytrace(const Pose &gpose, // global pose
                      const meters_t range,
@@ -727,20 +1796,7 @@ void World::Raytrace(const Pose &gpose, // global pose
 		     const bool ztest,
                      std::vector<RaytraceResult> &results)
 {
-  // find the direction of the first ray
-  Pose raypose(gpose);
-  const double starta(fov / 2.0 - raypose.a);
-
-  // set up a ray to trace
-  Ray ray(mod, gpose, range, func, arg, ztest);
-
-  const size_t sample_count = results.size();
-
-  for (size_t s(0); s < sample_count; ++s) {
-    // aim the ray in the right direction before tracing
-    ray.origin.a = (s * fov / (double)(sample_count - 1)) - starta;
-    results[s] = Raytrace(ray);
-  }
+  Raytrace(Ray(mod, gpose, range, func, arg, ztest), fov, RayFuncMatch(func, arg), results);
 }
 
 RaytraceResult World::Raytrace(const Pose &gpose,
@@ -753,218 +1809,55 @@ RaytraceResult World::Raytrace(const Pose &gpose,
   return Raytrace(Ray(mod, gpose, range, func, arg, ztest));
 }
 
-RaytraceResult World::Raytrace(const Ray &r)
+uint64_t World::CellsVersion(const Pose &pos, meters_t range)
 {
-  // rt_cells.clear();
-  // rt_candidate_cells.clear();
-
-  // initialize result for return
-  RaytraceResult result(r.origin, NULL, Color(), r.range);
-
-  // our global position in (floating point) cell coordinates
-  double globx(r.origin.x * ppm);
-  double globy(r.origin.y * ppm);
-
-  // record our starting position
-  const double startx(globx);
-  const double starty(globy);
-
-  // eliminate a potential divide by zero
-  const double angle(r.origin.a == 0.0 ? 1e-12 : r.origin.a);
-  const double sina(sin(angle));
-  const double cosa(cos(angle));
-  const double tana(sina / cosa); // approximately tan(angle) but faster
-
-  // the x and y components of the ray (these need to be doubles, or a
-  // very weird and rare bug is produced)
-  const double dx(ppm * r.range * cosa);
-  const double dy(ppm * r.range * sina);
-
-  // fast integer line 3d algorithm adapted from Cohen's code from
-  // Graphics Gems IV
-  const int32_t sx(sgn(dx));
-  const int32_t sy(sgn(dy));
-  const int32_t ax(std::abs(dx));
-  const int32_t ay(std::abs(dy));
-  const int32_t bx(2 * ax);
-  const int32_t by(2 * ay);
-  int32_t exy(ay - ax); // difference between x and y distances
-  int32_t n(ax + ay); // the manhattan distance to the goal cell
-
-  // the distances between region crossings in X and Y
-  const double xjumpx(sx * REGIONWIDTH);
-  const double xjumpy(sx * REGIONWIDTH * tana);
-  const double yjumpx(sy * REGIONWIDTH / tana);
-  const double yjumpy(sy * REGIONWIDTH);
-
-  // manhattan distance between region crossings in X and Y
-  const double xjumpdist(fabs(xjumpx) + fabs(xjumpy));
-  const double yjumpdist(fabs(yjumpx) + fabs(yjumpy));
-
   const unsigned int layer((updates + 1) % 2);
 
-  // these are updated as we go along the ray
-  double xcrossx(0), xcrossy(0);
-  double ycrossx(0), ycrossy(0);
-  double distX(0), distY(0);
-  bool calculatecrossings(true);
-
-  // Stage spends up to 95% of its time in this loop! It would be
-  // neater with more function calls encapsulating things, but even
-  // inline calls have a noticeable (2-3%) effect on performance.
-
-  // several useful asserts are commented out so that Stage is not too
-  // slow in debug builds. Add them in if chasing a suspected raytrace bug
-  while (n > 0) // while we are still not at the ray end
-  {
-    SuperRegion *sr(GetSuperRegion(point_int_t(GETSREG(globx), GETSREG(globy))));
-    Region *reg(sr ? sr->GetRegion(GETREG(globx), GETREG(globy)) : NULL);
-
-    if (reg && reg->count) // if the region contains any objects
-    {
-      // assert( reg->cells.size() );
-
-      // invalidate the region crossing points used to jump over
-      // empty regions
-      calculatecrossings = true;
-
-      // convert from global cell to local cell coords
-      int32_t cx(GETCELL(globx));
-      int32_t cy(GETCELL(globy));
-
-      // since reg->count was non-zero, we expect this pointer to be good
-      Cell *c(&reg->cells[cx + cy * REGIONWIDTH]);
-
-      // while within the bounds of this region and while some ray remains
-      // we'll tweak the cell pointer directly to move around quickly
-      while ((cx >= 0) && (cx < REGIONWIDTH) && (cy >= 0) && (cy < REGIONWIDTH) && n > 0) {
-        FOR_EACH (it, c->blocks[layer]) {
-          Block *block(*it);
-          assert(block);
-
-          // skip if not in the right z range
-          if (r.ztest && (r.origin.z < block->global_z.min || r.origin.z > block->global_z.max))
-            continue;
-
-          // test the predicate we were passed
-          if ((*r.func)(&block->group->mod, r.mod, r.arg)) {
-            // a hit!
-            result.pose = r.origin;
-            result.mod = &block->group->mod;
-            result.color = result.mod->GetColor();
-
-            if (ax > ay) // faster than the equivalent hypot() call
-              result.range = fabs((globx - startx) / cosa) / ppm;
-            else
-              result.range = fabs((globy - starty) / sina) / ppm;
-
-            return result;
-          }
-        }
-
-        // increment our cell in the correct direction
-        if (exy < 0) // we're iterating along X
-        {
-          globx += sx; // global coordinate
-          exy += by;
-          c += sx; // move the cell left or right
-          cx += sx; // cell coordinate for bounds checking
-        } else // we're iterating along Y
-        {
-          globy += sy; // global coordinate
-          exy -= bx;
-          c += sy * REGIONWIDTH; // move the cell up or down
-          cy += sy; // cell coordinate for bounds checking
-        }
-        --n; // decrement the manhattan distance remaining
-
-        // rt_cells.push_back( point_int_t( globx, globy ));
-      }
-      // printf( "leaving populated region\n" );
-    } else // jump over the empty region
-    {
-      // on the first run, and when we've been iterating over
-      // cells, we need to calculate the next crossing of a region
-      // boundary along each axis
-      if (calculatecrossings) {
-        calculatecrossings = false;
-
-        // find the coordinate in cells of the bottom left corner of
-        // the current region
-        const int32_t ix(globx);
-        const int32_t iy(globy);
-        double regionx(ix / REGIONWIDTH * REGIONWIDTH);
-        double regiony(iy / REGIONWIDTH * REGIONWIDTH);
-        if ((globx < 0) && (ix % REGIONWIDTH))
-          regionx -= REGIONWIDTH;
-        if ((globy < 0) && (iy % REGIONWIDTH))
-          regiony -= REGIONWIDTH;
-
-        // calculate the distance to the edge of the current region
-        const double xdx(sx < 0 ? regionx - globx - 1.0 : // going left
-                             regionx + REGIONWIDTH - globx); // going right
-        const double xdy(xdx * tana);
-
-        const double ydy(sy < 0 ? regiony - globy - 1.0 : // going down
-                             regiony + REGIONWIDTH - globy); // going up
-        const double ydx(ydy / tana);
-
-        // these stored hit points are updated as we go along
-        xcrossx = globx + xdx;
-        xcrossy = globy + xdy;
-
-        ycrossx = globx + ydx;
-        ycrossy = globy + ydy;
-
-        // find the distances to the region crossing points
-        // manhattan distance is faster than using hypot()
-        distX = fabs(xdx) + fabs(xdy);
-        distY = fabs(ydx) + fabs(ydy);
-      }
-
-      if (distX < distY) // crossing a region boundary left or right
-      {
-        // move to the X crossing
-        globx = xcrossx;
-        globy = xcrossy;
-
-        n -= distX; // decrement remaining manhattan distance
-
-        // calculate the next region crossing
-        xcrossx += xjumpx;
-        xcrossy += xjumpy;
-
-        distY -= distX;
-        distX = xjumpdist;
-
-        // rt_candidate_cells.push_back( point_int_t( xcrossx, xcrossy ));
-      } else // crossing a region boundary up or down
-      {
-        // move to the X crossing
-        globx = ycrossx;
-        globy = ycrossy;
-
-        n -= distY; // decrement remaining manhattan distance
-
-        // calculate the next region crossing
-        ycrossx += yjumpx;
-        ycrossy += yjumpy;
-
-        distX -= distY;
-        distY = yjumpdist;
-
-        // rt_candidate_cells.push_back( point_int_t( ycrossx, ycrossy ));
-      }
+  // the cells of every ray shorter than range lie in this box, with a
+  // cell to spare for rounding
+  const int32_t x0(MetersToPixels(pos.x - range) - 1);
+  const int32_t y0(MetersToPixels(pos.y - range) - 1);
+  const int32_t x1(MetersToPixels(pos.x + range) + 1);
+  const int32_t y1(MetersToPixels(pos.y + range) + 1);
+
+  // hash the modification counters of the regions in the box, and
+  // whether their superregions exist, in a fixed order
+  const uint64_t prime(1000003);
+  uint64_t version(superregions_destroyed);
+
+  const RegionBits &bits(region_bits);
+
+  for (int32_t sy(bits.GetSReg(y0)); sy <= bits.GetSReg(y1); ++sy)
+    for (int32_t sx(bits.GetSReg(x0)); sx <= bits.GetSReg(x1); ++sx) {
+      SuperRegion *sr(GetSuperRegion(point_int_t(sx, sy)));
+      version = version * prime + (sr != NULL);
+      if (sr == NULL)
+        continue;
+
+      const int32_t rx0(sx == bits.GetSReg(x0) ? bits.GetReg(x0) : 0);
+      const int32_t ry0(sy == bits.GetSReg(y0) ? bits.GetReg(y0) : 0);
+      const int32_t rx1(sx == bits.GetSReg(x1) ? bits.GetReg(x1) : bits.superregion_width - 1);
+      const int32_t ry1(sy == bits.GetSReg(y1) ? bits.GetReg(y1) : bits.superregion_width - 1);
+
+      for (int32_t ry(ry0); ry <= ry1; ++ry)
+        for (int32_t rx(rx0); rx <= rx1; ++rx)
+          version = version * prime + sr->GetRegion(rx, ry)->modifications[layer];
     }
-    // rt_cells.push_back( point_int_t( globx, globy ));
-  }
 
-  return result;
+  return version;
 }
 
+RaytraceResult World::Raytrace(const Ray &r)
+{
+  return Raytrace(r, RayFuncMatch(r.func, r.arg));
+}
+
+// spawned models share their worldfile entity with their prototype,
+// so they are neither saved nor reloaded
 static int _save_cb(Model *mod, void *)
 {
-  mod->Save();
+  if (!mod->IsSpawned())
+    mod->Save();
   return 0;
 }
 
@@ -976,7 +1869,8 @@ bool World::Save(const char *filename)
 
 static int _reload_cb(Model *mod, void *)
 {
-  mod->Load();
+  if (!mod->IsSpawned())
+    mod->Load();
   return 0;
 }
 
@@ -987,7 +1881,8 @@ void World::Reload(void)
 }
 
 // add a block to each cell described by a polygon in world coordinates
-void World::MapPoly(const std::vector<point_int_t> &pts, Block *block, unsigned int layer)
+template <class Visitor>
+void World::TraceOutline(const std::vector<point_int_t> &pts, Visitor &visit)
 {
   const size_t pt_count(pts.size());
 
@@ -1007,77 +1902,317 @@ void World::MapPoly(const std::vector<point_int_t> &pts, Block *block, unsigned
     const int32_t by(2 * ay);
 
     int32_t exy(ay - ax);
-    int32_t n(ax + ay);
-
     int32_t globx(start.x);
     int32_t globy(start.y);
 
-    while (n) {
-      Region *reg(GetSuperRegionCreate(point_int_t(GETSREG(globx), GETSREG(globy)))
-                      ->GetRegion(GETREG(globx), GETREG(globy)));
-      assert(reg);
+    for (int32_t n(ax + ay); n > 0; --n) {
+      visit(globx, globy);
 
-      // add all the required cells in this region before looking up
-      // another region
-      int32_t cx(GETCELL(globx));
-      int32_t cy(GETCELL(globy));
-
-      // need to call Region::GetCell() before using a Cell pointer
-      // directly, because the region allocates cells lazily, waiting
-      // for a call of this method
-      Cell *c(reg->GetCell(cx, cy));
-
-      // while inside the region, manipulate the Cell pointer directly
-      while ((cx >= 0) && (cx < REGIONWIDTH) && (cy >= 0) && (cy < REGIONWIDTH) && n > 0) {
-	assert( c != NULL );
-	
-        // if the block is not already rendered in the cell
-        // if( find (block->rendered_cells[layer].begin(),
-        // block->rendered_cells[layer].end(), c )
-        // == block->rendered_cells[layer].end() )
-        c->AddBlock(block, layer);
-
-        // compute the next cell index inside the region 
-        if (exy < 0) {
-          globx += sx;
-          exy += by;
-          c += sx;
-          cx += sx;
-        } else {
-          globy += sy;
-          exy -= bx;
-          c += sy * REGIONWIDTH;
-          cy += sy;
-        }
-        --n;
+      if (exy < 0) {
+        globx += sx;
+        exy += by;
+      } else {
+        globy += sy;
+        exy -= bx;
       }
     }
   }
 }
 
+// MapPoly()'s visitor: adds the block to each cell, looking up the
+// region only when the outline crosses into another one
+class AddToCells {
+public:
+  AddToCells(World *world, Block *block, unsigned int layer)
+      : world(world), block(block), layer(layer), bits(world->GetRegionBits()), reg(NULL),
+        rx(0), ry(0)
+  {
+  }
+
+  void operator()(int32_t x, int32_t y)
+  {
+    if (reg == NULL || (x >> bits.rbits) != rx || (y >> bits.rbits) != ry) {
+      SuperRegion *sr(
+          world->GetSuperRegionCreate(point_int_t(bits.GetSReg(x), bits.GetSReg(y))));
+
+      sr->Touch(world->UpdateCount());
+      if (sr->IsCompacted())
+        sr->Expand();
+
+      reg = sr->GetRegion(bits.GetReg(x), bits.GetReg(y));
+      assert(reg);
+      rx = x >> bits.rbits;
+      ry = y >> bits.rbits;
+    }
+
+    // Region::GetCell() allocates the region's cells on first use
+    reg->GetCell(bits.GetCell(x), bits.GetCell(y))->AddBlock(block, layer);
+  }
+
+private:
+  World *world;
+  Block *block;
+  const unsigned int layer;
+  const RegionBits bits;
+  Region *reg; ///< the region of the last cell visited
+  int32_t rx, ry; ///< the global coordinates of reg
+};
+
+void World::MapPoly(const std::vector<point_int_t> &pts, Block *block, unsigned int layer)
+{
+  AddToCells visit(this, block, layer);
+  TraceOutline(pts, visit);
+}
+
+bool World::MapCell::operator<(const MapCell &other) const
+{
+  return (sr == other.sr ? offset < other.offset : sr < other.sr);
+}
+
+// the work shared by the threads of MapModels()
+struct World::MapJob {
+  const World *world;
+  const std::vector<Model *> *mods;
+  std::vector<std::vector<MapCell> > rasters; ///< the cells of each model
+  std::vector<MapCell> cells; ///< all the cells, sorted by superregion
+  std::vector<size_t> starts; ///< the first cell in each superregion, and the end
+  std::vector<SuperRegion *> srs; ///< the superregion of each run of cells
+};
+
+void World::RasterizeJob(void *arg, size_t i)
+{
+  MapJob *job(static_cast<MapJob *>(arg));
+  job->world->RasterizeModel((*job->mods)[i], job->rasters[i]);
+}
+
+void World::PlaceJob(void *arg, size_t i)
+{
+  MapJob *job(static_cast<MapJob *>(arg));
+  SuperRegion *sr(job->srs[i]);
+  const RegionBits &bits(sr->Bits());
+
+  // nothing outside sr is touched, so the superregions are independent
+  for (size_t c(job->starts[i]); c < job->starts[i + 1]; ++c) {
+    MapCell &mc(job->cells[c]);
+    const uint32_t reg(mc.offset >> (2 * bits.rbits));
+    const uint32_t cell(mc.offset & (bits.region_size - 1));
+
+    mc.cell = sr->GetRegion(reg & (bits.superregion_width - 1), reg >> bits.sbits)
+                  ->GetCell(cell & (bits.region_width - 1), cell >> bits.rbits);
+    mc.before[0] = mc.cell->PlaceBlock(mc.block, 0);
+    mc.before[1] = mc.cell->PlaceBlock(mc.block, 1);
+  }
+}
+
+// RasterizeModel()'s visitor: records each cell for PlaceJob()
+struct World::CollectCells {
+  const RegionBits &bits;
+  Block *block;
+  std::vector<MapCell> &cells;
+
+  CollectCells(const RegionBits &bits, Block *block, std::vector<MapCell> &cells)
+      : bits(bits), block(block), cells(cells)
+  {
+  }
+
+  void operator()(int32_t x, int32_t y)
+  {
+    MapCell mc;
+    mc.sr = point_int_t(bits.GetSReg(x), bits.GetSReg(y));
+    mc.offset = ((bits.GetReg(x) + (bits.GetReg(y) << bits.sbits)) << (2 * bits.rbits))
+                | (bits.GetCell(x) + (bits.GetCell(y) << bits.rbits));
+    mc.block = block;
+    mc.cell = NULL;
+    cells.push_back(mc);
+  }
+};
+
+void World::RasterizeModel(Model *mod, std::vector<MapCell> &cells) const
+{
+  const RegionBits bits(region_bits);
+  std::vector<point_int_t> pixels;
+
+  mod->blockgroup.CalcSize();
+
+  FOR_EACH (it, mod->blockgroup.blocks) {
+    Block &block(*it);
+    const size_t cells_before(cells.size());
+
+    // as Block::Map()
+    Pose gpose(mod->GetGlobalPose());
+    gpose.z += mod->geom.pose.z;
+    block.global_z.min = block.local_z.min + gpose.z;
+    block.global_z.max = block.local_z.max + gpose.z;
+
+    mod->LocalToPixels(block.pts, pixels);
+
+    // the same cells as MapPoly(), in the same order
+    CollectCells visit(bits, &block, cells);
+    TraceOutline(pixels, visit);
+
+    // counted as the two Block::Map() calls it replaces
+    if (profiling) {
+      mod->profile.maps += 2;
+      mod->profile.map_cells += 2 * (cells.size() - cells_before);
+    }
+  }
+}
+
+void World::MapModels(const std::vector<Model *> &mods)
+{
+  FOR_EACH (it, mods)
+    (*it)->UnMap(); // clears both layers
+
+  MapJob job;
+  job.world = this;
+  job.mods = &mods;
+  job.rasters.resize(mods.size());
+
+  // the models share the pose caches of their ancestors, so fill
+  // them here rather than race to fill them from the threads
+  FOR_EACH (it, mods)
+    (*it)->CachedGlobalPose();
+
+  const unsigned int threads(LoadThreads());
+  parallel_for(threads, mods.size(), RasterizeJob, &job);
+
+  // in the order Map() would have placed them, so that each cell
+  // lists its blocks as it would have
+  size_t total(0);
+  FOR_EACH (it, job.rasters)
+    total += it->size();
+  job.cells.reserve(total);
+  FOR_EACH (it, job.rasters) {
+    job.cells.insert(job.cells.end(), it->begin(), it->end());
+    std::vector<MapCell>().swap(*it);
+  }
+
+  std::stable_sort(job.cells.begin(), job.cells.end());
+
+  // creating superregions extends the world, so it is done here
+  for (size_t c(0); c < job.cells.size(); ++c)
+    if (c == 0 || !(job.cells[c].sr == job.cells[c - 1].sr)) {
+      SuperRegion *sr(GetSuperRegionCreate(job.cells[c].sr));
+      sr->Touch(updates);
+      if (sr->IsCompacted())
+        sr->Expand();
+
+      job.starts.push_back(c);
+      job.srs.push_back(sr);
+    }
+  job.starts.push_back(job.cells.size());
+
+  parallel_for(threads, job.srs.size(), PlaceJob, &job);
+
+  // the contacts pair blocks of different models, so they are added
+  // on one thread
+  FOR_EACH (it, job.cells) {
+    it->cell->LinkBlock(it->block, 0, it->before[0]);
+    it->cell->LinkBlock(it->block, 1, it->before[1]);
+  }
+}
+
 SuperRegion *World::AddSuperRegion(const point_int_t &sup)
 {
   SuperRegion *sr(CreateSuperRegion(sup));
 
   // set the lower left corner of the new superregion
-  Extend(point3_t((sup.x << SRBITS) / ppm, (sup.y << SRBITS) / ppm, 0));
+  Extend(point3_t((sup.x << region_bits.srbits) / ppm, (sup.y << region_bits.srbits) / ppm, 0));
 
   // top right corner of the new superregion
-  Extend(point3_t(((sup.x + 1) << SRBITS) / ppm, ((sup.y + 1) << SRBITS) / ppm, 0));
+  Extend(point3_t(((sup.x + 1) << region_bits.srbits) / ppm,
+                  ((sup.y + 1) << region_bits.srbits) / ppm, 0));
   return sr;
 }
 
-inline SuperRegion *World::GetSuperRegion(const point_int_t &org)
+bool World::SetRegionBits(const RegionBits &bits)
 {
-  SuperRegion *sr(NULL);
+  if (!bits.Valid()) {
+    PRINT_WARN2("region_bits [%u %u] out of range, ignored", bits.rbits, bits.sbits);
+    return false;
+  }
 
-  // I despise some STL syntax sometimes...
-  std::map<point_int_t, SuperRegion *>::iterator it(superregions.find(org));
+  if (bits == region_bits)
+    return true;
 
-  if (it != superregions.end())
-    sr = it->second;
+  // empty the grid, so that every superregion can go
+  FOR_EACH (it, models)
+    (*it)->UnMap();
 
-  return sr;
+  FOR_EACH (it, superregions) {
+    delete it->second;
+    ++superregions_destroyed;
+  }
+  superregions.clear();
+
+  // the extent of the world is that of its superregions, which change
+  // size with the grid
+  extent = bounds3d_t();
+  region_bits = bits;
+
+  FOR_EACH (it, models)
+    (*it)->Map();
+
+  dirty = true;
+  return true;
+}
+
+// stops rays at anything solid, like a typical sensor
+class TuneMatch {
+public:
+  static const uint32_t VIS = Model::VIS_OBSTACLE;
+
+  bool operator()(Model *, const Model *) const
+  {
+    return true; // VIS has already picked out the obstacles
+  }
+};
+
+void World::TuneRegionBits()
+{
+  // random rays the length of a typical ranger's, from anywhere on the
+  // map, the same for every shape of grid
+  const unsigned int count(20000);
+  const meters_t range(8.0);
+  unsigned short seed[3] = { 1, 2, 3 };
+  std::vector<Ray> rays(count);
+  FOR_EACH (it, rays)
+    *it = Ray(NULL, Pose(extent.x.min + erand48(seed) * (extent.x.max - extent.x.min),
+                         extent.y.min + erand48(seed) * (extent.y.max - extent.y.min), 0,
+                         normalize(erand48(seed) * 2.0 * M_PI)),
+              range, NULL, NULL, false);
+
+  RegionBits best(region_bits);
+  uint64_t best_time(0);
+
+  // regions of 8 to 128 cells, in superregions of 256 to 4096 cells
+  for (uint32_t rbits(3); rbits <= 7; ++rbits)
+    for (uint32_t sbits(3); sbits <= 7; ++sbits) {
+      const RegionBits bits(rbits, sbits);
+      if (bits.srbits < 8 || bits.srbits > 12)
+        continue;
+
+      SetRegionBits(bits);
+
+      // once to allocate the cells and warm the caches, then timed
+      double sum(0);
+      FOR_EACH (it, rays)
+        sum += Raytrace(*it, TuneMatch()).range;
+      const uint64_t start(ProfileClock());
+      FOR_EACH (it, rays)
+        sum += Raytrace(*it, TuneMatch()).range;
+      const uint64_t time(ProfileClock() - start);
+
+      PRINT_DEBUG4("region_bits [%u %u] %.1f ns/ray (%.0f)", rbits, sbits, time / (double)count,
+                   sum);
+      if (best_time == 0 || time < best_time) {
+        best = bits;
+        best_time = time;
+      }
+    }
+
+  SetRegionBits(best);
+  printf("[region_bits %u %u]", best.rbits, best.sbits);
 }
 
 inline SuperRegion *World::GetSuperRegionCreate(const point_int_t &org)
@@ -1119,11 +2254,441 @@ void World::RegisterOption(Option *opt)
   option_table.insert(opt);
 }
 
-void World::Log(Model *)
+void World::Log(Model *mod)
+{
+  if (logger)
+    mod->LogState(*logger, mod->event_queue_num, mod->log_kinds);
+}
+
+void World::Publish(Model *mod)
+{
+  if (mod->shm == NULL) {
+    // size the frames by the model's first one
+    ShmSizer sizer;
+    mod->LogState(sizer, mod->event_queue_num, mod->shm_kinds);
+    const size_t frame(std::max<size_t>(shm_frame, 2 * sizer.bytes));
+
+    // only position models take commands
+    mod->shm = new ShmPublisher(ShmName(shm_prefix, mod->token), mod->id, mod->type,
+                                mod->shm_kinds, shm_slots,
+                                frame + sizeof(ShmFormat::FrameHeader),
+                                dynamic_cast<ModelPosition *>(mod) ? shm_commands : 0);
+  }
+
+  if (!mod->shm->Ok())
+    return;
+
+  mod->shm->BeginFrame(sim_time);
+  mod->LogState(*mod->shm, mod->event_queue_num, mod->shm_kinds);
+  mod->shm->EndFrame();
+}
+
+void World::CloseLog(FILE *report)
+{
+  if (logger == NULL)
+    return;
+
+  logger->Close();
+  if (report)
+    logger->Report(report);
+
+  delete logger;
+  logger = NULL;
+}
+
+bool World::ReplayOnTrack(Model *mod) const
+{
+  uint32_t count(0);
+  const float *rec(replay->Find(mod->id, LOG_POSE, 0, sim_time, count));
+  if (rec == NULL || count < 4)
+    return true;
+
+  const Pose gpose(mod->GetGlobalPose());
+  return hypot(gpose.x - rec[0], gpose.y - rec[1]) <= replay_tolerance
+         && fabs(gpose.z - rec[2]) <= replay_tolerance
+         && fabs(normalize(gpose.a - rec[3])) <= replay_angle_tolerance;
+}
+
+const float *World::Replay(Model *mod, log_kind_t kind, uint16_t aux, uint32_t &count)
+{
+  if (replay == NULL)
+    return NULL;
+
+  // sensor models run in worker threads, hence the atomic counters
+  const float *values(NULL);
+  if (!replay_diverged && ReplayOnTrack(mod))
+    values = replay->Find(mod->id, kind, aux, sim_time, count);
+
+  __sync_fetch_and_add(values ? &replay_hits : &replay_misses, 1);
+  return values;
+}
+
+void World::ReplayCheck(Model *mod)
+{
+  if (replay_diverged || ReplayOnTrack(mod))
+    return;
+
+  // only the first model to leave its trajectory reports it
+  if (__sync_bool_compare_and_swap(&replay_diverged, 0, 1)) {
+    replay_diverged_time = sim_time;
+    PRINT_WARN2("replay: %s left its recorded trajectory at %.3f s, sensing live from now on",
+                mod->Token(), sim_time / 1e6);
+  }
+}
+
+void World::ReplayReport(FILE *fp) const
+{
+  if (replay == NULL)
+    return;
+
+  const uint64_t updates(replay_hits + replay_misses);
+  fprintf(fp, "\n[Replay %s: %llu of %llu sensor updates replayed (%.1f%%)", Token(),
+          (unsigned long long)replay_hits, (unsigned long long)updates,
+          updates ? 100.0 * replay_hits / updates : 0.0);
+  if (replay_diverged)
+    fprintf(fp, ", diverged at %.3f s", replay_diverged_time / 1e6);
+  fputs("]", fp);
+}
+
+void World::ClearProfile()
+{
+  profile = Profile();
+  profile.worker_time.resize(worker_threads + 1);
+  profile.worker_events.resize(worker_threads + 1);
+  profile.pose_cache.resize(worker_threads + 1);
+
+  FOR_EACH (it, models)
+    (*it)->profile.Clear();
+}
+
+// order models by decreasing update time
+static bool more_update_time(const Model *a, const Model *b)
+{
+  return a->GetProfile().update_time > b->GetProfile().update_time;
+}
+
+// order types by decreasing update time
+static bool more_type_update_time(const std::pair<std::string, ModelProfile> &a,
+                                  const std::pair<std::string, ModelProfile> &b)
+{
+  return a.second.update_time > b.second.update_time;
+}
+
+// count is the number of models of a type, or 0 for a model's own
+// row, which leaves the column empty
+static void profile_row(FILE *fp, bool csv, const char *scope, const std::string &name,
+                        const std::string &type, uint64_t count, const ModelProfile &p)
+{
+  char countstr[24] = "";
+  if (count)
+    snprintf(countstr, sizeof(countstr), "%llu", (unsigned long long)count);
+
+  if (csv)
+    fprintf(fp, "%s,%s,%s,%s,%llu,%.3f,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.3f,%llu,%llu\n", scope,
+            name.c_str(), type.c_str(), countstr,
+            (unsigned long long)p.updates, p.update_time / 1e6, (unsigned long long)p.rays,
+            (unsigned long long)p.cells, (unsigned long long)p.maps,
+            (unsigned long long)p.map_cells, (unsigned long long)p.unmaps, (unsigned long long)p.collision_tests,
+            (unsigned long long)p.callbacks, p.callback_time / 1e6, (unsigned long long)p.scans,
+            (unsigned long long)p.scans_cached);
+  else
+    fprintf(fp, "  %-32s %6s %8llu %10.3f %10llu %12llu %8llu %8llu %8llu %10.3f\n",
+            name.c_str(), countstr, (unsigned long long)p.updates,
+            p.update_time / 1e6, (unsigned long long)p.rays, (unsigned long long)p.cells,
+            (unsigned long long)p.maps, (unsigned long long)p.unmaps,
+            (unsigned long long)p.collision_tests, p.callback_time / 1e6);
+}
+
+static void profile_phase(FILE *fp, bool csv, const char *name, uint64_t time, uint64_t total,
+                          uint64_t updates)
+{
+  if (csv)
+    fprintf(fp, "phase,%s,,,%llu,%.3f,,,,,,,,,,\n", name, (unsigned long long)updates, time / 1e6);
+  else
+    fprintf(fp, "  %-16s %12.3f %10.4f %6.1f%%\n", name, time / 1e6,
+            updates ? time / 1e6 / updates : 0.0, total ? 100.0 * time / total : 0.0);
+}
+
+void World::ProfileWorkerReport(FILE *fp, bool csv) const
+{
+  // how busy each worker was while the workers were running
+  if (profile.worker_time.size() < 2)
+    return;
+
+  std::vector<unsigned int> queued(profile.worker_time.size(), 0);
+  FOR_EACH (it, models)
+    if ((*it)->event_queue_num < queued.size())
+      ++queued[(*it)->event_queue_num];
+
+  const uint64_t window(profile.worker_window);
+  if (csv)
+    fprintf(fp, "\nthread,cpu,models,events,busy_ms,window_ms\n");
+  else
+    fprintf(fp, "\n  %-10s %5s %8s %10s %12s %8s   (workers ran for %.3f ms)\n", "thread", "cpu",
+            "models", "events", "busy ms", "busy", window / 1e6);
+
+  for (size_t t(1); t < profile.worker_time.size(); ++t) {
+    char name[32], cpu[16] = ""; // empty if the worker is not pinned
+    snprintf(name, sizeof(name), "worker_%u", (unsigned int)t);
+    if (t < worker_cpus.size() && worker_cpus[t] >= 0)
+      snprintf(cpu, sizeof(cpu), "%d", worker_cpus[t]);
+    const uint64_t events(t < profile.worker_events.size() ? profile.worker_events[t] : 0);
+
+    if (csv)
+      fprintf(fp, "%s,%s,%u,%llu,%.3f,%.3f\n", name, cpu, queued[t],
+              (unsigned long long)events, profile.worker_time[t] / 1e6, window / 1e6);
+    else
+      fprintf(fp, "  %-10s %5s %8u %10llu %12.3f %7.1f%%\n", name, cpu[0] ? cpu : "-", queued[t],
+              (unsigned long long)events, profile.worker_time[t] / 1e6,
+              window ? 100.0 * profile.worker_time[t] / window : 0.0);
+  }
+}
+
+void World::ProfileChurnReport(FILE *fp, bool csv) const
+{
+  // models coming and going through SpawnModels() and DespawnModels()
+  if (!(profile.spawned || profile.respawned || profile.despawned))
+    return;
+
+  const double per_update(profile.updates ? 1.0 / profile.updates : 0.0);
+  if (csv)
+    fprintf(fp, "\nspawned,respawned,despawned,pooled,updates\n%llu,%llu,%llu,%u,%llu\n",
+            (unsigned long long)profile.spawned, (unsigned long long)profile.respawned,
+            (unsigned long long)profile.despawned, (unsigned int)PooledModels(),
+            (unsigned long long)profile.updates);
+  else
+    fprintf(fp,
+            "\n  churn: %llu spawned, %llu respawned from the pool, %llu despawned "
+            "(%.3f, %.3f, %.3f per update), %u pooled\n",
+            (unsigned long long)profile.spawned, (unsigned long long)profile.respawned,
+            (unsigned long long)profile.despawned, profile.spawned * per_update,
+            profile.respawned * per_update, profile.despawned * per_update,
+            (unsigned int)PooledModels());
+}
+
+void World::ProfileReport(FILE *fp, bool csv) const
+{
+  std::vector<Model *> sorted(models.begin(), models.end());
+  std::sort(sorted.begin(), sorted.end(), more_update_time);
+
+  // accumulate the models' profiles by type
+  std::map<std::string, std::pair<uint64_t, ModelProfile> > bytype;
+  FOR_EACH (it, sorted) {
+    std::pair<uint64_t, ModelProfile> &t(bytype[(*it)->GetModelType()]);
+    ++t.first;
+    t.second += (*it)->GetProfile();
+  }
+
+  std::vector<std::pair<std::string, ModelProfile> > types;
+  FOR_EACH (it, bytype)
+    types.push_back(std::make_pair(it->first, it->second.second));
+  std::sort(types.begin(), types.end(), more_type_update_time);
+
+  const uint64_t total(profile.update_time);
+
+  if (csv)
+    fprintf(fp, "scope,name,type,count,updates,update_ms,rays,cells,maps,map_cells,unmaps,"
+                "collision_tests,callbacks,callback_ms,scans,scans_cached\n");
+  else {
+    fprintf(fp, "\n[Profile %s: %llu updates, %.3f s in World::Update()]\n", Token(),
+            (unsigned long long)profile.updates, total / 1e9);
+    fprintf(fp, "  %-16s %12s %10s %7s\n", "phase", "total ms", "ms/update", "share");
+  }
+
+  profile_phase(fp, csv, "sort_fiducials", profile.sort_time, total, profile.updates);
+  profile_phase(fp, csv, "main_queue", profile.main_queue_time, total, profile.updates);
+  profile_phase(fp, csv, "move", profile.move_time, total, profile.updates);
+  profile_phase(fp, csv, "barrier_wait", profile.barrier_time, total, profile.updates);
+  profile_phase(fp, csv, "callbacks", profile.callback_time, total, profile.updates);
+  profile_phase(fp, csv, "charge", profile.charge_time, total, profile.updates);
+
+  for (size_t t(1); t < profile.worker_time.size(); ++t) {
+    char name[32];
+    snprintf(name, sizeof(name), "worker_%u", (unsigned int)t);
+    profile_phase(fp, csv, name, profile.worker_time[t], total, profile.updates);
+  }
+
+  if (!csv) {
+    ProfileWorkerReport(fp, false);
+    ProfileChurnReport(fp, false);
+    fprintf(fp, "\n  %-32s %6s %8s %10s %10s %12s %8s %8s %8s %10s\n", "type", "count",
+            "updates", "update ms", "rays", "cells", "maps", "unmaps", "collide", "cb ms");
+  }
+
+  FOR_EACH (it, types)
+    profile_row(fp, csv, "type", it->first, it->first, bytype[it->first].first, it->second);
+
+  if (!csv)
+    fprintf(fp, "\n  %-32s %6s %8s %10s %10s %12s %8s %8s %8s %10s\n", "model", "", "updates",
+            "update ms", "rays", "cells", "maps", "unmaps", "collide", "cb ms");
+
+  FOR_EACH (it, sorted)
+    profile_row(fp, csv, "model", (*it)->TokenStr(), (*it)->GetModelType(), 0,
+                (*it)->GetProfile());
+
+  // the CSV sections that follow the table have columns of their own
+  if (csv) {
+    ProfileWorkerReport(fp, true);
+    ProfileChurnReport(fp, true);
+  }
+
+  if (!csv) {
+    const PoseCacheStats pc(GetPoseCacheStats());
+    fprintf(fp, "\n  pose cache: %llu lookups, %llu compositions, %llu saved\n",
+            (unsigned long long)pc.lookups, (unsigned long long)pc.compositions,
+            (unsigned long long)pc.saved);
+
+    ModelProfile all;
+    FOR_EACH (it, types)
+      all += it->second;
+    if (all.scans)
+      fprintf(fp, "  scan cache: %llu of %llu ranger scans reused (%.1f%%)\n",
+              (unsigned long long)all.scans_cached, (unsigned long long)all.scans,
+              100.0 * all.scans_cached / all.scans);
+  }
+
+  fflush(fp);
+}
+
+ModelProfile World::GetModelProfileTotal() const
+{
+  ModelProfile total;
+  FOR_EACH (it, models)
+    total += (*it)->GetProfile();
+  return total;
+}
+
+World::PoseCacheStats World::GetPoseCacheStats() const
+{
+  PoseCacheStats stats;
+
+  FOR_EACH (it, profile.pose_cache) {
+    stats.lookups += it->lookups;
+    stats.compositions += it->compositions;
+    stats.saved += it->saved;
+  }
+
+  stats.saved = (stats.saved > stats.compositions ? stats.saved - stats.compositions : 0);
+  return stats;
+}
+
+World::PoseCacheStats &World::ThreadPoseCacheStats()
+{
+  assert(thread_index < (int)profile.pose_cache.size());
+  return profile.pose_cache[thread_index];
+}
+
+void World::SetPacing(double speedup, PacePolicy policy)
+{
+  pace_speedup = speedup;
+  pace_policy = policy;
+  pace_deadline = 0; // restart the schedule from the next update
+}
+
+void World::Pace()
 {
-  // LogEntry( sim_time, mod);
-  // printf( "log entry count %u\n", (unsigned int)LogEntry::Count() );
-  // LogEntry::Print();
+  if (pace_speedup <= 0.0 || PastQuitTime() || World::quit_all || quit)
+    return;
+
+  // the wall clock time between deadlines, in nanoseconds
+  const uint64_t period((uint64_t)(sim_interval * 1e3 / pace_speedup));
+
+  uint64_t now(ProfileClock());
+
+  // deadlines are absolute, so time spent sleeping too long or
+  // updating is not carried over into the next period
+  if (pace_deadline == 0)
+    pace_deadline = now;
+  else
+    pace_deadline += period;
+
+  if (now < pace_deadline) {
+#ifdef TIMER_ABSTIME
+    struct timespec ts;
+    ts.tv_sec = pace_deadline / 1000000000ULL;
+    ts.tv_nsec = pace_deadline % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+#else
+    const uint64_t wait(pace_deadline - now);
+    struct timespec ts;
+    ts.tv_sec = wait / 1000000000ULL;
+    ts.tv_nsec = wait % 1000000000ULL;
+    nanosleep(&ts, NULL);
+#endif
+    now = ProfileClock();
+  }
+
+  const uint64_t lateness(now > pace_deadline ? now - pace_deadline : 0);
+  pace_stats.Add(lateness);
+
+  if (period > 0 && lateness >= period) {
+    ++pace_stats.late;
+
+    if (pace_policy == PACE_SKIP) {
+      // move the schedule to the latest deadline that has passed
+      const uint64_t missed(lateness / period);
+      pace_stats.skipped += missed;
+      pace_deadline += missed * period;
+    }
+  }
+}
+
+void World::PaceReport(FILE *fp) const
+{
+  const PaceStats &p(pace_stats);
+
+  fprintf(fp,
+          "\n[Pacing %s: speedup %.2f %s, %llu updates, lateness mean %.1f us, stddev %.1f us, "
+          "p99 < %.0f us, max %.1f us, %llu late, %llu skipped]",
+          Token(), pace_speedup, pace_policy == PACE_SKIP ? "skip" : "catchup",
+          (unsigned long long)p.ticks, p.Mean() / 1e3, p.StdDev() / 1e3, p.Percentile(0.99) / 1e3,
+          p.lateness_max / 1e3, (unsigned long long)p.late, (unsigned long long)p.skipped);
+}
+
+void World::PaceStats::Clear()
+{
+  ticks = late = skipped = lateness_max = 0;
+  lateness_sum = lateness_sum_sq = 0.0;
+  memset(histogram, 0, sizeof(histogram));
+}
+
+void World::PaceStats::Add(uint64_t lateness)
+{
+  ++ticks;
+  lateness_max = std::max(lateness_max, lateness);
+  lateness_sum += lateness;
+  lateness_sum_sq += (double)lateness * lateness;
+
+  // bin b holds latenesses of less than 2^b microseconds
+  unsigned int bin(0);
+  for (uint64_t us(lateness / 1000); us && bin < 31; us >>= 1)
+    ++bin;
+  ++histogram[bin];
+}
+
+double World::PaceStats::Mean() const
+{
+  return ticks ? lateness_sum / ticks : 0.0;
+}
+
+double World::PaceStats::StdDev() const
+{
+  if (ticks < 2)
+    return 0.0;
+  const double mean(Mean());
+  return sqrt(std::max(0.0, lateness_sum_sq / ticks - mean * mean));
+}
+
+uint64_t World::PaceStats::Percentile(double fraction) const
+{
+  uint64_t count(0);
+  for (unsigned int bin(0); bin < 32; ++bin) {
+    count += histogram[bin];
+    if (count >= fraction * ticks)
+      return (1ULL << bin) * 1000;
+  }
+  return lateness_max;
 }
 
 bool World::Event::operator<(const Event &other) const
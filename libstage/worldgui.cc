@@ -26,6 +26,7 @@ API: Stg::WorldGui
 
 speedup 1
 confirm_on_quit 1
+sim_thread 0
 
 @verbatim
 window
@@ -68,6 +69,16 @@ window
  - confirm_on_quit <int>\n
  If non-zero, a dialog box will pop up when exiting Stage through the UI.
 
+ - sim_thread <int>\n
+ If non-zero, the simulation runs on a thread of its own, paced to
+ the speedup on a schedule of absolute deadlines, and the window is
+ redrawn between its updates. Slow frames then no longer slow the
+ simulation down, and a busy simulation no longer makes the window
+ unresponsive. The simulation waits while a frame is drawn, so large
+ visualizations still cost simulation time. Controllers then run on
+ the simulation thread, so must not call FLTK, and camera models,
+ which render with OpenGL, are not supported.
+
 - size [ <width:int> <height:int> ]\n
 size of the window in pixels
 - center [ <x:float> <y:float> ]\n
@@ -197,8 +208,16 @@ WorldGui::WorldGui(int width, int height, const char *caption)
       drawOptions(), fileMan(new FileManager()), interval_log(), speedup(1.0), // real time
       confirm_on_quit(true), mbar(new Fl_Menu_Bar(0, 0, width, 30)), oDlg(NULL), pause_time(false),
       real_time_interval(sim_interval), real_time_now(RealTimeNow()),
-      real_time_recorded(real_time_now), timing_interval(20)
+      real_time_recorded(real_time_now), timing_interval(20), sim_threaded(false),
+      sim_thread_started(false), sim_thread(), sim_mutex(), sim_cond(), gui_waiting(0)
 {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&sim_mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  pthread_cond_init(&sim_cond, NULL);
+
   Fl::lock(); // start FLTK's thread safe behaviour
 
   Fl::scheme("");
@@ -247,6 +266,14 @@ WorldGui::WorldGui(int width, int height, const char *caption)
 
 WorldGui::~WorldGui()
 {
+  if (sim_thread_started) {
+    Lock();
+    Quit();
+    pthread_cond_signal(&sim_cond);
+    Unlock();
+    pthread_join(sim_thread, NULL);
+  }
+
   if (mbar)
     delete mbar;
   if (oDlg)
@@ -304,6 +331,7 @@ void WorldGui::LoadWorldGuiPostHook(usec_t load_start_time)
   speedup = wf->ReadFloat(world_section, "speedup", speedup);
   paused = wf->ReadInt(world_section, "paused", paused);
   confirm_on_quit = wf->ReadInt(world_section, "confirm_on_quit", confirm_on_quit);
+  sim_threaded = wf->ReadInt(world_section, "sim_thread", sim_threaded);
 
   // use the window section for the rest
   const int window_section = wf->LookupEntity("window");
@@ -380,6 +408,7 @@ bool WorldGui::Save(const char *filename)
   wf->WriteFloat(world_section, "speedup", speedup);
   wf->WriteInt(world_section, "paused", paused);
   wf->WriteInt(world_section, "confirm_on_quit", confirm_on_quit);
+  wf->WriteInt(world_section, "sim_thread", sim_threaded);
 
   // use the window section for the rest
   const int window_section = wf->LookupEntity("window");
@@ -406,7 +435,7 @@ static void UpdateCallback(WorldGui *world)
 
 bool WorldGui::Update()
 {
-  if (speedup > 0)
+  if (speedup > 0 && !sim_threaded)
     Fl::repeat_timeout((sim_interval / 1e6) / speedup, (Fl_Timeout_Handler)UpdateCallback, this);
   // else we're called by an idle callback
 
@@ -429,12 +458,74 @@ bool WorldGui::Update()
 
   if (done) {
     quit_time = 0; // allows us to continue by un-pausing
-    Stop();
+    if (sim_threaded)
+      World::Stop(); // FLTK's timeouts belong to the main thread
+    else
+      Stop();
   }
 
   return done;
 }
 
+void *WorldGui::SimThreadEntry(WorldGui *wg)
+{
+  wg->SimThreadLoop();
+  return NULL;
+}
+
+void WorldGui::SimThreadLoop()
+{
+  pthread_mutex_lock(&sim_mutex);
+
+  while (!TestQuit()) {
+    if (paused) {
+      pthread_cond_wait(&sim_cond, &sim_mutex);
+      if (!paused) // resumed, so start a new schedule
+        SetPacing(speedup, GetPacePolicy());
+      continue;
+    }
+
+    // follow changes made to the speed in the Run menu
+    if (speedup != GetPaceSpeedup())
+      SetPacing(speedup, GetPacePolicy());
+
+    // wait for the next deadline without holding the world
+    pthread_mutex_unlock(&sim_mutex);
+    Pace();
+    pthread_mutex_lock(&sim_mutex);
+
+    // hand the world to the GUI if it is waiting for it, until
+    // Unlock() signals that it is done
+    while (gui_waiting)
+      pthread_cond_wait(&sim_cond, &sim_mutex);
+
+    if (!paused)
+      Update();
+  }
+
+  pthread_mutex_unlock(&sim_mutex);
+}
+
+void WorldGui::Lock()
+{
+  __sync_fetch_and_add(&gui_waiting, 1);
+  pthread_mutex_lock(&sim_mutex);
+  __sync_fetch_and_sub(&gui_waiting, 1);
+}
+
+void WorldGui::Unlock()
+{
+  pthread_cond_signal(&sim_cond);
+  pthread_mutex_unlock(&sim_mutex);
+}
+
+void WorldGui::CloseLog(FILE *report)
+{
+  Lock();
+  World::CloseLog(report);
+  Unlock();
+}
+
 std::string WorldGui::ClockString() const
 {
   std::string str = World::ClockString();
@@ -544,6 +635,8 @@ void WorldGui::fileLoadCb(Fl_Widget *, WorldGui *wg)
     if (FileManager::readable(filename)) {
       // file is readable, clear and load
 
+      wg->Lock();
+
       // if (initialized) {
       wg->Stop();
       wg->UnLoad();
@@ -551,6 +644,7 @@ void WorldGui::fileLoadCb(Fl_Widget *, WorldGui *wg)
 
       // todo: make sure loading is successful
       wg->Load(filename);
+      wg->Unlock();
       wg->Start(); // if (stopped)
     } else {
       fl_alert("Unable to read selected world file.");
@@ -561,7 +655,9 @@ void WorldGui::fileLoadCb(Fl_Widget *, WorldGui *wg)
 void WorldGui::fileSaveCb(Fl_Widget *, WorldGui *wg)
 {
   // save to current file
+  wg->Lock();
   const bool success = wg->Save(NULL);
+  wg->Unlock();
   if (!success) {
     fl_alert("Error saving world file.");
   }
@@ -649,6 +745,19 @@ void WorldGui::SetTimeouts()
   Fl::remove_idle((Fl_Timeout_Handler)UpdateCallback, this);
   Fl::remove_timeout((Fl_Timeout_Handler)UpdateCallback, this);
 
+  if (sim_threaded) {
+    // the simulation thread follows the speedup by itself
+    if (!sim_thread_started) {
+      pthread_create(&sim_thread, NULL, (void *(*)(void *))WorldGui::SimThreadEntry, this);
+      sim_thread_started = true;
+    }
+
+    Lock();
+    pthread_cond_signal(&sim_cond);
+    Unlock();
+    return;
+  }
+
   if (speedup > 0.0)
     // attempt some multiple of real time
     Fl::add_timeout((sim_interval / 1e6) / speedup, (Fl_Timeout_Handler)UpdateCallback, this);
@@ -681,7 +790,9 @@ void WorldGui::onceCb(Fl_Widget *, WorldGui *wg)
   wg->Stop();
 
   // run exactly once
+  wg->Lock();
   wg->World::Update();
+  wg->Unlock();
 }
 
 void WorldGui::viewOptionsCb(OptionsDlg *, WorldGui *wg)
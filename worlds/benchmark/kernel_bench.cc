@@ -0,0 +1,418 @@
+/////////////////////////////////
+// File: kernel_bench.cc
+// Desc: Microbenchmarks of the raytracing, block mapping and
+//       collision testing kernels on synthetic worlds.
+// License: GPL
+/////////////////////////////////
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "stage.hh"
+using namespace Stg;
+
+const char *USAGE =
+    "USAGE:  stage-kernel-bench [options]\n"
+    "Times World::Raytrace(), block mapping and collision tests in isolation\n"
+    "on synthetic worlds, and reports the median and 99th percentile time per\n"
+    "call and the cycles spent per occupancy grid cell.\n"
+    "Available [options] are:\n"
+    "  --scene name     : empty, corridor, cluttered, cave or all (default all)\n"
+    "  --kernel name    : raytrace, map, collision or all (default all)\n"
+    "  --samples n      : timed batches per kernel (default 200)\n"
+    "  --batch n        : kernel calls per timed batch (default 100)\n"
+    "  --range m        : ray length in meters (default 8)\n"
+    "  --angles dist    : ray headings: uniform, axis or diagonal (default uniform)\n"
+    "  --blocks n       : blocks in the model that is mapped and tested (default 16)\n"
+    "  --density frac   : fraction of the cluttered scene covered by boxes (default 0.1)\n"
+    "  --seed n         : random seed (default 1)\n"
+    "  --csv            : print the results as CSV\n"
+    "  --help           : print this message";
+
+static struct option longopts[] = {
+  { "scene",  required_argument,   NULL,  's' },
+  { "kernel",  required_argument,   NULL,  'k' },
+  { "samples",  required_argument,   NULL,  'n' },
+  { "batch",  required_argument,   NULL,  'b' },
+  { "range",  required_argument,   NULL,  'r' },
+  { "angles",  required_argument,   NULL,  'a' },
+  { "blocks",  required_argument,   NULL,  'B' },
+  { "density",  required_argument,   NULL,  'd' },
+  { "seed",  required_argument,   NULL,  'S' },
+  { "csv",  no_argument,   NULL,  'c' },
+  { "help",  no_argument,   NULL,  'h' },
+  { NULL, 0, NULL, 0 }
+};
+
+/** The side of the square synthetic worlds in meters. The cave
+bitmap is scaled to the same size. */
+static const meters_t SCENE_SIZE = 16.0;
+
+class Options {
+public:
+  std::string scene;
+  std::string kernel;
+  unsigned int samples;
+  unsigned int batch;
+  meters_t range;
+  std::string angles;
+  unsigned int blocks;
+  double density;
+  long seed;
+  bool csv;
+
+  Options()
+      : scene("all"), kernel("all"), samples(200), batch(100), range(8.0), angles("uniform"),
+        blocks(16), density(0.1), seed(1), csv(false)
+  {
+  }
+};
+
+/** Timings of one kernel in one scene */
+class Result {
+public:
+  std::string kernel;
+  std::string scene;
+  uint64_t calls;
+  double median_ns; ///< median time per call
+  double p99_ns; ///< 99th percentile time per call
+  double cells_per_call; ///< occupancy grid cells visited per call
+  double cycles_per_cell; ///< median cycles per cell visited
+
+  Result(const std::string &kernel, const std::string &scene)
+      : kernel(kernel), scene(scene), calls(0), median_ns(0), p99_ns(0), cells_per_call(0),
+        cycles_per_cell(0)
+  {
+  }
+};
+
+// a cycle counter where we have one, otherwise nanoseconds
+static inline uint64_t cycles()
+{
+#if defined(__i386__) || defined(__x86_64__)
+  return __rdtsc();
+#else
+  return ProfileClock();
+#endif
+}
+
+// the value below which the given fraction of the sorted samples lie
+static double percentile(const std::vector<double> &sorted, double fraction)
+{
+  const size_t i(std::min(sorted.size() - 1, (size_t)ceil(fraction * sorted.size()) - 1));
+  return sorted[i];
+}
+
+static meters_t uniform(meters_t min, meters_t max)
+{
+  return min + drand48() * (max - min);
+}
+
+// a worldfile model entry for a plain box
+static void box(std::ostream &out, const char *name, meters_t x, meters_t y, meters_t dx,
+                meters_t dy)
+{
+  out << "model( name \"" << name << "\" pose [" << x << " " << y << " 0 0] size [" << dx
+      << " " << dy << " 0.5] gui_nose 0 )\n";
+}
+
+// build the worldfile of the named scene. Every scene contains the
+// "probe" model, which is mapped and collision tested by the benchmarks
+// and which finds the rays.
+static bool scene_worldfile(const std::string &scene, const Options &opt, std::ostream &out)
+{
+  out << "resolution 0.02\nthreads 1\npaused 1\n";
+
+  if (scene == "empty")
+    ; // nothing but the probe
+  else if (scene == "corridor") {
+    // a 2m wide corridor along the X axis
+    box(out, "wall_north", 0, 1.05, SCENE_SIZE, 0.1);
+    box(out, "wall_south", 0, -1.05, SCENE_SIZE, 0.1);
+  } else if (scene == "cluttered") {
+    const meters_t side(0.3);
+    const unsigned int count(opt.density * SCENE_SIZE * SCENE_SIZE / (side * side));
+    for (unsigned int i(0); i < count; ++i) {
+      char name[32];
+      snprintf(name, sizeof(name), "box_%u", i);
+      box(out, name, uniform(-SCENE_SIZE / 2, SCENE_SIZE / 2),
+          uniform(-SCENE_SIZE / 2, SCENE_SIZE / 2), side, side);
+    }
+  } else if (scene == "cave") {
+    // the floorplan of cave.world, without its robots
+    out << "model( name \"cave\" size [" << SCENE_SIZE << " " << SCENE_SIZE
+        << " 0.6] bitmap \"../bitmaps/cave_filled.png\" gui_nose 0 )\n";
+  } else
+    return false;
+
+  // the probe is a ring of small square blocks, so that mapping it
+  // renders many short polygon edges, as robot bodies do
+  out << "model( name \"probe\" size [0.5 0.5 0.5] gui_nose 0\n";
+  for (unsigned int i(0); i < opt.blocks; ++i) {
+    const double a(2.0 * M_PI * i / opt.blocks);
+    const double x(cos(a)), y(sin(a)), s(0.1);
+    out << "  block( points 4 point[0] [" << x - s << " " << y - s << "] point[1] [" << x + s
+        << " " << y - s << "] point[2] [" << x + s << " " << y + s << "] point[3] [" << x - s
+        << " " << y + s << "] z [0 1] )\n";
+  }
+  out << ")\n";
+
+  return true;
+}
+
+static bool ray_match(Model *candidate, const Model *finder, const void *arg)
+{
+  (void)arg;
+  return candidate != finder && candidate->vis.ranger_return >= 0;
+}
+
+static radians_t heading(const std::string &dist)
+{
+  if (dist == "axis")
+    return (lrand48() % 4) * M_PI / 2.0;
+  if (dist == "diagonal")
+    return M_PI / 4.0 + (lrand48() % 4) * M_PI / 2.0;
+  return uniform(-M_PI, M_PI);
+}
+
+// a random pose of the probe, inside the scene
+static Pose random_pose()
+{
+  const meters_t edge(SCENE_SIZE / 2 - 1.0);
+  return Pose(uniform(-edge, edge), uniform(-edge, edge), 0, uniform(-M_PI, M_PI));
+}
+
+/** Times batches of calls of one kernel. Prepare(i) sets up batch i
+untimed and Run(i) makes the batch's calls. */
+class Kernel {
+public:
+  virtual ~Kernel() {}
+  virtual void Prepare(unsigned int sample) { (void)sample; }
+  virtual void Run(unsigned int sample) = 0;
+};
+
+// run every batch once with profiling enabled, to count the cells the
+// kernel visits, then again with it disabled, to time them
+static Result measure(World &world, Model *probe, Kernel &kernel, Result result,
+                      const Options &opt, uint64_t ModelProfile::*cells, double cell_scale)
+{
+  world.ClearProfile();
+  world.EnableProfiling(true);
+  for (unsigned int i(0); i < opt.samples; ++i) {
+    kernel.Prepare(i);
+    kernel.Run(i);
+  }
+  world.EnableProfiling(false);
+
+  result.calls = (uint64_t)opt.samples * opt.batch;
+  result.cells_per_call = probe->GetProfile().*cells * cell_scale / result.calls;
+
+  std::vector<double> ns, cyc;
+  ns.reserve(opt.samples);
+  cyc.reserve(opt.samples);
+
+  for (unsigned int i(0); i < opt.samples; ++i) {
+    kernel.Prepare(i);
+    const uint64_t start_ns(ProfileClock());
+    const uint64_t start_cycles(cycles());
+    kernel.Run(i);
+    cyc.push_back((double)(cycles() - start_cycles) / opt.batch);
+    ns.push_back((double)(ProfileClock() - start_ns) / opt.batch);
+  }
+
+  std::sort(ns.begin(), ns.end());
+  std::sort(cyc.begin(), cyc.end());
+
+  result.median_ns = percentile(ns, 0.5);
+  result.p99_ns = percentile(ns, 0.99);
+  if (result.cells_per_call > 0)
+    result.cycles_per_cell = percentile(cyc, 0.5) / result.cells_per_call;
+
+  return result;
+}
+
+/** World::Raytrace() of rays from random origins */
+class RaytraceKernel : public Kernel {
+public:
+  World &world;
+  std::vector<Ray> rays;
+  unsigned int batch;
+
+  RaytraceKernel(World &world, Model *probe, const Options &opt)
+      : world(world), rays(), batch(opt.batch)
+  {
+    rays.reserve((size_t)opt.samples * opt.batch);
+    for (size_t i(0); i < (size_t)opt.samples * opt.batch; ++i) {
+      const Pose origin(uniform(-SCENE_SIZE / 2, SCENE_SIZE / 2),
+                        uniform(-SCENE_SIZE / 2, SCENE_SIZE / 2), 0.25, heading(opt.angles));
+      rays.push_back(Ray(probe, origin, opt.range, ray_match, NULL, true));
+    }
+  }
+
+  virtual void Run(unsigned int sample)
+  {
+    const Ray *r(&rays[(size_t)sample * batch]);
+    for (unsigned int i(0); i < batch; ++i)
+      world.Raytrace(r[i]);
+  }
+};
+
+/** Moving the probe, which removes its blocks from both occupancy
+layers and renders them again with World::MapPoly() */
+class MapKernel : public Kernel {
+public:
+  Model *probe;
+  std::vector<Pose> poses;
+  unsigned int batch;
+
+  MapKernel(Model *probe, const Options &opt) : probe(probe), poses(), batch(opt.batch)
+  {
+    poses.reserve((size_t)opt.samples * opt.batch);
+    for (size_t i(0); i < (size_t)opt.samples * opt.batch; ++i)
+      poses.push_back(random_pose());
+  }
+
+  virtual void Run(unsigned int sample)
+  {
+    const Pose *p(&poses[(size_t)sample * batch]);
+    for (unsigned int i(0); i < batch; ++i)
+      probe->SetPose(p[i]);
+  }
+};
+
+/** Collision tests of the probe's blocks, repeated at one random pose
+per batch */
+class CollisionKernel : public Kernel {
+public:
+  Model *probe;
+  std::vector<Pose> poses;
+  unsigned int batch;
+  uint64_t hits;
+
+  CollisionKernel(Model *probe, const Options &opt) : probe(probe), poses(), batch(opt.batch), hits(0)
+  {
+    for (unsigned int i(0); i < opt.samples; ++i)
+      poses.push_back(random_pose());
+  }
+
+  virtual void Prepare(unsigned int sample) { probe->SetPose(poses[sample]); }
+  virtual void Run(unsigned int sample)
+  {
+    (void)sample;
+    for (unsigned int i(0); i < batch; ++i)
+      hits += probe->HasCollision();
+  }
+};
+
+static bool run_scene(const std::string &scene, const Options &opt, std::vector<Result> &results)
+{
+  std::stringstream content;
+  if (!scene_worldfile(scene, opt, content)) {
+    PRINT_ERR1("unknown scene \"%s\"", scene.c_str());
+    return false;
+  }
+
+  srand48(opt.seed);
+
+  World world(scene);
+  // relative paths in the scene resolve against the benchmark worlds
+  if (!world.Load(content, BENCHMARK_DIR "/" + scene + ".world"))
+    return false;
+
+  Model *probe(world.GetModel("probe"));
+  assert(probe);
+
+  if (opt.kernel == "all" || opt.kernel == "raytrace") {
+    RaytraceKernel k(world, probe, opt);
+    results.push_back(measure(world, probe, k, Result("raytrace", scene), opt,
+                              &ModelProfile::cells, 1.0));
+  }
+
+  if (opt.kernel == "all" || opt.kernel == "map") {
+    MapKernel k(probe, opt);
+    results.push_back(measure(world, probe, k, Result("map", scene), opt,
+                              &ModelProfile::map_cells, 1.0));
+  }
+
+  if (opt.kernel == "all" || opt.kernel == "collision") {
+    // a collision test visits the cells of one layer, which is half
+    // of those mapped by the SetPose() in Prepare()
+    CollisionKernel k(probe, opt);
+    results.push_back(measure(world, probe, k, Result("collision", scene), opt,
+                              &ModelProfile::map_cells, 0.5 * opt.batch));
+  }
+
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  Options opt;
+
+  int ch = 0, optindex = 0;
+  while ((ch = getopt_long(argc, argv, "h?", longopts, &optindex)) != -1) {
+    switch (ch) {
+    case 's': opt.scene = optarg; break;
+    case 'k': opt.kernel = optarg; break;
+    case 'n': opt.samples = std::max(1, atoi(optarg)); break;
+    case 'b': opt.batch = std::max(1, atoi(optarg)); break;
+    case 'r': opt.range = atof(optarg); break;
+    case 'a': opt.angles = optarg; break;
+    case 'B': opt.blocks = std::max(1, atoi(optarg)); break;
+    case 'd': opt.density = atof(optarg); break;
+    case 'S': opt.seed = atol(optarg); break;
+    case 'c': opt.csv = true; break;
+    case 'h':
+    case '?':
+    default: puts(USAGE); exit(ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+
+  Init(&argc, &argv);
+
+  std::vector<std::string> scenes;
+  if (opt.scene == "all") {
+    scenes.push_back("empty");
+    scenes.push_back("corridor");
+    scenes.push_back("cluttered");
+    scenes.push_back("cave");
+  } else
+    scenes.push_back(opt.scene);
+
+  std::vector<Result> results;
+  FOR_EACH (it, scenes)
+    if (!run_scene(*it, opt, results))
+      return EXIT_FAILURE;
+
+  if (opt.csv)
+    puts("kernel,scene,calls,median_ns,p99_ns,cells_per_call,cycles_per_cell");
+  else
+    printf("\n[Kernel benchmark: %u x %u calls, range %.2f m, %s headings, %u blocks]\n"
+           "  %-10s %-10s %12s %12s %12s %12s\n",
+           opt.samples, opt.batch, opt.range, opt.angles.c_str(), opt.blocks, "kernel",
+           "scene", "median ns", "p99 ns", "cells/call", "cycles/cell");
+
+  FOR_EACH (it, results)
+    if (opt.csv)
+      printf("%s,%s,%llu,%.1f,%.1f,%.1f,%.2f\n", it->kernel.c_str(), it->scene.c_str(),
+             (unsigned long long)it->calls, it->median_ns, it->p99_ns, it->cells_per_call,
+             it->cycles_per_cell);
+    else
+      printf("  %-10s %-10s %12.1f %12.1f %12.1f %12.2f\n", it->kernel.c_str(),
+             it->scene.c_str(), it->median_ns, it->p99_ns, it->cells_per_call,
+             it->cycles_per_cell);
+
+  return EXIT_SUCCESS;
+}
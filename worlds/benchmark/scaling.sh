@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# Measures how simulation throughput and memory scale with the number
+# of robots and worker threads. Generates a world for each robot count
+# with stage-worldgen, runs it with stage-bench at each thread count
+# and prints one CSV row per run.
+#
+# usage: scaling.sh <dir holding stage-worldgen and stage-bench> \
+#          [robot counts] [thread counts] [sim seconds] [robot type]
+# e.g.   scaling.sh build/worlds/benchmark "1000 10000 100000" 1,2,4,8 10 swarm
+
+BIN=${1:?usage: $0 bindir [robots] [threads] [seconds] [type]}
+ROBOTS=${2:-"1000 10000 100000"}
+THREADS=${3:-1,2,4,8}
+SECONDS_SIM=${4:-10}
+TYPE=${5:-swarm}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+echo "type,robots,threads,sim_per_wall,ticks_per_second,rays_per_second,peak_rss_kb"
+
+for N in $ROBOTS ; do
+  WORLD="$TMP/${TYPE}_$N.world"
+  "$BIN/stage-worldgen" --type "$TYPE" --robots "$N" --output "$WORLD" || exit 1
+  "$BIN/stage-bench" --time "$SECONDS_SIM" --threads "$THREADS" --output "$TMP/result.json" "$WORLD" || exit 1
+
+  # stage-bench writes one result object per line
+  sed -n 's/.*"threads": \([0-9]*\).*"sim_per_wall": \([0-9.]*\).*"ticks_per_second": \([0-9.]*\).*"rays_per_second": \([0-9.]*\).*"peak_rss_kb": \([0-9]*\).*/\1,\2,\3,\4,\5/p' \
+    "$TMP/result.json" | while read ROW ; do
+    echo "$TYPE,$N,$ROW"
+  done
+done
@@ -0,0 +1,370 @@
+/////////////////////////////////
+// File: stage_bench.cc
+// Desc: Runs the benchmark worlds headless at several thread counts
+//       and reports throughput as JSON, optionally checking for
+//       regressions against a stored baseline.
+// License: GPL
+/////////////////////////////////
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "stage.hh"
+using namespace Stg;
+
+const char *USAGE =
+    "USAGE:  stage-bench [options] [worldfile1 ... worldfileN]\n"
+    "Runs each world headless for a fixed simulated time at each thread count\n"
+    "and prints the results as JSON. Defaults to the worlds in worlds/benchmark.\n"
+    "Each is run twice: once for the timings and memory, and once with profiling\n"
+    "on to count the rays traced, which also measures the profiling overhead.\n"
+    "Available [options] are:\n"
+    "  --time secs      : simulated seconds to run each world (default 60)\n"
+    "  --threads list   : comma separated worker thread counts (default 1,2,4)\n"
+    "  --output file    : write the JSON results to file instead of stdout\n"
+    "  --baseline file  : compare against results previously written by stage-bench,\n"
+    "                     failing if it can't be read or holds no results\n"
+    "  --tolerance frac : allowed fractional slowdown or memory growth\n"
+    "                     before a result counts as a regression (default 0.1)\n"
+    "  --help           : print this message";
+
+static struct option longopts[] = {
+  { "time",  required_argument,   NULL,  't' },
+  { "threads",  required_argument,   NULL,  'n' },
+  { "output",  required_argument,   NULL,  'o' },
+  { "baseline",  required_argument,   NULL,  'b' },
+  { "tolerance",  required_argument,   NULL,  'r' },
+  { "help",  no_argument,   NULL,  'h' },
+  { NULL, 0, NULL, 0 }
+};
+
+/** The measurements of one world at one thread count */
+class Result {
+public:
+  std::string world;
+  unsigned int threads;
+  double sim_seconds;
+  double wall_seconds;
+  uint64_t ticks;
+  uint64_t rays;
+  long peak_rss_kb;
+  double profiled_wall_seconds; ///< wall time of the same run with profiling on
+
+  Result()
+      : world(), threads(0), sim_seconds(0), wall_seconds(0), ticks(0), rays(0), peak_rss_kb(0),
+        profiled_wall_seconds(0)
+  {
+  }
+
+  double SimPerWall() const { return wall_seconds > 0 ? sim_seconds / wall_seconds : 0; }
+  double TicksPerSecond() const { return wall_seconds > 0 ? ticks / wall_seconds : 0; }
+  double RaysPerSecond() const { return wall_seconds > 0 ? rays / wall_seconds : 0; }
+  /** The fraction by which profiling slowed the run */
+  double ProfilingOverhead() const
+  {
+    return wall_seconds > 0 ? profiled_wall_seconds / wall_seconds - 1.0 : 0;
+  }
+  std::string Json() const
+  {
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "{ \"world\": \"%s\", \"threads\": %u, \"sim_seconds\": %.3f, "
+             "\"wall_seconds\": %.3f, \"sim_per_wall\": %.3f, \"ticks_per_second\": %.2f, "
+             "\"rays_per_second\": %.0f, \"profiling_overhead\": %.3f, \"peak_rss_kb\": %ld }",
+             world.c_str(), threads, sim_seconds, wall_seconds, SimPerWall(), TicksPerSecond(),
+             RaysPerSecond(), ProfilingOverhead(), peak_rss_kb);
+    return buf;
+  }
+};
+
+// find "key": in a line of our own JSON output and return what follows
+static const char *json_field(const std::string &line, const char *key)
+{
+  const std::string pattern(std::string("\"") + key + "\": ");
+  const size_t pos(line.find(pattern));
+  return pos == std::string::npos ? NULL : line.c_str() + pos + pattern.size();
+}
+
+// read the results written by a previous run into results. Each
+// result is on a line of its own, which is all the parsing we
+// need. Returns false if the file can't be read or holds no results.
+static bool load_baseline(const char *filename, std::vector<Result> &results)
+{
+  std::ifstream in(filename);
+  std::string line;
+
+  if (!in) {
+    PRINT_ERR1("failed to open baseline %s", filename);
+    return false;
+  }
+
+  while (std::getline(in, line)) {
+    const char *world(json_field(line, "world"));
+    const char *threads(json_field(line, "threads"));
+    const char *spw(json_field(line, "sim_per_wall"));
+    const char *rss(json_field(line, "peak_rss_kb"));
+
+    if (!(world && threads && spw && rss) || *world != '"')
+      continue;
+
+    const char *world_end(strchr(world + 1, '"'));
+    if (world_end == NULL)
+      continue;
+
+    Result r;
+    r.world = std::string(world + 1, world_end);
+    r.threads = strtoul(threads, NULL, 10);
+    r.sim_seconds = strtod(spw, NULL); // so that SimPerWall() returns it
+    r.wall_seconds = 1.0;
+    r.peak_rss_kb = strtol(rss, NULL, 10);
+    results.push_back(r);
+  }
+
+  if (results.empty()) {
+    PRINT_ERR1("no results in baseline %s", filename);
+    return false;
+  }
+
+  return true;
+}
+
+// run one world in this process and return the measurements. Rays
+// are only counted if profiling, which slows the run.
+static Result run(const std::string &worldfile, unsigned int threads, double seconds,
+                  bool profile)
+{
+  int argc = 1;
+  char arg0[] = "stage-bench";
+  char *args[] = { arg0, NULL };
+  char **argv = args;
+  Init(&argc, &argv);
+
+  World world(worldfile);
+  world.SetWorkerThreads(threads);
+  world.Load(worldfile);
+
+  world.EnableProfiling(profile);
+
+  const usec_t start_sim(world.SimTimeNow());
+  const usec_t end_sim(start_sim + (usec_t)(seconds * 1e6));
+  const uint64_t start_wall(ProfileClock());
+
+  while (world.SimTimeNow() < end_sim && !world.Update())
+    ;
+
+  Result r;
+  r.world = worldfile;
+  r.threads = threads;
+  r.wall_seconds = (ProfileClock() - start_wall) / 1e9;
+  r.sim_seconds = (world.SimTimeNow() - start_sim) / 1e6;
+  r.ticks = world.UpdateCount();
+  r.rays = world.GetModelProfileTotal().rays;
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  r.peak_rss_kb = ru.ru_maxrss / 1024; // bytes on OS X
+#else
+  r.peak_rss_kb = ru.ru_maxrss;
+#endif
+
+  return r;
+}
+
+// run one world in a child process, so that each run starts with a
+// fresh heap and its peak RSS is its own
+static bool run_child(const std::string &worldfile, unsigned int threads, double seconds,
+                      bool profile, Result &result)
+{
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("stage-bench: pipe");
+    return false;
+  }
+
+  const pid_t pid(fork());
+
+  if (pid < 0) {
+    perror("stage-bench: fork");
+    return false;
+  }
+
+  if (pid == 0) { // child
+    close(fds[0]);
+
+    // keep Stage's progress output out of the JSON
+    FILE *devnull(fopen("/dev/null", "w"));
+    if (devnull)
+      dup2(fileno(devnull), STDOUT_FILENO);
+
+    const Result r(run(worldfile, threads, seconds, profile));
+
+    char buf[256];
+    const int len(snprintf(buf, sizeof(buf), "%.9f %.9f %llu %llu %ld\n", r.sim_seconds,
+                           r.wall_seconds, (unsigned long long)r.ticks,
+                           (unsigned long long)r.rays, r.peak_rss_kb));
+    if (len < 0 || len >= (int)sizeof(buf) || write(fds[1], buf, len) != len)
+      _exit(EXIT_FAILURE);
+    _exit(EXIT_SUCCESS);
+  }
+
+  close(fds[1]);
+
+  char buf[256] = { 0 };
+  size_t got(0);
+  ssize_t n;
+  while (got < sizeof(buf) - 1 && (n = read(fds[0], buf + got, sizeof(buf) - 1 - got)) > 0)
+    got += n;
+  close(fds[0]);
+
+  int status(0);
+  waitpid(pid, &status, 0);
+
+  unsigned long long ticks(0), rays(0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS
+      || sscanf(buf, "%lf %lf %llu %llu %ld", &result.sim_seconds, &result.wall_seconds, &ticks,
+                &rays, &result.peak_rss_kb) != 5) {
+    fprintf(stderr, "stage-bench: %s with %u threads failed\n", worldfile.c_str(), threads);
+    return false;
+  }
+
+  result.world = worldfile;
+  result.threads = threads;
+  result.ticks = ticks;
+  result.rays = rays;
+  return true;
+}
+
+// the file name without its directory, so that baselines do not
+// depend on where the worlds are
+static std::string basename_of(const std::string &path)
+{
+  const size_t slash(path.rfind('/'));
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+int main(int argc, char *argv[])
+{
+  double seconds(60.0);
+  double tolerance(0.1);
+  std::vector<unsigned int> thread_counts;
+  const char *output(NULL);
+  const char *baseline(NULL);
+
+  int ch = 0, optindex = 0;
+  while ((ch = getopt_long(argc, argv, "h?", longopts, &optindex)) != -1) {
+    switch (ch) {
+    case 't': seconds = atof(optarg); break;
+    case 'n': {
+      char *tok(strtok(optarg, ","));
+      for (; tok; tok = strtok(NULL, ","))
+        if (atoi(tok) > 0)
+          thread_counts.push_back(atoi(tok));
+    } break;
+    case 'o': output = optarg; break;
+    case 'b': baseline = optarg; break;
+    case 'r': tolerance = atof(optarg); break;
+    case 'h':
+    case '?':
+    default: puts(USAGE); exit(ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+
+  if (thread_counts.empty()) {
+    thread_counts.push_back(1);
+    thread_counts.push_back(2);
+    thread_counts.push_back(4);
+  }
+
+  // read the baseline first, so that a bad one fails before the runs
+  std::vector<Result> base;
+  if (baseline && !load_baseline(baseline, base))
+    return EXIT_FAILURE;
+
+  std::vector<std::string> worlds;
+  for (int i(optind); i < argc; ++i)
+    worlds.push_back(argv[i]);
+
+  if (worlds.empty()) {
+    worlds.push_back(BENCHMARK_DIR "/hospital.world");
+    worlds.push_back(BENCHMARK_DIR "/cave.world");
+  }
+
+  // let the worlds find the controller plugins built next to us
+  setenv("STAGEPATH", BENCHMARK_BINARY_DIR, 0);
+
+  std::vector<Result> results;
+  FOR_EACH (w, worlds)
+    FOR_EACH (t, thread_counts) {
+      fprintf(stderr, "[stage-bench: %s, %u threads]\n", w->c_str(), *t);
+
+      // the profiler counts the rays, but its timers would slow the
+      // measured run, so they are counted in a second run
+      Result r, profiled;
+      if (!run_child(*w, *t, seconds, false, r) || !run_child(*w, *t, seconds, true, profiled))
+        return EXIT_FAILURE;
+      r.rays = profiled.rays;
+      r.profiled_wall_seconds = profiled.wall_seconds;
+      r.world = basename_of(r.world);
+      results.push_back(r);
+    }
+
+  FILE *fp(output ? fopen(output, "w") : stdout);
+  if (fp == NULL) {
+    PRINT_ERR1("failed to open output %s", output);
+    return EXIT_FAILURE;
+  }
+
+  fprintf(fp, "{\n  \"version\": \"%s\",\n  \"sim_seconds\": %.3f,\n  \"results\": [\n",
+          Version(), seconds);
+  for (size_t i(0); i < results.size(); ++i)
+    fprintf(fp, "    %s%s\n", results[i].Json().c_str(), i + 1 < results.size() ? "," : "");
+  fprintf(fp, "  ]\n}\n");
+
+  if (fp != stdout)
+    fclose(fp);
+
+  if (baseline == NULL)
+    return EXIT_SUCCESS;
+
+  // a result regresses if it is slower, or uses more memory, than the
+  // baseline by more than the tolerance, or if it is missing
+  int regressions(0);
+
+  FOR_EACH (b, base) {
+    bool found(false);
+
+    FOR_EACH (r, results) {
+      if (b->world != r->world || b->threads != r->threads)
+        continue;
+      found = true;
+
+      const bool slower(r->SimPerWall() < b->SimPerWall() * (1.0 - tolerance));
+      const bool bigger(r->peak_rss_kb > b->peak_rss_kb * (1.0 + tolerance));
+
+      fprintf(stderr, "[%s %u threads: %.2f sim/wall (baseline %.2f), %ld KB (baseline %ld)%s]\n",
+              r->world.c_str(), r->threads, r->SimPerWall(), b->SimPerWall(), r->peak_rss_kb,
+              b->peak_rss_kb, slower || bigger ? " REGRESSION" : "");
+
+      if (slower || bigger)
+        ++regressions;
+    }
+
+    if (!found) {
+      fprintf(stderr, "[%s %u threads: in the baseline but not run REGRESSION]\n",
+              b->world.c_str(), b->threads);
+      ++regressions;
+    }
+  }
+
+  return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
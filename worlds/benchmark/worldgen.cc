@@ -0,0 +1,275 @@
+/////////////////////////////////
+// File: worldgen.cc
+// Desc: Generates worldfiles with many robots for scaling tests
+// License: GPL
+/////////////////////////////////
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+const char *USAGE =
+    "USAGE:  stage-worldgen [options]\n"
+    "Writes a worldfile with many robots placed on a grid among random\n"
+    "obstacles inside a walled square arena.\n"
+    "Available [options] are:\n"
+    "  --robots n        : number of robots (default 100)\n"
+    "  --type name       : swarm (ranger ring, expand_swarm) or\n"
+    "                      pioneer (sonar and laser, expand_pioneer) (default swarm)\n"
+    "  --size m          : side of the arena in meters (default fits the robots)\n"
+    "  --clutter frac    : fraction of the arena covered by obstacles (default 0.05)\n"
+    "  --laser frac      : fraction of swarm robots that also carry a laser (default 0)\n"
+    "  --fiducial frac   : fraction of robots that carry a fiducial finder (default 0)\n"
+    "  --blobfinder frac : fraction of robots that carry a blobfinder (default 0)\n"
+    "  --threads n       : worker threads in the worldfile (default 1)\n"
+    "  --quit-time secs  : quit_time in the worldfile (default 0, never)\n"
+    "  --seed n          : random seed (default 1)\n"
+    "  --include dir     : directory holding pioneer.inc and sick.inc\n"
+    "  --output file     : write the worldfile to file instead of stdout\n"
+    "  --help            : print this message";
+
+static struct option longopts[] = {
+  { "robots",  required_argument,   NULL,  'n' },
+  { "type",  required_argument,   NULL,  't' },
+  { "size",  required_argument,   NULL,  's' },
+  { "clutter",  required_argument,   NULL,  'c' },
+  { "laser",  required_argument,   NULL,  'l' },
+  { "fiducial",  required_argument,   NULL,  'f' },
+  { "blobfinder",  required_argument,   NULL,  'b' },
+  { "threads",  required_argument,   NULL,  'T' },
+  { "quit-time",  required_argument,   NULL,  'q' },
+  { "seed",  required_argument,   NULL,  'S' },
+  { "include",  required_argument,   NULL,  'i' },
+  { "output",  required_argument,   NULL,  'o' },
+  { "help",  no_argument,   NULL,  'h' },
+  { NULL, 0, NULL, 0 }
+};
+
+class Options {
+public:
+  unsigned int robots;
+  std::string type;
+  double size;
+  double clutter;
+  double laser;
+  double fiducial;
+  double blobfinder;
+  unsigned int threads;
+  double quit_time;
+  long seed;
+  std::string include;
+  const char *output;
+
+  Options()
+      : robots(100), type("swarm"), size(0), clutter(0.05), laser(0), fiducial(0), blobfinder(0),
+        threads(1), quit_time(0), seed(1), include(WORLDS_DIR), output(NULL)
+  {
+  }
+};
+
+// true for about the given fraction of calls
+static bool chance(double fraction)
+{
+  return drand48() < fraction;
+}
+
+// the definitions used by the robots of each type. Extra sensors are
+// "alwayson", as the controllers do not subscribe to them.
+static void write_defines(FILE *fp, const Options &opt)
+{
+  fprintf(fp,
+          "define obstacle model\n"
+          "(\n"
+          "  color \"gray30\"\n"
+          "  gui_nose 0\n"
+          "  gui_move 0\n"
+          ")\n\n"
+          "define extra_fiducial fiducial\n"
+          "(\n"
+          "  range_max 4\n"
+          "  alwayson 1\n"
+          ")\n\n"
+          "define extra_blobfinder blobfinder\n"
+          "(\n"
+          "  colors_count 1\n"
+          "  colors [ \"red\" ]\n"
+          "  image [ 80 60 ]\n"
+          "  range 4\n"
+          "  alwayson 1\n"
+          ")\n\n");
+
+  if (opt.type == "pioneer") {
+    fprintf(fp,
+            "define robot pioneer2dx\n"
+            "(\n"
+            "  sicklaser( samples 90 )\n"
+            "  ctrl \"expand_pioneer\"\n"
+            ")\n\n");
+    return;
+  }
+
+  // the swarmbot of hospital.world
+  fprintf(fp,
+          "define ir sensor\n"
+          "(\n"
+          "  samples 1\n"
+          "  range [0 2]\n"
+          "  fov 30\n"
+          "  color_rgba [1 0 0 0.3]\n"
+          ")\n\n"
+          "define extra_laser ranger\n"
+          "(\n"
+          "  sensor( range [0 4] fov 180 samples 90 )\n"
+          "  size [0.05 0.05 0.05]\n"
+          "  alwayson 1\n"
+          ")\n\n"
+          "define robot position\n"
+          "(\n"
+          "  size [0.100 0.100 0.100]\n"
+          "  color \"random\"\n"
+          "  ranger\n"
+          "  (\n"
+          "    pose [ 0 0 -0.050 0 ]\n");
+  for (int a(0); a < 360; a += 30)
+    fprintf(fp, "    ir( pose [ 0 0 0 %d ] )\n", a);
+  fprintf(fp,
+          "  )\n"
+          "  ctrl \"expand_swarm\"\n"
+          ")\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+  Options opt;
+
+  int ch = 0, optindex = 0;
+  while ((ch = getopt_long(argc, argv, "h?", longopts, &optindex)) != -1) {
+    switch (ch) {
+    case 'n': opt.robots = atoi(optarg); break;
+    case 't': opt.type = optarg; break;
+    case 's': opt.size = atof(optarg); break;
+    case 'c': opt.clutter = atof(optarg); break;
+    case 'l': opt.laser = atof(optarg); break;
+    case 'f': opt.fiducial = atof(optarg); break;
+    case 'b': opt.blobfinder = atof(optarg); break;
+    case 'T': opt.threads = std::max(1, atoi(optarg)); break;
+    case 'q': opt.quit_time = atof(optarg); break;
+    case 'S': opt.seed = atol(optarg); break;
+    case 'i': opt.include = optarg; break;
+    case 'o': opt.output = optarg; break;
+    case 'h':
+    case '?':
+    default: puts(USAGE); exit(ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+
+  if (opt.type != "swarm" && opt.type != "pioneer") {
+    fprintf(stderr, "stage-worldgen: unknown robot type \"%s\"\n", opt.type.c_str());
+    return EXIT_FAILURE;
+  }
+
+  if (opt.clutter < 0 || opt.clutter >= 0.5) {
+    fputs("stage-worldgen: clutter must be at least 0 and less than 0.5\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  srand48(opt.seed);
+
+  // The arena is divided into square cells, each holding at most one
+  // robot or one obstacle, so nothing starts in collision. Obstacles
+  // fill most of their cell.
+  const double pitch(opt.type == "pioneer" ? 1.0 : 0.5);
+  const double obstacle(0.8 * pitch);
+
+  if (opt.size <= 0) {
+    // leave about as many empty cells as there are robots, so they
+    // have room to move. Obstacles take clutter * (pitch/obstacle)^2
+    // of the cells.
+    const double free_fraction(1.0 - opt.clutter * pitch * pitch / (obstacle * obstacle));
+    const double needed(2.0 * opt.robots / free_fraction);
+    opt.size = std::max(10.0, pitch * ceil(sqrt(needed)));
+  }
+
+  const unsigned int side((unsigned int)(opt.size / pitch));
+  const unsigned int obstacles((unsigned int)(opt.clutter * opt.size * opt.size
+                                              / (obstacle * obstacle)));
+
+  if ((size_t)side * side < (size_t)opt.robots + obstacles) {
+    fprintf(stderr, "stage-worldgen: %u robots and %u obstacles do not fit in a %.1f m arena\n",
+            opt.robots, obstacles, opt.size);
+    return EXIT_FAILURE;
+  }
+
+  // deal the cells out in random order, robots first
+  std::vector<unsigned int> cells((size_t)side * side);
+  for (size_t i(0); i < cells.size(); ++i)
+    cells[i] = i;
+  for (size_t i(cells.size() - 1); i > 0; --i)
+    std::swap(cells[i], cells[lrand48() % (i + 1)]);
+
+  FILE *fp(opt.output ? fopen(opt.output, "w") : stdout);
+  if (fp == NULL) {
+    perror("stage-worldgen");
+    return EXIT_FAILURE;
+  }
+
+  fprintf(fp,
+          "# generated by stage-worldgen: %u %s robots, %.1f m arena, %.3f clutter,\n"
+          "# %.3f laser, %.3f fiducial, %.3f blobfinder, seed %ld\n\n",
+          opt.robots, opt.type.c_str(), opt.size, opt.clutter, opt.laser, opt.fiducial,
+          opt.blobfinder, opt.seed);
+
+  if (opt.type == "pioneer")
+    fprintf(fp, "include \"%s/pioneer.inc\"\ninclude \"%s/sick.inc\"\n\n", opt.include.c_str(),
+            opt.include.c_str());
+
+  fprintf(fp, "resolution 0.02\nspeedup -1\npaused 0\nthreads %u\nquit_time %.3f\n\n",
+          opt.threads, opt.quit_time);
+
+  write_defines(fp, opt);
+
+  // the arena walls
+  const double half(opt.size / 2.0);
+  fprintf(fp,
+          "obstacle( name \"wall_north\" pose [0 %.3f 0 0] size [%.3f 0.1 0.5] )\n"
+          "obstacle( name \"wall_south\" pose [0 %.3f 0 0] size [%.3f 0.1 0.5] )\n"
+          "obstacle( name \"wall_east\" pose [%.3f 0 0 0] size [0.1 %.3f 0.5] )\n"
+          "obstacle( name \"wall_west\" pose [%.3f 0 0 0] size [0.1 %.3f 0.5] )\n\n",
+          half + 0.05, opt.size + 0.2, -half - 0.05, opt.size + 0.2, half + 0.05, opt.size,
+          -half - 0.05, opt.size);
+
+  for (unsigned int i(0); i < obstacles; ++i) {
+    const unsigned int c(cells[opt.robots + i]);
+    fprintf(fp, "obstacle( name \"o%u\" pose [%.3f %.3f 0 0] size [%.3f %.3f 0.5] )\n", i,
+            -half + (c % side + 0.5) * pitch, -half + (c / side + 0.5) * pitch, obstacle,
+            obstacle);
+  }
+  fputc('\n', fp);
+
+  for (unsigned int i(0); i < opt.robots; ++i) {
+    const unsigned int c(cells[i]);
+    fprintf(fp, "robot( name \"r%u\" pose [%.3f %.3f 0 %.1f]", i,
+            -half + (c % side + 0.5) * pitch, -half + (c / side + 0.5) * pitch,
+            drand48() * 360.0 - 180.0);
+
+    if (opt.type == "swarm" && chance(opt.laser))
+      fputs(" extra_laser()", fp);
+    if (chance(opt.fiducial))
+      fputs(" extra_fiducial()", fp);
+    if (chance(opt.blobfinder))
+      fputs(" extra_blobfinder()", fp);
+
+    fputs(" )\n", fp);
+  }
+
+  if (fp != stdout)
+    fclose(fp);
+
+  return EXIT_SUCCESS;
+}